@@ -150,6 +150,15 @@ static int cow_is_allocated(BlockDriverState *bs, int64_t sector_num,
     return is_changed(s->cow_bitmap, sector_num, nb_sectors, pnum);
 }
 
+static int64_t cow_get_host_offset(BlockDriverState *bs, int64_t sector_num,
+                                   int nb_sectors, int *pnum)
+{
+    BDRVCowState *s = bs->opaque;
+    if (!is_changed(s->cow_bitmap, sector_num, nb_sectors, pnum))
+        return -1;
+    return s->cow_sectors_offset + sector_num * 512;
+}
+
 static int cow_read(BlockDriverState *bs, int64_t sector_num, 
                     uint8_t *buf, int nb_sectors)
 {
@@ -263,5 +272,6 @@ BlockDriver bdrv_cow = {
     cow_create,
     cow_flush,
     cow_is_allocated,
+    .bdrv_get_host_offset = cow_get_host_offset,
 };
 #endif
@@ -394,6 +394,25 @@ static int qcow_is_allocated(BlockDriverState *bs, int64_t sector_num,
     return (cluster_offset != 0);
 }
 
+static int64_t qcow_get_host_offset(BlockDriverState *bs, int64_t sector_num,
+                                    int nb_sectors, int *pnum)
+{
+    BDRVQcowState *s = bs->opaque;
+    int index_in_cluster, n;
+    uint64_t cluster_offset;
+
+    cluster_offset = get_cluster_offset(bs, sector_num << 9, 0, 0, 0, 0);
+    index_in_cluster = sector_num & (s->cluster_sectors - 1);
+    n = s->cluster_sectors - index_in_cluster;
+    if (n > nb_sectors)
+        n = nb_sectors;
+    *pnum = n;
+    if (!cluster_offset || (cluster_offset & QCOW_OFLAG_COMPRESSED) ||
+        bs->encrypted)
+        return -1;
+    return cluster_offset + index_in_cluster * 512;
+}
+
 static int decompress_buffer(uint8_t *out_buf, int out_buf_size,
                              const uint8_t *buf, int buf_size)
 {
@@ -769,7 +788,7 @@ static int qcow_create(const char *filename, int64_t total_size,
     l1_size = ((total_size * 512) + (1LL << shift) - 1) >> shift;
 
     header.l1_table_offset = cpu_to_be64(header_size);
-    if (flags) {
+    if (flags & BLOCK_FLAG_ENCRYPT) {
         header.crypt_method = cpu_to_be32(QCOW_CRYPT_AES);
     } else {
         header.crypt_method = cpu_to_be32(QCOW_CRYPT_NONE);
@@ -809,33 +828,24 @@ static int qcow_make_empty(BlockDriverState *bs)
     return 0;
 }
 
-/* XXX: put compressed sectors first, then all the cluster aligned
-   tables to avoid losing bytes in alignment */
-static int qcow_write_compressed(BlockDriverState *bs, int64_t sector_num, 
-                                 const uint8_t *buf, int nb_sectors)
+/* Compress the cluster 'buf' to 'out_buf', which has room for one
+   cluster. Return the compressed size, 0 if the cluster cannot be
+   compressed or -1 on error. It does not access the image, so it can
+   be called from any thread. */
+static int qcow_compress_cluster(BlockDriverState *bs, uint8_t *out_buf,
+                                 const uint8_t *buf)
 {
     BDRVQcowState *s = bs->opaque;
     z_stream strm;
     int ret, out_len;
-    uint8_t *out_buf;
-    uint64_t cluster_offset;
-
-    if (nb_sectors != s->cluster_sectors)
-        return -EINVAL;
-
-    out_buf = qemu_malloc(s->cluster_size + (s->cluster_size / 1000) + 128);
-    if (!out_buf)
-        return -1;
 
     /* best compression, small window, no zlib header */
     memset(&strm, 0, sizeof(strm));
     ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
                        Z_DEFLATED, -12, 
                        9, Z_DEFAULT_STRATEGY);
-    if (ret != 0) {
-        qemu_free(out_buf);
+    if (ret != 0)
         return -1;
-    }
 
     strm.avail_in = s->cluster_size;
     strm.next_in = (uint8_t *)buf;
@@ -844,7 +854,6 @@ static int qcow_write_compressed(BlockDriverState *bs, int64_t sector_num,
 
     ret = deflate(&strm, Z_FINISH);
     if (ret != Z_STREAM_END && ret != Z_OK) {
-        qemu_free(out_buf);
         deflateEnd(&strm);
         return -1;
     }
@@ -852,21 +861,54 @@ static int qcow_write_compressed(BlockDriverState *bs, int64_t sector_num,
 
     deflateEnd(&strm);
 
-    if (ret != Z_STREAM_END || out_len >= s->cluster_size) {
+    if (ret != Z_STREAM_END || out_len >= s->cluster_size)
+        return 0;
+    return out_len;
+}
+
+/* write a cluster compressed by qcow_compress_cluster() */
+static int qcow_write_compressed_data(BlockDriverState *bs, int64_t sector_num,
+                                      const uint8_t *out_buf, int out_len)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t cluster_offset;
+
+    if (out_len <= 0 || out_len >= s->cluster_size)
+        return -EINVAL;
+    cluster_offset = get_cluster_offset(bs, sector_num << 9, 2, 
+                                        out_len, 0, 0);
+    cluster_offset &= s->cluster_offset_mask;
+    if (bdrv_pwrite(s->hd, cluster_offset, out_buf, out_len) != out_len)
+        return -1;
+    return 0;
+}
+
+/* XXX: put compressed sectors first, then all the cluster aligned
+   tables to avoid losing bytes in alignment */
+static int qcow_write_compressed(BlockDriverState *bs, int64_t sector_num, 
+                                 const uint8_t *buf, int nb_sectors)
+{
+    BDRVQcowState *s = bs->opaque;
+    int ret;
+    uint8_t *out_buf;
+
+    if (nb_sectors != s->cluster_sectors)
+        return -EINVAL;
+
+    out_buf = qemu_malloc(s->cluster_size);
+    if (!out_buf)
+        return -ENOMEM;
+
+    ret = qcow_compress_cluster(bs, out_buf, buf);
+    if (ret == 0) {
         /* could not compress: write normal cluster */
-        qcow_write(bs, sector_num, buf, s->cluster_sectors);
-    } else {
-        cluster_offset = get_cluster_offset(bs, sector_num << 9, 2, 
-                                            out_len, 0, 0);
-        cluster_offset &= s->cluster_offset_mask;
-        if (bdrv_pwrite(s->hd, cluster_offset, out_buf, out_len) != out_len) {
-            qemu_free(out_buf);
-            return -1;
-        }
+        ret = qcow_write(bs, sector_num, buf, s->cluster_sectors);
+    } else if (ret > 0) {
+        ret = qcow_write_compressed_data(bs, sector_num, out_buf, ret);
     }
     
     qemu_free(out_buf);
-    return 0;
+    return ret;
 }
 
 static void qcow_flush(BlockDriverState *bs)
@@ -875,6 +917,34 @@ static void qcow_flush(BlockDriverState *bs)
     bdrv_flush(s->hd);
 }
 
+/* the L1 table follows the header: the new name must fit before it */
+static int qcow_change_backing_file(BlockDriverState *bs,
+                                    const char *backing_file, int check_only)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint8_t buf[12];
+    uint64_t offset;
+    uint32_t len;
+
+    len = strlen(backing_file);
+    if (sizeof(QCowHeader) + len > s->l1_table_offset)
+        return -ENOSPC;
+    if (check_only)
+        return 0;
+    offset = len ? sizeof(QCowHeader) : 0;
+    /* write the name before making the header point to it */
+    if (len && bdrv_pwrite(s->hd, offset, backing_file, len) != len)
+        return -EIO;
+    offset = cpu_to_be64(offset);
+    len = cpu_to_be32(len);
+    memcpy(buf, &offset, 8);
+    memcpy(buf + 8, &len, 4);
+    if (bdrv_pwrite(s->hd, offsetof(QCowHeader, backing_file_offset),
+                    buf, sizeof(buf)) != sizeof(buf))
+        return -EIO;
+    return 0;
+}
+
 static int qcow_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
 {
     BDRVQcowState *s = bs->opaque;
@@ -901,5 +971,9 @@ BlockDriver bdrv_qcow = {
     .bdrv_aio_cancel = qcow_aio_cancel,
     .aiocb_size = sizeof(QCowAIOCB),
     .bdrv_write_compressed = qcow_write_compressed,
+    .bdrv_compress_cluster = qcow_compress_cluster,
+    .bdrv_write_compressed_data = qcow_write_compressed_data,
     .bdrv_get_info = qcow_get_info,
+    .bdrv_get_host_offset = qcow_get_host_offset,
+    .bdrv_change_backing_file = qcow_change_backing_file,
 };
@@ -26,6 +26,9 @@
 #include <zlib.h>
 #include "aes.h"
 #include <assert.h>
+#ifdef CONFIG_AIO_THREADS
+#include <pthread.h>
+#endif
 
 /*
   Differences with QCOW:
@@ -99,8 +102,41 @@ typedef struct __attribute__((packed)) QCowSnapshotHeader {
     /* name follows  */
 } QCowSnapshotHeader;
 
+/* number of L1 or L2 entries in a sector */
+#define TABLE_ENTRIES_PER_SECTOR (512 / sizeof(uint64_t))
+
+/* minimum number of cached L2 tables */
 #define L2_CACHE_SIZE 16
 
+typedef struct L2CacheEntry {
+    uint64_t offset; /* 0 if the entry is unused */
+    uint64_t *table;
+    int dirty_start, dirty_end; /* modified entries not written yet */
+    struct L2CacheEntry *hash_next;
+    struct L2CacheEntry *lru_prev, *lru_next;
+} L2CacheEntry;
+
+/* number of cached decompressed clusters */
+#define ZCACHE_SIZE 16
+/* maximum number of compressed clusters read after a miss */
+#define ZCACHE_READAHEAD 8
+
+#define ZC_EMPTY   0
+#define ZC_PENDING 1 /* queued or being inflated by a thread */
+#define ZC_READY   2
+#define ZC_ERROR   3
+
+typedef struct ZCacheEntry {
+    uint64_t offset; /* of the compressed data, -1 if the entry is unused */
+    int state;
+    int64_t last_use;
+    uint8_t *cdata; /* compressed data */
+    int csize;
+    uint8_t *data; /* decompressed cluster */
+    int data_size;
+    struct ZCacheEntry *next; /* in the queue of the threads */
+} ZCacheEntry;
+
 typedef struct QCowSnapshot {
     uint64_t l1_table_offset;
     uint32_t l1_size;
@@ -112,6 +148,18 @@ typedef struct QCowSnapshot {
     uint64_t vm_clock_nsec;
 } QCowSnapshot;
 
+/* A write to newly allocated clusters makes their L2 entries visible
+   before its data is written: the sectors it writes must not be
+   accessed until then. */
+typedef struct QCowAllocWrite {
+    int64_t sector_num;
+    int nb_sectors;
+    CoMutex lock; /* held by the write until its data is written */
+    int done;
+    int refs;
+    struct QCowAllocWrite *next;
+} QCowAllocWrite;
+
 typedef struct BDRVQcowState {
     BlockDriverState *hd;
     int cluster_bits;
@@ -127,17 +175,29 @@ typedef struct BDRVQcowState {
     uint64_t l1_table_offset;
     uint64_t *l1_table;
     uint64_t *l2_cache;
-    uint64_t l2_cache_offsets[L2_CACHE_SIZE];
-    uint32_t l2_cache_counts[L2_CACHE_SIZE];
-    uint8_t *cluster_cache;
+    int l2_cache_size; /* number of cached L2 tables */
+    L2CacheEntry *l2_cache_entries;
+    L2CacheEntry **l2_cache_hash;
+    int l2_cache_hash_mask;
+    L2CacheEntry l2_cache_lru; /* lru_next is the most recently used */
+    int64_t l2_cache_hits;
+    int64_t l2_cache_misses;
     uint8_t *cluster_data;
-    uint64_t cluster_cache_offset;
+    ZCacheEntry *zcache; /* allocated at the first compressed read */
+    int64_t zcache_clock;
 
     uint64_t *refcount_table;
     uint64_t refcount_table_offset;
     uint32_t refcount_table_size;
     uint64_t refcount_block_cache_offset;
     uint16_t *refcount_block_cache;
+    int refcount_dirty_start, refcount_dirty_end;
+    /* the metadata is written back in order: the refcount increments
+       before the L2 entries which use the clusters, and the L2
+       entries before the refcount decrements of the clusters they
+       stopped using */
+    int l2_depends_on_refcount;
+    int refcount_depends_on_l2;
     int64_t free_cluster_index;
     int64_t free_byte_offset;
 
@@ -149,22 +209,39 @@ typedef struct BDRVQcowState {
     int snapshots_size;
     int nb_snapshots;
     QCowSnapshot *snapshots;
+
+    CoMutex lock; /* protects the metadata */
+    QCowAllocWrite *alloc_writes;
 } BDRVQcowState;
 
-static int decompress_cluster(BDRVQcowState *s, uint64_t cluster_offset);
+/* L2 cache coverage in MB, 0 for the default */
+int qcow2_l2_cache_mb;
+/* number of threads inflating the compressed clusters, 0 for none */
+int qcow2_zlib_threads = 4;
+
+static uint8_t *decompress_cluster(BlockDriverState *bs, uint64_t offset,
+                                   uint64_t cluster_offset);
+static void zcache_close(BlockDriverState *bs);
+static void zcache_invalidate(BDRVQcowState *s, uint64_t coffset);
+static void zcache_reset(BDRVQcowState *s);
+static int l2_cache_init(BlockDriverState *bs);
+static void l2_cache_reset(BlockDriverState *bs);
+static int l2_cache_flush(BlockDriverState *bs);
 static int qcow_read(BlockDriverState *bs, int64_t sector_num, 
                      uint8_t *buf, int nb_sectors);
 static int qcow_read_snapshots(BlockDriverState *bs);
 static void qcow_free_snapshots(BlockDriverState *bs);
 static int refcount_init(BlockDriverState *bs);
 static void refcount_close(BlockDriverState *bs);
+static int refcount_block_writeback(BlockDriverState *bs);
+static int qcow_flush_metadata(BlockDriverState *bs);
 static int get_refcount(BlockDriverState *bs, int64_t cluster_index);
 static int update_cluster_refcount(BlockDriverState *bs, 
                                    int64_t cluster_index,
                                    int addend);
-static void update_refcount(BlockDriverState *bs, 
-                            int64_t offset, int64_t length, 
-                            int addend);
+static int update_refcount(BlockDriverState *bs, 
+                           int64_t offset, int64_t length, 
+                           int addend);
 static int64_t alloc_clusters(BlockDriverState *bs, int64_t size);
 static int64_t alloc_bytes(BlockDriverState *bs, int size);
 static void free_clusters(BlockDriverState *bs, 
@@ -191,6 +268,7 @@ static int qcow_open(BlockDriverState *bs, const char *filename, int flags)
     int len, i, shift, ret;
     QCowHeader header;
 
+    qemu_co_mutex_init(&s->lock);
     ret = bdrv_file_open(&s->hd, filename, flags);
     if (ret < 0)
         return ret;
@@ -255,18 +333,11 @@ static int qcow_open(BlockDriverState *bs, const char *filename, int flags)
     for(i = 0;i < s->l1_size; i++) {
         be64_to_cpus(&s->l1_table[i]);
     }
-    /* alloc L2 cache */
-    s->l2_cache = qemu_malloc(s->l2_size * L2_CACHE_SIZE * sizeof(uint64_t));
-    if (!s->l2_cache)
-        goto fail;
-    s->cluster_cache = qemu_malloc(s->cluster_size);
-    if (!s->cluster_cache)
+    if (l2_cache_init(bs) < 0)
         goto fail;
-    /* one more sector for decompressed data alignment */
-    s->cluster_data = qemu_malloc(s->cluster_size + 512);
+    s->cluster_data = qemu_malloc(s->cluster_size);
     if (!s->cluster_data)
         goto fail;
-    s->cluster_cache_offset = -1;
     
     if (refcount_init(bs) < 0)
         goto fail;
@@ -293,7 +364,8 @@ static int qcow_open(BlockDriverState *bs, const char *filename, int flags)
     refcount_close(bs);
     qemu_free(s->l1_table);
     qemu_free(s->l2_cache);
-    qemu_free(s->cluster_cache);
+    qemu_free(s->l2_cache_entries);
+    qemu_free(s->l2_cache_hash);
     qemu_free(s->cluster_data);
     bdrv_delete(s->hd);
     return -1;
@@ -366,6 +438,105 @@ static void encrypt_sectors(BDRVQcowState *s, int64_t sector_num,
     }
 }
 
+/* The metadata is only accessed with s->lock held. The AIO requests
+   run in coroutines which yield while they wait for the lock or for
+   the metadata I/O, so a cache miss or a cluster allocation does not
+   stop the VM. The synchronous callers wait until the coroutines have
+   released the lock. */
+static void qcow_lock(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    if (!qemu_in_coroutine() && s->lock.locked && s->lock.owner) {
+        qemu_aio_wait_start();
+        qemu_aio_poll();
+        while (s->lock.locked && s->lock.owner)
+            qemu_aio_wait();
+        qemu_aio_wait_end();
+    }
+    qemu_co_mutex_lock(&s->lock);
+}
+
+static void qcow_unlock(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    qemu_co_mutex_unlock(&s->lock);
+}
+
+/* Called with s->lock held. If an allocating write over the sectors
+   is in flight, release the lock, wait until its data is written and
+   return 1: the caller must look up the clusters again. */
+static int qcow_wait_alloc_write(BlockDriverState *bs, int64_t sector_num,
+                                 int nb_sectors)
+{
+    BDRVQcowState *s = bs->opaque;
+    QCowAllocWrite *w;
+
+    for(w = s->alloc_writes; w != NULL; w = w->next) {
+        if (sector_num < w->sector_num + w->nb_sectors &&
+            w->sector_num < sector_num + nb_sectors)
+            break;
+    }
+    if (!w)
+        return 0;
+    w->refs++;
+    qcow_unlock(bs);
+    if (qemu_in_coroutine()) {
+        qemu_co_mutex_lock(&w->lock);
+        qemu_co_mutex_unlock(&w->lock);
+    } else {
+        qemu_aio_wait_start();
+        qemu_aio_poll();
+        while (!w->done)
+            qemu_aio_wait();
+        qemu_aio_wait_end();
+    }
+    if (--w->refs == 0)
+        qemu_free(w);
+    return 1;
+}
+
+/* called with s->lock held */
+static void qcow_alloc_write_begin(BlockDriverState *bs, QCowAllocWrite *w,
+                                   int64_t sector_num, int nb_sectors)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    memset(w, 0, sizeof(QCowAllocWrite));
+    w->sector_num = sector_num;
+    w->nb_sectors = nb_sectors;
+    w->refs = 1;
+    qemu_co_mutex_init(&w->lock);
+    qemu_co_mutex_lock(&w->lock);
+    w->next = s->alloc_writes;
+    s->alloc_writes = w;
+}
+
+/* the data of 'w' is written: wake up the requests waiting for it */
+static void qcow_alloc_write_end(BlockDriverState *bs, QCowAllocWrite *w)
+{
+    BDRVQcowState *s = bs->opaque;
+    QCowAllocWrite **pw;
+
+    for(pw = &s->alloc_writes; *pw != w; pw = &(*pw)->next)
+        ;
+    *pw = w->next;
+    w->done = 1;
+    qemu_co_mutex_unlock(&w->lock);
+    if (--w->refs == 0)
+        qemu_free(w);
+}
+
+/* wait until no request is updating the metadata. The synchronous
+   code does not run the coroutines, so none can take the lock again
+   before it returns. */
+static void qcow_drain(BlockDriverState *bs)
+{
+    qcow_lock(bs);
+    qcow_unlock(bs);
+}
+
 static int copy_sectors(BlockDriverState *bs, uint64_t start_sect,
                         uint64_t cluster_offset, int n_start, int n_end)
 {
@@ -391,31 +562,212 @@ static int copy_sectors(BlockDriverState *bs, uint64_t start_sect,
     return 0;
 }
 
+/* The L2 cache holds l2_cache_size tables. Entries are found by
+   their L2 table offset through a hash table and kept on a list in
+   most recently used order, so that both lookup and eviction are
+   O(1). The modified entries are written back when their table is
+   evicted or when the image is flushed. */
+
+static int l2_cache_init(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    int64_t coverage;
+    int nb_entries, hash_size;
+
+    /* each L2 table maps 'coverage' bytes of the disk */
+    coverage = (int64_t)s->cluster_size << s->l2_bits;
+    nb_entries = L2_CACHE_SIZE;
+    if (qcow2_l2_cache_mb > 0) {
+        int64_t n;
+        n = (((int64_t)qcow2_l2_cache_mb << 20) + coverage - 1) / coverage;
+        /* no need to cache more tables than the image can have */
+        if (n > s->l1_size)
+            n = s->l1_size;
+        if (n > nb_entries)
+            nb_entries = n;
+    }
+    hash_size = 1;
+    while (hash_size < nb_entries * 2)
+        hash_size <<= 1;
+
+    s->l2_cache_size = nb_entries;
+    s->l2_cache_hash_mask = hash_size - 1;
+    s->l2_cache = qemu_malloc(s->l2_size * nb_entries * sizeof(uint64_t));
+    s->l2_cache_entries = qemu_malloc(nb_entries * sizeof(L2CacheEntry));
+    s->l2_cache_hash = qemu_malloc(hash_size * sizeof(L2CacheEntry *));
+    if (!s->l2_cache || !s->l2_cache_entries || !s->l2_cache_hash)
+        return -1;
+    l2_cache_reset(bs);
+    return 0;
+}
+
+static inline unsigned int l2_cache_hash(BDRVQcowState *s, uint64_t l2_offset)
+{
+    return (l2_offset >> s->cluster_bits) & s->l2_cache_hash_mask;
+}
+
+static inline void l2_cache_lru_unlink(L2CacheEntry *e)
+{
+    e->lru_prev->lru_next = e->lru_next;
+    e->lru_next->lru_prev = e->lru_prev;
+}
+
+static inline void l2_cache_lru_insert(L2CacheEntry *head, L2CacheEntry *e)
+{
+    e->lru_prev = head;
+    e->lru_next = head->lru_next;
+    head->lru_next->lru_prev = e;
+    head->lru_next = e;
+}
+
+static void l2_cache_unhash(BDRVQcowState *s, L2CacheEntry *e)
+{
+    L2CacheEntry **pe;
+
+    for(pe = &s->l2_cache_hash[l2_cache_hash(s, e->offset)]; *pe != NULL;
+        pe = &(*pe)->hash_next) {
+        if (*pe == e) {
+            *pe = e->hash_next;
+            break;
+        }
+    }
+    e->hash_next = NULL;
+    e->offset = 0;
+}
+
+/* the modified entries are lost: l2_cache_flush() must be called
+   before */
 static void l2_cache_reset(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
+    L2CacheEntry *e;
+    int i;
+
+    memset(s->l2_cache_hash, 0,
+           (s->l2_cache_hash_mask + 1) * sizeof(L2CacheEntry *));
+    s->l2_cache_lru.lru_prev = &s->l2_cache_lru;
+    s->l2_cache_lru.lru_next = &s->l2_cache_lru;
+    for(i = 0; i < s->l2_cache_size; i++) {
+        e = &s->l2_cache_entries[i];
+        e->offset = 0;
+        e->table = s->l2_cache + ((int64_t)i << s->l2_bits);
+        e->dirty_start = 0;
+        e->dirty_end = 0;
+        e->hash_next = NULL;
+        l2_cache_lru_insert(&s->l2_cache_lru, e);
+    }
+}
+
+/* return the cached entry for 'l2_offset' or NULL */
+static L2CacheEntry *l2_cache_lookup(BDRVQcowState *s, uint64_t l2_offset)
+{
+    L2CacheEntry *e;
+
+    for(e = s->l2_cache_hash[l2_cache_hash(s, l2_offset)]; e != NULL;
+        e = e->hash_next) {
+        if (e->offset == l2_offset)
+            return e;
+    }
+    return NULL;
+}
 
-    memset(s->l2_cache, 0, s->l2_size * L2_CACHE_SIZE * sizeof(uint64_t));
-    memset(s->l2_cache_offsets, 0, L2_CACHE_SIZE * sizeof(uint64_t));
-    memset(s->l2_cache_counts, 0, L2_CACHE_SIZE * sizeof(uint32_t));
+/* make 'e' the most recently used entry */
+static inline void l2_cache_touch(BDRVQcowState *s, L2CacheEntry *e)
+{
+    if (s->l2_cache_lru.lru_next != e) {
+        l2_cache_lru_unlink(e);
+        l2_cache_lru_insert(&s->l2_cache_lru, e);
+    }
 }
 
-static inline int l2_cache_new_entry(BlockDriverState *bs)
+/* write the modified sectors of a cached table */
+static int l2_cache_writeback(BlockDriverState *bs, L2CacheEntry *e)
 {
     BDRVQcowState *s = bs->opaque;
-    uint32_t min_count;
-    int min_index, i;
-
-    /* find a new entry in the least used one */
-    min_index = 0;
-    min_count = 0xffffffff;
-    for(i = 0; i < L2_CACHE_SIZE; i++) {
-        if (s->l2_cache_counts[i] < min_count) {
-            min_count = s->l2_cache_counts[i];
-            min_index = i;
-        }
+    int start, end, len;
+
+    if (e->dirty_start == e->dirty_end)
+        return 0;
+    if (s->l2_depends_on_refcount) {
+        if (refcount_block_writeback(bs) < 0)
+            return -EIO;
+    }
+    start = e->dirty_start & ~(TABLE_ENTRIES_PER_SECTOR - 1);
+    end = (e->dirty_end + TABLE_ENTRIES_PER_SECTOR - 1) & 
+        ~(TABLE_ENTRIES_PER_SECTOR - 1);
+    len = (end - start) * sizeof(uint64_t);
+    if (bdrv_pwrite(s->hd, e->offset + start * sizeof(uint64_t),
+                    &e->table[start], len) != len)
+        return -EIO;
+    e->dirty_start = 0;
+    e->dirty_end = 0;
+    return 0;
+}
+
+static int l2_cache_flush(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    int i, ret;
+
+    ret = 0;
+    for(i = 0; i < s->l2_cache_size; i++) {
+        if (l2_cache_writeback(bs, &s->l2_cache_entries[i]) < 0)
+            ret = -EIO;
     }
-    return min_index;
+    if (ret == 0)
+        s->refcount_depends_on_l2 = 0;
+    return ret;
+}
+
+/* the entries 'l2_index' to 'l2_index + nb_entries - 1' of a cached
+   table were modified */
+static void l2_cache_set_dirty(L2CacheEntry *e, int l2_index, int nb_entries)
+{
+    if (e->dirty_start == e->dirty_end) {
+        e->dirty_start = l2_index;
+        e->dirty_end = l2_index + nb_entries;
+    } else {
+        if (l2_index < e->dirty_start)
+            e->dirty_start = l2_index;
+        if (l2_index + nb_entries > e->dirty_end)
+            e->dirty_end = l2_index + nb_entries;
+    }
+}
+
+/* return an entry for 'l2_offset' whose table the caller must fill,
+   evicting the least recently used one if needed. Return NULL if the
+   evicted table could not be written back. */
+static L2CacheEntry *l2_cache_new_entry(BlockDriverState *bs,
+                                        uint64_t l2_offset)
+{
+    BDRVQcowState *s = bs->opaque;
+    L2CacheEntry *e, **pe;
+
+    e = l2_cache_lookup(s, l2_offset);
+    if (!e) {
+        e = s->l2_cache_lru.lru_prev;
+        if (e->offset) {
+            if (l2_cache_writeback(bs, e) < 0)
+                return NULL;
+            l2_cache_unhash(s, e);
+        }
+        e->offset = l2_offset;
+        pe = &s->l2_cache_hash[l2_cache_hash(s, l2_offset)];
+        e->hash_next = *pe;
+        *pe = e;
+    }
+    e->dirty_start = 0;
+    e->dirty_end = 0;
+    l2_cache_touch(s, e);
+    return e;
+}
+
+/* forget an entry whose table could not be filled */
+static void l2_cache_drop(BDRVQcowState *s, L2CacheEntry *e)
+{
+    l2_cache_unhash(s, e);
+    l2_cache_lru_unlink(e);
+    l2_cache_lru_insert(s->l2_cache_lru.lru_prev, e);
 }
 
 static int64_t align_offset(int64_t offset, int n)
@@ -443,7 +795,8 @@ static int grow_l1_table(BlockDriverState *bs, int min_size)
     printf("grow l1_table from %d to %d\n", s->l1_size, new_l1_size);
 #endif
 
-    new_l1_size2 = sizeof(uint64_t) * new_l1_size;
+    /* the table is written by whole sectors */
+    new_l1_size2 = align_offset(sizeof(uint64_t) * new_l1_size, 512);
     new_l1_table = qemu_mallocz(new_l1_size2);
     if (!new_l1_table)
         return -ENOMEM;
@@ -451,6 +804,10 @@ static int grow_l1_table(BlockDriverState *bs, int min_size)
 
     /* write new table (align to cluster) */
     new_l1_table_offset = alloc_clusters(bs, new_l1_size2);
+    if ((int64_t)new_l1_table_offset < 0) {
+        qemu_free(new_l1_table);
+        return -EIO;
+    }
     
     for(i = 0; i < s->l1_size; i++)
         new_l1_table[i] = cpu_to_be64(new_l1_table[i]);
@@ -460,6 +817,10 @@ static int grow_l1_table(BlockDriverState *bs, int min_size)
     for(i = 0; i < s->l1_size; i++)
         new_l1_table[i] = be64_to_cpu(new_l1_table[i]);
     
+    /* the refcount of the new table must be on disk before it is used */
+    if (refcount_block_writeback(bs) < 0)
+        goto fail;
+
     /* set new table */
     data64 = cpu_to_be64(new_l1_table_offset);
     if (bdrv_pwrite(s->hd, offsetof(QCowHeader, l1_table_offset),
@@ -476,100 +837,132 @@ static int grow_l1_table(BlockDriverState *bs, int min_size)
     s->l1_size = new_l1_size;
     return 0;
  fail:
-    qemu_free(s->l1_table);
+    qemu_free(new_l1_table);
     return -EIO;
 }
 
-/* 'allocate' is:
- *
- * 0 not to allocate.
- *
- * 1 to allocate a normal cluster (for sector indexes 'n_start' to
- * 'n_end')
- *
- * 2 to allocate a compressed cluster of size
- * 'compressed_size'. 'compressed_size' must be > 0 and <
- * cluster_size 
- *
- * return 0 if not allocated.
- */
-static uint64_t get_cluster_offset(BlockDriverState *bs,
-                                   uint64_t offset, int allocate,
-                                   int compressed_size,
-                                   int n_start, int n_end)
+/* write the sector of the L1 table which contains 'l1_index' */
+static int write_l1_entry(BlockDriverState *bs, int l1_index)
 {
     BDRVQcowState *s = bs->opaque;
-    int min_index, i, j, l1_index, l2_index, ret;
-    uint64_t l2_offset, *l2_table, cluster_offset, tmp, old_l2_offset;
+    uint64_t buf[TABLE_ENTRIES_PER_SECTOR];
+    int l1_start, i;
+
+    l1_start = l1_index & ~(TABLE_ENTRIES_PER_SECTOR - 1);
+    for(i = 0; i < TABLE_ENTRIES_PER_SECTOR; i++) {
+        if (l1_start + i < s->l1_size)
+            buf[i] = cpu_to_be64(s->l1_table[l1_start + i]);
+        else
+            buf[i] = 0;
+    }
+    if (bdrv_pwrite(s->hd, s->l1_table_offset + l1_start * sizeof(uint64_t),
+                    buf, sizeof(buf)) != sizeof(buf))
+        return -1;
+    return 0;
+}
+
+/* return the cache entry of the L2 table which maps 'offset'. If
+   'allocate' is set, a missing or shared L2 table is allocated. Return
+   NULL if there is no L2 table or on error. */
+static L2CacheEntry *get_l2_table(BlockDriverState *bs, uint64_t offset,
+                                  int allocate)
+{
+    BDRVQcowState *s = bs->opaque;
+    int l1_index;
+    uint64_t l2_offset, old_l2_offset;
+    L2CacheEntry *e;
     
     l1_index = offset >> (s->l2_bits + s->cluster_bits);
     if (l1_index >= s->l1_size) {
         /* outside l1 table is allowed: we grow the table if needed */
         if (!allocate)
-            return 0;
+            return NULL;
         if (grow_l1_table(bs, l1_index + 1) < 0)
-            return 0;
+            return NULL;
     }
     l2_offset = s->l1_table[l1_index];
-    if (!l2_offset) {
+    if (!l2_offset || (allocate && !(l2_offset & QCOW_OFLAG_COPIED))) {
         if (!allocate)
-            return 0;
-    l2_allocate:
+            return NULL;
         old_l2_offset = l2_offset;
         /* allocate a new l2 entry */
         l2_offset = alloc_clusters(bs, s->l2_size * sizeof(uint64_t));
-        /* update the L1 entry */
-        s->l1_table[l1_index] = l2_offset | QCOW_OFLAG_COPIED;
-        tmp = cpu_to_be64(l2_offset | QCOW_OFLAG_COPIED);
-        if (bdrv_pwrite(s->hd, s->l1_table_offset + l1_index * sizeof(tmp), 
-                        &tmp, sizeof(tmp)) != sizeof(tmp))
-            return 0;
-        min_index = l2_cache_new_entry(bs);
-        l2_table = s->l2_cache + (min_index << s->l2_bits);
-
+        if ((int64_t)l2_offset < 0)
+            return NULL;
+        e = l2_cache_new_entry(bs, l2_offset);
+        if (!e)
+            return NULL;
         if (old_l2_offset == 0) {
-            memset(l2_table, 0, s->l2_size * sizeof(uint64_t));
+            memset(e->table, 0, s->l2_size * sizeof(uint64_t));
         } else {
             if (bdrv_pread(s->hd, old_l2_offset, 
-                           l2_table, s->l2_size * sizeof(uint64_t)) !=
-                s->l2_size * sizeof(uint64_t))
-                return 0;
+                           e->table, s->l2_size * sizeof(uint64_t)) !=
+                s->l2_size * sizeof(uint64_t)) {
+                l2_cache_drop(s, e);
+                return NULL;
+            }
         }
-        if (bdrv_pwrite(s->hd, l2_offset, 
-                        l2_table, s->l2_size * sizeof(uint64_t)) !=
-            s->l2_size * sizeof(uint64_t))
-            return 0;
+        /* the table must be on disk before the L1 entry */
+        l2_cache_set_dirty(e, 0, s->l2_size);
+        if (l2_cache_writeback(bs, e) < 0) {
+            l2_cache_drop(s, e);
+            return NULL;
+        }
+        /* update the L1 entry */
+        s->l1_table[l1_index] = l2_offset | QCOW_OFLAG_COPIED;
+        if (write_l1_entry(bs, l1_index) < 0)
+            return NULL;
+        if (old_l2_offset != 0)
+            free_clusters(bs, old_l2_offset, s->l2_size * sizeof(uint64_t));
     } else {
-        if (!(l2_offset & QCOW_OFLAG_COPIED)) {
-            if (allocate) {
-                free_clusters(bs, l2_offset, s->l2_size * sizeof(uint64_t));
-                goto l2_allocate;
-            }
+        l2_offset &= ~QCOW_OFLAG_COPIED;
+        e = l2_cache_lookup(s, l2_offset);
+        if (e) {
+            s->l2_cache_hits++;
+            l2_cache_touch(s, e);
         } else {
-            l2_offset &= ~QCOW_OFLAG_COPIED;
-        }
-        for(i = 0; i < L2_CACHE_SIZE; i++) {
-            if (l2_offset == s->l2_cache_offsets[i]) {
-                /* increment the hit count */
-                if (++s->l2_cache_counts[i] == 0xffffffff) {
-                    for(j = 0; j < L2_CACHE_SIZE; j++) {
-                        s->l2_cache_counts[j] >>= 1;
-                    }
-                }
-                l2_table = s->l2_cache + (i << s->l2_bits);
-                goto found;
+            /* not found: load it in place of the least recently used */
+            s->l2_cache_misses++;
+            e = l2_cache_new_entry(bs, l2_offset);
+            if (!e)
+                return NULL;
+            if (bdrv_pread(s->hd, l2_offset, e->table, s->l2_size * sizeof(uint64_t)) != 
+                s->l2_size * sizeof(uint64_t)) {
+                l2_cache_drop(s, e);
+                return NULL;
             }
         }
-        /* not found: load a new entry in the least used one */
-        min_index = l2_cache_new_entry(bs);
-        l2_table = s->l2_cache + (min_index << s->l2_bits);
-        if (bdrv_pread(s->hd, l2_offset, l2_table, s->l2_size * sizeof(uint64_t)) != 
-            s->l2_size * sizeof(uint64_t))
-            return 0;
     }
-    s->l2_cache_offsets[min_index] = l2_offset;
-    s->l2_cache_counts[min_index] = 1;
- found:
+    return e;
+}
+
+/* 'allocate' is:
+ *
+ * 0 not to allocate.
+ *
+ * 1 to allocate a normal cluster (for sector indexes 'n_start' to
+ * 'n_end')
+ *
+ * 2 to allocate a compressed cluster of size
+ * 'compressed_size'. 'compressed_size' must be > 0 and <
+ * cluster_size 
+ *
+ * return 0 if not allocated.
+ */
+static uint64_t get_cluster_offset(BlockDriverState *bs,
+                                   uint64_t offset, int allocate,
+                                   int compressed_size,
+                                   int n_start, int n_end)
+{
+    BDRVQcowState *s = bs->opaque;
+    int l2_index, ret;
+    uint64_t *l2_table, cluster_offset, old_cluster_offset;
+    L2CacheEntry *e;
+    
+    e = get_l2_table(bs, offset, allocate);
+    if (!e)
+        return 0;
+    l2_table = e->table;
     l2_index = (offset >> s->cluster_bits) & (s->l2_size - 1);
     cluster_offset = be64_to_cpu(l2_table[l2_index]);
     if (!cluster_offset) {
@@ -578,23 +971,16 @@ static uint64_t get_cluster_offset(BlockDriverState *bs,
     } else if (!(cluster_offset & QCOW_OFLAG_COPIED)) {
         if (!allocate)
             return cluster_offset;
-        /* free the cluster */
-        if (cluster_offset & QCOW_OFLAG_COMPRESSED) {
-            int nb_csectors;
-            nb_csectors = ((cluster_offset >> s->csize_shift) & 
-                           s->csize_mask) + 1;
-            free_clusters(bs, (cluster_offset & s->cluster_offset_mask) & ~511,
-                          nb_csectors * 512);
-        } else {
-            free_clusters(bs, cluster_offset, s->cluster_size);
-        }
     } else {
         cluster_offset &= ~QCOW_OFLAG_COPIED;
         return cluster_offset;
     }
+    old_cluster_offset = cluster_offset;
     if (allocate == 1) {
         /* allocate a new cluster */
         cluster_offset = alloc_clusters(bs, s->cluster_size);
+        if ((int64_t)cluster_offset < 0)
+            return 0;
 
         /* we must initialize the cluster content which won't be
            written */
@@ -611,22 +997,117 @@ static uint64_t get_cluster_offset(BlockDriverState *bs,
             if (ret < 0)
                 return 0;
         }
-        tmp = cpu_to_be64(cluster_offset | QCOW_OFLAG_COPIED);
+        l2_table[l2_index] = cpu_to_be64(cluster_offset | QCOW_OFLAG_COPIED);
     } else {
         int nb_csectors;
         cluster_offset = alloc_bytes(bs, compressed_size);
+        if ((int64_t)cluster_offset < 0)
+            return 0;
         nb_csectors = ((cluster_offset + compressed_size - 1) >> 9) - 
             (cluster_offset >> 9);
         cluster_offset |= QCOW_OFLAG_COMPRESSED | 
             ((uint64_t)nb_csectors << s->csize_shift);
         /* compressed clusters never have the copied flag */
-        tmp = cpu_to_be64(cluster_offset);
+        l2_table[l2_index] = cpu_to_be64(cluster_offset);
     }
-    /* update L2 table */
-    l2_table[l2_index] = tmp;
-    if (bdrv_pwrite(s->hd, 
-                    l2_offset + l2_index * sizeof(tmp), &tmp, sizeof(tmp)) != sizeof(tmp))
+    l2_cache_set_dirty(e, l2_index, 1);
+    /* free the old cluster once it is no longer referenced */
+    if (old_cluster_offset & QCOW_OFLAG_COMPRESSED) {
+        int nb_csectors;
+        nb_csectors = ((old_cluster_offset >> s->csize_shift) & 
+                       s->csize_mask) + 1;
+        zcache_invalidate(s, old_cluster_offset & s->cluster_offset_mask);
+        free_clusters(bs, (old_cluster_offset & s->cluster_offset_mask) & ~511,
+                      nb_csectors * 512);
+    } else if (old_cluster_offset) {
+        free_clusters(bs, old_cluster_offset, s->cluster_size);
+    }
+    return cluster_offset;
+}
+
+/* Return the offset of the cluster in which 'sector_num' is written
+   and in '*pnum' the number of sectors, at most 'nb_sectors', which
+   are contiguous in the image file from there. The clusters which
+   are not allocated yet are allocated together: their refcounts and
+   their L2 entries are updated once for the whole range. '*pnew' is
+   set if the clusters were allocated by the call. Return 0 on
+   error. */
+static uint64_t alloc_cluster_range(BlockDriverState *bs, int64_t sector_num,
+                                    int nb_sectors, int *pnum, int *pnew)
+{
+    BDRVQcowState *s = bs->opaque;
+    int l2_index, index_in_cluster, nb_clusters, i, n, n_end;
+    uint64_t *l2_table, cluster_offset, entry;
+    int64_t start_sect;
+    L2CacheEntry *e;
+
+    index_in_cluster = sector_num & (s->cluster_sectors - 1);
+    e = get_l2_table(bs, sector_num << 9, 1);
+    if (!e)
         return 0;
+    l2_table = e->table;
+    l2_index = (sector_num >> (s->cluster_bits - 9)) & (s->l2_size - 1);
+    nb_clusters = (index_in_cluster + nb_sectors + s->cluster_sectors - 1) >>
+        (s->cluster_bits - 9);
+    if (nb_clusters > s->l2_size - l2_index)
+        nb_clusters = s->l2_size - l2_index;
+
+    entry = be64_to_cpu(l2_table[l2_index]);
+    *pnew = !(entry & QCOW_OFLAG_COPIED);
+    if (entry & QCOW_OFLAG_COPIED) {
+        /* already allocated: extend over the contiguous clusters */
+        cluster_offset = entry & ~QCOW_OFLAG_COPIED;
+        for(i = 1; i < nb_clusters; i++) {
+            if (be64_to_cpu(l2_table[l2_index + i]) !=
+                ((cluster_offset + ((uint64_t)i << s->cluster_bits)) |
+                 QCOW_OFLAG_COPIED))
+                break;
+        }
+        nb_clusters = i;
+    } else if (entry != 0) {
+        /* shared or compressed: the cluster is copied on its own */
+        n = s->cluster_sectors - index_in_cluster;
+        if (n > nb_sectors)
+            n = nb_sectors;
+        cluster_offset = get_cluster_offset(bs, sector_num << 9, 1, 0,
+                                            index_in_cluster,
+                                            index_in_cluster + n);
+        *pnum = n;
+        return cluster_offset;
+    } else {
+        for(i = 1; i < nb_clusters; i++) {
+            if (l2_table[l2_index + i] != 0)
+                break;
+        }
+        nb_clusters = i;
+        cluster_offset = alloc_clusters(bs, (int64_t)nb_clusters << s->cluster_bits);
+        if ((int64_t)cluster_offset < 0)
+            return 0;
+
+        /* we must initialize the content of the first and last
+           clusters which won't be written */
+        start_sect = sector_num - index_in_cluster;
+        n_end = index_in_cluster + nb_sectors;
+        if (n_end > nb_clusters * s->cluster_sectors)
+            n_end = nb_clusters * s->cluster_sectors;
+        if (copy_sectors(bs, start_sect, cluster_offset,
+                         0, index_in_cluster) < 0)
+            return 0;
+        if (copy_sectors(bs, start_sect, cluster_offset, n_end,
+                         align_offset(n_end, s->cluster_sectors)) < 0)
+            return 0;
+
+        for(i = 0; i < nb_clusters; i++) {
+            l2_table[l2_index + i] = 
+                cpu_to_be64((cluster_offset + ((uint64_t)i << s->cluster_bits)) |
+                            QCOW_OFLAG_COPIED);
+        }
+        l2_cache_set_dirty(e, l2_index, nb_clusters);
+    }
+    n = nb_clusters * s->cluster_sectors - index_in_cluster;
+    if (n > nb_sectors)
+        n = nb_sectors;
+    *pnum = n;
     return cluster_offset;
 }
 
@@ -637,7 +1118,9 @@ static int qcow_is_allocated(BlockDriverState *bs, int64_t sector_num,
     int index_in_cluster, n;
     uint64_t cluster_offset;
 
+    qcow_lock(bs);
     cluster_offset = get_cluster_offset(bs, sector_num << 9, 0, 0, 0, 0);
+    qcow_unlock(bs);
     index_in_cluster = sector_num & (s->cluster_sectors - 1);
     n = s->cluster_sectors - index_in_cluster;
     if (n > nb_sectors)
@@ -646,6 +1129,27 @@ static int qcow_is_allocated(BlockDriverState *bs, int64_t sector_num,
     return (cluster_offset != 0);
 }
 
+static int64_t qcow_get_host_offset(BlockDriverState *bs, int64_t sector_num,
+                                    int nb_sectors, int *pnum)
+{
+    BDRVQcowState *s = bs->opaque;
+    int index_in_cluster, n;
+    uint64_t cluster_offset;
+
+    qcow_lock(bs);
+    cluster_offset = get_cluster_offset(bs, sector_num << 9, 0, 0, 0, 0);
+    qcow_unlock(bs);
+    index_in_cluster = sector_num & (s->cluster_sectors - 1);
+    n = s->cluster_sectors - index_in_cluster;
+    if (n > nb_sectors)
+        n = nb_sectors;
+    *pnum = n;
+    if (!cluster_offset || (cluster_offset & QCOW_OFLAG_COMPRESSED) ||
+        bs->encrypted)
+        return -1;
+    return cluster_offset + index_in_cluster * 512;
+}
+
 static int decompress_buffer(uint8_t *out_buf, int out_buf_size,
                              const uint8_t *buf, int buf_size)
 {
@@ -673,27 +1177,308 @@ static int decompress_buffer(uint8_t *out_buf, int out_buf_size,
     return 0;
 }
                               
-static int decompress_cluster(BDRVQcowState *s, uint64_t cluster_offset)
+/*********************************************************/
+/* compressed cluster cache */
+
+/* The decompressed clusters are kept in a small cache. When threads
+   are available, a miss also reads the compressed clusters which
+   follow in the L2 table and in the image file, and all of them are
+   inflated in parallel by a pool of threads shared by the images. */
+
+#ifdef CONFIG_AIO_THREADS
+static pthread_mutex_t zpool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t zpool_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t zpool_done_cond = PTHREAD_COND_INITIALIZER;
+static ZCacheEntry *zpool_first; /* entries waiting for a thread */
+static ZCacheEntry **zpool_last = &zpool_first;
+static int zpool_nb_threads; /* -1 if the threads cannot be created */
+
+static void *zpool_worker(void *opaque)
 {
-    int ret, csize, nb_csectors, sector_offset;
-    uint64_t coffset;
+    ZCacheEntry *e;
+    int ret;
 
-    coffset = cluster_offset & s->cluster_offset_mask;
-    if (s->cluster_cache_offset != coffset) {
-        nb_csectors = ((cluster_offset >> s->csize_shift) & s->csize_mask) + 1;
-        sector_offset = coffset & 511;
-        csize = nb_csectors * 512 - sector_offset;
-        ret = bdrv_read(s->hd, coffset >> 9, s->cluster_data, nb_csectors);
-        if (ret < 0) {
+    pthread_mutex_lock(&zpool_lock);
+    for(;;) {
+        while (!zpool_first)
+            pthread_cond_wait(&zpool_cond, &zpool_lock);
+        e = zpool_first;
+        zpool_first = e->next;
+        if (!zpool_first)
+            zpool_last = &zpool_first;
+        pthread_mutex_unlock(&zpool_lock);
+
+        ret = decompress_buffer(e->data, e->data_size, e->cdata, e->csize);
+
+        pthread_mutex_lock(&zpool_lock);
+        e->state = (ret < 0) ? ZC_ERROR : ZC_READY;
+        pthread_cond_broadcast(&zpool_done_cond);
+    }
+    return NULL;
+}
+
+/* return the number of threads, starting them if needed */
+static int zpool_start(void)
+{
+    pthread_t thread;
+    sigset_t set, oldset;
+    int i;
+
+    if (zpool_nb_threads != 0 || qcow2_zlib_threads <= 0)
+        return zpool_nb_threads > 0 ? zpool_nb_threads : 0;
+    /* the signals are handled by the main thread */
+    sigfillset(&set);
+    pthread_sigmask(SIG_SETMASK, &set, &oldset);
+    for(i = 0; i < qcow2_zlib_threads; i++) {
+        if (pthread_create(&thread, NULL, zpool_worker, NULL))
+            break;
+        pthread_detach(thread);
+    }
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+    zpool_nb_threads = i > 0 ? i : -1;
+    return i;
+}
+#endif
+
+/* inflate the compressed data of 'e', in a thread if possible */
+static void zcache_submit(ZCacheEntry *e)
+{
+#ifdef CONFIG_AIO_THREADS
+    if (zpool_start() > 0) {
+        pthread_mutex_lock(&zpool_lock);
+        e->state = ZC_PENDING;
+        e->next = NULL;
+        *zpool_last = e;
+        zpool_last = &e->next;
+        pthread_cond_signal(&zpool_cond);
+        pthread_mutex_unlock(&zpool_lock);
+        return;
+    }
+#endif
+    if (decompress_buffer(e->data, e->data_size, e->cdata, e->csize) < 0)
+        e->state = ZC_ERROR;
+    else
+        e->state = ZC_READY;
+}
+
+/* wait until 'e' is no longer being inflated */
+static void zcache_wait(ZCacheEntry *e)
+{
+#ifdef CONFIG_AIO_THREADS
+    pthread_mutex_lock(&zpool_lock);
+    while (e->state == ZC_PENDING)
+        pthread_cond_wait(&zpool_done_cond, &zpool_lock);
+    pthread_mutex_unlock(&zpool_lock);
+#endif
+}
+
+static int zcache_init(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    ZCacheEntry *e;
+    int i;
+
+    s->zcache = qemu_mallocz(ZCACHE_SIZE * sizeof(ZCacheEntry));
+    if (!s->zcache)
+        return -1;
+    for(i = 0; i < ZCACHE_SIZE; i++) {
+        e = &s->zcache[i];
+        e->offset = -1;
+        e->data_size = s->cluster_size;
+        e->data = qemu_malloc(s->cluster_size);
+        /* one more sector for the alignment of the compressed data */
+        e->cdata = qemu_malloc(s->cluster_size + 512);
+        if (!e->data || !e->cdata)
             return -1;
+    }
+    return 0;
+}
+
+static void zcache_close(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    int i;
+
+    if (!s->zcache)
+        return;
+    for(i = 0; i < ZCACHE_SIZE; i++) {
+        zcache_wait(&s->zcache[i]);
+        qemu_free(s->zcache[i].data);
+        qemu_free(s->zcache[i].cdata);
+    }
+    qemu_free(s->zcache);
+    s->zcache = NULL;
+}
+
+static ZCacheEntry *zcache_lookup(BDRVQcowState *s, uint64_t coffset)
+{
+    int i;
+
+    if (!s->zcache)
+        return NULL;
+    for(i = 0; i < ZCACHE_SIZE; i++) {
+        if (s->zcache[i].offset == coffset)
+            return &s->zcache[i];
+    }
+    return NULL;
+}
+
+/* return the least recently used entry, which the caller must fill */
+static ZCacheEntry *zcache_new_entry(BDRVQcowState *s, uint64_t coffset)
+{
+    ZCacheEntry *e, *e1;
+    int i;
+
+    e = &s->zcache[0];
+    for(i = 1; i < ZCACHE_SIZE; i++) {
+        e1 = &s->zcache[i];
+        if (e1->last_use < e->last_use)
+            e = e1;
+    }
+    /* it may still be inflated by a thread for a readahead */
+    zcache_wait(e);
+    e->offset = coffset;
+    e->state = ZC_EMPTY;
+    e->last_use = ++s->zcache_clock;
+    return e;
+}
+
+/* forget the cached data at 'coffset', whose clusters were freed */
+static void zcache_invalidate(BDRVQcowState *s, uint64_t coffset)
+{
+    ZCacheEntry *e;
+
+    e = zcache_lookup(s, coffset);
+    if (e) {
+        zcache_wait(e);
+        e->offset = -1;
+        e->last_use = 0;
+    }
+}
+
+static void zcache_reset(BDRVQcowState *s)
+{
+    int i;
+
+    if (!s->zcache)
+        return;
+    for(i = 0; i < ZCACHE_SIZE; i++) {
+        zcache_wait(&s->zcache[i]);
+        s->zcache[i].offset = -1;
+        s->zcache[i].last_use = 0;
+    }
+}
+
+/* Read the compressed cluster 'cluster_offset' which maps 'offset'
+   in 'e' and start to inflate it. The next compressed clusters of
+   the L2 table are also read if they are stored just after it. */
+static int zcache_fill(BlockDriverState *bs, ZCacheEntry *e,
+                       uint64_t offset, uint64_t cluster_offset)
+{
+    BDRVQcowState *s = bs->opaque;
+    ZCacheEntry *ra[ZCACHE_READAHEAD + 1];
+    uint64_t ra_offset[ZCACHE_READAHEAD + 1];
+    uint64_t coffset, start, end;
+    uint8_t *buf;
+    int nb, i, nb_csectors;
+
+    coffset = cluster_offset & s->cluster_offset_mask;
+    nb_csectors = ((cluster_offset >> s->csize_shift) & s->csize_mask) + 1;
+    start = coffset & ~511;
+    end = start + nb_csectors * 512;
+    ra[0] = e;
+    ra_offset[0] = cluster_offset;
+    nb = 1;
+
+#ifdef CONFIG_AIO_THREADS
+    if (zpool_start() > 0) {
+        uint64_t l2_offset, entry, sector;
+        L2CacheEntry *l2;
+        int l2_index;
+
+        l2_offset = s->l1_table[offset >> (s->l2_bits + s->cluster_bits)];
+        l2 = l2_cache_lookup(s, l2_offset & ~QCOW_OFLAG_COPIED);
+        l2_index = (offset >> s->cluster_bits) & (s->l2_size - 1);
+        for(i = l2_index + 1; l2 && i < s->l2_size && 
+                nb < ZCACHE_READAHEAD + 1; i++) {
+            entry = be64_to_cpu(l2->table[i]);
+            if (!(entry & QCOW_OFLAG_COMPRESSED))
+                break;
+            coffset = entry & s->cluster_offset_mask;
+            sector = coffset & ~511;
+            /* compressed clusters are packed: the next one starts in
+               the last sector of the previous one or just after */
+            if (sector + 512 < end || sector > end)
+                break;
+            if (zcache_lookup(s, coffset))
+                break;
+            ra[nb] = zcache_new_entry(s, coffset);
+            ra_offset[nb] = entry;
+            nb++;
+            nb_csectors = ((entry >> s->csize_shift) & s->csize_mask) + 1;
+            end = sector + nb_csectors * 512;
         }
-        if (decompress_buffer(s->cluster_cache, s->cluster_size,
-                              s->cluster_data + sector_offset, csize) < 0) {
-            return -1;
+    }
+#endif
+
+    buf = qemu_malloc(end - start);
+    if (!buf)
+        goto fail;
+    if (bdrv_pread(s->hd, start, buf, end - start) != end - start) {
+        qemu_free(buf);
+        goto fail;
+    }
+    for(i = 0; i < nb; i++) {
+        coffset = ra_offset[i] & s->cluster_offset_mask;
+        nb_csectors = ((ra_offset[i] >> s->csize_shift) & s->csize_mask) + 1;
+        ra[i]->csize = nb_csectors * 512 - (coffset & 511);
+        if (ra[i]->csize > s->cluster_size + 512) {
+            ra[i]->state = ZC_ERROR;
+            continue;
         }
-        s->cluster_cache_offset = coffset;
+        memcpy(ra[i]->cdata, buf + (coffset - start), ra[i]->csize);
+        zcache_submit(ra[i]);
     }
+    qemu_free(buf);
     return 0;
+ fail:
+    for(i = 0; i < nb; i++) {
+        ra[i]->offset = -1;
+        ra[i]->last_use = 0;
+    }
+    return -1;
+}
+
+/* return the data of the compressed cluster 'cluster_offset' which
+   maps 'offset', or NULL if error */
+static uint8_t *decompress_cluster(BlockDriverState *bs, uint64_t offset,
+                                   uint64_t cluster_offset)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t coffset;
+    ZCacheEntry *e;
+
+    if (!s->zcache) {
+        if (zcache_init(bs) < 0) {
+            zcache_close(bs);
+            return NULL;
+        }
+    }
+    coffset = cluster_offset & s->cluster_offset_mask;
+    e = zcache_lookup(s, coffset);
+    if (!e) {
+        e = zcache_new_entry(s, coffset);
+        if (zcache_fill(bs, e, offset, cluster_offset) < 0)
+            return NULL;
+    }
+    e->last_use = ++s->zcache_clock;
+    zcache_wait(e);
+    if (e->state != ZC_READY) {
+        e->offset = -1;
+        e->last_use = 0;
+        return NULL;
+    }
+    return e->data;
 }
 
 /* handle reading after the end of the backing file */
@@ -719,11 +1504,17 @@ static int qcow_read(BlockDriverState *bs, int64_t sector_num,
     uint64_t cluster_offset;
     
     while (nb_sectors > 0) {
+        qcow_lock(bs);
         cluster_offset = get_cluster_offset(bs, sector_num << 9, 0, 0, 0, 0);
         index_in_cluster = sector_num & (s->cluster_sectors - 1);
         n = s->cluster_sectors - index_in_cluster;
         if (n > nb_sectors)
             n = nb_sectors;
+        if (qcow_wait_alloc_write(bs, sector_num, n))
+            continue;
+        /* the compressed cluster cache is shared */
+        if (!(cluster_offset & QCOW_OFLAG_COMPRESSED))
+            qcow_unlock(bs);
         if (!cluster_offset) {
             if (bs->backing_hd) {
                 /* read from the base image */
@@ -737,9 +1528,13 @@ static int qcow_read(BlockDriverState *bs, int64_t sector_num,
                 memset(buf, 0, 512 * n);
             }
         } else if (cluster_offset & QCOW_OFLAG_COMPRESSED) {
-            if (decompress_cluster(s, cluster_offset) < 0)
+            uint8_t *data;
+            data = decompress_cluster(bs, sector_num << 9, cluster_offset);
+            if (data)
+                memcpy(buf, data + index_in_cluster * 512, 512 * n);
+            qcow_unlock(bs);
+            if (!data)
                 return -1;
-            memcpy(buf, s->cluster_cache + index_in_cluster * 512, 512 * n);
         } else {
             ret = bdrv_pread(s->hd, cluster_offset + index_in_cluster * 512, buf, n * 512);
             if (ret != n * 512) 
@@ -760,35 +1555,69 @@ static int qcow_write(BlockDriverState *bs, int64_t sector_num,
                      const uint8_t *buf, int nb_sectors)
 {
     BDRVQcowState *s = bs->opaque;
-    int ret, index_in_cluster, n;
+    int ret, index_in_cluster, n, allocated;
     uint64_t cluster_offset;
+    uint8_t *cluster_data;
+    QCowAllocWrite *w;
     
+    /* the lock is not held while the data is written, so the
+       encrypted data cannot use s->cluster_data */
+    cluster_data = NULL;
+    if (s->crypt_method) {
+        cluster_data = qemu_malloc(nb_sectors * 512);
+        if (!cluster_data)
+            return -1;
+    }
+    ret = 0;
     while (nb_sectors > 0) {
+        /* allocated before the clusters, which cannot be released */
+        w = qemu_malloc(sizeof(QCowAllocWrite));
+        if (!w) {
+            ret = -1;
+            break;
+        }
         index_in_cluster = sector_num & (s->cluster_sectors - 1);
-        n = s->cluster_sectors - index_in_cluster;
-        if (n > nb_sectors)
-            n = nb_sectors;
-        cluster_offset = get_cluster_offset(bs, sector_num << 9, 1, 0, 
-                                            index_in_cluster, 
-                                            index_in_cluster + n);
-        if (!cluster_offset)
-            return -1;
-        if (s->crypt_method) {
-            encrypt_sectors(s, sector_num, s->cluster_data, buf, n, 1,
+        qcow_lock(bs);
+        if (qcow_wait_alloc_write(bs, sector_num, nb_sectors)) {
+            qemu_free(w);
+            continue;
+        }
+        cluster_offset = alloc_cluster_range(bs, sector_num, nb_sectors, &n,
+                                             &allocated);
+        if (cluster_offset && allocated) {
+            qcow_alloc_write_begin(bs, w, sector_num, n);
+        } else {
+            qemu_free(w);
+            w = NULL;
+        }
+        qcow_unlock(bs);
+        if (!cluster_offset || (cluster_offset & 511) != 0) {
+            if (w)
+                qcow_alloc_write_end(bs, w);
+            ret = -1;
+            break;
+        }
+        if (cluster_data) {
+            encrypt_sectors(s, sector_num, cluster_data, buf, n, 1,
                             &s->aes_encrypt_key);
             ret = bdrv_pwrite(s->hd, cluster_offset + index_in_cluster * 512, 
-                              s->cluster_data, n * 512);
+                              cluster_data, n * 512);
         } else {
             ret = bdrv_pwrite(s->hd, cluster_offset + index_in_cluster * 512, buf, n * 512);
         }
-        if (ret != n * 512) 
-            return -1;
+        if (w)
+            qcow_alloc_write_end(bs, w);
+        if (ret != n * 512) {
+            ret = -1;
+            break;
+        }
+        ret = 0;
         nb_sectors -= n;
         sector_num += n;
         buf += n * 512;
     }
-    s->cluster_cache_offset = -1; /* disable compressed cache */
-    return 0;
+    qemu_free(cluster_data);
+    return ret;
 }
 
 typedef struct QCowAIOCB {
@@ -796,224 +1625,101 @@ typedef struct QCowAIOCB {
     int64_t sector_num;
     uint8_t *buf;
     int nb_sectors;
-    int n;
-    uint64_t cluster_offset;
-    uint8_t *cluster_data; 
-    BlockDriverAIOCB *hd_aiocb;
+    int is_write;
+    int done;
+    int cancelled;
 } QCowAIOCB;
 
-static void qcow_aio_read_cb(void *opaque, int ret)
+/* the AIO requests run the synchronous code in a coroutine: the I/O
+   it does on the image file and on the backing file is submitted
+   asynchronously and the coroutine yields until it completes */
+static void qcow_aio_co_entry(void *opaque)
 {
     QCowAIOCB *acb = opaque;
     BlockDriverState *bs = acb->common.bs;
-    BDRVQcowState *s = bs->opaque;
-    int index_in_cluster, n1;
-
-    acb->hd_aiocb = NULL;
-    if (ret < 0) {
-    fail:
-        acb->common.cb(acb->common.opaque, ret);
-        qemu_aio_release(acb);
-        return;
-    }
-
- redo:
-    /* post process the read buffer */
-    if (!acb->cluster_offset) {
-        /* nothing to do */
-    } else if (acb->cluster_offset & QCOW_OFLAG_COMPRESSED) {
-        /* nothing to do */
-    } else {
-        if (s->crypt_method) {
-            encrypt_sectors(s, acb->sector_num, acb->buf, acb->buf, 
-                            acb->n, 0, 
-                            &s->aes_decrypt_key);
-        }
-    }
-
-    acb->nb_sectors -= acb->n;
-    acb->sector_num += acb->n;
-    acb->buf += acb->n * 512;
+    int ret;
 
-    if (acb->nb_sectors == 0) {
-        /* request completed */
-        acb->common.cb(acb->common.opaque, 0);
-        qemu_aio_release(acb);
+    if (acb->is_write)
+        ret = qcow_write(bs, acb->sector_num, acb->buf, acb->nb_sectors);
+    else
+        ret = qcow_read(bs, acb->sector_num, acb->buf, acb->nb_sectors);
+    acb->done = 1;
+    if (acb->cancelled) {
+        /* released by qcow_aio_cancel() */
         return;
     }
-    
-    /* prepare next AIO request */
-    acb->cluster_offset = get_cluster_offset(bs, acb->sector_num << 9, 
-                                             0, 0, 0, 0);
-    index_in_cluster = acb->sector_num & (s->cluster_sectors - 1);
-    acb->n = s->cluster_sectors - index_in_cluster;
-    if (acb->n > acb->nb_sectors)
-        acb->n = acb->nb_sectors;
-
-    if (!acb->cluster_offset) {
-        if (bs->backing_hd) {
-            /* read from the base image */
-            n1 = backing_read1(bs->backing_hd, acb->sector_num, 
-                               acb->buf, acb->n);
-            if (n1 > 0) {
-                acb->hd_aiocb = bdrv_aio_read(bs->backing_hd, acb->sector_num, 
-                                    acb->buf, acb->n, qcow_aio_read_cb, acb);
-                if (acb->hd_aiocb == NULL)
-                    goto fail;
-            } else {
-                goto redo;
-            }
-        } else {
-            /* Note: in this case, no need to wait */
-            memset(acb->buf, 0, 512 * acb->n);
-            goto redo;
-        }
-    } else if (acb->cluster_offset & QCOW_OFLAG_COMPRESSED) {
-        /* add AIO support for compressed blocks ? */
-        if (decompress_cluster(s, acb->cluster_offset) < 0)
-            goto fail;
-        memcpy(acb->buf, 
-               s->cluster_cache + index_in_cluster * 512, 512 * acb->n);
-        goto redo;
-    } else {
-        if ((acb->cluster_offset & 511) != 0) {
-            ret = -EIO;
-            goto fail;
-        }
-        acb->hd_aiocb = bdrv_aio_read(s->hd,
-                            (acb->cluster_offset >> 9) + index_in_cluster, 
-                            acb->buf, acb->n, qcow_aio_read_cb, acb);
-        if (acb->hd_aiocb == NULL)
-            goto fail;
-    }
+    acb->common.cb(acb->common.opaque, ret < 0 ? -EIO : 0);
+    qemu_aio_release(acb);
 }
 
-static QCowAIOCB *qcow_aio_setup(BlockDriverState *bs,
+static BlockDriverAIOCB *qcow_aio_submit(BlockDriverState *bs,
         int64_t sector_num, uint8_t *buf, int nb_sectors,
-        BlockDriverCompletionFunc *cb, void *opaque)
+        BlockDriverCompletionFunc *cb, void *opaque, int is_write)
 {
     QCowAIOCB *acb;
+    Coroutine *co;
 
     acb = qemu_aio_get(bs, cb, opaque);
     if (!acb)
         return NULL;
-    acb->hd_aiocb = NULL;
     acb->sector_num = sector_num;
     acb->buf = buf;
     acb->nb_sectors = nb_sectors;
-    acb->n = 0;
-    acb->cluster_offset = 0;
-    return acb;
+    acb->is_write = is_write;
+    acb->done = 0;
+    acb->cancelled = 0;
+    co = qemu_coroutine_create(qcow_aio_co_entry, acb);
+    if (!co) {
+        qemu_aio_release(acb);
+        return NULL;
+    }
+    qemu_coroutine_enter(co);
+    return &acb->common;
 }
 
 static BlockDriverAIOCB *qcow_aio_read(BlockDriverState *bs,
         int64_t sector_num, uint8_t *buf, int nb_sectors,
         BlockDriverCompletionFunc *cb, void *opaque)
 {
-    QCowAIOCB *acb;
-
-    acb = qcow_aio_setup(bs, sector_num, buf, nb_sectors, cb, opaque);
-    if (!acb)
-        return NULL;
-
-    qcow_aio_read_cb(acb, 0);
-    return &acb->common;
-}
-
-static void qcow_aio_write_cb(void *opaque, int ret)
-{
-    QCowAIOCB *acb = opaque;
-    BlockDriverState *bs = acb->common.bs;
-    BDRVQcowState *s = bs->opaque;
-    int index_in_cluster;
-    uint64_t cluster_offset;
-    const uint8_t *src_buf;
-
-    acb->hd_aiocb = NULL;
-
-    if (ret < 0) {
-    fail:
-        acb->common.cb(acb->common.opaque, ret);
-        qemu_aio_release(acb);
-        return;
-    }
-
-    acb->nb_sectors -= acb->n;
-    acb->sector_num += acb->n;
-    acb->buf += acb->n * 512;
-
-    if (acb->nb_sectors == 0) {
-        /* request completed */
-        acb->common.cb(acb->common.opaque, 0);
-        qemu_aio_release(acb);
-        return;
-    }
-    
-    index_in_cluster = acb->sector_num & (s->cluster_sectors - 1);
-    acb->n = s->cluster_sectors - index_in_cluster;
-    if (acb->n > acb->nb_sectors)
-        acb->n = acb->nb_sectors;
-    cluster_offset = get_cluster_offset(bs, acb->sector_num << 9, 1, 0, 
-                                        index_in_cluster, 
-                                        index_in_cluster + acb->n);
-    if (!cluster_offset || (cluster_offset & 511) != 0) {
-        ret = -EIO;
-        goto fail;
-    }
-    if (s->crypt_method) {
-        if (!acb->cluster_data) {
-            acb->cluster_data = qemu_mallocz(s->cluster_size);
-            if (!acb->cluster_data) {
-                ret = -ENOMEM;
-                goto fail;
-            }
-        }
-        encrypt_sectors(s, acb->sector_num, acb->cluster_data, acb->buf, 
-                        acb->n, 1, &s->aes_encrypt_key);
-        src_buf = acb->cluster_data;
-    } else {
-        src_buf = acb->buf;
-    }
-    acb->hd_aiocb = bdrv_aio_write(s->hd,
-                                   (cluster_offset >> 9) + index_in_cluster, 
-                                   src_buf, acb->n, 
-                                   qcow_aio_write_cb, acb);
-    if (acb->hd_aiocb == NULL)
-        goto fail;
+    return qcow_aio_submit(bs, sector_num, buf, nb_sectors, cb, opaque, 0);
 }
 
 static BlockDriverAIOCB *qcow_aio_write(BlockDriverState *bs,
         int64_t sector_num, const uint8_t *buf, int nb_sectors,
         BlockDriverCompletionFunc *cb, void *opaque)
 {
-    BDRVQcowState *s = bs->opaque;
-    QCowAIOCB *acb;
-    
-    s->cluster_cache_offset = -1; /* disable compressed cache */
-
-    acb = qcow_aio_setup(bs, sector_num, (uint8_t*)buf, nb_sectors, cb, opaque);
-    if (!acb)
-        return NULL;
-    
-    qcow_aio_write_cb(acb, 0);
-    return &acb->common;
+    return qcow_aio_submit(bs, sector_num, (uint8_t *)buf, nb_sectors,
+                           cb, opaque, 1);
 }
 
 static void qcow_aio_cancel(BlockDriverAIOCB *blockacb)
 {
     QCowAIOCB *acb = (QCowAIOCB *)blockacb;
-    if (acb->hd_aiocb)
-        bdrv_aio_cancel(acb->hd_aiocb);
+
+    /* the coroutine cannot be stopped in the middle of a metadata
+       update: wait until it is done */
+    acb->cancelled = 1;
+    qemu_aio_wait_start();
+    qemu_aio_poll();
+    while (!acb->done)
+        qemu_aio_wait();
+    qemu_aio_wait_end();
     qemu_aio_release(acb);
 }
 
 static void qcow_close(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
+    qcow_drain(bs);
+    if (qcow_flush_metadata(bs) < 0)
+        fprintf(stderr, "qemu: could not write the metadata of '%s'\n",
+                bs->filename);
     qemu_free(s->l1_table);
     qemu_free(s->l2_cache);
-    qemu_free(s->cluster_cache);
+    qemu_free(s->l2_cache_entries);
+    qemu_free(s->l2_cache_hash);
     qemu_free(s->cluster_data);
+    zcache_close(bs);
     refcount_close(bs);
     bdrv_delete(s->hd);
 }
@@ -1047,6 +1753,44 @@ static void create_refcount_update(QCowCreateState *s,
     }
 }
 
+/* allocate the L2 tables and the clusters of the whole image. The
+   data clusters are not written: they read as zeros. */
+static int qcow_preallocate(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    int64_t sector_num, nb_sectors, end_offset, len;
+    uint64_t cluster_offset;
+    uint8_t buf[512];
+    int n, allocated;
+
+    end_offset = 0;
+    sector_num = 0;
+    nb_sectors = bs->total_sectors;
+    while (nb_sectors > 0) {
+        n = s->l2_size * s->cluster_sectors;
+        if (n > nb_sectors)
+            n = nb_sectors;
+        /* no request runs: the new clusters need not be tracked */
+        cluster_offset = alloc_cluster_range(bs, sector_num, n, &n,
+                                             &allocated);
+        if (!cluster_offset)
+            return -EIO;
+        len = align_offset(n * 512, s->cluster_size);
+        if (cluster_offset + len > end_offset)
+            end_offset = cluster_offset + len;
+        sector_num += n;
+        nb_sectors -= n;
+    }
+    /* extend the file so that the last clusters can be read */
+    if (end_offset > bdrv_getlength(s->hd)) {
+        memset(buf, 0, sizeof(buf));
+        if (bdrv_pwrite(s->hd, end_offset - sizeof(buf), 
+                        buf, sizeof(buf)) != sizeof(buf))
+            return -EIO;
+    }
+    return 0;
+}
+
 static int qcow_create(const char *filename, int64_t total_size,
                       const char *backing_file, int flags)
 {
@@ -1055,6 +1799,12 @@ static int qcow_create(const char *filename, int64_t total_size,
     uint64_t tmp, offset;
     QCowCreateState s1, *s = &s1;
     
+    /* the preallocated clusters would hide the backing file and
+       would not be encrypted */
+    if ((flags & BLOCK_FLAG_PREALLOC_METADATA) &&
+        (backing_file || (flags & BLOCK_FLAG_ENCRYPT)))
+        return -ENOTSUP;
+
     memset(s, 0, sizeof(*s));
 
     fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
@@ -1076,7 +1826,7 @@ static int qcow_create(const char *filename, int64_t total_size,
     s->cluster_size = 1 << s->cluster_bits;
     header.cluster_bits = cpu_to_be32(s->cluster_bits);
     header_size = (header_size + 7) & ~7;
-    if (flags) {
+    if (flags & BLOCK_FLAG_ENCRYPT) {
         header.crypt_method = cpu_to_be32(QCOW_CRYPT_AES);
     } else {
         header.crypt_method = cpu_to_be32(QCOW_CRYPT_NONE);
@@ -1131,6 +1881,23 @@ static int qcow_create(const char *filename, int64_t total_size,
     qemu_free(s->refcount_table);
     qemu_free(s->refcount_block);
     close(fd);
+
+    if (flags & BLOCK_FLAG_PREALLOC_METADATA) {
+        BlockDriverState *bs;
+        int ret;
+
+        bs = bdrv_new("");
+        if (!bs)
+            return -ENOMEM;
+        ret = bdrv_open2(bs, filename, BDRV_O_RDWR, &bdrv_qcow2);
+        if (ret >= 0)
+            ret = qcow_preallocate(bs);
+        /* the metadata is cached: report its write errors here */
+        if (ret >= 0)
+            ret = qcow_flush_metadata(bs);
+        bdrv_delete(bs);
+        return ret;
+    }
     return 0;
  fail:
     qemu_free(s->refcount_table);
@@ -1159,42 +1926,24 @@ static int qcow_make_empty(BlockDriverState *bs)
     return 0;
 }
 
-/* XXX: put compressed sectors first, then all the cluster aligned
-   tables to avoid losing bytes in alignment */
-static int qcow_write_compressed(BlockDriverState *bs, int64_t sector_num, 
-                                 const uint8_t *buf, int nb_sectors)
+/* Compress the cluster 'buf' to 'out_buf', which has room for one
+   cluster. Return the compressed size, 0 if the cluster cannot be
+   compressed or -1 on error. It does not access the image, so it can
+   be called from any thread. */
+static int qcow_compress_cluster(BlockDriverState *bs, uint8_t *out_buf,
+                                 const uint8_t *buf)
 {
     BDRVQcowState *s = bs->opaque;
     z_stream strm;
     int ret, out_len;
-    uint8_t *out_buf;
-    uint64_t cluster_offset;
-
-    if (nb_sectors == 0) {
-        /* align end of file to a sector boundary to ease reading with
-           sector based I/Os */
-        cluster_offset = bdrv_getlength(s->hd);
-        cluster_offset = (cluster_offset + 511) & ~511;
-        bdrv_truncate(s->hd, cluster_offset);
-        return 0;
-    }
-
-    if (nb_sectors != s->cluster_sectors)
-        return -EINVAL;
-
-    out_buf = qemu_malloc(s->cluster_size + (s->cluster_size / 1000) + 128);
-    if (!out_buf)
-        return -ENOMEM;
 
     /* best compression, small window, no zlib header */
     memset(&strm, 0, sizeof(strm));
     ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
                        Z_DEFLATED, -12, 
                        9, Z_DEFAULT_STRATEGY);
-    if (ret != 0) {
-        qemu_free(out_buf);
+    if (ret != 0)
         return -1;
-    }
 
     strm.avail_in = s->cluster_size;
     strm.next_in = (uint8_t *)buf;
@@ -1203,7 +1952,6 @@ static int qcow_write_compressed(BlockDriverState *bs, int64_t sector_num,
 
     ret = deflate(&strm, Z_FINISH);
     if (ret != Z_STREAM_END && ret != Z_OK) {
-        qemu_free(out_buf);
         deflateEnd(&strm);
         return -1;
     }
@@ -1211,35 +1959,123 @@ static int qcow_write_compressed(BlockDriverState *bs, int64_t sector_num,
 
     deflateEnd(&strm);
 
-    if (ret != Z_STREAM_END || out_len >= s->cluster_size) {
+    if (ret != Z_STREAM_END || out_len >= s->cluster_size)
+        return 0;
+    return out_len;
+}
+
+/* write a cluster compressed by qcow_compress_cluster() */
+static int qcow_write_compressed_data(BlockDriverState *bs, int64_t sector_num,
+                                      const uint8_t *out_buf, int out_len)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t cluster_offset;
+
+    qcow_drain(bs);
+
+    if (out_len <= 0 || out_len >= s->cluster_size)
+        return -EINVAL;
+    cluster_offset = get_cluster_offset(bs, sector_num << 9, 2, 
+                                        out_len, 0, 0);
+    cluster_offset &= s->cluster_offset_mask;
+    if (bdrv_pwrite(s->hd, cluster_offset, out_buf, out_len) != out_len)
+        return -1;
+    return 0;
+}
+
+/* XXX: put compressed sectors first, then all the cluster aligned
+   tables to avoid losing bytes in alignment */
+static int qcow_write_compressed(BlockDriverState *bs, int64_t sector_num, 
+                                 const uint8_t *buf, int nb_sectors)
+{
+    BDRVQcowState *s = bs->opaque;
+    int ret;
+    uint8_t *out_buf;
+    uint64_t cluster_offset;
+
+    qcow_drain(bs);
+
+    if (nb_sectors == 0) {
+        /* align end of file to a sector boundary to ease reading with
+           sector based I/Os */
+        cluster_offset = bdrv_getlength(s->hd);
+        cluster_offset = (cluster_offset + 511) & ~511;
+        bdrv_truncate(s->hd, cluster_offset);
+        return 0;
+    }
+
+    if (nb_sectors != s->cluster_sectors)
+        return -EINVAL;
+
+    out_buf = qemu_malloc(s->cluster_size);
+    if (!out_buf)
+        return -ENOMEM;
+
+    ret = qcow_compress_cluster(bs, out_buf, buf);
+    if (ret == 0) {
         /* could not compress: write normal cluster */
-        qcow_write(bs, sector_num, buf, s->cluster_sectors);
-    } else {
-        cluster_offset = get_cluster_offset(bs, sector_num << 9, 2, 
-                                            out_len, 0, 0);
-        cluster_offset &= s->cluster_offset_mask;
-        if (bdrv_pwrite(s->hd, cluster_offset, out_buf, out_len) != out_len) {
-            qemu_free(out_buf);
-            return -1;
-        }
+        ret = qcow_write(bs, sector_num, buf, s->cluster_sectors);
+    } else if (ret > 0) {
+        ret = qcow_write_compressed_data(bs, sector_num, out_buf, ret);
     }
     
     qemu_free(out_buf);
-    return 0;
+    return ret;
 }
 
 static void qcow_flush(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
+    qcow_lock(bs);
+    qcow_flush_metadata(bs);
+    qcow_unlock(bs);
     bdrv_flush(s->hd);
 }
 
+/* the new name must fit in the first cluster, after the header */
+static int qcow_change_backing_file(BlockDriverState *bs,
+                                    const char *backing_file, int check_only)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint8_t buf[12];
+    uint64_t offset;
+    uint32_t len;
+    int ret;
+
+    len = strlen(backing_file);
+    if (sizeof(QCowHeader) + len > s->cluster_size)
+        return -ENOSPC;
+    if (check_only)
+        return 0;
+    offset = len ? sizeof(QCowHeader) : 0;
+    qcow_lock(bs);
+    ret = 0;
+    /* write the name before making the header point to it */
+    if (len && bdrv_pwrite(s->hd, offset, backing_file, len) != len) {
+        ret = -EIO;
+        goto fail;
+    }
+    offset = cpu_to_be64(offset);
+    len = cpu_to_be32(len);
+    memcpy(buf, &offset, 8);
+    memcpy(buf + 8, &len, 4);
+    if (bdrv_pwrite(s->hd, offsetof(QCowHeader, backing_file_offset),
+                    buf, sizeof(buf)) != sizeof(buf))
+        ret = -EIO;
+ fail:
+    qcow_unlock(bs);
+    return ret;
+}
+
 static int qcow_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
 {
     BDRVQcowState *s = bs->opaque;
     bdi->cluster_size = s->cluster_size;
     bdi->vm_state_offset = (int64_t)s->l1_vm_state_index << 
         (s->cluster_bits + s->l2_bits);
+    bdi->l2_cache_size = s->l2_cache_size;
+    bdi->l2_cache_hits = s->l2_cache_hits;
+    bdi->l2_cache_misses = s->l2_cache_misses;
     return 0;
 }
 
@@ -1257,7 +2093,12 @@ static int update_snapshot_refcount(BlockDriverState *bs,
     int64_t old_offset, old_l2_offset;
     int l2_size, i, j, l1_modified, l2_modified, nb_csectors, refcount;
     
+    /* the L2 tables are read and written without the cache */
+    if (qcow_flush_metadata(bs) < 0)
+        return -EIO;
     l2_cache_reset(bs);
+    /* the compressed clusters may be freed */
+    zcache_reset(s);
 
     l2_table = NULL;
     l1_table = NULL;
@@ -1300,9 +2141,11 @@ static int update_snapshot_refcount(BlockDriverState *bs,
                     if (offset & QCOW_OFLAG_COMPRESSED) {
                         nb_csectors = ((offset >> s->csize_shift) & 
                                        s->csize_mask) + 1;
-                        if (addend != 0)
-                            update_refcount(bs, (offset & s->cluster_offset_mask) & ~511,
-                                            nb_csectors * 512, addend);
+                        if (addend != 0) {
+                            if (update_refcount(bs, (offset & s->cluster_offset_mask) & ~511,
+                                                nb_csectors * 512, addend) < 0)
+                                goto fail;
+                        }
                         /* compressed clusters are never modified */
                         refcount = 2; 
                     } else {
@@ -1454,6 +2297,8 @@ static int qcow_write_snapshots(BlockDriverState *bs)
     snapshots_size = offset;
 
     snapshots_offset = alloc_clusters(bs, snapshots_size);
+    if (snapshots_offset < 0)
+        goto fail;
     offset = snapshots_offset;
     
     for(i = 0; i < s->nb_snapshots; i++) {
@@ -1482,6 +2327,10 @@ static int qcow_write_snapshots(BlockDriverState *bs)
         offset += name_size;
     }
 
+    /* the snapshots must be fully counted before the header uses them */
+    if (qcow_flush_metadata(bs) < 0)
+        goto fail;
+
     /* update the various header fields */
     data64 = cpu_to_be64(snapshots_offset);
     if (bdrv_pwrite(s->hd, offsetof(QCowHeader, snapshots_offset),
@@ -1553,6 +2402,7 @@ static int qcow_snapshot_create(BlockDriverState *bs,
     int i, ret;
     uint64_t *l1_table = NULL;
     
+    qcow_drain(bs);
     memset(sn, 0, sizeof(*sn));
 
     if (sn_info->id_str[0] == '\0') {
@@ -1581,6 +2431,8 @@ static int qcow_snapshot_create(BlockDriverState *bs,
 
     /* create the L1 table of the snapshot */
     sn->l1_table_offset = alloc_clusters(bs, s->l1_size * sizeof(uint64_t));
+    if ((int64_t)sn->l1_table_offset < 0)
+        goto fail;
     sn->l1_size = s->l1_size;
 
     l1_table = qemu_malloc(s->l1_size * sizeof(uint64_t));
@@ -1605,6 +2457,8 @@ static int qcow_snapshot_create(BlockDriverState *bs,
 
     if (qcow_write_snapshots(bs) < 0)
         goto fail;
+    if (qcow_flush_metadata(bs) < 0)
+        return -EIO;
 #ifdef DEBUG_ALLOC
     check_refcounts(bs);
 #endif
@@ -1623,6 +2477,7 @@ static int qcow_snapshot_goto(BlockDriverState *bs,
     QCowSnapshot *sn;
     int i, snapshot_index, l1_size2;
 
+    qcow_drain(bs);
     snapshot_index = find_snapshot_by_id_or_name(bs, snapshot_id);
     if (snapshot_index < 0)
         return -ENOENT;
@@ -1650,6 +2505,8 @@ static int qcow_snapshot_goto(BlockDriverState *bs,
     if (update_snapshot_refcount(bs, s->l1_table_offset, s->l1_size, 1) < 0)
         goto fail;
 
+    if (qcow_flush_metadata(bs) < 0)
+        return -EIO;
 #ifdef DEBUG_ALLOC
     check_refcounts(bs);
 #endif
@@ -1664,6 +2521,7 @@ static int qcow_snapshot_delete(BlockDriverState *bs, const char *snapshot_id)
     QCowSnapshot *sn;
     int snapshot_index, ret;
     
+    qcow_drain(bs);
     snapshot_index = find_snapshot_by_id_or_name(bs, snapshot_id);
     if (snapshot_index < 0)
         return -ENOENT;
@@ -1687,6 +2545,8 @@ static int qcow_snapshot_delete(BlockDriverState *bs, const char *snapshot_id)
         /* XXX: restore snapshot if error ? */
         return ret;
     }
+    if (qcow_flush_metadata(bs) < 0)
+        return -EIO;
 #ifdef DEBUG_ALLOC
     check_refcounts(bs);
 #endif
@@ -1759,12 +2619,89 @@ static void refcount_close(BlockDriverState *bs)
     qemu_free(s->refcount_table);
 }
 
+/* write the modified sectors of the cached refcount block */
+static int refcount_block_writeback(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    int start, end, len;
+
+    if (s->refcount_dirty_start != s->refcount_dirty_end) {
+        if (s->refcount_depends_on_l2) {
+            if (l2_cache_flush(bs) < 0)
+                return -EIO;
+        }
+        start = s->refcount_dirty_start & ~((512 >> REFCOUNT_SHIFT) - 1);
+        end = (s->refcount_dirty_end + (512 >> REFCOUNT_SHIFT) - 1) &
+            ~((512 >> REFCOUNT_SHIFT) - 1);
+        len = (end - start) << REFCOUNT_SHIFT;
+        if (bdrv_pwrite(s->hd, 
+                        s->refcount_block_cache_offset + (start << REFCOUNT_SHIFT), 
+                        &s->refcount_block_cache[start], len) != len)
+            return -EIO;
+        s->refcount_dirty_start = 0;
+        s->refcount_dirty_end = 0;
+    }
+    s->l2_depends_on_refcount = 0;
+    s->refcount_depends_on_l2 = 0;
+    return 0;
+}
+
+/* the counts 'block_index' to 'block_index + n - 1' of the cached
+   refcount block were modified */
+static void refcount_set_dirty(BDRVQcowState *s, int block_index, int n)
+{
+    if (s->refcount_dirty_start == s->refcount_dirty_end) {
+        s->refcount_dirty_start = block_index;
+        s->refcount_dirty_end = block_index + n;
+    } else {
+        if (block_index < s->refcount_dirty_start)
+            s->refcount_dirty_start = block_index;
+        if (block_index + n > s->refcount_dirty_end)
+            s->refcount_dirty_end = block_index + n;
+    }
+}
+
+/* called before the refcounts are updated by 'addend'. A cache which
+   must be written back before the other one is written back first
+   if the other one must already wait for it, so that the two never
+   depend on each other. Return < 0 if this write back failed: the
+   refcounts must not be updated then. */
+static int refcount_set_dependency(BlockDriverState *bs, int addend)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    if (addend > 0) {
+        if (s->refcount_depends_on_l2) {
+            if (refcount_block_writeback(bs) < 0)
+                return -EIO;
+        }
+        s->l2_depends_on_refcount = 1;
+    } else if (addend < 0) {
+        if (s->l2_depends_on_refcount) {
+            if (l2_cache_flush(bs) < 0)
+                return -EIO;
+        }
+        s->refcount_depends_on_l2 = 1;
+    }
+    return 0;
+}
+
+/* write back all the modified metadata */
+static int qcow_flush_metadata(BlockDriverState *bs)
+{
+    if (l2_cache_flush(bs) < 0)
+        return -EIO;
+    return refcount_block_writeback(bs);
+}
+
 
 static int load_refcount_block(BlockDriverState *bs, 
                                int64_t refcount_block_offset)
 {
     BDRVQcowState *s = bs->opaque;
     int ret;
+    if (refcount_block_writeback(bs) < 0)
+        return -EIO;
     ret = bdrv_pread(s->hd, refcount_block_offset, s->refcount_block_cache, 
                      s->cluster_size);
     if (ret != s->cluster_size)
@@ -1823,26 +2760,34 @@ static int64_t alloc_clusters_noref(BlockDriverState *bs, int64_t size)
     }
 }
 
+/* return < 0 if error */
 static int64_t alloc_clusters(BlockDriverState *bs, int64_t size)
 {
     int64_t offset;
+    int ret;
 
     offset = alloc_clusters_noref(bs, size);
-    update_refcount(bs, offset, size, 1);
+    ret = update_refcount(bs, offset, size, 1);
+    if (ret < 0)
+        return ret;
     return offset;
 }
 
 /* only used to allocate compressed sectors. We try to allocate
-   contiguous sectors. size must be <= cluster_size */
+   contiguous sectors. size must be <= cluster_size. Return < 0 if
+   error */
 static int64_t alloc_bytes(BlockDriverState *bs, int size)
 {
     BDRVQcowState *s = bs->opaque;
     int64_t offset, cluster_offset;
-    int free_in_cluster;
+    int free_in_cluster, ret;
     
     assert(size > 0 && size <= s->cluster_size);
     if (s->free_byte_offset == 0) {
-        s->free_byte_offset = alloc_clusters(bs, s->cluster_size);
+        offset = alloc_clusters(bs, s->cluster_size);
+        if (offset < 0)
+            return offset;
+        s->free_byte_offset = offset;
     }
  redo:
     free_in_cluster = s->cluster_size - 
@@ -1854,15 +2799,22 @@ static int64_t alloc_bytes(BlockDriverState *bs, int size)
         free_in_cluster -= size;
         if (free_in_cluster == 0)
             s->free_byte_offset = 0;
-        if ((offset & (s->cluster_size - 1)) != 0)
-            update_cluster_refcount(bs, offset >> s->cluster_bits, 1);
+        if ((offset & (s->cluster_size - 1)) != 0) {
+            ret = update_cluster_refcount(bs, offset >> s->cluster_bits, 1);
+            if (ret < 0)
+                return ret;
+        }
     } else {
         offset = alloc_clusters(bs, s->cluster_size);
+        if (offset < 0)
+            return offset;
         cluster_offset = s->free_byte_offset & ~(s->cluster_size - 1);
         if ((cluster_offset + s->cluster_size) == offset) {
             /* we are lucky: contiguous data */
             offset = s->free_byte_offset;
-            update_cluster_refcount(bs, offset >> s->cluster_bits, 1);
+            ret = update_cluster_refcount(bs, offset >> s->cluster_bits, 1);
+            if (ret < 0)
+                return ret;
             s->free_byte_offset += size;
         } else {
             s->free_byte_offset = offset;
@@ -1959,6 +2911,9 @@ static int update_cluster_refcount(BlockDriverState *bs,
     int ret, refcount_table_index, block_index, refcount;
     uint64_t data64;
 
+    ret = refcount_set_dependency(bs, addend);
+    if (ret < 0)
+        return ret;
     refcount_table_index = cluster_index >> (s->cluster_bits - REFCOUNT_SHIFT);
     if (refcount_table_index >= s->refcount_table_size) {
         if (addend < 0)
@@ -1974,6 +2929,8 @@ static int update_cluster_refcount(BlockDriverState *bs,
         /* create a new refcount block */
         /* Note: we cannot update the refcount now to avoid recursion */
         offset = alloc_clusters_noref(bs, s->cluster_size);
+        if (refcount_block_writeback(bs) < 0)
+            return -EIO;
         memset(s->refcount_block_cache, 0, s->cluster_size);
         ret = bdrv_pwrite(s->hd, offset, s->refcount_block_cache, s->cluster_size);
         if (ret != s->cluster_size)
@@ -1988,7 +2945,14 @@ static int update_cluster_refcount(BlockDriverState *bs,
 
         refcount_block_offset = offset;
         s->refcount_block_cache_offset = offset;
-        update_refcount(bs, offset, s->cluster_size, 1);
+        ret = update_refcount(bs, offset, s->cluster_size, 1);
+        if (ret < 0)
+            return ret;
+        /* the new block may be counted in another block */
+        if (refcount_block_offset != s->refcount_block_cache_offset) {
+            if (load_refcount_block(bs, refcount_block_offset) < 0)
+                return -EIO;
+        }
     } else {
         if (refcount_block_offset != s->refcount_block_cache_offset) {
             if (load_refcount_block(bs, refcount_block_offset) < 0)
@@ -2006,32 +2970,74 @@ static int update_cluster_refcount(BlockDriverState *bs,
         s->free_cluster_index = cluster_index;
     }
     s->refcount_block_cache[block_index] = cpu_to_be16(refcount);
-    if (bdrv_pwrite(s->hd, 
-                    refcount_block_offset + (block_index << REFCOUNT_SHIFT), 
-                    &s->refcount_block_cache[block_index], 2) != 2)
-        return -EIO;
+    refcount_set_dirty(s, block_index, 1);
     return refcount;
 }
 
-static void update_refcount(BlockDriverState *bs, 
-                            int64_t offset, int64_t length, 
-                            int addend)
+/* The counts of a range are updated in the cached refcount block,
+   which is written back when another block is loaded. The blocks
+   which must be created go through update_cluster_refcount(). */
+static int update_refcount(BlockDriverState *bs, 
+                           int64_t offset, int64_t length, 
+                           int addend)
 {
     BDRVQcowState *s = bs->opaque;
-    int64_t start, last, cluster_offset;
+    int64_t start, last, cluster_index, last_index, block_end;
+    int64_t refcount_block_offset;
+    int refcount_table_index, block_index, refcount, first, end, ret;
 
 #ifdef DEBUG_ALLOC2
     printf("update_refcount: offset=%lld size=%lld addend=%d\n", 
            offset, length, addend);
 #endif
     if (length <= 0)
-        return;
+        return 0;
+    ret = refcount_set_dependency(bs, addend);
+    if (ret < 0)
+        return ret;
     start = offset & ~(s->cluster_size - 1);
     last = (offset + length - 1) & ~(s->cluster_size - 1);
-    for(cluster_offset = start; cluster_offset <= last; 
-        cluster_offset += s->cluster_size) {
-        update_cluster_refcount(bs, cluster_offset >> s->cluster_bits, addend);
+    cluster_index = start >> s->cluster_bits;
+    last_index = last >> s->cluster_bits;
+    while (cluster_index <= last_index) {
+        refcount_table_index = cluster_index >> (s->cluster_bits - REFCOUNT_SHIFT);
+        if (refcount_table_index >= s->refcount_table_size ||
+            !s->refcount_table[refcount_table_index]) {
+            ret = update_cluster_refcount(bs, cluster_index, addend);
+            if (ret < 0)
+                return ret;
+            cluster_index++;
+            continue;
+        }
+        refcount_block_offset = s->refcount_table[refcount_table_index];
+        if (refcount_block_offset != s->refcount_block_cache_offset) {
+            if (load_refcount_block(bs, refcount_block_offset) < 0)
+                return -EIO;
+        }
+        block_end = (int64_t)(refcount_table_index + 1) <<
+            (s->cluster_bits - REFCOUNT_SHIFT);
+        first = -1;
+        end = 0;
+        for(; cluster_index <= last_index && cluster_index < block_end;
+            cluster_index++) {
+            block_index = cluster_index & 
+                ((1 << (s->cluster_bits - REFCOUNT_SHIFT)) - 1);
+            refcount = be16_to_cpu(s->refcount_block_cache[block_index]);
+            refcount += addend;
+            if (refcount < 0 || refcount > 0xffff)
+                continue;
+            if (refcount == 0 && cluster_index < s->free_cluster_index) {
+                s->free_cluster_index = cluster_index;
+            }
+            s->refcount_block_cache[block_index] = cpu_to_be16(refcount);
+            if (first < 0)
+                first = block_index;
+            end = block_index + 1;
+        }
+        if (first >= 0)
+            refcount_set_dirty(s, first, end - first);
     }
+    return 0;
 }
 
 #ifdef DEBUG_ALLOC
@@ -2243,10 +3249,14 @@ BlockDriver bdrv_qcow2 = {
     .bdrv_aio_cancel = qcow_aio_cancel,
     .aiocb_size = sizeof(QCowAIOCB),
     .bdrv_write_compressed = qcow_write_compressed,
+    .bdrv_compress_cluster = qcow_compress_cluster,
+    .bdrv_write_compressed_data = qcow_write_compressed_data,
 
     .bdrv_snapshot_create = qcow_snapshot_create,
     .bdrv_snapshot_goto = qcow_snapshot_goto,
     .bdrv_snapshot_delete = qcow_snapshot_delete,
     .bdrv_snapshot_list = qcow_snapshot_list,
     .bdrv_get_info = qcow_get_info,
+    .bdrv_get_host_offset = qcow_get_host_offset,
+    .bdrv_change_backing_file = qcow_change_backing_file,
 };
@@ -56,6 +56,14 @@
 #ifdef __FreeBSD__
 #include <sys/disk.h>
 #endif
+#ifdef CONFIG_LINUX_AIO
+#include <sys/syscall.h>
+#include <linux/aio_abi.h>
+#endif
+#ifdef CONFIG_AIO_THREADS
+#include <pthread.h>
+#include <poll.h>
+#endif
 
 //#define DEBUG_FLOPPY
 
@@ -67,9 +75,39 @@
    reopen it to see if the disk has been changed */
 #define FD_OPEN_TIMEOUT 1000
 
+/* O_DIRECT needs the buffers, offsets and sizes aligned on the sector
+   size */
+#define DIRECT_ALIGN 512
+/* size of the bounce buffer of the unaligned synchronous accesses */
+#define ALIGNED_BUFFER_SIZE (64 * 1024)
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+/* number of worker threads of each image opened with BDRV_O_AIO_THREADS */
+int aio_thread_workers = 4;
+
+#ifdef CONFIG_AIO_THREADS
+typedef struct RawThreadPool {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct RawAIOCB *first_req; /* requests not yet started */
+    struct RawAIOCB **last_req;
+    int stop;
+    int nb_threads;
+    pthread_t *threads;
+} RawThreadPool;
+#endif
+
 typedef struct BDRVRawState {
     int fd;
     int type;
+    uint8_t *aligned_buf; /* bounce buffer, only set with O_DIRECT */
+    int native_aio; /* use the Linux native AIO */
+#ifdef CONFIG_AIO_THREADS
+    RawThreadPool *pool; /* NULL if the requests use the kernel AIO */
+#endif
 #if defined(__linux__)
     /* linux floppy specific */
     int fd_open_flags;
@@ -81,6 +119,64 @@ typedef struct BDRVRawState {
 } BDRVRawState;
 
 static int fd_open(BlockDriverState *bs);
+#ifdef CONFIG_LINUX_AIO
+static int laio_init(void);
+#endif
+#ifdef CONFIG_AIO_THREADS
+static RawThreadPool *raw_pool_new(int nb_threads);
+static void raw_pool_delete(RawThreadPool *pool);
+#endif
+
+static void *raw_alloc_aligned(size_t size)
+{
+    void *ptr;
+
+    if (posix_memalign(&ptr, DIRECT_ALIGN, size) != 0)
+        return NULL;
+    return ptr;
+}
+
+/* setup the O_DIRECT bounce buffer and the AIO backend */
+static int raw_open_common(BlockDriverState *bs, int flags)
+{
+    BDRVRawState *s = bs->opaque;
+
+    s->aligned_buf = NULL;
+    s->native_aio = 0;
+#ifdef CONFIG_AIO_THREADS
+    s->pool = NULL;
+    if (flags & BDRV_O_AIO_THREADS) {
+        s->pool = raw_pool_new(aio_thread_workers);
+        if (!s->pool)
+            return -ENOMEM;
+        /* the pool replaces the native AIO */
+        flags &= ~BDRV_O_NATIVE_AIO;
+    }
+#endif
+#ifdef O_DIRECT
+    if (flags & BDRV_O_DIRECT) {
+        s->aligned_buf = raw_alloc_aligned(ALIGNED_BUFFER_SIZE);
+        if (!s->aligned_buf)
+            goto fail;
+#ifdef CONFIG_LINUX_AIO
+        /* the native AIO is only asynchronous with O_DIRECT */
+        if ((flags & BDRV_O_NATIVE_AIO) && laio_init() == 0)
+            s->native_aio = 1;
+#endif
+    }
+#endif
+    return 0;
+#ifdef O_DIRECT
+ fail:
+#ifdef CONFIG_AIO_THREADS
+    if (s->pool) {
+        raw_pool_delete(s->pool);
+        s->pool = NULL;
+    }
+#endif
+    return -ENOMEM;
+#endif
+}
 
 static int raw_open(BlockDriverState *bs, const char *filename, int flags)
 {
@@ -96,6 +192,10 @@ static int raw_open(BlockDriverState *bs, const char *filename, int flags)
     }
     if (flags & BDRV_O_CREAT)
         open_flags |= O_CREAT | O_TRUNC;
+#ifdef O_DIRECT
+    if (flags & BDRV_O_DIRECT)
+        open_flags |= O_DIRECT;
+#endif
 
     s->type = FTYPE_FILE;
 
@@ -107,6 +207,12 @@ static int raw_open(BlockDriverState *bs, const char *filename, int flags)
         return ret;
     }
     s->fd = fd;
+    ret = raw_open_common(bs, flags);
+    if (ret < 0) {
+        close(fd);
+        s->fd = -1;
+        return ret;
+    }
     return 0;
 }
 
@@ -127,8 +233,8 @@ static int raw_open(BlockDriverState *bs, const char *filename, int flags)
 #endif
 */
 
-static int raw_pread(BlockDriverState *bs, int64_t offset, 
-                     uint8_t *buf, int count)
+static int raw_pread_aligned(BlockDriverState *bs, int64_t offset, 
+                             uint8_t *buf, int count)
 {
     BDRVRawState *s = bs->opaque;
     int ret;
@@ -142,8 +248,8 @@ static int raw_pread(BlockDriverState *bs, int64_t offset,
     return ret;
 }
 
-static int raw_pwrite(BlockDriverState *bs, int64_t offset, 
-                      const uint8_t *buf, int count)
+static int raw_pwrite_aligned(BlockDriverState *bs, int64_t offset, 
+                              const uint8_t *buf, int count)
 {
     BDRVRawState *s = bs->opaque;
     int ret;
@@ -157,6 +263,92 @@ static int raw_pwrite(BlockDriverState *bs, int64_t offset,
     return ret;
 }
 
+static inline int raw_is_aligned(int64_t offset, const uint8_t *buf,
+                                 int count)
+{
+    return ((offset | (unsigned long)buf | count) & (DIRECT_ALIGN - 1)) == 0;
+}
+
+/* With O_DIRECT, the unaligned accesses (such as the image format
+   metadata) go through the aligned bounce buffer. */
+static int raw_pread(BlockDriverState *bs, int64_t offset, 
+                     uint8_t *buf, int count)
+{
+    BDRVRawState *s = bs->opaque;
+    int64_t start;
+    int ret, shift, len, n, total;
+
+    if (!s->aligned_buf || raw_is_aligned(offset, buf, count))
+        return raw_pread_aligned(bs, offset, buf, count);
+
+    total = 0;
+    while (count > 0) {
+        shift = offset & (DIRECT_ALIGN - 1);
+        start = offset - shift;
+        len = (shift + count + DIRECT_ALIGN - 1) & ~(DIRECT_ALIGN - 1);
+        if (len > ALIGNED_BUFFER_SIZE)
+            len = ALIGNED_BUFFER_SIZE;
+        ret = raw_pread_aligned(bs, start, s->aligned_buf, len);
+        if (ret < 0)
+            return ret;
+        n = ret - shift;
+        if (n <= 0)
+            break;
+        if (n > count)
+            n = count;
+        memcpy(buf, s->aligned_buf + shift, n);
+        buf += n;
+        offset += n;
+        count -= n;
+        total += n;
+        if (ret < len)
+            break;
+    }
+    return total;
+}
+
+static int raw_pwrite(BlockDriverState *bs, int64_t offset, 
+                      const uint8_t *buf, int count)
+{
+    BDRVRawState *s = bs->opaque;
+    int64_t start;
+    int ret, shift, len, n, total;
+
+    if (!s->aligned_buf || raw_is_aligned(offset, buf, count))
+        return raw_pwrite_aligned(bs, offset, buf, count);
+
+    total = 0;
+    while (count > 0) {
+        shift = offset & (DIRECT_ALIGN - 1);
+        start = offset - shift;
+        len = (shift + count + DIRECT_ALIGN - 1) & ~(DIRECT_ALIGN - 1);
+        if (len > ALIGNED_BUFFER_SIZE)
+            len = ALIGNED_BUFFER_SIZE;
+        n = len - shift;
+        if (n > count)
+            n = count;
+        /* read the partially written sectors */
+        if (shift != 0 || n != len) {
+            ret = raw_pread_aligned(bs, start, s->aligned_buf, len);
+            if (ret < 0)
+                return ret;
+            if (ret < len)
+                memset(s->aligned_buf + ret, 0, len - ret);
+        }
+        memcpy(s->aligned_buf + shift, buf, n);
+        ret = raw_pwrite_aligned(bs, start, s->aligned_buf, len);
+        if (ret < 0)
+            return ret;
+        if (ret < shift + n)
+            return total + (ret > shift ? ret - shift : 0);
+        buf += n;
+        offset += n;
+        count -= n;
+        total += n;
+    }
+    return total;
+}
+
 /***********************************************************/
 /* Unix AIO using POSIX AIO */
 
@@ -164,6 +356,20 @@ typedef struct RawAIOCB {
     BlockDriverAIOCB common;
     struct aiocb aiocb;
     struct RawAIOCB *next;
+    uint8_t *buf; /* buffer of the caller if 'bounce' is used */
+    QEMUIOVector *qiov; /* vector of the caller, or NULL */
+    uint8_t *bounce; /* linear or aligned copy of the caller data */
+    int is_write;
+    int cancelled; /* wait for the completion without callback */
+#ifdef CONFIG_LINUX_AIO
+    struct iocb iocb;
+    int native; /* submitted with the Linux native AIO */
+#endif
+#ifdef CONFIG_AIO_THREADS
+    RawThreadPool *pool; /* submitted to a worker thread */
+    int tp_state;
+    int tp_ret;
+#endif
 } RawAIOCB;
 
 static int aio_sig_num = SIGUSR2;
@@ -211,11 +417,465 @@ void qemu_aio_init(void)
 #endif
 }
 
+static void raw_aio_free_bounce(RawAIOCB *acb)
+{
+    if (acb->bounce) {
+        free(acb->bounce);
+        acb->bounce = NULL;
+    }
+}
+
+/* end of a request: 'ret' is 0 or a negative errno */
+static void raw_aio_complete(RawAIOCB *acb, int ret)
+{
+    if (acb->bounce) {
+        if (ret == 0 && !acb->is_write) {
+            if (acb->qiov)
+                qemu_iovec_from_buffer(acb->qiov, acb->bounce,
+                                       acb->aiocb.aio_nbytes);
+            else
+                memcpy(acb->buf, acb->bounce, acb->aiocb.aio_nbytes);
+        }
+        raw_aio_free_bounce(acb);
+    }
+    if (acb->cancelled) {
+        acb->cancelled = 0;
+        qemu_aio_release(acb);
+        return;
+    }
+    acb->common.cb(acb->common.opaque, ret);
+    qemu_aio_release(acb);
+}
+
+/***********************************************************/
+/* Linux native AIO */
+
+#ifdef CONFIG_LINUX_AIO
+
+/* maximum number of requests in flight */
+#define LAIO_MAX_EVENTS 128
+
+static aio_context_t laio_ctx;
+static int laio_initialized; /* 1 if usable, -1 if not supported */
+static int laio_efd = -1; /* signalled on each completion */
+static int laio_nb_pending;
+
+static void laio_reap(int min_nr, struct timespec *ts)
+{
+    struct io_event events[LAIO_MAX_EVENTS];
+    RawAIOCB *acb;
+    long res;
+    int i, n, ret;
+
+    n = syscall(__NR_io_getevents, laio_ctx, min_nr, LAIO_MAX_EVENTS,
+                events, ts);
+    for(i = 0; i < n; i++) {
+        acb = (RawAIOCB *)(unsigned long)events[i].data;
+        laio_nb_pending--;
+        res = events[i].res;
+        if (res == acb->aiocb.aio_nbytes)
+            ret = 0;
+        else if (res < 0)
+            ret = res;
+        else
+            ret = -EINVAL;
+        raw_aio_complete(acb, ret);
+    }
+}
+
+/* reap all the completed requests without waiting */
+static void laio_poll(void)
+{
+    struct timespec ts;
+
+    if (laio_nb_pending == 0)
+        return;
+    ts.tv_sec = 0;
+    ts.tv_nsec = 0;
+    laio_reap(0, &ts);
+}
+
+#ifndef QEMU_TOOL
+static void laio_completion_cb(void *opaque)
+{
+    uint64_t val;
+
+    /* the counter is only used to wake up the main loop */
+    while (read(laio_efd, &val, sizeof(val)) > 0)
+        continue;
+    laio_poll();
+}
+#endif
+
+static int laio_eventfd(void)
+{
+    int fd;
+
+    fd = -1;
+#ifdef __NR_eventfd2
+    fd = syscall(__NR_eventfd2, 0, 0);
+#endif
+#ifdef __NR_eventfd
+    if (fd < 0)
+        fd = syscall(__NR_eventfd, 0);
+#endif
+    return fd;
+}
+
+static int laio_init(void)
+{
+    if (laio_initialized)
+        return laio_initialized > 0 ? 0 : -1;
+    laio_initialized = -1;
+    laio_ctx = 0;
+    if (syscall(__NR_io_setup, LAIO_MAX_EVENTS, &laio_ctx) < 0)
+        return -1;
+    laio_efd = laio_eventfd();
+    if (laio_efd < 0) {
+        syscall(__NR_io_destroy, laio_ctx);
+        return -1;
+    }
+    fcntl(laio_efd, F_SETFL, O_NONBLOCK);
+#ifndef QEMU_TOOL
+    qemu_set_fd_handler(laio_efd, laio_completion_cb, NULL, NULL);
+#endif
+    laio_initialized = 1;
+    return 0;
+}
+
+/* submit a request prepared by raw_aio_setup() */
+static int laio_submit(RawAIOCB *acb)
+{
+    struct iocb *iocbs[1];
+
+    if (acb->qiov && !acb->bounce && acb->qiov->niov > IOV_MAX)
+        return -1;
+    memset(&acb->iocb, 0, sizeof(acb->iocb));
+    acb->iocb.aio_data = (unsigned long)acb;
+    acb->iocb.aio_fildes = acb->aiocb.aio_fildes;
+    if (acb->qiov && !acb->bounce) {
+        acb->iocb.aio_lio_opcode = acb->is_write ? IOCB_CMD_PWRITEV :
+            IOCB_CMD_PREADV;
+        acb->iocb.aio_buf = (unsigned long)acb->qiov->iov;
+        acb->iocb.aio_nbytes = acb->qiov->niov;
+    } else {
+        acb->iocb.aio_lio_opcode = acb->is_write ? IOCB_CMD_PWRITE :
+            IOCB_CMD_PREAD;
+        acb->iocb.aio_buf = (unsigned long)acb->aiocb.aio_buf;
+        acb->iocb.aio_nbytes = acb->aiocb.aio_nbytes;
+    }
+    acb->iocb.aio_offset = acb->aiocb.aio_offset;
+    acb->iocb.aio_flags = IOCB_FLAG_RESFD;
+    acb->iocb.aio_resfd = laio_efd;
+    iocbs[0] = &acb->iocb;
+    if (syscall(__NR_io_submit, laio_ctx, 1, iocbs) != 1)
+        return -1;
+    acb->native = 1;
+    laio_nb_pending++;
+    return 0;
+}
+
+static void laio_cancel(RawAIOCB *acb)
+{
+    struct io_event event;
+
+    if (syscall(__NR_io_cancel, laio_ctx, &acb->iocb, &event) == 0) {
+        laio_nb_pending--;
+        raw_aio_free_bounce(acb);
+        qemu_aio_release(acb);
+        return;
+    }
+    /* the request is in progress: wait for it, as the buffer may
+       still be accessed */
+    acb->cancelled = 1;
+    while (acb->cancelled)
+        laio_reap(1, NULL);
+}
+
+#endif /* CONFIG_LINUX_AIO */
+
+/***********************************************************/
+/* AIO thread pool */
+
+#ifdef CONFIG_AIO_THREADS
+
+#define TP_QUEUED  0
+#define TP_RUNNING 1
+
+/* requests completed by the workers, in reverse order */
+static RawAIOCB *tp_done;
+/* a byte is written when 'tp_done' becomes non empty */
+static int tp_notify_fds[2] = { -1, -1 };
+static int tp_nb_pending;
+
+static int raw_pool_rw_buf(int fd, uint8_t *buf, size_t len, off_t offset,
+                           int is_write)
+{
+    size_t done;
+    ssize_t ret;
+
+    done = 0;
+    while (done < len) {
+        if (is_write)
+            ret = pwrite(fd, buf + done, len - done, offset + done);
+        else
+            ret = pread(fd, buf + done, len - done, offset + done);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return -errno;
+        }
+        if (ret == 0)
+            return -EINVAL;
+        done += ret;
+    }
+    return 0;
+}
+
+static int raw_pool_rw(RawAIOCB *acb)
+{
+    QEMUIOVector *qiov = acb->qiov;
+    int fd = acb->aiocb.aio_fildes;
+    off_t offset = acb->aiocb.aio_offset;
+    size_t done, pos, skip, l;
+    ssize_t ret;
+    int i;
+
+    if (!qiov || acb->bounce)
+        return raw_pool_rw_buf(fd, (uint8_t *)acb->aiocb.aio_buf,
+                               acb->aiocb.aio_nbytes, offset, acb->is_write);
+    done = 0;
+#ifdef CONFIG_PREADV
+    if (qiov->niov <= IOV_MAX) {
+        do {
+            if (acb->is_write)
+                ret = pwritev(fd, qiov->iov, qiov->niov, offset);
+            else
+                ret = preadv(fd, qiov->iov, qiov->niov, offset);
+        } while (ret < 0 && errno == EINTR);
+        if (ret < 0)
+            return -errno;
+        done = ret;
+    }
+#endif
+    /* finish a short (or not vectored) transfer element by element */
+    pos = 0;
+    for(i = 0; i < qiov->niov && done < qiov->size; i++) {
+        l = qiov->iov[i].iov_len;
+        if (pos + l > done) {
+            skip = done - pos;
+            ret = raw_pool_rw_buf(fd, (uint8_t *)qiov->iov[i].iov_base + skip,
+                                  l - skip, offset + done, acb->is_write);
+            if (ret < 0)
+                return ret;
+            done = pos + l;
+        }
+        pos += l;
+    }
+    return 0;
+}
+
+static void *raw_pool_worker(void *opaque)
+{
+    RawThreadPool *pool = opaque;
+    RawAIOCB *acb, *head;
+    char byte = 0;
+
+    for(;;) {
+        pthread_mutex_lock(&pool->lock);
+        while (!pool->first_req && !pool->stop)
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        acb = pool->first_req;
+        if (!acb) {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        pool->first_req = acb->next;
+        if (!pool->first_req)
+            pool->last_req = &pool->first_req;
+        acb->tp_state = TP_RUNNING;
+        pthread_mutex_unlock(&pool->lock);
+
+        acb->tp_ret = raw_pool_rw(acb);
+
+        do {
+            head = tp_done;
+            acb->next = head;
+        } while (!__sync_bool_compare_and_swap(&tp_done, head, acb));
+        if (!head)
+            write(tp_notify_fds[1], &byte, 1);
+    }
+    return NULL;
+}
+
+/* call the callbacks of the completed requests */
+static void raw_pool_poll(void)
+{
+    RawAIOCB *acb, *list, *next;
+    char buf[64];
+
+    if (tp_notify_fds[0] < 0)
+        return;
+    /* the pipe must be emptied before 'tp_done' is taken */
+    while (read(tp_notify_fds[0], buf, sizeof(buf)) > 0)
+        continue;
+    do {
+        list = tp_done;
+    } while (!__sync_bool_compare_and_swap(&tp_done, list, NULL));
+    /* complete the requests in order */
+    acb = NULL;
+    while (list) {
+        next = list->next;
+        list->next = acb;
+        acb = list;
+        list = next;
+    }
+    while (acb) {
+        next = acb->next;
+        tp_nb_pending--;
+        raw_aio_complete(acb, acb->tp_ret);
+        acb = next;
+    }
+}
+
+/* wait at most 'timeout' ms (-1 = infinite) for a completion */
+static void raw_pool_wait(int timeout)
+{
+    struct pollfd pfd;
+
+    pfd.fd = tp_notify_fds[0];
+    pfd.events = POLLIN;
+    poll(&pfd, 1, timeout);
+    raw_pool_poll();
+}
+
+#ifndef QEMU_TOOL
+static void raw_pool_completion_cb(void *opaque)
+{
+    raw_pool_poll();
+}
+#endif
+
+static int raw_pool_init(void)
+{
+    if (tp_notify_fds[0] >= 0)
+        return 0;
+    if (pipe(tp_notify_fds) < 0)
+        return -1;
+    fcntl(tp_notify_fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(tp_notify_fds[1], F_SETFL, O_NONBLOCK);
+#ifndef QEMU_TOOL
+    qemu_set_fd_handler(tp_notify_fds[0], raw_pool_completion_cb, NULL, NULL);
+#endif
+    return 0;
+}
+
+static RawThreadPool *raw_pool_new(int nb_threads)
+{
+    RawThreadPool *pool;
+    sigset_t set, oldset;
+    int i;
+
+    if (raw_pool_init() < 0)
+        return NULL;
+    if (nb_threads < 1)
+        nb_threads = 1;
+    pool = qemu_mallocz(sizeof(RawThreadPool));
+    if (!pool)
+        return NULL;
+    pool->threads = qemu_mallocz(nb_threads * sizeof(pthread_t));
+    if (!pool->threads) {
+        qemu_free(pool);
+        return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+    pool->last_req = &pool->first_req;
+
+    /* the signals are handled by the main thread */
+    sigfillset(&set);
+    pthread_sigmask(SIG_SETMASK, &set, &oldset);
+    for(i = 0; i < nb_threads; i++) {
+        if (pthread_create(&pool->threads[i], NULL, raw_pool_worker, pool))
+            break;
+    }
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+    pool->nb_threads = i;
+    if (i == 0) {
+        raw_pool_delete(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+/* the queued requests are executed before the workers exit */
+static void raw_pool_delete(RawThreadPool *pool)
+{
+    int i;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+    for(i = 0; i < pool->nb_threads; i++)
+        pthread_join(pool->threads[i], NULL);
+    pthread_cond_destroy(&pool->cond);
+    pthread_mutex_destroy(&pool->lock);
+    qemu_free(pool->threads);
+    qemu_free(pool);
+}
+
+static void raw_pool_submit(RawThreadPool *pool, RawAIOCB *acb)
+{
+    acb->pool = pool;
+    acb->tp_state = TP_QUEUED;
+    acb->next = NULL;
+    pthread_mutex_lock(&pool->lock);
+    *pool->last_req = acb;
+    pool->last_req = &acb->next;
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+    tp_nb_pending++;
+}
+
+static void raw_pool_cancel(RawAIOCB *acb)
+{
+    RawThreadPool *pool = acb->pool;
+    RawAIOCB **pacb;
+
+    pthread_mutex_lock(&pool->lock);
+    if (acb->tp_state == TP_QUEUED) {
+        for(pacb = &pool->first_req; *pacb != acb; pacb = &(*pacb)->next)
+            continue;
+        *pacb = acb->next;
+        if (!acb->next)
+            pool->last_req = pacb;
+        pthread_mutex_unlock(&pool->lock);
+        tp_nb_pending--;
+        raw_aio_free_bounce(acb);
+        qemu_aio_release(acb);
+        return;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    /* a worker is accessing the buffer: wait for it */
+    acb->cancelled = 1;
+    while (acb->cancelled)
+        raw_pool_wait(-1);
+}
+
+#endif /* CONFIG_AIO_THREADS */
+
 void qemu_aio_poll(void)
 {
     RawAIOCB *acb, **pacb;
     int ret;
 
+#ifdef CONFIG_LINUX_AIO
+    laio_poll();
+#endif
+#ifdef CONFIG_AIO_THREADS
+    raw_pool_poll();
+#endif
     for(;;) {
         pacb = &first_aio;
         for(;;) {
@@ -226,6 +886,7 @@ void qemu_aio_poll(void)
             if (ret == ECANCELED) {
                 /* remove the request */
                 *pacb = acb->next;
+                raw_aio_free_bounce(acb);
                 qemu_aio_release(acb);
             } else if (ret != EINPROGRESS) {
                 /* end of aio */
@@ -241,8 +902,7 @@ void qemu_aio_poll(void)
                 /* remove the request */
                 *pacb = acb->next;
                 /* call the callback */
-                acb->common.cb(acb->common.opaque, ret);
-                qemu_aio_release(acb);
+                raw_aio_complete(acb, ret);
                 break;
             } else {
                 pacb = &acb->next;
@@ -252,12 +912,25 @@ void qemu_aio_poll(void)
  the_end: ;
 }
 
+static int qemu_aio_pending(void)
+{
+#ifdef CONFIG_LINUX_AIO
+    if (laio_nb_pending > 0)
+        return 1;
+#endif
+#ifdef CONFIG_AIO_THREADS
+    if (tp_nb_pending > 0)
+        return 1;
+#endif
+    return first_aio != NULL;
+}
+
 /* Wait for all IO requests to complete.  */
 void qemu_aio_flush(void)
 {
     qemu_aio_wait_start();
     qemu_aio_poll();
-    while (first_aio) {
+    while (qemu_aio_pending()) {
         qemu_aio_wait();
     }
     qemu_aio_wait_end();
@@ -285,9 +958,44 @@ void qemu_aio_wait(void)
 #ifndef QEMU_TOOL
     if (qemu_bh_poll())
         return;
+#endif
+#ifdef CONFIG_AIO_THREADS
+    if (tp_nb_pending > 0) {
+        int timeout;
+        /* the kernel AIO requests, if any, are polled periodically */
+        timeout = first_aio ? 1 : -1;
+#ifdef CONFIG_LINUX_AIO
+        if (laio_nb_pending > 0)
+            timeout = 1;
+#endif
+        raw_pool_wait(timeout);
+        qemu_aio_poll();
+        return;
+    }
+#endif
+#ifdef CONFIG_LINUX_AIO
+    if (laio_nb_pending > 0) {
+        struct timespec ts;
+        /* the POSIX AIO requests, if any, are polled periodically */
+        ts.tv_sec = 0;
+        ts.tv_nsec = 1000000;
+        laio_reap(1, first_aio ? &ts : NULL);
+        qemu_aio_poll();
+        return;
+    }
 #endif
     sigemptyset(&set);
     sigaddset(&set, aio_sig_num);
+#if defined(CONFIG_VCPU_THREADS) && !defined(QEMU_TOOL)
+    if (vcpu_threads) {
+        struct timespec ts;
+        /* the signal may be delivered to the main thread, so the
+           requests are polled periodically */
+        ts.tv_sec = 0;
+        ts.tv_nsec = 1000000;
+        sigtimedwait(&set, NULL, &ts);
+    } else
+#endif
     sigwait(&set, &nb_sigs);
     qemu_aio_poll();
 }
@@ -297,12 +1005,42 @@ void qemu_aio_wait_end(void)
     sigprocmask(SIG_SETMASK, &wait_oset, NULL);
 }
 
+/* copy the data of the caller to a linear and aligned buffer */
+static int raw_aio_bounce(RawAIOCB *acb)
+{
+    acb->bounce = raw_alloc_aligned(acb->aiocb.aio_nbytes);
+    if (!acb->bounce)
+        return -1;
+    if (acb->is_write) {
+        if (acb->qiov)
+            qemu_iovec_to_buffer(acb->qiov, acb->bounce);
+        else
+            memcpy(acb->bounce, acb->buf, acb->aiocb.aio_nbytes);
+    }
+    acb->aiocb.aio_buf = acb->bounce;
+    return 0;
+}
+
+static int raw_iovec_is_aligned(QEMUIOVector *qiov)
+{
+    int i;
+
+    for(i = 0; i < qiov->niov; i++) {
+        if (((unsigned long)qiov->iov[i].iov_base |
+             qiov->iov[i].iov_len) & (DIRECT_ALIGN - 1))
+            return 0;
+    }
+    return 1;
+}
+
+/* 'qiov' is NULL for the flat buffer requests */
 static RawAIOCB *raw_aio_setup(BlockDriverState *bs,
-        int64_t sector_num, uint8_t *buf, int nb_sectors,
-        BlockDriverCompletionFunc *cb, void *opaque)
+        int64_t sector_num, QEMUIOVector *qiov, uint8_t *buf, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque, int is_write)
 {
     BDRVRawState *s = bs->opaque;
     RawAIOCB *acb;
+    int need_bounce;
 
     if (fd_open(bs) < 0)
         return NULL;
@@ -310,15 +1048,55 @@ static RawAIOCB *raw_aio_setup(BlockDriverState *bs,
     acb = qemu_aio_get(bs, cb, opaque);
     if (!acb)
         return NULL;
+    acb->is_write = is_write;
+    acb->buf = buf;
+    acb->qiov = qiov;
+    acb->bounce = NULL;
+    acb->cancelled = 0;
+#ifdef CONFIG_LINUX_AIO
+    acb->native = 0;
+#endif
+#ifdef CONFIG_AIO_THREADS
+    acb->pool = NULL;
+#endif
     acb->aiocb.aio_fildes = s->fd;
     acb->aiocb.aio_sigevent.sigev_signo = aio_sig_num;
     acb->aiocb.aio_sigevent.sigev_notify = SIGEV_SIGNAL;
     acb->aiocb.aio_buf = buf;
     acb->aiocb.aio_nbytes = nb_sectors * 512;
     acb->aiocb.aio_offset = sector_num * 512;
+
+    /* O_DIRECT cannot use unaligned buffers */
+    if (qiov)
+        need_bounce = s->aligned_buf && !raw_iovec_is_aligned(qiov);
+    else
+        need_bounce = s->aligned_buf &&
+            ((unsigned long)buf & (DIRECT_ALIGN - 1));
+    if (need_bounce && raw_aio_bounce(acb) < 0)
+        goto fail;
+#ifdef CONFIG_LINUX_AIO
+    /* if the ring is full, the POSIX AIO is used */
+    if (s->native_aio && laio_submit(acb) == 0)
+        return acb;
+#endif
+#ifdef CONFIG_AIO_THREADS
+    if (s->pool) {
+        raw_pool_submit(s->pool, acb);
+        return acb;
+    }
+#endif
+    /* the POSIX AIO has no vectored requests */
+    if (qiov && !acb->bounce && raw_aio_bounce(acb) < 0)
+        goto fail;
+    if ((is_write ? aio_write(&acb->aiocb) : aio_read(&acb->aiocb)) < 0)
+        goto fail;
     acb->next = first_aio;
     first_aio = acb;
     return acb;
+ fail:
+    raw_aio_free_bounce(acb);
+    qemu_aio_release(acb);
+    return NULL;
 }
 
 static BlockDriverAIOCB *raw_aio_read(BlockDriverState *bs,
@@ -327,13 +1105,9 @@ static BlockDriverAIOCB *raw_aio_read(BlockDriverState *bs,
 {
     RawAIOCB *acb;
 
-    acb = raw_aio_setup(bs, sector_num, buf, nb_sectors, cb, opaque);
+    acb = raw_aio_setup(bs, sector_num, NULL, buf, nb_sectors, cb, opaque, 0);
     if (!acb)
         return NULL;
-    if (aio_read(&acb->aiocb) < 0) {
-        qemu_aio_release(acb);
-        return NULL;
-    } 
     return &acb->common;
 }
 
@@ -343,13 +1117,34 @@ static BlockDriverAIOCB *raw_aio_write(BlockDriverState *bs,
 {
     RawAIOCB *acb;
 
-    acb = raw_aio_setup(bs, sector_num, (uint8_t*)buf, nb_sectors, cb, opaque);
+    acb = raw_aio_setup(bs, sector_num, NULL, (uint8_t*)buf, nb_sectors,
+                        cb, opaque, 1);
     if (!acb)
         return NULL;
-    if (aio_write(&acb->aiocb) < 0) {
-        qemu_aio_release(acb);
+    return &acb->common;
+}
+
+static BlockDriverAIOCB *raw_aio_readv(BlockDriverState *bs,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque)
+{
+    RawAIOCB *acb;
+
+    acb = raw_aio_setup(bs, sector_num, qiov, NULL, nb_sectors, cb, opaque, 0);
+    if (!acb)
+        return NULL;
+    return &acb->common;
+}
+
+static BlockDriverAIOCB *raw_aio_writev(BlockDriverState *bs,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque)
+{
+    RawAIOCB *acb;
+
+    acb = raw_aio_setup(bs, sector_num, qiov, NULL, nb_sectors, cb, opaque, 1);
+    if (!acb)
         return NULL;
-    } 
     return &acb->common;
 }
 
@@ -359,6 +1154,18 @@ static void raw_aio_cancel(BlockDriverAIOCB *blockacb)
     RawAIOCB *acb = (RawAIOCB *)blockacb;
     RawAIOCB **pacb;
 
+#ifdef CONFIG_LINUX_AIO
+    if (acb->native) {
+        laio_cancel(acb);
+        return;
+    }
+#endif
+#ifdef CONFIG_AIO_THREADS
+    if (acb->pool) {
+        raw_pool_cancel(acb);
+        return;
+    }
+#endif
     ret = aio_cancel(acb->aiocb.aio_fildes, &acb->aiocb);
     if (ret == AIO_NOTCANCELED) {
         /* fail safe: if the aio could not be canceled, we wait for
@@ -373,10 +1180,11 @@ static void raw_aio_cancel(BlockDriverAIOCB *blockacb)
             break;
         } else if (*pacb == acb) {
             *pacb = acb->next;
+            raw_aio_free_bounce(acb);
             qemu_aio_release(acb);
             break;
         }
-        pacb = &acb->next;
+        pacb = &(*pacb)->next;
     }
 }
 
@@ -387,6 +1195,16 @@ static void raw_close(BlockDriverState *bs)
         close(s->fd);
         s->fd = -1;
     }
+    if (s->aligned_buf) {
+        free(s->aligned_buf);
+        s->aligned_buf = NULL;
+    }
+#ifdef CONFIG_AIO_THREADS
+    if (s->pool) {
+        raw_pool_delete(s->pool);
+        s->pool = NULL;
+    }
+#endif
 }
 
 static int raw_truncate(BlockDriverState *bs, int64_t offset)
@@ -483,6 +1301,8 @@ BlockDriver bdrv_raw = {
     .bdrv_aio_read = raw_aio_read,
     .bdrv_aio_write = raw_aio_write,
     .bdrv_aio_cancel = raw_aio_cancel,
+    .bdrv_aio_readv = raw_aio_readv,
+    .bdrv_aio_writev = raw_aio_writev,
     .aiocb_size = sizeof(RawAIOCB),
     .protocol_name = "file",
     .bdrv_pread = raw_pread,
@@ -603,6 +1423,13 @@ static int hdev_open(BlockDriverState *bs, const char *filename, int flags)
         /* open will not fail even if no floppy is inserted */
         open_flags |= O_NONBLOCK;
     }
+#endif
+    /* removable media are always accessed through the page cache */
+    if (s->type != FTYPE_FILE)
+        flags &= ~(BDRV_O_DIRECT | BDRV_O_NATIVE_AIO);
+#ifdef O_DIRECT
+    if (flags & BDRV_O_DIRECT)
+        open_flags |= O_DIRECT;
 #endif
     fd = open(filename, open_flags, 0644);
     if (fd < 0) {
@@ -612,6 +1439,12 @@ static int hdev_open(BlockDriverState *bs, const char *filename, int flags)
         return ret;
     }
     s->fd = fd;
+    ret = raw_open_common(bs, flags);
+    if (ret < 0) {
+        close(fd);
+        s->fd = -1;
+        return ret;
+    }
 #if defined(__linux__)
     /* close fd so that we can reopen it as needed */
     if (s->type == FTYPE_FD) {
@@ -819,6 +1652,8 @@ BlockDriver bdrv_host_device = {
     .bdrv_aio_read = raw_aio_read,
     .bdrv_aio_write = raw_aio_write,
     .bdrv_aio_cancel = raw_aio_cancel,
+    .bdrv_aio_readv = raw_aio_readv,
+    .bdrv_aio_writev = raw_aio_writev,
     .aiocb_size = sizeof(RawAIOCB),
     .bdrv_pread = raw_pread,
     .bdrv_pwrite = raw_pwrite,
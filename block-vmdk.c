@@ -622,6 +622,24 @@ static int vmdk_is_allocated(BlockDriverState *bs, int64_t sector_num,
     return (cluster_offset != 0);
 }
 
+static int64_t vmdk_get_host_offset(BlockDriverState *bs, int64_t sector_num,
+                                    int nb_sectors, int *pnum)
+{
+    BDRVVmdkState *s = bs->opaque;
+    int index_in_cluster, n;
+    uint64_t cluster_offset;
+
+    cluster_offset = get_cluster_offset(bs, NULL, sector_num << 9, 0);
+    index_in_cluster = sector_num % s->cluster_sectors;
+    n = s->cluster_sectors - index_in_cluster;
+    if (n > nb_sectors)
+        n = nb_sectors;
+    *pnum = n;
+    if (!cluster_offset)
+        return -1;
+    return cluster_offset + index_in_cluster * 512;
+}
+
 static int vmdk_read(BlockDriverState *bs, int64_t sector_num, 
                     uint8_t *buf, int nb_sectors)
 {
@@ -836,4 +854,5 @@ BlockDriver bdrv_vmdk = {
     vmdk_create,
     vmdk_flush,
     vmdk_is_allocated,
+    .bdrv_get_host_offset = vmdk_get_host_offset,
 };
@@ -377,12 +377,13 @@ int bdrv_open2(BlockDriverState *bs, const char *filename, int flags,
     /* Note: for compatibility, we open disk image files as RDWR, and
        RDONLY as fallback */
     if (!(flags & BDRV_O_FILE))
-        open_flags = BDRV_O_RDWR;
+        open_flags = BDRV_O_RDWR | (flags & BDRV_O_AIO_MASK);
     else
         open_flags = flags & ~(BDRV_O_FILE | BDRV_O_SNAPSHOT);
     ret = drv->bdrv_open(bs, filename, open_flags);
     if (ret == -EACCES && !(flags & BDRV_O_FILE)) {
-        ret = drv->bdrv_open(bs, filename, BDRV_O_RDONLY);
+        ret = drv->bdrv_open(bs, filename,
+                             BDRV_O_RDONLY | (flags & BDRV_O_AIO_MASK));
         bs->read_only = 1;
     }
     if (ret < 0) {
@@ -424,6 +425,9 @@ int bdrv_open2(BlockDriverState *bs, const char *filename, int flags,
 void bdrv_close(BlockDriverState *bs)
 {
     if (bs->drv) {
+#ifndef QEMU_TOOL
+        bdrv_stream_cancel(bs);
+#endif
         if (bs->backing_hd)
             bdrv_delete(bs->backing_hd);
         bs->drv->bdrv_close(bs);
@@ -450,6 +454,694 @@ void bdrv_delete(BlockDriverState *bs)
     qemu_free(bs);
 }
 
+/* Return TRUE if the sector at 'sector_num' is allocated in the image
+   itself (not in its backing file) and set '*pnum' to the number of
+   following sectors (at most 'nb_sectors') in the same state. The
+   formats which do not track the allocation report all the sectors as
+   allocated. */
+int bdrv_is_allocated(BlockDriverState *bs, int64_t sector_num,
+                      int nb_sectors, int *pnum)
+{
+    BlockDriver *drv = bs->drv;
+    int64_t n;
+    int ret, n1;
+
+    if (!drv)
+        return -ENOMEDIUM;
+    n = bs->total_sectors - sector_num;
+    if (n <= 0) {
+        *pnum = 0;
+        return 0;
+    }
+    if (nb_sectors > n)
+        nb_sectors = n;
+    if (!drv->bdrv_is_allocated) {
+        *pnum = nb_sectors;
+        return 1;
+    }
+    ret = drv->bdrv_is_allocated(bs, sector_num, nb_sectors, pnum);
+    /* the drivers stop at the end of their allocation unit */
+    while (*pnum < nb_sectors) {
+        if (drv->bdrv_is_allocated(bs, sector_num + *pnum,
+                                   nb_sectors - *pnum, &n1) != ret || n1 <= 0)
+            break;
+        *pnum += n1;
+    }
+    return ret;
+}
+
+/* Like bdrv_is_allocated(), but look in the images of the backing chain
+   from 'top' down to 'base' excluded. 'base' can be NULL to look in the
+   whole chain. */
+int bdrv_is_allocated_above(BlockDriverState *top, BlockDriverState *base,
+                            int64_t sector_num, int nb_sectors, int *pnum)
+{
+    BlockDriverState *bs;
+    int ret, n;
+
+    for(bs = top; bs && bs != base; bs = bs->backing_hd) {
+        ret = bdrv_is_allocated(bs, sector_num, nb_sectors, &n);
+        if (ret < 0)
+            return ret;
+        if (ret) {
+            *pnum = n;
+            return 1;
+        }
+        /* the sectors after the end of a shorter image are not
+           allocated in it */
+        if (n > 0)
+            nb_sectors = n;
+    }
+    *pnum = nb_sectors;
+    return 0;
+}
+
+/* Return the offset in bytes of the sector 'sector_num' in the file
+   of the image, or -1 if it is not stored as is in the file (not
+   allocated, compressed or encrypted). '*pnum' is set to the number of
+   following sectors (at most 'nb_sectors') which are contiguous in the
+   file or in the same state. */
+int64_t bdrv_get_host_offset(BlockDriverState *bs, int64_t sector_num,
+                             int nb_sectors, int *pnum)
+{
+    BlockDriver *drv = bs->drv;
+
+    if (!drv)
+        return -1;
+    if (!drv->bdrv_get_host_offset) {
+        *pnum = nb_sectors;
+        /* the raw images store the sectors as is */
+        if (drv == &bdrv_raw || drv == &bdrv_host_device)
+            return sector_num * 512;
+        return -1;
+    }
+    return drv->bdrv_get_host_offset(bs, sector_num, nb_sectors, pnum);
+}
+
+/* Change the name of the backing file recorded in the image. The
+   backing file which is open is not changed. */
+int bdrv_change_backing_file(BlockDriverState *bs, const char *backing_file)
+{
+    BlockDriver *drv = bs->drv;
+    int ret;
+
+    if (!drv)
+        return -ENOMEDIUM;
+    if (bs->read_only)
+        return -EACCES;
+    if (!drv->bdrv_change_backing_file)
+        return -ENOTSUP;
+    ret = drv->bdrv_change_backing_file(bs, backing_file, 0);
+    if (ret == 0)
+        pstrcpy(bs->backing_file, sizeof(bs->backing_file), backing_file);
+    return ret;
+}
+
+/* return 0 if bdrv_change_backing_file() can write 'backing_file',
+   so that a copy is not done for nothing */
+int bdrv_check_backing_file(BlockDriverState *bs, const char *backing_file)
+{
+    BlockDriver *drv = bs->drv;
+
+    if (!drv)
+        return -ENOMEDIUM;
+    if (bs->read_only)
+        return -EACCES;
+    if (!drv->bdrv_change_backing_file)
+        return -ENOTSUP;
+    return drv->bdrv_change_backing_file(bs, backing_file, 1);
+}
+
+/* Make 'base', which is in the backing chain of 'bs', its backing file
+   once the data of the images between them has been copied to 'bs'.
+   'base_name' is the name of 'base' relative to 'bs'. */
+static int bdrv_stream_finish(BlockDriverState *bs, BlockDriverState *base,
+                              const char *base_name)
+{
+    BlockDriverState *p;
+    int ret;
+
+    bdrv_flush(bs);
+    ret = bdrv_change_backing_file(bs, base ? base_name : "");
+    if (ret < 0)
+        return ret;
+    if (bs->backing_hd == base)
+        return 0;
+    /* close the images between 'bs' and 'base' */
+    for(p = bs->backing_hd; p->backing_hd != base; p = p->backing_hd)
+        ;
+    p->backing_hd = NULL;
+    bdrv_delete(bs->backing_hd);
+    bs->backing_hd = base;
+    return 0;
+}
+
+#define STREAM_BUF_SIZE (1024 * 1024)
+
+/* Copy to 'bs' the sectors which are allocated in the images of its
+   backing chain above 'base' but not in 'bs', then make 'base' (NULL
+   for none) the backing file of 'bs'. It shortens the chain walked by
+   the reads of 'bs'. */
+int bdrv_stream(BlockDriverState *bs, BlockDriverState *base,
+                const char *base_name)
+{
+    uint8_t *buf;
+    int64_t sector_num, total_sectors;
+    int n, ret;
+
+    ret = bdrv_check_backing_file(bs, base ? base_name : "");
+    if (ret < 0)
+        return ret;
+    buf = qemu_malloc(STREAM_BUF_SIZE);
+    if (!buf)
+        return -ENOMEM;
+    total_sectors = bdrv_getlength(bs) >> SECTOR_BITS;
+    ret = 0;
+    for(sector_num = 0; sector_num < total_sectors; sector_num += n) {
+        n = STREAM_BUF_SIZE >> SECTOR_BITS;
+        if (total_sectors - sector_num < n)
+            n = total_sectors - sector_num;
+        ret = bdrv_is_allocated(bs, sector_num, n, &n);
+        if (ret < 0)
+            break;
+        if (ret)
+            continue;
+        ret = bdrv_is_allocated_above(bs->backing_hd, base, sector_num, n,
+                                      &n);
+        if (ret < 0)
+            break;
+        if (!ret)
+            continue;
+        if (bdrv_read(bs->backing_hd, sector_num, buf, n) < 0 ||
+            bdrv_write(bs, sector_num, buf, n) < 0) {
+            ret = -EIO;
+            break;
+        }
+    }
+    qemu_free(buf);
+    if (ret < 0)
+        return ret;
+    return bdrv_stream_finish(bs, base, base_name);
+}
+
+#ifndef QEMU_TOOL
+/* Online streaming: the copy of bdrv_stream() is done in the background
+   while the guest uses the image. A timer starts the copy of a chunk
+   and the AIO callbacks complete it, so the guest I/O is interleaved
+   with the copy. A chunk must not overwrite the data of a guest write:
+   it is not started over a guest write in flight, and a guest write
+   over the chunk in flight is submitted when the chunk is copied. */
+
+/* number of extents examined by a step of the timer */
+#define STREAM_SCAN_MAX 64
+
+enum {
+    STREAM_IDLE,
+    STREAM_READ,
+    STREAM_WRITE,
+};
+
+typedef struct BlockStreamWrite {
+    BlockDriverAIOCB common;
+    struct BlockStreamState *stream;
+    int64_t sector_num;
+    int nb_sectors;
+    const uint8_t *buf;
+    QEMUIOVector *qiov; /* NULL for a linear buffer */
+    BlockDriverAIOCB *acb; /* of the driver, NULL while deferred */
+    int in_submit;
+    int completed;
+    struct BlockStreamWrite *next;
+} BlockStreamWrite;
+
+typedef struct BlockStreamState {
+    BlockDriverState *bs;
+    BlockDriverState *base;
+    char base_name[1024];
+    QEMUTimer *timer;
+    uint8_t *buf;
+    int cluster_sectors;
+    int64_t sector_num; /* next sector to examine */
+    int64_t total_sectors;
+    int state;
+    int ret;
+    int64_t chunk_sector;
+    int chunk_sectors;
+    int64_t speed; /* in bytes per second, 0 for no limit */
+    int64_t next_start; /* rt_clock time of the next chunk */
+    int64_t copied_bytes;
+    int cancelled;
+    int ending; /* set while the tracked guest writes are drained */
+    /* guest writes in flight or deferred */
+    BlockStreamWrite *writes;
+    int write_gen; /* incremented when a guest write completes */
+} BlockStreamState;
+
+static void bdrv_stream_kick(BlockStreamState *s)
+{
+    if (s->bs->stream == s && !s->ending && s->state == STREAM_IDLE)
+        qemu_mod_timer(s->timer, qemu_get_clock(rt_clock));
+}
+
+static int bdrv_stream_overlap(int64_t sector_num1, int nb_sectors1,
+                               int64_t sector_num2, int nb_sectors2)
+{
+    return sector_num1 < sector_num2 + nb_sectors2 &&
+        sector_num2 < sector_num1 + nb_sectors1;
+}
+
+/* the clusters are allocated as a whole, so the overlap of the guest
+   writes with the chunk is checked at the cluster level */
+static int bdrv_stream_overlap_chunk(BlockStreamState *s,
+                                     int64_t sector_num, int nb_sectors)
+{
+    int64_t start, end;
+
+    start = sector_num - sector_num % s->cluster_sectors;
+    end = sector_num + nb_sectors + s->cluster_sectors - 1;
+    end -= end % s->cluster_sectors;
+    return bdrv_stream_overlap(start, end - start,
+                               s->chunk_sector, s->chunk_sectors);
+}
+
+static void bdrv_stream_unlink_write(BlockStreamWrite *w)
+{
+    BlockStreamState *s = w->stream;
+    BlockStreamWrite **pw;
+
+    for(pw = &s->writes; *pw != w; pw = &(*pw)->next)
+        ;
+    *pw = w->next;
+    s->write_gen++;
+}
+
+static void bdrv_stream_write_cb(void *opaque, int ret)
+{
+    BlockStreamWrite *w = opaque;
+
+    bdrv_stream_unlink_write(w);
+    bdrv_stream_kick(w->stream);
+    w->common.cb(w->common.opaque, ret);
+    if (w->in_submit)
+        w->completed = 1;
+    else
+        qemu_free(w);
+}
+
+/* Return the AIOCB of the driver. 'w->completed' is set if the write
+   completed during the submission. */
+static BlockDriverAIOCB *bdrv_stream_submit_write(BlockStreamWrite *w)
+{
+    BlockDriverState *bs = w->common.bs;
+    BlockDriver *drv = bs->drv;
+    BlockDriverAIOCB *acb;
+
+    w->in_submit = 1;
+    if (w->qiov)
+        acb = drv->bdrv_aio_writev(bs, w->sector_num, w->qiov, w->nb_sectors,
+                                   bdrv_stream_write_cb, w);
+    else
+        acb = drv->bdrv_aio_write(bs, w->sector_num, w->buf, w->nb_sectors,
+                                  bdrv_stream_write_cb, w);
+    w->in_submit = 0;
+    w->acb = acb;
+    return acb;
+}
+
+/* guest write while the image is streamed */
+static BlockDriverAIOCB *bdrv_stream_aio_write(BlockDriverState *bs,
+        int64_t sector_num, const uint8_t *buf, QEMUIOVector *qiov,
+        int nb_sectors, BlockDriverCompletionFunc *cb, void *opaque)
+{
+    BlockStreamState *s = bs->stream;
+    BlockStreamWrite *w;
+    BlockDriverAIOCB *acb;
+
+    if (s->ending) {
+        /* no chunk is copied any more */
+        if (qiov)
+            return bs->drv->bdrv_aio_writev(bs, sector_num, qiov, nb_sectors,
+                                            cb, opaque);
+        return bs->drv->bdrv_aio_write(bs, sector_num, buf, nb_sectors,
+                                       cb, opaque);
+    }
+    w = qemu_mallocz(sizeof(BlockStreamWrite));
+    if (!w)
+        return NULL;
+    w->common.bs = bs;
+    w->common.cb = cb;
+    w->common.opaque = opaque;
+    w->stream = s;
+    w->sector_num = sector_num;
+    w->nb_sectors = nb_sectors;
+    w->buf = buf;
+    w->qiov = qiov;
+    w->next = s->writes;
+    s->writes = w;
+    if (s->state != STREAM_IDLE &&
+        bdrv_stream_overlap_chunk(s, sector_num, nb_sectors)) {
+        /* submitted when the chunk is copied */
+        return &w->common;
+    }
+    acb = bdrv_stream_submit_write(w);
+    if (w->completed) {
+        qemu_free(w);
+        return acb;
+    }
+    if (!acb) {
+        bdrv_stream_unlink_write(w);
+        qemu_free(w);
+        return NULL;
+    }
+    return &w->common;
+}
+
+/* return TRUE if 'acb' was a guest write of the stream */
+static int bdrv_stream_cancel_write(BlockDriverAIOCB *acb)
+{
+    BlockStreamState *s = acb->bs->stream;
+    BlockStreamWrite *w;
+
+    for(w = s->writes; w != NULL; w = w->next) {
+        if (&w->common == acb)
+            break;
+    }
+    if (!w)
+        return 0;
+    if (w->acb)
+        acb->bs->drv->bdrv_aio_cancel(w->acb);
+    bdrv_stream_unlink_write(w);
+    bdrv_stream_kick(s);
+    qemu_free(w);
+    return 1;
+}
+
+/* the data of a synchronous write must not be overwritten by the
+   chunk in flight */
+static void bdrv_stream_wait_chunk(BlockDriverState *bs, int64_t sector_num,
+                                   int nb_sectors)
+{
+    BlockStreamState *s = bs->stream;
+
+    if (s->state == STREAM_IDLE ||
+        !bdrv_stream_overlap_chunk(s, sector_num, nb_sectors))
+        return;
+    qemu_aio_wait_start();
+    qemu_aio_poll();
+    while (s->state != STREAM_IDLE)
+        qemu_aio_wait();
+    qemu_aio_wait_end();
+}
+
+static void bdrv_stream_chunk_done(BlockStreamState *s, int ret)
+{
+    BlockStreamWrite *w;
+    BlockDriverAIOCB *acb;
+
+    s->state = STREAM_IDLE;
+    if (ret < 0) {
+        s->ret = ret;
+    } else {
+        s->copied_bytes += (int64_t)s->chunk_sectors * 512;
+    }
+    /* submit the guest writes which waited for the chunk. The list
+       changes during the submission, so it is scanned again. */
+    for(;;) {
+        for(w = s->writes; w != NULL; w = w->next) {
+            if (!w->acb && !w->in_submit)
+                break;
+        }
+        if (!w)
+            break;
+        acb = bdrv_stream_submit_write(w);
+        if (w->completed) {
+            qemu_free(w);
+        } else if (!acb) {
+            /* the guest has the AIOCB: report the error with the
+               callback */
+            bdrv_stream_unlink_write(w);
+            w->common.cb(w->common.opaque, -EIO);
+            qemu_free(w);
+        }
+    }
+    bdrv_stream_kick(s);
+}
+
+static void bdrv_stream_chunk_write_cb(void *opaque, int ret)
+{
+    BlockStreamState *s = opaque;
+
+    bdrv_stream_chunk_done(s, ret);
+}
+
+static void bdrv_stream_chunk_read_cb(void *opaque, int ret)
+{
+    BlockStreamState *s = opaque;
+    BlockDriverState *bs = s->bs;
+    BlockDriverAIOCB *acb;
+
+    if (ret < 0) {
+        bdrv_stream_chunk_done(s, ret);
+        return;
+    }
+    /* the write of the chunk is not a guest write: it is submitted to
+       the driver directly */
+    s->state = STREAM_WRITE;
+    acb = bs->drv->bdrv_aio_write(bs, s->chunk_sector, s->buf,
+                                  s->chunk_sectors,
+                                  bdrv_stream_chunk_write_cb, s);
+    if (!acb && s->state == STREAM_WRITE)
+        bdrv_stream_chunk_done(s, -EIO);
+}
+
+static void bdrv_stream_end(BlockStreamState *s, int ret)
+{
+    BlockDriverState *bs = s->bs;
+
+    /* the new guest writes are not tracked: wait for the others,
+       which can still be cancelled through the stream */
+    s->ending = 1;
+    qemu_del_timer(s->timer);
+    qemu_aio_wait_start();
+    qemu_aio_poll();
+    while (s->writes != NULL)
+        qemu_aio_wait();
+    qemu_aio_wait_end();
+    bs->stream = NULL;
+    if (ret == 0) {
+        /* no request may use the images which are closed */
+        qemu_aio_flush();
+        ret = bdrv_stream_finish(bs, s->base, s->base_name);
+    }
+    if (ret < 0 && !s->cancelled)
+        fprintf(stderr, "qemu: streaming of '%s' failed: %s\n",
+                bs->device_name, strerror(-ret));
+    qemu_free_timer(s->timer);
+    qemu_free(s->buf);
+    qemu_free(s);
+}
+
+static void bdrv_stream_step(void *opaque)
+{
+    BlockStreamState *s = opaque;
+    BlockDriverState *bs = s->bs;
+    BlockDriverAIOCB *acb;
+    BlockStreamWrite *w;
+    int64_t now, sector_num, end;
+    int i, n, ret, write_gen;
+
+    if (s->state != STREAM_IDLE)
+        return;
+    if (s->ret < 0) {
+        bdrv_stream_end(s, s->ret);
+        return;
+    }
+    now = qemu_get_clock(rt_clock);
+    if (s->speed > 0 && now < s->next_start) {
+        qemu_mod_timer(s->timer, s->next_start);
+        return;
+    }
+
+    /* find the next extent to copy. The allocation lookups may wait
+       for the metadata I/O, during which guest writes can complete. */
+    write_gen = s->write_gen;
+    for(i = 0;; i++) {
+        if (s->sector_num >= s->total_sectors) {
+            bdrv_stream_end(s, 0);
+            return;
+        }
+        if (i == STREAM_SCAN_MAX) {
+            qemu_mod_timer(s->timer, now);
+            return;
+        }
+        n = STREAM_BUF_SIZE >> SECTOR_BITS;
+        if (s->total_sectors - s->sector_num < n)
+            n = s->total_sectors - s->sector_num;
+        ret = bdrv_is_allocated(bs, s->sector_num, n, &n);
+        if (ret < 0)
+            goto fail;
+        if (!ret) {
+            ret = bdrv_is_allocated_above(bs->backing_hd, s->base,
+                                          s->sector_num, n, &n);
+            if (ret < 0)
+                goto fail;
+            if (ret)
+                break;
+        }
+        s->sector_num += n;
+    }
+    if (s->write_gen != write_gen) {
+        /* the extent may have been written */
+        qemu_mod_timer(s->timer, now);
+        return;
+    }
+
+    /* the whole clusters are copied */
+    sector_num = s->sector_num - s->sector_num % s->cluster_sectors;
+    end = s->sector_num + n + s->cluster_sectors - 1;
+    end -= end % s->cluster_sectors;
+    if (end > s->total_sectors)
+        end = s->total_sectors;
+    s->chunk_sector = sector_num;
+    s->chunk_sectors = end - sector_num;
+    for(w = s->writes; w != NULL; w = w->next) {
+        if (bdrv_stream_overlap_chunk(s, w->sector_num, w->nb_sectors))
+            break;
+    }
+    if (w) {
+        /* retried when the guest write completes */
+        return;
+    }
+    s->sector_num = end;
+    if (s->speed > 0) {
+        if (s->next_start < now)
+            s->next_start = now;
+        s->next_start += (int64_t)s->chunk_sectors * 512 * 1000 / s->speed;
+    }
+    s->state = STREAM_READ;
+    acb = bdrv_aio_read(bs->backing_hd, s->chunk_sector, s->buf,
+                        s->chunk_sectors, bdrv_stream_chunk_read_cb, s);
+    if (!acb && s->state == STREAM_READ) {
+        s->state = STREAM_IDLE;
+        ret = -EIO;
+        goto fail;
+    }
+    return;
+ fail:
+    bdrv_stream_end(s, ret);
+}
+
+/* Start the online streaming of the backing chain of 'bs' down to the
+   image 'base_name' (NULL or empty for the whole chain), whose name is
+   relative to 'bs'. */
+int bdrv_stream_start(BlockDriverState *bs, const char *base_name)
+{
+    BlockStreamState *s;
+    BlockDriverState *base;
+    BlockDriverInfo bdi;
+    char base_filename[1024];
+    int ret;
+
+    if (!bs->drv)
+        return -ENOMEDIUM;
+    if (bs->read_only)
+        return -EACCES;
+    if (bs->stream)
+        return -EBUSY;
+    if (!bs->backing_hd)
+        return -EINVAL;
+    base = NULL;
+    if (base_name && base_name[0] != '\0') {
+        path_combine(base_filename, sizeof(base_filename),
+                     bs->filename, base_name);
+        for(base = bs->backing_hd; base != NULL; base = base->backing_hd) {
+            if (!strcmp(base->filename, base_filename))
+                break;
+        }
+        if (!base)
+            return -ENOENT;
+    }
+    ret = bdrv_check_backing_file(bs, base ? base_name : "");
+    if (ret < 0)
+        return ret;
+
+    s = qemu_mallocz(sizeof(BlockStreamState));
+    if (!s)
+        return -ENOMEM;
+    s->cluster_sectors = 1;
+    if (bdrv_get_info(bs, &bdi) >= 0 && bdi.cluster_size > SECTOR_SIZE)
+        s->cluster_sectors = bdi.cluster_size >> SECTOR_BITS;
+    s->buf = qemu_malloc(STREAM_BUF_SIZE + 2 * s->cluster_sectors * 512);
+    if (!s->buf) {
+        qemu_free(s);
+        return -ENOMEM;
+    }
+    s->bs = bs;
+    s->base = base;
+    if (base)
+        pstrcpy(s->base_name, sizeof(s->base_name), base_name);
+    s->total_sectors = bdrv_getlength(bs) >> SECTOR_BITS;
+    s->timer = qemu_new_timer(rt_clock, bdrv_stream_step, s);
+    bs->stream = s;
+    qemu_mod_timer(s->timer, qemu_get_clock(rt_clock));
+    return 0;
+}
+
+/* limit the copy to 'speed' bytes per second (0 for no limit) */
+int bdrv_stream_set_speed(BlockDriverState *bs, int64_t speed)
+{
+    BlockStreamState *s = bs->stream;
+
+    if (!s)
+        return -ENOENT;
+    if (speed < 0)
+        return -EINVAL;
+    s->speed = speed;
+    s->next_start = 0;
+    bdrv_stream_kick(s);
+    return 0;
+}
+
+/* Stop the streaming of 'bs'. The backing chain is not changed. */
+void bdrv_stream_cancel(BlockDriverState *bs)
+{
+    BlockStreamState *s = bs->stream;
+
+    if (!s || s->ending)
+        return;
+    qemu_aio_wait_start();
+    qemu_aio_poll();
+    while (s->state != STREAM_IDLE)
+        qemu_aio_wait();
+    qemu_aio_wait_end();
+    s->cancelled = 1;
+    bdrv_stream_end(s, -EINTR);
+}
+
+void bdrv_stream_info(void)
+{
+    BlockDriverState *bs;
+    BlockStreamState *s;
+
+    for (bs = bdrv_first; bs != NULL; bs = bs->next) {
+        s = bs->stream;
+        if (!s)
+            continue;
+        term_printf("%s: sector=%" PRId64 "/%" PRId64
+                    " copied=%" PRId64 "KB",
+                    bs->device_name, s->sector_num, s->total_sectors,
+                    s->copied_bytes >> 10);
+        if (s->speed > 0)
+            term_printf(" speed=%" PRId64 "KB/s", s->speed >> 10);
+        if (s->base) {
+            term_printf(" base=");
+            term_print_filename(s->base_name);
+        }
+        term_printf("\n");
+    }
+}
+#endif /* !QEMU_TOOL */
+
 /* commit COW file into the raw image */
 int bdrv_commit(BlockDriverState *bs)
 {
@@ -493,6 +1185,62 @@ int bdrv_commit(BlockDriverState *bs)
     return 0;
 }
 
+/**************************************************************/
+/* I/O from coroutines */
+
+typedef struct CoRWState {
+    Coroutine *co;
+    int ret;
+    int done;
+    int waiting;
+} CoRWState;
+
+static void bdrv_co_rw_cb(void *opaque, int ret)
+{
+    CoRWState *st = opaque;
+
+    st->ret = ret;
+    st->done = 1;
+    if (st->waiting)
+        qemu_coroutine_enter(st->co);
+}
+
+/* submit the request asynchronously and yield until it completes */
+static int bdrv_co_rw(BlockDriverState *bs, int64_t sector_num,
+                      uint8_t *buf, int nb_sectors, int is_write)
+{
+    BlockDriver *drv = bs->drv;
+    BlockDriverAIOCB *acb;
+    CoRWState st;
+
+    st.co = qemu_coroutine_self();
+    st.ret = 0;
+    st.done = 0;
+    st.waiting = 0;
+    if (is_write)
+        acb = drv->bdrv_aio_write(bs, sector_num, buf, nb_sectors,
+                                  bdrv_co_rw_cb, &st);
+    else
+        acb = drv->bdrv_aio_read(bs, sector_num, buf, nb_sectors,
+                                 bdrv_co_rw_cb, &st);
+    if (!acb)
+        return -EIO;
+    /* the request may also complete before the submission returns */
+    while (!st.done) {
+        st.waiting = 1;
+        qemu_coroutine_yield();
+        st.waiting = 0;
+    }
+    return st.ret;
+}
+
+/* true if the synchronous I/O of a coroutine must be submitted
+   asynchronously */
+static inline int bdrv_in_co(BlockDriverState *bs)
+{
+    return qemu_in_coroutine() && bs->drv->bdrv_aio_read != bdrv_aio_read_em;
+}
+
 /* return < 0 if error. See bdrv_write() for the return codes */
 int bdrv_read(BlockDriverState *bs, int64_t sector_num, 
               uint8_t *buf, int nb_sectors)
@@ -510,6 +1258,8 @@ int bdrv_read(BlockDriverState *bs, int64_t sector_num,
         if (nb_sectors == 0)
             return 0;
     }
+    if (bdrv_in_co(bs))
+        return bdrv_co_rw(bs, sector_num, buf, nb_sectors, 0);
     if (drv->bdrv_pread) {
         int ret, len;
         len = nb_sectors * 512;
@@ -542,6 +1292,12 @@ int bdrv_write(BlockDriverState *bs, int64_t sector_num,
     if (sector_num == 0 && bs->boot_sector_enabled && nb_sectors > 0) {
         memcpy(bs->boot_sector_data, buf, 512);   
     }
+    if (bdrv_in_co(bs))
+        return bdrv_co_rw(bs, sector_num, (uint8_t *)buf, nb_sectors, 1);
+#ifndef QEMU_TOOL
+    if (bs->stream)
+        bdrv_stream_wait_chunk(bs, sector_num, nb_sectors);
+#endif
     if (drv->bdrv_pwrite) {
         int ret, len;
         len = nb_sectors * 512;
@@ -659,7 +1415,8 @@ int bdrv_pread(BlockDriverState *bs, int64_t offset,
 
     if (!drv)
         return -ENOMEDIUM;
-    if (!drv->bdrv_pread)
+    /* in a coroutine, the sectors are read asynchronously */
+    if (!drv->bdrv_pread || bdrv_in_co(bs))
         return bdrv_pread_em(bs, offset, buf1, count1);
     return drv->bdrv_pread(bs, offset, buf1, count1);
 }
@@ -674,7 +1431,7 @@ int bdrv_pwrite(BlockDriverState *bs, int64_t offset,
 
     if (!drv)
         return -ENOMEDIUM;
-    if (!drv->bdrv_pwrite)
+    if (!drv->bdrv_pwrite || bdrv_in_co(bs))
         return bdrv_pwrite_em(bs, offset, buf1, count1);
     return drv->bdrv_pwrite(bs, offset, buf1, count1);
 }
@@ -851,6 +1608,17 @@ const char *bdrv_get_device_name(BlockDriverState *bs)
     return bs->device_name;
 }
 
+const char *bdrv_get_filename(BlockDriverState *bs)
+{
+    return bs->filename;
+}
+
+/* return NULL if the image has no backing file */
+BlockDriverState *bdrv_get_backing_hd(BlockDriverState *bs)
+{
+    return bs->backing_hd;
+}
+
 void bdrv_flush(BlockDriverState *bs)
 {
     if (bs->drv->bdrv_flush)
@@ -859,9 +1627,22 @@ void bdrv_flush(BlockDriverState *bs)
         bdrv_flush(bs->backing_hd);
 }
 
+/* the formats may keep modified metadata in memory until they are
+   flushed */
+void bdrv_flush_all(void)
+{
+    BlockDriverState *bs;
+
+    for (bs = bdrv_first; bs != NULL; bs = bs->next) {
+        if (bs->drv)
+            bdrv_flush(bs);
+    }
+}
+
 void bdrv_info(void)
 {
     BlockDriverState *bs;
+    BlockDriverInfo bdi;
 
     for (bs = bdrv_first; bs != NULL; bs = bs->next) {
         term_printf("%s:", bs->device_name);
@@ -892,6 +1673,12 @@ void bdrv_info(void)
             term_printf(" drv=%s", bs->drv->format_name);
             if (bs->encrypted)
                 term_printf(" encrypted");
+            if (bdrv_get_info(bs, &bdi) >= 0 && bdi.l2_cache_size > 0) {
+                term_printf(" l2_cache=%d l2_hits=%" PRId64
+                            " l2_misses=%" PRId64,
+                            bdi.l2_cache_size, bdi.l2_cache_hits,
+                            bdi.l2_cache_misses);
+            }
         } else {
             term_printf(" [not inserted]");
         }
@@ -919,6 +1706,35 @@ int bdrv_write_compressed(BlockDriverState *bs, int64_t sector_num,
         return -ENOTSUP;
     return drv->bdrv_write_compressed(bs, sector_num, buf, nb_sectors);
 }
+
+/* Compress one cluster of 'buf' to 'out_buf', which must have room for
+   one cluster. Return the compressed size, 0 if the cluster must be
+   written uncompressed with bdrv_write() or < 0 if error. Unlike the
+   other functions, it can be called from another thread. */
+int bdrv_compress_cluster(BlockDriverState *bs, uint8_t *out_buf,
+                          const uint8_t *buf)
+{
+    BlockDriver *drv = bs->drv;
+    if (!drv)
+        return -ENOMEDIUM;
+    if (!drv->bdrv_compress_cluster)
+        return -ENOTSUP;
+    return drv->bdrv_compress_cluster(bs, out_buf, buf);
+}
+
+/* write the data returned by bdrv_compress_cluster() */
+int bdrv_write_compressed_data(BlockDriverState *bs, int64_t sector_num,
+                               const uint8_t *out_buf, int out_len)
+{
+    BlockDriver *drv = bs->drv;
+    if (!drv)
+        return -ENOMEDIUM;
+    if (!drv->bdrv_write_compressed_data)
+        return -ENOTSUP;
+    if (bs->read_only)
+        return -EACCES;
+    return drv->bdrv_write_compressed_data(bs, sector_num, out_buf, out_len);
+}
     
 int bdrv_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
 {
@@ -1087,14 +1903,139 @@ BlockDriverAIOCB *bdrv_aio_write(BlockDriverState *bs, int64_t sector_num,
     if (sector_num == 0 && bs->boot_sector_enabled && nb_sectors > 0) {
         memcpy(bs->boot_sector_data, buf, 512);   
     }
+#ifndef QEMU_TOOL
+    if (bs->stream)
+        return bdrv_stream_aio_write(bs, sector_num, buf, NULL, nb_sectors,
+                                     cb, opaque);
+#endif
 
     return drv->bdrv_aio_write(bs, sector_num, buf, nb_sectors, cb, opaque);
 }
 
+/* vectored request of a driver without bdrv_aio_readv/writev */
+typedef struct VectorTranslationState {
+    QEMUIOVector *qiov;
+    uint8_t *bounce;
+    int is_write;
+    int in_submit; /* the emulated AIO may complete during the submission */
+    int completed;
+    BlockDriverCompletionFunc *cb;
+    void *opaque;
+} VectorTranslationState;
+
+static void bdrv_aio_rw_vector_cb(void *opaque, int ret)
+{
+    VectorTranslationState *s = opaque;
+
+    if (!s->is_write && ret == 0)
+        qemu_iovec_from_buffer(s->qiov, s->bounce, s->qiov->size);
+    qemu_free(s->bounce);
+    s->bounce = NULL;
+    s->cb(s->opaque, ret);
+    if (s->in_submit)
+        s->completed = 1;
+    else
+        qemu_free(s);
+}
+
+static BlockDriverAIOCB *bdrv_aio_rw_vector(BlockDriverState *bs,
+                                            int64_t sector_num,
+                                            QEMUIOVector *qiov,
+                                            int nb_sectors,
+                                            BlockDriverCompletionFunc *cb,
+                                            void *opaque, int is_write)
+{
+    VectorTranslationState *s;
+    BlockDriverAIOCB *acb;
+
+    s = qemu_mallocz(sizeof(VectorTranslationState));
+    if (!s)
+        return NULL;
+    s->bounce = qemu_malloc(nb_sectors * 512);
+    if (!s->bounce) {
+        qemu_free(s);
+        return NULL;
+    }
+    s->qiov = qiov;
+    s->is_write = is_write;
+    s->cb = cb;
+    s->opaque = opaque;
+    s->in_submit = 1;
+    if (is_write) {
+        qemu_iovec_to_buffer(qiov, s->bounce);
+        acb = bdrv_aio_write(bs, sector_num, s->bounce, nb_sectors,
+                             bdrv_aio_rw_vector_cb, s);
+    } else {
+        acb = bdrv_aio_read(bs, sector_num, s->bounce, nb_sectors,
+                            bdrv_aio_rw_vector_cb, s);
+    }
+    s->in_submit = 0;
+    if (!acb || s->completed) {
+        qemu_free(s->bounce);
+        qemu_free(s);
+    }
+    return acb;
+}
+
+BlockDriverAIOCB *bdrv_aio_readv(BlockDriverState *bs, int64_t sector_num,
+                                 QEMUIOVector *qiov, int nb_sectors,
+                                 BlockDriverCompletionFunc *cb, void *opaque)
+{
+    BlockDriver *drv = bs->drv;
+
+    if (!drv)
+        return NULL;
+    if (qiov->niov == 1)
+        return bdrv_aio_read(bs, sector_num, qiov->iov[0].iov_base,
+                             nb_sectors, cb, opaque);
+    if (!drv->bdrv_aio_readv ||
+        (sector_num == 0 && bs->boot_sector_enabled))
+        return bdrv_aio_rw_vector(bs, sector_num, qiov, nb_sectors,
+                                  cb, opaque, 0);
+    return drv->bdrv_aio_readv(bs, sector_num, qiov, nb_sectors, cb, opaque);
+}
+
+BlockDriverAIOCB *bdrv_aio_writev(BlockDriverState *bs, int64_t sector_num,
+                                  QEMUIOVector *qiov, int nb_sectors,
+                                  BlockDriverCompletionFunc *cb, void *opaque)
+{
+    BlockDriver *drv = bs->drv;
+
+    if (!drv)
+        return NULL;
+    if (bs->read_only)
+        return NULL;
+    if (qiov->niov == 1)
+        return bdrv_aio_write(bs, sector_num, qiov->iov[0].iov_base,
+                              nb_sectors, cb, opaque);
+    if (!drv->bdrv_aio_writev ||
+        (sector_num == 0 && bs->boot_sector_enabled))
+        return bdrv_aio_rw_vector(bs, sector_num, qiov, nb_sectors,
+                                  cb, opaque, 1);
+#ifndef QEMU_TOOL
+    if (bs->stream)
+        return bdrv_stream_aio_write(bs, sector_num, NULL, qiov, nb_sectors,
+                                     cb, opaque);
+#endif
+    return drv->bdrv_aio_writev(bs, sector_num, qiov, nb_sectors, cb, opaque);
+}
+
 void bdrv_aio_cancel(BlockDriverAIOCB *acb)
 {
     BlockDriver *drv = acb->bs->drv;
+    VectorTranslationState *s;
 
+#ifndef QEMU_TOOL
+    if (acb->bs->stream && bdrv_stream_cancel_write(acb))
+        return;
+#endif
+    if (acb->cb == bdrv_aio_rw_vector_cb) {
+        s = acb->opaque;
+        drv->bdrv_aio_cancel(acb);
+        qemu_free(s->bounce);
+        qemu_free(s);
+        return;
+    }
     drv->bdrv_aio_cancel(acb);
 }
 
@@ -1198,6 +2139,9 @@ static int bdrv_read_em(BlockDriverState *bs, int64_t sector_num,
         qemu_aio_wait_end();
         return -1;
     }
+    /* the request may wait for one submitted before the AIO signal
+       was blocked */
+    qemu_aio_poll();
     while (async_ret == NOT_DONE) {
         qemu_aio_wait();
     }
@@ -1219,6 +2163,9 @@ static int bdrv_write_em(BlockDriverState *bs, int64_t sector_num,
         qemu_aio_wait_end();
         return -1;
     }
+    /* the request may wait for one submitted before the AIO signal
+       was blocked */
+    qemu_aio_poll();
     while (async_ret == NOT_DONE) {
         qemu_aio_wait();
     }
@@ -49,6 +49,13 @@ struct BlockDriver {
         int64_t sector_num, const uint8_t *buf, int nb_sectors,
         BlockDriverCompletionFunc *cb, void *opaque);
     void (*bdrv_aio_cancel)(BlockDriverAIOCB *acb);
+    /* optional: the vectored requests are emulated with a bounce buffer */
+    BlockDriverAIOCB *(*bdrv_aio_readv)(BlockDriverState *bs,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque);
+    BlockDriverAIOCB *(*bdrv_aio_writev)(BlockDriverState *bs,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque);
     int aiocb_size;
 
     const char *protocol_name;
@@ -60,6 +67,11 @@ struct BlockDriver {
     int64_t (*bdrv_getlength)(BlockDriverState *bs);
     int (*bdrv_write_compressed)(BlockDriverState *bs, int64_t sector_num, 
                                  const uint8_t *buf, int nb_sectors);
+    /* optional: compression in another thread than the write */
+    int (*bdrv_compress_cluster)(BlockDriverState *bs, uint8_t *out_buf,
+                                 const uint8_t *buf);
+    int (*bdrv_write_compressed_data)(BlockDriverState *bs, int64_t sector_num,
+                                      const uint8_t *out_buf, int out_len);
 
     int (*bdrv_snapshot_create)(BlockDriverState *bs, 
                                 QEMUSnapshotInfo *sn_info);
@@ -69,6 +81,13 @@ struct BlockDriver {
     int (*bdrv_snapshot_list)(BlockDriverState *bs, 
                               QEMUSnapshotInfo **psn_info);
     int (*bdrv_get_info)(BlockDriverState *bs, BlockDriverInfo *bdi);
+    /* optional: where the data is stored in the image file */
+    int64_t (*bdrv_get_host_offset)(BlockDriverState *bs, int64_t sector_num,
+                                    int nb_sectors, int *pnum);
+    /* only check that the name can be written if 'check_only' */
+    int (*bdrv_change_backing_file)(BlockDriverState *bs,
+                                    const char *backing_file,
+                                    int check_only);
 
     /* removable device specific */
     int (*bdrv_is_inserted)(BlockDriverState *bs);
@@ -104,6 +123,8 @@ struct BlockDriverState {
     int media_changed;
 
     BlockDriverState *backing_hd;
+    /* copy of the backing chain running in the background, if any */
+    struct BlockStreamState *stream;
     /* async read/write emulation */
 
     void *sync_aiocb;
@@ -0,0 +1,269 @@
+/*
+ * Coroutines for the block layer
+ *
+ * Copyright (c) 2026 QEMU contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+/* longjmp() is used to switch between stacks */
+#undef _FORTIFY_SOURCE
+#include "vl.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <setjmp.h>
+#include <ucontext.h>
+#endif
+
+/* A coroutine runs on its own stack until it yields, which returns to
+   the code that entered it. The coroutines are only used by the block
+   layer, which is called with the global lock held, so there is a
+   single current coroutine. */
+
+#define COROUTINE_STACK_SIZE (256 * 1024)
+/* number of terminated coroutines kept for reuse */
+#define COROUTINE_POOL_MAX 16
+
+struct Coroutine {
+    CoroutineEntry *entry;
+    void *opaque;
+    Coroutine *caller;
+    Coroutine *next; /* in the free pool or in a CoMutex queue */
+    int terminated;
+#ifdef _WIN32
+    LPVOID fiber;
+#else
+    sigjmp_buf env;
+    void *stack;
+#endif
+};
+
+/* the context of the code which is not running in a coroutine */
+static Coroutine leader;
+static Coroutine *current = &leader;
+static Coroutine *free_pool;
+static int free_pool_size;
+
+/* Unlike swapcontext(), the switch does not save and restore the
+   signal mask: the coroutines can be entered while the AIO signal is
+   blocked by qemu_aio_wait_start(). */
+static void coroutine_switch(Coroutine *from, Coroutine *to)
+{
+    current = to;
+#ifdef _WIN32
+    SwitchToFiber(to->fiber);
+#else
+    if (!sigsetjmp(from->env, 0))
+        siglongjmp(to->env, 1);
+#endif
+}
+
+#ifdef _WIN32
+static void CALLBACK coroutine_trampoline(void *opaque)
+{
+    Coroutine *co = opaque;
+#else
+static Coroutine *coroutine_starting;
+static sigjmp_buf coroutine_start_env;
+
+static void coroutine_trampoline(void)
+{
+    Coroutine *co = coroutine_starting;
+
+    /* save the initial context and return to coroutine_new() */
+    if (!sigsetjmp(co->env, 0))
+        siglongjmp(coroutine_start_env, 1);
+#endif
+    /* the coroutine is reused after its termination */
+    for(;;) {
+        co->entry(co->opaque);
+        co->terminated = 1;
+        coroutine_switch(co, co->caller);
+    }
+}
+
+static Coroutine *coroutine_new(void)
+{
+    Coroutine *co;
+
+    co = qemu_mallocz(sizeof(Coroutine));
+    if (!co)
+        return NULL;
+#ifdef _WIN32
+    if (!leader.fiber)
+        leader.fiber = ConvertThreadToFiber(NULL);
+    co->fiber = CreateFiber(COROUTINE_STACK_SIZE, coroutine_trampoline, co);
+    if (!co->fiber) {
+        qemu_free(co);
+        return NULL;
+    }
+#else
+    {
+        ucontext_t uc, old_uc;
+
+        co->stack = qemu_malloc(COROUTINE_STACK_SIZE);
+        if (!co->stack) {
+            qemu_free(co);
+            return NULL;
+        }
+        /* makecontext() is only used to start the coroutine on its
+           stack */
+        getcontext(&uc);
+        uc.uc_stack.ss_sp = co->stack;
+        uc.uc_stack.ss_size = COROUTINE_STACK_SIZE;
+        uc.uc_link = NULL;
+        makecontext(&uc, coroutine_trampoline, 0);
+        coroutine_starting = co;
+        if (!sigsetjmp(coroutine_start_env, 0))
+            swapcontext(&old_uc, &uc);
+    }
+#endif
+    return co;
+}
+
+static void coroutine_delete(Coroutine *co)
+{
+    if (free_pool_size < COROUTINE_POOL_MAX) {
+        co->next = free_pool;
+        free_pool = co;
+        free_pool_size++;
+        return;
+    }
+#ifdef _WIN32
+    DeleteFiber(co->fiber);
+#else
+    qemu_free(co->stack);
+#endif
+    qemu_free(co);
+}
+
+/* create a coroutine which runs 'entry(opaque)' when entered. It is
+   deleted when 'entry' returns. Return NULL if no memory. */
+Coroutine *qemu_coroutine_create(CoroutineEntry *entry, void *opaque)
+{
+    Coroutine *co;
+
+    co = free_pool;
+    if (co) {
+        free_pool = co->next;
+        free_pool_size--;
+    } else {
+        co = coroutine_new();
+        if (!co)
+            return NULL;
+    }
+    co->entry = entry;
+    co->opaque = opaque;
+    co->caller = NULL;
+    co->next = NULL;
+    co->terminated = 0;
+    return co;
+}
+
+/* run 'co' until it yields or terminates */
+void qemu_coroutine_enter(Coroutine *co)
+{
+    Coroutine *self = current;
+
+    if (co->caller) {
+        fprintf(stderr, "qemu: coroutine entered recursively\n");
+        abort();
+    }
+    co->caller = self;
+    coroutine_switch(self, co);
+    if (co->terminated)
+        coroutine_delete(co);
+}
+
+/* return to the code which entered the current coroutine */
+void qemu_coroutine_yield(void)
+{
+    Coroutine *self = current;
+    Coroutine *to = self->caller;
+
+    if (!to) {
+        fprintf(stderr, "qemu: yield outside of a coroutine\n");
+        abort();
+    }
+    self->caller = NULL;
+    coroutine_switch(self, to);
+}
+
+/* return NULL outside of a coroutine */
+Coroutine *qemu_coroutine_self(void)
+{
+    if (current == &leader)
+        return NULL;
+    return current;
+}
+
+int qemu_in_coroutine(void)
+{
+    return current != &leader;
+}
+
+void qemu_co_mutex_init(CoMutex *mutex)
+{
+    memset(mutex, 0, sizeof(*mutex));
+    mutex->waiters_tail = &mutex->waiters;
+}
+
+/* Outside of a coroutine, the mutex must be free or already taken
+   outside of a coroutine: the caller must wait for its release. */
+void qemu_co_mutex_lock(CoMutex *mutex)
+{
+    Coroutine *self = qemu_coroutine_self();
+
+    if (mutex->locked == 0) {
+        mutex->owner = self;
+    } else if (mutex->owner != self) {
+        if (!self) {
+            fprintf(stderr, "qemu: CoMutex taken outside of a coroutine\n");
+            abort();
+        }
+        /* wait in FIFO order: the mutex is handed over by the unlock */
+        self->next = NULL;
+        *mutex->waiters_tail = self;
+        mutex->waiters_tail = &self->next;
+        qemu_coroutine_yield();
+        return;
+    }
+    mutex->locked++;
+}
+
+void qemu_co_mutex_unlock(CoMutex *mutex)
+{
+    Coroutine *co;
+
+    if (--mutex->locked > 0)
+        return;
+    co = mutex->waiters;
+    if (!co) {
+        mutex->owner = NULL;
+        return;
+    }
+    mutex->waiters = co->next;
+    if (!mutex->waiters)
+        mutex->waiters_tail = &mutex->waiters;
+    co->next = NULL;
+    mutex->owner = co;
+    mutex->locked = 1;
+    qemu_coroutine_enter(co);
+}
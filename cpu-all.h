@@ -704,7 +704,13 @@ void cpu_dump_statistics (CPUState *env, FILE *f,
 void cpu_abort(CPUState *env, const char *fmt, ...)
     __attribute__ ((__format__ (__printf__, 2, 3)));
 extern CPUState *first_cpu;
-extern CPUState *cpu_single_env;
+/* with CPU threads, cpu_single_env is the CPU of the current thread */
+#if defined(CONFIG_VCPU_THREADS) && !defined(CONFIG_USER_ONLY)
+#define VCPU_TLS __thread
+#else
+#define VCPU_TLS
+#endif
+extern VCPU_TLS CPUState *cpu_single_env;
 extern int code_copy_enabled;
 
 #define CPU_INTERRUPT_EXIT   0x01 /* wants exit from main loop */
@@ -830,6 +836,10 @@ void stq_phys(target_phys_addr_t addr, uint64_t val);
 
 void cpu_physical_memory_write_rom(target_phys_addr_t addr, 
                                    const uint8_t *buf, int len);
+uint8_t *cpu_physical_memory_map(target_phys_addr_t addr,
+                                 target_phys_addr_t *plen, int is_write);
+void cpu_physical_memory_unmap(uint8_t *buffer, target_phys_addr_t len,
+                               int is_write);
 int cpu_memory_rw_debug(CPUState *env, target_ulong addr, 
                         uint8_t *buf, int len, int is_write);
 
@@ -857,6 +867,15 @@ void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t end,
                                      int dirty_flags);
 void cpu_tlb_update_dirty(CPUState *env);
 
+void cpu_exec_init_all(unsigned long tb_size, int tb_regions);
+/* number of lookups after which a TB is retranslated as a superblock
+   (0 = disabled) */
+extern int tb_hot_threshold;
+#if defined(CONFIG_USER_ONLY)
+void tb_cache_load(const char *filename);
+void tb_cache_save(void);
+#endif
+
 void dump_exec_info(FILE *f,
                     int (*cpu_fprintf)(FILE *f, const char *fmt, ...));
 
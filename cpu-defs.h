@@ -93,9 +93,16 @@ typedef unsigned long ram_addr_t;
 #define TB_JMP_ADDR_MASK (TB_JMP_PAGE_SIZE - 1)
 #define TB_JMP_PAGE_MASK (TB_JMP_CACHE_SIZE - TB_JMP_PAGE_SIZE)
 
+/* the TLB size can be set with the configure --tlb-bits option */
+#ifndef CPU_TLB_BITS
 #define CPU_TLB_BITS 8
+#endif
 #define CPU_TLB_SIZE (1 << CPU_TLB_BITS)
 
+/* fully associative victim TLB holding the entries recently evicted
+   from the direct mapped TLB */
+#define CPU_VTLB_SIZE 8
+
 typedef struct CPUTLBEntry {
     /* bit 31 to TARGET_PAGE_BITS : virtual address 
        bit TARGET_PAGE_BITS-1..IO_MEM_SHIFT : if non zero, memory io
@@ -106,10 +113,26 @@ typedef struct CPUTLBEntry {
     target_ulong addr_read; 
     target_ulong addr_write; 
     target_ulong addr_code; 
+    /* value of tlb_gen when the entry was filled. tlb_flush() bumps
+       tlb_gen so that all the older entries become invalid */
+    uint32_t gen;
     /* addend to virtual address to get physical address */
     target_phys_addr_t addend; 
+#if defined(__i386__) && TARGET_LONG_BITS == 32 && TARGET_PHYS_ADDR_BITS == 32
+    /* the i386 host softmmu fast path assumes 32 byte entries */
+    uint32_t dummy[3];
+#endif
 } CPUTLBEntry;
 
+/* large page mapping found by the last guest page table walk. It is
+   used to refill the TLB without walking the page tables again */
+typedef struct CPUTLBLargePage {
+    target_ulong vaddr;
+    target_ulong mask; /* page size - 1, or 0 if no large page */
+    target_phys_addr_t paddr;
+    int prot;
+} CPUTLBLargePage;
+
 /* Alpha has 4 different running levels */
 #if defined(TARGET_ALPHA)
 #define NB_MMU_MODES 4
@@ -129,9 +152,18 @@ typedef struct CPUTLBEntry {
                                    written */                           \
     target_ulong mem_write_vaddr; /* target virtual addr at which the   \
                                      memory was written */              \
+    uint32_t tlb_gen; /* current TLB generation */                      \
     /* 0 = kernel, 1 = user */                                          \
     CPUTLBEntry tlb_table[NB_MMU_MODES][CPU_TLB_SIZE];                  \
+    CPUTLBEntry tlb_v_table[NB_MMU_MODES][CPU_VTLB_SIZE];               \
+    int vtlb_index[NB_MMU_MODES]; /* next victim entry to replace */    \
+    CPUTLBLargePage tlb_large_page[NB_MMU_MODES];                       \
+    /* virtual area covered by the large pages since the last flush */  \
+    target_ulong tlb_flush_addr;                                        \
+    target_ulong tlb_flush_mask;                                        \
     struct TranslationBlock *tb_jmp_cache[TB_JMP_CACHE_SIZE];           \
+    /* TLB generation at which each tb_jmp_cache entry was set */       \
+    uint32_t tb_jmp_cache_gen[TB_JMP_CACHE_SIZE];                       \
                                                                         \
     /* from this point: preserved by CPU reset */                       \
     /* ice debug support */                                             \
@@ -148,6 +180,9 @@ typedef struct CPUTLBEntry {
                                                                         \
     void *next_cpu; /* next CPU sharing TB cache */                     \
     int cpu_index; /* CPU index (informative) */                        \
+    /* state of the host thread running the CPU (see vl.c) */           \
+    int thread_running; /* the thread is inside cpu_exec() */           \
+    int thread_halted; /* the thread waits for cpu_interrupt() */       \
     /* user data */                                                     \
     void *opaque;
 
@@ -48,6 +48,18 @@ void cpu_loop_exit(void)
     longjmp(env->jmp_env, 1);
 }
 
+#if !defined(CONFIG_USER_ONLY)
+/* with CPU threads, the translated code cannot be recycled while the
+   other CPUs may execute it: leave cpu_exec() so that the CPU thread
+   recycles it after stopping them (see vl.c) */
+static void tb_request_recycle(void)
+{
+    tb_recycle_requested = 1;
+    env->exception_index = EXCP_INTERRUPT;
+    cpu_loop_exit();
+}
+#endif
+
 #if !(defined(TARGET_SPARC) || defined(TARGET_SH4) || defined(TARGET_M68K))
 #define reg_T2
 #endif
@@ -85,7 +97,7 @@ static TranslationBlock *tb_find_slow(target_ulong pc,
     target_ulong phys_pc, phys_page1, phys_page2, virt_page2;
     uint8_t *tc_ptr;
     
-    spin_lock(&tb_lock);
+    tb_lock_acquire();
 
     tb_invalidated_flag = 0;
     
@@ -119,7 +131,17 @@ static TranslationBlock *tb_find_slow(target_ulong pc,
         ptb1 = &tb->phys_hash_next;
     }
  not_found:
+#if defined(CONFIG_USER_ONLY)
+    /* use the translation saved by a previous run if any */
+    tb = tb_cache_find(pc, cs_base, flags);
+    if (tb)
+        goto found;
+#endif
     /* if no translated code available, then translate it now */
+#if !defined(CONFIG_USER_ONLY)
+    if (vcpu_threads && tb_alloc_full())
+        tb_request_recycle();
+#endif
     tb = tb_alloc(pc);
     if (!tb) {
         /* flush must be done */
@@ -146,8 +168,10 @@ static TranslationBlock *tb_find_slow(target_ulong pc,
     
  found:
     /* we add the TB in the virtual pc hash table */
-    env->tb_jmp_cache[tb_jmp_cache_hash_func(pc)] = tb;
-    spin_unlock(&tb_lock);
+    h = tb_jmp_cache_hash_func(pc);
+    env->tb_jmp_cache[h] = tb;
+    env->tb_jmp_cache_gen[h] = env->tlb_gen;
+    tb_lock_release();
     return tb;
 }
 
@@ -155,7 +179,7 @@ static inline TranslationBlock *tb_find_fast(void)
 {
     TranslationBlock *tb;
     target_ulong cs_base, pc;
-    unsigned int flags;
+    unsigned int flags, h;
 
     /* we record a subset of the CPU state. It will
        always be the same before a given translated block
@@ -212,8 +236,10 @@ static inline TranslationBlock *tb_find_fast(void)
 #else
 #error unsupported CPU
 #endif
-    tb = env->tb_jmp_cache[tb_jmp_cache_hash_func(pc)];
-    if (__builtin_expect(!tb || tb->pc != pc || tb->cs_base != cs_base ||
+    h = tb_jmp_cache_hash_func(pc);
+    tb = env->tb_jmp_cache[h];
+    if (__builtin_expect(!tb || env->tb_jmp_cache_gen[h] != env->tlb_gen ||
+                         tb->pc != pc || tb->cs_base != cs_base ||
                          tb->flags != flags, 0)) {
         tb = tb_find_slow(pc, cs_base, flags);
         /* Note: we do it here to avoid a gcc bug on Mac OS X when
@@ -225,6 +251,26 @@ static inline TranslationBlock *tb_find_fast(void)
             T0 = 0;
         }
     }
+#if defined(TARGET_HAS_SUPERBLOCKS)
+    /* retranslate the hot TBs ending with a direct jump as superblocks */
+    if (__builtin_expect(tb->exec_count < tb_hot_threshold, 1)) {
+        tb->exec_count++;
+    } else if ((tb->cflags & (CF_SB_JUMP | CF_SUPERBLOCK)) == CF_SB_JUMP &&
+               tb_hot_threshold > 0) {
+        tb_lock_acquire();
+#if !defined(CONFIG_USER_ONLY)
+        if (vcpu_threads && tb_alloc_full())
+            tb_request_recycle();
+#endif
+        tb = tb_gen_superblock(env, tb);
+        h = tb_jmp_cache_hash_func(pc);
+        env->tb_jmp_cache[h] = tb;
+        env->tb_jmp_cache_gen[h] = env->tlb_gen;
+        tb_lock_release();
+        /* the previous TB may have been invalidated */
+        T0 = 0;
+    }
+#endif
     return tb;
 }
 
@@ -375,14 +421,14 @@ int cpu_exec(CPUState *env1)
                 interrupt_request = env->interrupt_request;
                 if (__builtin_expect(interrupt_request, 0)) {
                     if (interrupt_request & CPU_INTERRUPT_DEBUG) {
-                        env->interrupt_request &= ~CPU_INTERRUPT_DEBUG;
+                        cpu_reset_interrupt(env, CPU_INTERRUPT_DEBUG);
                         env->exception_index = EXCP_DEBUG;
                         cpu_loop_exit();
                     }
 #if defined(TARGET_ARM) || defined(TARGET_SPARC) || defined(TARGET_MIPS) || \
     defined(TARGET_PPC) || defined(TARGET_ALPHA)
                     if (interrupt_request & CPU_INTERRUPT_HALT) {
-                        env->interrupt_request &= ~CPU_INTERRUPT_HALT;
+                        cpu_reset_interrupt(env, CPU_INTERRUPT_HALT);
                         env->halted = 1;
                         env->exception_index = EXCP_HLT;
                         cpu_loop_exit();
@@ -391,7 +437,7 @@ int cpu_exec(CPUState *env1)
 #if defined(TARGET_I386)
                     if ((interrupt_request & CPU_INTERRUPT_SMI) &&
                         !(env->hflags & HF_SMM_MASK)) {
-                        env->interrupt_request &= ~CPU_INTERRUPT_SMI;
+                        cpu_reset_interrupt(env, CPU_INTERRUPT_SMI);
                         do_smm_enter();
 #if defined(__sparc__) && !defined(HOST_SOLARIS)
                         tmp_T0 = 0;
@@ -402,8 +448,14 @@ int cpu_exec(CPUState *env1)
                         (env->eflags & IF_MASK) && 
                         !(env->hflags & HF_INHIBIT_IRQ_MASK)) {
                         int intno;
-                        env->interrupt_request &= ~CPU_INTERRUPT_HARD;
+                        cpu_reset_interrupt(env, CPU_INTERRUPT_HARD);
+#if !defined(CONFIG_USER_ONLY)
+                        qemu_global_lock();
+                        intno = cpu_get_pic_interrupt(env);
+                        qemu_global_unlock();
+#else
                         intno = cpu_get_pic_interrupt(env);
+#endif
                         if (loglevel & CPU_LOG_TB_IN_ASM) {
                             fprintf(logfile, "Servicing hardware INT=0x%02x\n", intno);
                         }
@@ -425,7 +477,7 @@ int cpu_exec(CPUState *env1)
                     if (interrupt_request & CPU_INTERRUPT_HARD) {
                         ppc_hw_interrupt(env);
                         if (env->pending_interrupts == 0)
-                            env->interrupt_request &= ~CPU_INTERRUPT_HARD;
+                            cpu_reset_interrupt(env, CPU_INTERRUPT_HARD);
 #if defined(__sparc__) && !defined(HOST_SOLARIS)
                         tmp_T0 = 0;
 #else
@@ -458,7 +510,7 @@ int cpu_exec(CPUState *env1)
 			if (((type == TT_EXTINT) &&
 			     (pil == 15 || pil > env->psrpil)) ||
 			    type != TT_EXTINT) {
-			    env->interrupt_request &= ~CPU_INTERRUPT_HARD;
+			    cpu_reset_interrupt(env, CPU_INTERRUPT_HARD);
 			    do_interrupt(env->interrupt_index);
 			    env->interrupt_index = 0;
 #if defined(__sparc__) && !defined(HOST_SOLARIS)
@@ -469,7 +521,7 @@ int cpu_exec(CPUState *env1)
 			}
 		    } else if (interrupt_request & CPU_INTERRUPT_TIMER) {
 			//do_interrupt(0, 0, 0, 0, 0);
-			env->interrupt_request &= ~CPU_INTERRUPT_TIMER;
+			cpu_reset_interrupt(env, CPU_INTERRUPT_TIMER);
 		    }
 #elif defined(TARGET_ARM)
                     if (interrupt_request & CPU_INTERRUPT_FIQ
@@ -504,7 +556,7 @@ int cpu_exec(CPUState *env1)
                    /* Don't use the cached interupt_request value,
                       do_interrupt may have updated the EXITTB flag. */
                     if (env->interrupt_request & CPU_INTERRUPT_EXITTB) {
-                        env->interrupt_request &= ~CPU_INTERRUPT_EXITTB;
+                        cpu_reset_interrupt(env, CPU_INTERRUPT_EXITTB);
                         /* ensure that no TB jump will be modified as
                            the program flow was changed */
 #if defined(__sparc__) && !defined(HOST_SOLARIS)
@@ -514,7 +566,7 @@ int cpu_exec(CPUState *env1)
 #endif
                     }
                     if (interrupt_request & CPU_INTERRUPT_EXIT) {
-                        env->interrupt_request &= ~CPU_INTERRUPT_EXIT;
+                        cpu_reset_interrupt(env, CPU_INTERRUPT_EXIT);
                         env->exception_index = EXCP_INTERRUPT;
                         cpu_loop_exit();
                     }
@@ -572,19 +624,30 @@ int cpu_exec(CPUState *env1)
                         (env->kqemu_enabled != 2) &&
 #endif
                         tb->page_addr[1] == -1
+#if defined(TARGET_HAS_SUPERBLOCKS)
+                        /* do not chain the TBs which may become
+                           superblocks before they are hot, so that
+                           their lookups are counted */
+                        && ((tb->cflags & (CF_SB_JUMP | CF_SUPERBLOCK)) !=
+                            CF_SB_JUMP || tb_hot_threshold == 0)
+#endif
 #if defined(TARGET_I386) && defined(USE_CODE_COPY)
                     && (tb->cflags & CF_CODE_COPY) == 
                     (((TranslationBlock *)(T0 & ~3))->cflags & CF_CODE_COPY)
 #endif
                     ) {
-                    spin_lock(&tb_lock);
-                    tb_add_jump((TranslationBlock *)(long)(T0 & ~3), T0 & 3, tb);
+                    tb_lock_acquire();
+                    /* another CPU thread may have invalidated the
+                       TBs meanwhile */
+                    if (!((((TranslationBlock *)(long)(T0 & ~3))->cflags | 
+                           tb->cflags) & CF_INVALIDATED))
+                        tb_add_jump((TranslationBlock *)(long)(T0 & ~3), T0 & 3, tb);
 #if defined(USE_CODE_COPY)
                     /* propagates the FP use info */
                     ((TranslationBlock *)(T0 & ~3))->cflags |= 
                         (tb->cflags & CF_FP_USED);
 #endif
-                    spin_unlock(&tb_lock);
+                    tb_lock_release();
                 }
                 }
                 tc_ptr = tb->tc_ptr;
@@ -713,6 +776,13 @@ int cpu_exec(CPUState *env1)
             } /* for(;;) */
         } else {
             env_to_regs();
+            /* the exception may have been raised while translating
+               code or inside a LOCK prefixed instruction */
+            tb_lock_reset();
+#if defined(TARGET_I386)
+            if (env->lock_held)
+                cpu_unlock();
+#endif
         }
     } /* for(;;) */
 
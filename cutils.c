@@ -81,3 +81,75 @@ int stristart(const char *str, const char *val, const char **ptr)
         *ptr = p;
     return 1;
 }
+
+void qemu_iovec_init(QEMUIOVector *qiov, int alloc_hint)
+{
+    qiov->iov = qemu_malloc(alloc_hint * sizeof(struct iovec));
+    qiov->niov = 0;
+    qiov->nalloc = qiov->iov ? alloc_hint : 0;
+    qiov->size = 0;
+}
+
+/* a zeroed QEMUIOVector is a valid empty list. Return -1 if there is
+   not enough memory: the list is not changed then. */
+int qemu_iovec_add(QEMUIOVector *qiov, void *base, size_t len)
+{
+    struct iovec *iov;
+
+    if (qiov->niov == qiov->nalloc) {
+        iov = qemu_malloc((2 * qiov->nalloc + 1) * sizeof(struct iovec));
+        if (!iov)
+            return -1;
+        memcpy(iov, qiov->iov, qiov->niov * sizeof(struct iovec));
+        qemu_free(qiov->iov);
+        qiov->iov = iov;
+        qiov->nalloc = 2 * qiov->nalloc + 1;
+    }
+    qiov->iov[qiov->niov].iov_base = base;
+    qiov->iov[qiov->niov].iov_len = len;
+    qiov->niov++;
+    qiov->size += len;
+    return 0;
+}
+
+void qemu_iovec_reset(QEMUIOVector *qiov)
+{
+    qiov->niov = 0;
+    qiov->size = 0;
+}
+
+void qemu_iovec_destroy(QEMUIOVector *qiov)
+{
+    qemu_free(qiov->iov);
+    qiov->iov = NULL;
+    qiov->niov = 0;
+    qiov->nalloc = 0;
+    qiov->size = 0;
+}
+
+void qemu_iovec_to_buffer(QEMUIOVector *qiov, void *buf)
+{
+    uint8_t *p = buf;
+    int i;
+
+    for(i = 0; i < qiov->niov; i++) {
+        memcpy(p, qiov->iov[i].iov_base, qiov->iov[i].iov_len);
+        p += qiov->iov[i].iov_len;
+    }
+}
+
+void qemu_iovec_from_buffer(QEMUIOVector *qiov, const void *buf, size_t count)
+{
+    const uint8_t *p = buf;
+    size_t l;
+    int i;
+
+    for(i = 0; i < qiov->niov && count > 0; i++) {
+        l = qiov->iov[i].iov_len;
+        if (l > count)
+            l = count;
+        memcpy(qiov->iov[i].iov_base, p, l);
+        p += l;
+        count -= l;
+    }
+}
@@ -2844,7 +2844,7 @@ fprintf(outfile,
 #ifdef HOST_IA64
     fprintf(outfile,
 	    "    {\n"
-	    "      extern char code_gen_buffer[];\n"
+	    "      extern char *code_gen_buffer;\n"
 	    "      ia64_apply_fixes(&gen_code_ptr, ltoff_fixes, "
 	    "(uint64_t) code_gen_buffer + 2*(1<<20), plt_fixes,\n\t\t\t"
 	    "sizeof(plt_target)/sizeof(plt_target[0]),\n\t\t\t"
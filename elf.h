@@ -1108,6 +1108,9 @@ typedef struct elf64_shdr {
 #define NT_TASKSTRUCT	4
 #define NT_PRXFPREG     0x46e62b7f      /* copied from gdb5.1/include/elf/common.h */
 
+/* Notes used in PT_NOTE segments of the "GNU" owner */
+#define NT_GNU_BUILD_ID	3
+
 
 /* Note header in a PT_NOTE section */
 typedef struct elf32_note {
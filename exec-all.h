@@ -102,6 +102,9 @@ void tb_invalidate_phys_page_range(target_ulong start, target_ulong end,
 void tb_invalidate_page_range(target_ulong start, target_ulong end);
 void tlb_flush_page(CPUState *env, target_ulong addr);
 void tlb_flush(CPUState *env, int flush_global);
+void tlb_set_large_page(CPUState *env, target_ulong vaddr,
+                        target_phys_addr_t paddr, target_ulong size,
+                        int prot, int is_user);
 int tlb_set_page_exec(CPUState *env, target_ulong vaddr, 
                       target_phys_addr_t paddr, int prot, 
                       int is_user, int is_softmmu);
@@ -120,7 +123,8 @@ static inline int tlb_set_page(CPUState *env, target_ulong vaddr,
 #define CODE_GEN_PHYS_HASH_BITS     15
 #define CODE_GEN_PHYS_HASH_SIZE     (1 << CODE_GEN_PHYS_HASH_BITS)
 
-/* maximum total translate dcode allocated */
+/* default size of the translated code buffer. It can be changed at
+   startup with cpu_exec_init_all() (-tb-size option). */
 
 /* NOTE: the translated code area cannot be too big because on some
    archs the range of "fast" function calls is limited. Here is a
@@ -134,16 +138,31 @@ static inline int tlb_set_page(CPUState *env, target_ulong vaddr,
 */
 
 #if defined(__alpha__)
-#define CODE_GEN_BUFFER_SIZE     (2 * 1024 * 1024)
+#define DEFAULT_CODE_GEN_BUFFER_SIZE (2 * 1024 * 1024)
+#define MAX_CODE_GEN_BUFFER_SIZE     DEFAULT_CODE_GEN_BUFFER_SIZE
 #elif defined(__ia64)
-#define CODE_GEN_BUFFER_SIZE     (4 * 1024 * 1024)	/* range of addl */
+#define DEFAULT_CODE_GEN_BUFFER_SIZE (4 * 1024 * 1024)	/* range of addl */
+#define MAX_CODE_GEN_BUFFER_SIZE     DEFAULT_CODE_GEN_BUFFER_SIZE
 #elif defined(__powerpc__)
-#define CODE_GEN_BUFFER_SIZE     (6 * 1024 * 1024)
+#define DEFAULT_CODE_GEN_BUFFER_SIZE (6 * 1024 * 1024)
+#define MAX_CODE_GEN_BUFFER_SIZE     DEFAULT_CODE_GEN_BUFFER_SIZE
+#elif defined(__arm__)
+#define DEFAULT_CODE_GEN_BUFFER_SIZE (16 * 1024 * 1024)
+#define MAX_CODE_GEN_BUFFER_SIZE     (32 * 1024 * 1024)
+#elif defined(__x86_64__)
+#define DEFAULT_CODE_GEN_BUFFER_SIZE (16 * 1024 * 1024)
+/* the buffer must stay in the low 2GB (MAP_32BIT) */
+#define MAX_CODE_GEN_BUFFER_SIZE     (800 * 1024 * 1024)
 #else
-#define CODE_GEN_BUFFER_SIZE     (16 * 1024 * 1024)
+#define DEFAULT_CODE_GEN_BUFFER_SIZE (16 * 1024 * 1024)
 #endif
 
-//#define CODE_GEN_BUFFER_SIZE     (128 * 1024)
+#define MIN_CODE_GEN_BUFFER_SIZE     (1024 * 1024)
+
+/* the translated code buffer can be split in regions which are
+   recycled in FIFO order instead of flushing the whole buffer */
+#define MAX_CODE_GEN_REGIONS         64
+#define MIN_CODE_GEN_REGION_SIZE     (4 * CODE_GEN_MAX_SIZE)
 
 /* estimated block size for TB allocation */
 /* XXX: use a per code average code fragment size and modulate it
@@ -154,8 +173,6 @@ static inline int tlb_set_page(CPUState *env, target_ulong vaddr,
 #define CODE_GEN_AVG_BLOCK_SIZE 64
 #endif
 
-#define CODE_GEN_MAX_BLOCKS    (CODE_GEN_BUFFER_SIZE / CODE_GEN_AVG_BLOCK_SIZE)
-
 #if defined(__powerpc__) 
 #define USE_DIRECT_JUMP
 #endif
@@ -174,6 +191,10 @@ typedef struct TranslationBlock {
 #define CF_TB_FP_USED  0x0002 /* fp ops are used in the TB */
 #define CF_FP_USED     0x0004 /* fp ops are used in the TB or in a chained TB */
 #define CF_SINGLE_INSN 0x0008 /* compile only a single instruction */
+#define CF_INVALIDATED 0x0010 /* TB was removed from the lookup tables */
+#define CF_CACHE_PENDING 0x0020 /* TB loaded from the TB cache, not linked yet */
+#define CF_SUPERBLOCK  0x0040 /* translation continues across direct jumps */
+#define CF_SB_JUMP     0x0080 /* TB ends with a jump a superblock can follow */
 
     uint8_t *tc_ptr;    /* pointer to the translated code */
     /* next matching tb for physical address. */
@@ -197,6 +218,8 @@ typedef struct TranslationBlock {
        jmp_first */
     struct TranslationBlock *jmp_next[2]; 
     struct TranslationBlock *jmp_first;
+    /* number of lookups by cpu_exec(), used to find hot TBs */
+    uint32_t exec_count;
 } TranslationBlock;
 
 static inline unsigned int tb_jmp_cache_hash_page(target_ulong pc)
@@ -221,14 +244,25 @@ static inline unsigned int tb_phys_hash_func(unsigned long pc)
 
 TranslationBlock *tb_alloc(target_ulong pc);
 void tb_flush(CPUState *env);
+#if defined(TARGET_HAS_SUPERBLOCKS)
+TranslationBlock *tb_gen_superblock(CPUState *env, TranslationBlock *tb);
+#endif
 void tb_link_phys(TranslationBlock *tb, 
                   target_ulong phys_pc, target_ulong phys_page2);
 
 extern TranslationBlock *tb_phys_hash[CODE_GEN_PHYS_HASH_SIZE];
 
-extern uint8_t code_gen_buffer[CODE_GEN_BUFFER_SIZE];
+extern uint8_t *code_gen_buffer;
+extern unsigned long code_gen_buffer_size;
 extern uint8_t *code_gen_ptr;
 
+void cpu_flush_icache_range(unsigned long start, unsigned long stop);
+
+#if defined(CONFIG_USER_ONLY)
+TranslationBlock *tb_cache_find(target_ulong pc, target_ulong cs_base,
+                                unsigned int flags);
+#endif
+
 #if defined(USE_DIRECT_JUMP)
 
 #if defined(__powerpc__)
@@ -491,6 +525,13 @@ static inline int testandset (int *p)
 #error unimplemented CPU support
 #endif
 
+#if defined(__GNUC__) && \
+    (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 1))
+#define smp_mb() __sync_synchronize()
+#else
+#define smp_mb() asm volatile("" : : : "memory")
+#endif
+
 typedef int spinlock_t;
 
 #define SPIN_LOCK_UNLOCKED 0
@@ -511,28 +552,81 @@ static inline int spin_trylock(spinlock_t *lock)
     return !testandset(lock);
 }
 #else
+/* nonzero if each CPU runs in its own host thread (see vl.c). The
+   locks are only needed in that case. */
+extern int vcpu_threads;
+
 static inline void spin_lock(spinlock_t *lock)
 {
+    if (vcpu_threads) {
+        while (testandset(lock));
+    }
 }
 
 static inline void spin_unlock(spinlock_t *lock)
 {
+    if (vcpu_threads) {
+        smp_mb();
+        *(volatile spinlock_t *)lock = 0;
+    }
 }
 
 static inline int spin_trylock(spinlock_t *lock)
 {
-    return 1;
+    return !vcpu_threads || !testandset(lock);
 }
 #endif
 
 extern spinlock_t tb_lock;
 
+#if defined(CONFIG_USER_ONLY)
+#define tb_lock_acquire() spin_lock(&tb_lock)
+#define tb_lock_release() spin_unlock(&tb_lock)
+#define tb_lock_reset() do { } while (0)
+#else
+/* tb_lock may be taken recursively by a CPU thread, and is released
+   when an exception longjmps back to cpu_exec() */
+extern VCPU_TLS int tb_lock_count;
+
+static inline void tb_lock_acquire(void)
+{
+    if (tb_lock_count++ == 0)
+        spin_lock(&tb_lock);
+}
+
+static inline void tb_lock_release(void)
+{
+    if (--tb_lock_count == 0)
+        spin_unlock(&tb_lock);
+}
+
+static inline void tb_lock_reset(void)
+{
+    if (tb_lock_count != 0) {
+        tb_lock_count = 0;
+        spin_unlock(&tb_lock);
+    }
+}
+#endif
+
 extern int tb_invalidated_flag;
+extern int tb_recycle_requested;
+
+int tb_alloc_full(void);
+void tb_alloc_recycle(CPUState *env);
 
 #if !defined(CONFIG_USER_ONLY)
 
 void tlb_fill(target_ulong addr, int is_write, int is_user, 
               void *retaddr);
+int tlb_fill_fast(CPUState *env, target_ulong addr, int is_write,
+                  int is_user);
+
+/* lock protecting the device emulation when the CPUs run in their own
+   threads. It must not be taken while holding tb_lock. */
+void qemu_global_lock(void);
+void qemu_global_unlock(void);
+void qemu_cpu_kick(CPUState *env);
 
 #define ACCESS_TYPE 3
 #define MEMSUFFIX _code
@@ -590,7 +684,9 @@ static inline target_ulong get_phys_addr_code(CPUState *env, target_ulong addr)
 #error unimplemented CPU
 #endif
     if (__builtin_expect(env->tlb_table[is_user][index].addr_code != 
-                         (addr & TARGET_PAGE_MASK), 0)) {
+                         (addr & TARGET_PAGE_MASK) ||
+                         env->tlb_table[is_user][index].gen != env->tlb_gen,
+                         0)) {
         ldub_code(addr);
     }
     pd = env->tlb_table[is_user][index].addr_code & ~TARGET_PAGE_MASK;
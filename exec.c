@@ -23,6 +23,8 @@
 #else
 #include <sys/types.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 #endif
 #include <stdlib.h>
 #include <stdio.h>
@@ -55,9 +57,6 @@
 #undef DEBUG_TB_CHECK
 #endif
 
-/* threshold to flush the translated code buffer */
-#define CODE_GEN_BUFFER_MAX_SIZE (CODE_GEN_BUFFER_SIZE - CODE_GEN_MAX_SIZE)
-
 #define SMC_BITMAP_USE_THRESHOLD 10
 
 #define MMAP_AREA_START        0x00000000
@@ -77,15 +76,58 @@
 #define TARGET_PHYS_ADDR_SPACE_BITS 32
 #endif
 
-TranslationBlock tbs[CODE_GEN_MAX_BLOCKS];
+TranslationBlock *tbs;
+static int code_gen_max_blocks;
 TranslationBlock *tb_phys_hash[CODE_GEN_PHYS_HASH_SIZE];
 int nb_tbs;
 /* any access to the tbs or the page table must use this lock */
 spinlock_t tb_lock = SPIN_LOCK_UNLOCKED;
+#if !defined(CONFIG_USER_ONLY)
+VCPU_TLS int tb_lock_count;
+int vcpu_threads;
+#endif
+/* set by a CPU thread which needs the translated code to be recycled
+   while the other CPU threads are stopped */
+int tb_recycle_requested;
 
-uint8_t code_gen_buffer[CODE_GEN_BUFFER_SIZE] __attribute__((aligned (32)));
+#if defined(CONFIG_USER_ONLY)
+/* Currently it is not recommended to allocate big chunks of data in
+   user mode because they may collide with the guest mappings. The
+   fixed addresses also allow the translated code to be saved in the
+   TB cache. */
+#define USE_STATIC_CODE_GEN_BUFFER
+static uint8_t static_code_gen_buffer[DEFAULT_CODE_GEN_BUFFER_SIZE]
+    __attribute__((aligned (32)));
+static TranslationBlock static_tbs[DEFAULT_CODE_GEN_BUFFER_SIZE /
+                                   CODE_GEN_AVG_BLOCK_SIZE];
+#endif
+
+uint8_t *code_gen_buffer;
+unsigned long code_gen_buffer_size;
+/* threshold to flush the translated code buffer */
+static unsigned long code_gen_buffer_max_size;
 uint8_t *code_gen_ptr;
 
+/* The code buffer and the TB array are split in 'code_gen_nb_regions'
+   equal parts. TBs are allocated in the current region; when it is
+   full, the oldest region is evicted and becomes the current one. With
+   a single region, the whole buffer is flushed instead. */
+typedef struct CodeGenRegion {
+    uint8_t *start;     /* start of the generated code */
+    uint8_t *end;       /* end of the generated code (only valid if
+                           not the current region) */
+    int first_tb;       /* index of the first TB in tbs[] */
+    int nb_tbs;
+} CodeGenRegion;
+
+static CodeGenRegion code_gen_regions[MAX_CODE_GEN_REGIONS];
+static int code_gen_nb_regions;
+static int code_gen_cur_region;
+static unsigned long code_gen_region_max_size;
+static int code_gen_region_max_blocks;
+
+int tb_hot_threshold;
+
 int phys_ram_size;
 int phys_ram_fd;
 uint8_t *phys_ram_base;
@@ -95,7 +137,7 @@ static ram_addr_t phys_ram_alloc_offset = 0;
 CPUState *first_cpu;
 /* current CPU in the current thread. It is only valid inside
    cpu_exec() */
-CPUState *cpu_single_env; 
+VCPU_TLS CPUState *cpu_single_env; 
 
 typedef struct PageDesc {
     /* list of TBs intersecting this ram page */
@@ -155,7 +197,13 @@ int loglevel;
 
 /* statistics */
 static int tlb_flush_count;
+static int tlb_full_flush_count;
+static int tlb_miss_count;
+static int tlb_victim_hit_count;
+static int tlb_large_page_fill_count;
 static int tb_flush_count;
+static int tb_evict_count;
+static int tb_superblock_count;
 static int tb_phys_invalidate_count;
 
 #define SUBPAGE_IDX(addr) ((addr) & ~TARGET_PAGE_MASK)
@@ -166,6 +214,29 @@ typedef struct subpage_t {
     void *opaque[TARGET_PAGE_SIZE];
 } subpage_t;
 
+#if defined(USE_STATIC_CODE_GEN_BUFFER) || !defined(__linux__)
+static void map_exec(void *addr, long size)
+{
+#ifdef _WIN32
+    DWORD old_protect;
+    VirtualProtect(addr, size,
+                   PAGE_EXECUTE_READWRITE, &old_protect);
+#else
+    unsigned long start, end;
+
+    start = (unsigned long)addr;
+    start &= ~(qemu_real_host_page_size - 1);
+
+    end = (unsigned long)addr + size;
+    end += qemu_real_host_page_size - 1;
+    end &= ~(qemu_real_host_page_size - 1);
+
+    mprotect((void *)start, end - start,
+             PROT_READ | PROT_WRITE | PROT_EXEC);
+#endif
+}
+#endif
+
 static void page_init(void)
 {
     /* NOTE: we can always suppose that qemu_host_page_size >=
@@ -173,31 +244,13 @@ static void page_init(void)
 #ifdef _WIN32
     {
         SYSTEM_INFO system_info;
-        DWORD old_protect;
-        
+
         GetSystemInfo(&system_info);
         qemu_real_host_page_size = system_info.dwPageSize;
-        
-        VirtualProtect(code_gen_buffer, sizeof(code_gen_buffer),
-                       PAGE_EXECUTE_READWRITE, &old_protect);
     }
 #else
     qemu_real_host_page_size = getpagesize();
-    {
-        unsigned long start, end;
-
-        start = (unsigned long)code_gen_buffer;
-        start &= ~(qemu_real_host_page_size - 1);
-        
-        end = (unsigned long)code_gen_buffer + sizeof(code_gen_buffer);
-        end += qemu_real_host_page_size - 1;
-        end &= ~(qemu_real_host_page_size - 1);
-        
-        mprotect((void *)start, end - start, 
-                 PROT_READ | PROT_WRITE | PROT_EXEC);
-    }
 #endif
-
     if (qemu_host_page_size == 0)
         qemu_host_page_size = qemu_real_host_page_size;
     if (qemu_host_page_size < TARGET_PAGE_SIZE)
@@ -281,18 +334,131 @@ static inline PhysPageDesc *phys_page_find(target_phys_addr_t index)
 static void tlb_protect_code(ram_addr_t ram_addr);
 static void tlb_unprotect_code_phys(CPUState *env, ram_addr_t ram_addr, 
                                     target_ulong vaddr);
+#else
+static void tb_cache_reset(void);
 #endif
 
+/* allocate the translated code buffer. 'tb_size' is in bytes, 0
+   selects the default size for the host. */
+static void code_gen_alloc(unsigned long tb_size)
+{
+#ifdef USE_STATIC_CODE_GEN_BUFFER
+    code_gen_buffer = static_code_gen_buffer;
+    code_gen_buffer_size = DEFAULT_CODE_GEN_BUFFER_SIZE;
+    map_exec(code_gen_buffer, code_gen_buffer_size);
+#else
+    code_gen_buffer_size = tb_size;
+    if (code_gen_buffer_size == 0)
+        code_gen_buffer_size = DEFAULT_CODE_GEN_BUFFER_SIZE;
+    if (code_gen_buffer_size < MIN_CODE_GEN_BUFFER_SIZE)
+        code_gen_buffer_size = MIN_CODE_GEN_BUFFER_SIZE;
+#ifdef MAX_CODE_GEN_BUFFER_SIZE
+    /* the generated code must be able to call the helpers directly */
+    if (code_gen_buffer_size > MAX_CODE_GEN_BUFFER_SIZE)
+        code_gen_buffer_size = MAX_CODE_GEN_BUFFER_SIZE;
+#endif
+#if defined(__linux__)
+    {
+        int flags;
+
+        flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#if defined(__x86_64__)
+        flags |= MAP_32BIT;
+#endif
+        code_gen_buffer = mmap(NULL, code_gen_buffer_size,
+                               PROT_WRITE | PROT_READ | PROT_EXEC,
+                               flags, -1, 0);
+        if (code_gen_buffer == MAP_FAILED) {
+            fprintf(stderr, "Could not allocate dynamic translator buffer\n");
+            exit(1);
+        }
+    }
+#else
+    code_gen_buffer = qemu_vmalloc(code_gen_buffer_size);
+    if (!code_gen_buffer) {
+        fprintf(stderr, "Could not allocate dynamic translator buffer\n");
+        exit(1);
+    }
+    map_exec(code_gen_buffer, code_gen_buffer_size);
+#endif
+#endif /* !USE_STATIC_CODE_GEN_BUFFER */
+    code_gen_buffer_max_size = code_gen_buffer_size - CODE_GEN_MAX_SIZE;
+    code_gen_max_blocks = code_gen_buffer_size / CODE_GEN_AVG_BLOCK_SIZE;
+#ifdef USE_STATIC_CODE_GEN_BUFFER
+    tbs = static_tbs;
+#elif defined(__linux__) && defined(__x86_64__)
+    /* the 32 bit targets chain the blocks with a TB pointer passed in
+       T0, so the TBs must be below 4 GB like the code */
+    tbs = mmap(NULL, code_gen_max_blocks * sizeof(TranslationBlock),
+               PROT_WRITE | PROT_READ,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT, -1, 0);
+    if (tbs == MAP_FAILED) {
+        fprintf(stderr, "Could not allocate translation blocks\n");
+        exit(1);
+    }
+#else
+    tbs = qemu_malloc(code_gen_max_blocks * sizeof(TranslationBlock));
+    if (!tbs) {
+        fprintf(stderr, "Could not allocate translation blocks\n");
+        exit(1);
+    }
+#endif
+}
+
+static void code_gen_regions_init(int nb_regions)
+{
+    unsigned long region_size;
+    int i;
+
+    if (nb_regions < 1)
+        nb_regions = 1;
+    if (nb_regions > MAX_CODE_GEN_REGIONS)
+        nb_regions = MAX_CODE_GEN_REGIONS;
+    while (nb_regions > 1 &&
+           code_gen_buffer_size / nb_regions < MIN_CODE_GEN_REGION_SIZE)
+        nb_regions--;
+    code_gen_nb_regions = nb_regions;
+
+    if (nb_regions == 1) {
+        region_size = code_gen_buffer_size;
+        code_gen_region_max_size = code_gen_buffer_max_size;
+        code_gen_region_max_blocks = code_gen_max_blocks;
+    } else {
+        region_size = (code_gen_buffer_size / nb_regions) &
+            ~(CODE_GEN_ALIGN - 1);
+        code_gen_region_max_size = region_size - CODE_GEN_MAX_SIZE;
+        code_gen_region_max_blocks = code_gen_max_blocks / nb_regions;
+    }
+    for(i = 0; i < nb_regions; i++) {
+        code_gen_regions[i].start = code_gen_buffer + i * region_size;
+        code_gen_regions[i].end = code_gen_regions[i].start;
+        code_gen_regions[i].first_tb = i * code_gen_region_max_blocks;
+        code_gen_regions[i].nb_tbs = 0;
+    }
+    code_gen_cur_region = 0;
+}
+
+/* must be called before using any CPU. If it is not called
+   explicitly, the first cpu_exec_init() uses the default buffer
+   size. */
+void cpu_exec_init_all(unsigned long tb_size, int tb_regions)
+{
+    if (code_gen_ptr)
+        return;
+    page_init();
+    code_gen_alloc(tb_size);
+    code_gen_regions_init(tb_regions);
+    code_gen_ptr = code_gen_buffer;
+    io_mem_init();
+}
+
 void cpu_exec_init(CPUState *env)
 {
     CPUState **penv;
     int cpu_index;
 
-    if (!code_gen_ptr) {
-        code_gen_ptr = code_gen_buffer;
-        page_init();
-        io_mem_init();
-    }
+    if (!code_gen_ptr)
+        cpu_exec_init_all(0, 1);
     env->next_cpu = NULL;
     penv = &first_cpu;
     cpu_index = 0;
@@ -332,18 +498,42 @@ static void page_flush_tb(void)
     }
 }
 
+/* return the size of the generated code currently in use */
+static unsigned long code_gen_used_size(void)
+{
+    CodeGenRegion *r;
+    unsigned long size;
+    int i;
+
+    size = 0;
+    for(i = 0; i < code_gen_nb_regions; i++) {
+        r = &code_gen_regions[i];
+        if (i == code_gen_cur_region)
+            size += code_gen_ptr - r->start;
+        else
+            size += r->end - r->start;
+    }
+    return size;
+}
+
 /* flush all the translation blocks */
 /* XXX: tb_flush is currently not thread safe */
 void tb_flush(CPUState *env1)
 {
     CPUState *env;
+    int i;
 #if defined(DEBUG_FLUSH)
-    printf("qemu: flush code_size=%d nb_tbs=%d avg_tb_size=%d\n", 
-           code_gen_ptr - code_gen_buffer, 
+    printf("qemu: flush code_size=%ld nb_tbs=%d avg_tb_size=%ld\n", 
+           code_gen_used_size(), 
            nb_tbs, 
-           nb_tbs > 0 ? (code_gen_ptr - code_gen_buffer) / nb_tbs : 0);
+           nb_tbs > 0 ? code_gen_used_size() / nb_tbs : 0);
 #endif
     nb_tbs = 0;
+    for(i = 0; i < code_gen_nb_regions; i++) {
+        code_gen_regions[i].end = code_gen_regions[i].start;
+        code_gen_regions[i].nb_tbs = 0;
+    }
+    code_gen_cur_region = 0;
     
     for(env = first_cpu; env != NULL; env = env->next_cpu) {
         memset (env->tb_jmp_cache, 0, TB_JMP_CACHE_SIZE * sizeof (void *));
@@ -356,6 +546,9 @@ void tb_flush(CPUState *env1)
     /* XXX: flush processor icache at this point if cache flush is
        expensive */
     tb_flush_count++;
+#if defined(CONFIG_USER_ONLY)
+    tb_cache_reset();
+#endif
 }
 
 #ifdef DEBUG_TB_CHECK
@@ -535,6 +728,7 @@ static inline void tb_phys_invalidate(TranslationBlock *tb, unsigned int page_ad
         tb1 = tb2;
     }
     tb->jmp_first = (TranslationBlock *)((long)tb | 2); /* fail safe */
+    tb->cflags |= CF_INVALIDATED;
 
     tb_phys_invalidate_count++;
 }
@@ -597,11 +791,11 @@ static void build_page_bitmap(PageDesc *p)
     }
 }
 
-#ifdef TARGET_HAS_PRECISE_SMC
+#if defined(TARGET_HAS_PRECISE_SMC) || defined(TARGET_HAS_SUPERBLOCKS)
 
-static void tb_gen_code(CPUState *env, 
-                        target_ulong pc, target_ulong cs_base, int flags,
-                        int cflags)
+static TranslationBlock *tb_gen_code(CPUState *env, 
+                                     target_ulong pc, target_ulong cs_base,
+                                     int flags, int cflags)
 {
     TranslationBlock *tb;
     uint8_t *tc_ptr;
@@ -631,6 +825,26 @@ static void tb_gen_code(CPUState *env,
         phys_page2 = get_phys_addr_code(env, virt_page2);
     }
     tb_link_phys(tb, phys_pc, phys_page2);
+    return tb;
+}
+#endif
+
+#if defined(TARGET_HAS_SUPERBLOCKS)
+/* Retranslate the hot TB 'tb' so that the translation continues across
+   its direct jumps. 'tb' is invalidated, so the caller must not chain
+   a previous TB to it. */
+TranslationBlock *tb_gen_superblock(CPUState *env, TranslationBlock *tb)
+{
+    target_ulong pc, cs_base;
+    int flags, cflags;
+
+    pc = tb->pc;
+    cs_base = tb->cs_base;
+    flags = tb->flags;
+    cflags = (tb->cflags & ~(CF_INVALIDATED | CF_SB_JUMP)) | CF_SUPERBLOCK;
+    tb_phys_invalidate(tb, -1);
+    tb_superblock_count++;
+    return tb_gen_code(env, pc, cs_base, flags, cflags);
 }
 #endif
     
@@ -652,6 +866,7 @@ void tb_invalidate_phys_page_range(target_ulong start, target_ulong end,
     p = page_find(start >> TARGET_PAGE_BITS);
     if (!p) 
         return;
+    tb_lock_acquire();
     if (!p->code_bitmap && 
         ++p->code_write_count >= SMC_BITMAP_USE_THRESHOLD &&
         is_cpu_write_access) {
@@ -742,13 +957,18 @@ void tb_invalidate_phys_page_range(target_ulong start, target_ulong end,
     if (current_tb_modified) {
         /* we generate a block containing just the instruction
            modifying the memory. It will ensure that it cannot modify
-           itself */
+           itself. With CPU threads, a full code buffer is recycled
+           by tb_find_slow() instead. */
         env->current_tb = NULL;
-        tb_gen_code(env, current_pc, current_cs_base, current_flags, 
-                    CF_SINGLE_INSN);
+#if !defined(CONFIG_USER_ONLY)
+        if (!vcpu_threads || !tb_alloc_full())
+#endif
+            tb_gen_code(env, current_pc, current_cs_base, current_flags, 
+                        CF_SINGLE_INSN);
         cpu_resume_from_signal(env, NULL);
     }
 #endif
+    tb_lock_release();
 }
 
 /* len must be <= 8 and start must be a multiple of len */
@@ -769,6 +989,7 @@ static inline void tb_invalidate_phys_page_fast(target_ulong start, int len)
     p = page_find(start >> TARGET_PAGE_BITS);
     if (!p) 
         return;
+    tb_lock_acquire();
     if (p->code_bitmap) {
         offset = start & ~TARGET_PAGE_MASK;
         b = p->code_bitmap[offset >> 3] >> (offset & 7);
@@ -778,6 +999,7 @@ static inline void tb_invalidate_phys_page_fast(target_ulong start, int len)
     do_invalidate:
         tb_invalidate_phys_page_range(start, start + len, 1);
     }
+    tb_lock_release();
 }
 
 #if !defined(CONFIG_SOFTMMU)
@@ -904,18 +1126,87 @@ static inline void tb_alloc_page(TranslationBlock *tb,
 #endif /* TARGET_HAS_SMC */
 }
 
-/* Allocate a new translation block. Flush the translation buffer if
-   too many translation blocks or too much generated code. */
+/* invalidate all the TBs of a code region so that its code buffer
+   can be reused. The jumps from other regions to these TBs are
+   reset. */
+static void tb_evict_region(CodeGenRegion *r)
+{
+    TranslationBlock *tb;
+    int i;
+
+#if defined(DEBUG_FLUSH)
+    printf("qemu: evict region %d code_size=%ld nb_tbs=%d\n",
+           (int)(r - code_gen_regions), (long)(r->end - r->start),
+           r->nb_tbs);
+#endif
+    for(i = 0; i < r->nb_tbs; i++) {
+        tb = &tbs[r->first_tb + i];
+        if (!(tb->cflags & CF_INVALIDATED))
+            tb_phys_invalidate(tb, -1);
+    }
+    nb_tbs -= r->nb_tbs;
+    r->nb_tbs = 0;
+    r->end = r->start;
+    tb_evict_count++;
+}
+
+/* return TRUE if the current code region is full, i.e. if tb_alloc()
+   must evict or flush translated code */
+int tb_alloc_full(void)
+{
+    CodeGenRegion *r;
+
+    r = &code_gen_regions[code_gen_cur_region];
+    return r->nb_tbs >= code_gen_region_max_blocks || 
+        (code_gen_ptr - r->start) >= code_gen_region_max_size;
+}
+
+/* switch to the oldest region after evicting it */
+static void tb_next_region(void)
+{
+    CodeGenRegion *r;
+
+    r = &code_gen_regions[code_gen_cur_region];
+    r->end = code_gen_ptr;
+    code_gen_cur_region++;
+    if (code_gen_cur_region >= code_gen_nb_regions)
+        code_gen_cur_region = 0;
+    r = &code_gen_regions[code_gen_cur_region];
+    if (r->nb_tbs > 0)
+        tb_evict_region(r);
+    code_gen_ptr = r->start;
+}
+
+/* make room for new translation blocks as tb_alloc() would do. With
+   CPU threads, it must be called while the other CPUs are stopped as
+   they may execute the recycled code. */
+void tb_alloc_recycle(CPUState *env)
+{
+    if (code_gen_nb_regions <= 1)
+        tb_flush(env);
+    else
+        tb_next_region();
+}
+
+/* Allocate a new translation block. If too many translation blocks
+   or too much generated code, switch to the oldest region after
+   evicting it. Return NULL if the translation buffer must be flushed. */
 TranslationBlock *tb_alloc(target_ulong pc)
 {
     TranslationBlock *tb;
+    CodeGenRegion *r;
 
-    if (nb_tbs >= CODE_GEN_MAX_BLOCKS || 
-        (code_gen_ptr - code_gen_buffer) >= CODE_GEN_BUFFER_MAX_SIZE)
-        return NULL;
-    tb = &tbs[nb_tbs++];
+    if (tb_alloc_full()) {
+        if (code_gen_nb_regions <= 1)
+            return NULL;
+        tb_next_region();
+    }
+    r = &code_gen_regions[code_gen_cur_region];
+    tb = &tbs[r->first_tb + r->nb_tbs++];
+    nb_tbs++;
     tb->pc = pc;
     tb->cflags = 0;
+    tb->exec_count = 0;
     return tb;
 }
 
@@ -962,20 +1253,33 @@ void tb_link_phys(TranslationBlock *tb,
 
 /* find the TB 'tb' such that tb[0].tc_ptr <= tc_ptr <
    tb[1].tc_ptr. Return NULL if not found */
-TranslationBlock *tb_find_pc(unsigned long tc_ptr)
+static TranslationBlock *tb_find_pc1(unsigned long tc_ptr)
 {
-    int m_min, m_max, m;
-    unsigned long v;
+    int m_min, m_max, m, i;
+    unsigned long v, end;
     TranslationBlock *tb;
+    CodeGenRegion *r;
 
     if (nb_tbs <= 0)
         return NULL;
-    if (tc_ptr < (unsigned long)code_gen_buffer ||
-        tc_ptr >= (unsigned long)code_gen_ptr)
+    /* find the region containing tc_ptr. The TBs of a region are
+       sorted by tc_ptr */
+    for(i = code_gen_nb_regions - 1; i >= 0; i--) {
+        if (tc_ptr >= (unsigned long)code_gen_regions[i].start)
+            break;
+    }
+    if (i < 0)
+        return NULL;
+    r = &code_gen_regions[i];
+    if (i == code_gen_cur_region)
+        end = (unsigned long)code_gen_ptr;
+    else
+        end = (unsigned long)r->end;
+    if (r->nb_tbs <= 0 || tc_ptr >= end)
         return NULL;
     /* binary search (cf Knuth) */
-    m_min = 0;
-    m_max = nb_tbs - 1;
+    m_min = r->first_tb;
+    m_max = r->first_tb + r->nb_tbs - 1;
     while (m_min <= m_max) {
         m = (m_min + m_max) >> 1;
         tb = &tbs[m];
@@ -991,6 +1295,21 @@ TranslationBlock *tb_find_pc(unsigned long tc_ptr)
     return &tbs[m_max];
 }
 
+TranslationBlock *tb_find_pc(unsigned long tc_ptr)
+{
+#if !defined(CONFIG_USER_ONLY)
+    TranslationBlock *tb;
+
+    /* another CPU thread may be adding TBs */
+    tb_lock_acquire();
+    tb = tb_find_pc1(tc_ptr);
+    tb_lock_release();
+    return tb;
+#else
+    return tb_find_pc1(tc_ptr);
+#endif
+}
+
 static void tb_reset_jump_recursive(TranslationBlock *tb);
 
 static inline void tb_reset_jump_recursive2(TranslationBlock *tb, int n)
@@ -1188,7 +1507,29 @@ void cpu_interrupt(CPUState *env, int mask)
     TranslationBlock *tb;
     static int interrupt_lock;
 
+#if defined(CONFIG_VCPU_THREADS) && !defined(CONFIG_USER_ONLY)
+    if (vcpu_threads) {
+        /* the CPU thread clears its own bits concurrently */
+        __sync_fetch_and_or(&env->interrupt_request, mask);
+    } else
+#endif
     env->interrupt_request |= mask;
+#if !defined(CONFIG_USER_ONLY)
+    if (vcpu_threads) {
+        /* the CPU may run in another thread: the unlinking must not
+           race with its TB chaining, and a halted CPU must be woken
+           up. The caller must hold the global lock. */
+        tb_lock_acquire();
+        tb = env->current_tb;
+        if (tb) {
+            env->current_tb = NULL;
+            tb_reset_jump_recursive(tb);
+        }
+        tb_lock_release();
+        qemu_cpu_kick(env);
+        return;
+    }
+#endif
     /* if the cpu is currently executing code, we must unlink it and
        all the potentially executing TB */
     tb = env->current_tb;
@@ -1201,6 +1542,12 @@ void cpu_interrupt(CPUState *env, int mask)
 
 void cpu_reset_interrupt(CPUState *env, int mask)
 {
+#if defined(CONFIG_VCPU_THREADS) && !defined(CONFIG_USER_ONLY)
+    if (vcpu_threads) {
+        __sync_fetch_and_and(&env->interrupt_request, ~mask);
+        return;
+    }
+#endif
     env->interrupt_request &= ~mask;
 }
 
@@ -1311,8 +1658,6 @@ CPUState *cpu_copy(CPUState *env)
    implemented yet) */
 void tlb_flush(CPUState *env, int flush_global)
 {
-    int i;
-
 #if defined(DEBUG_TLB)
     printf("tlb_flush:\n");
 #endif
@@ -1320,26 +1665,20 @@ void tlb_flush(CPUState *env, int flush_global)
        links while we are modifying them */
     env->current_tb = NULL;
 
-    for(i = 0; i < CPU_TLB_SIZE; i++) {
-        env->tlb_table[0][i].addr_read = -1;
-        env->tlb_table[0][i].addr_write = -1;
-        env->tlb_table[0][i].addr_code = -1;
-        env->tlb_table[1][i].addr_read = -1;
-        env->tlb_table[1][i].addr_write = -1;
-        env->tlb_table[1][i].addr_code = -1;
-#if (NB_MMU_MODES >= 3)
-        env->tlb_table[2][i].addr_read = -1;
-        env->tlb_table[2][i].addr_write = -1;
-        env->tlb_table[2][i].addr_code = -1;
-#if (NB_MMU_MODES == 4)
-        env->tlb_table[3][i].addr_read = -1;
-        env->tlb_table[3][i].addr_write = -1;
-        env->tlb_table[3][i].addr_code = -1;
-#endif
-#endif
+    /* the TLB and tb_jmp_cache entries tagged with an older
+       generation are ignored, so we only need to really clear them
+       when the generation counter wraps */
+    env->tlb_gen++;
+    if (env->tlb_gen == 0) {
+        memset (env->tlb_table, -1, sizeof(env->tlb_table));
+        memset (env->tlb_v_table, -1, sizeof(env->tlb_v_table));
+        memset (env->tb_jmp_cache, 0, TB_JMP_CACHE_SIZE * sizeof (void *));
+        env->tlb_gen = 1;
+        tlb_full_flush_count++;
     }
-
-    memset (env->tb_jmp_cache, 0, TB_JMP_CACHE_SIZE * sizeof (void *));
+    memset (env->tlb_large_page, 0, sizeof(env->tlb_large_page));
+    env->tlb_flush_addr = -1;
+    env->tlb_flush_mask = 0;
 
 #if !defined(CONFIG_SOFTMMU)
     munmap((void *)MMAP_AREA_START, MMAP_AREA_END - MMAP_AREA_START);
@@ -1366,6 +1705,16 @@ static inline void tlb_flush_entry(CPUTLBEntry *tlb_entry, target_ulong addr)
     }
 }
 
+/* remove the victim TLB entries of virtual page 'addr' */
+static inline void tlb_flush_vtlb_page(CPUState *env, int is_user,
+                                       target_ulong addr)
+{
+    int i;
+
+    for(i = 0; i < CPU_VTLB_SIZE; i++)
+        tlb_flush_entry(&env->tlb_v_table[is_user][i], addr);
+}
+
 void tlb_flush_page(CPUState *env, target_ulong addr)
 {
     int i;
@@ -1374,6 +1723,16 @@ void tlb_flush_page(CPUState *env, target_ulong addr)
 #if defined(DEBUG_TLB)
     printf("tlb_flush_page: " TARGET_FMT_lx "\n", addr);
 #endif
+    /* an invalidation inside a large page must flush all the TARGET_PAGE_SIZE
+       entries mapping it */
+    if ((addr & env->tlb_flush_mask) == env->tlb_flush_addr) {
+#if defined(DEBUG_TLB)
+        printf("tlb_flush_page: forced full flush (" TARGET_FMT_lx "/" TARGET_FMT_lx ")\n",
+               env->tlb_flush_addr, env->tlb_flush_mask);
+#endif
+        tlb_flush(env, 1);
+        return;
+    }
     /* must reset current TB so that interrupts cannot modify the
        links while we are modifying them */
     env->current_tb = NULL;
@@ -1388,6 +1747,8 @@ void tlb_flush_page(CPUState *env, target_ulong addr)
     tlb_flush_entry(&env->tlb_table[3][i], addr);
 #endif
 #endif
+    for(i = 0; i < NB_MMU_MODES; i++)
+        tlb_flush_vtlb_page(env, i, addr);
 
     /* Discard jump cache entries for any tb which might potentially
        overlap the flushed page.  */
@@ -1437,12 +1798,36 @@ static inline void tlb_reset_dirty_range(CPUTLBEntry *tlb_entry,
     }
 }
 
+/* flush the TLB of a CPU which may be running in another thread, so
+   that it sees the dirty flags as they are now. The entries cannot be
+   modified in place as the CPU may be refilling them, so its TLB
+   generation is atomically incremented. As the CPU reads the
+   generation before the dirty flags when it fills an entry (see
+   tlb_set_page_exec), an entry filled with older dirty flags is
+   invalid. Return FALSE if the generation would wrap, which only the
+   CPU itself may handle. */
+static int tlb_flush_remote(CPUState *env)
+{
+#if defined(CONFIG_VCPU_THREADS) && !defined(CONFIG_USER_ONLY)
+    uint32_t gen;
+
+    do {
+        gen = env->tlb_gen;
+        if (gen + 1 == 0)
+            return 0;
+    } while (!__sync_bool_compare_and_swap(&env->tlb_gen, gen, gen + 1));
+    return 1;
+#else
+    return 0;
+#endif
+}
+
 void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t end,
                                      int dirty_flags)
 {
     CPUState *env;
     unsigned long length, start1;
-    int i, mask, len;
+    int i, j, mask, len;
     uint8_t *p;
 
     start &= TARGET_PAGE_MASK;
@@ -1472,7 +1857,12 @@ void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t end,
     /* we modify the TLB cache so that the dirty bit will be set again
        when accessing the range */
     start1 = start + (unsigned long)phys_ram_base;
+    if (vcpu_threads)
+        smp_mb();
     for(env = first_cpu; env != NULL; env = env->next_cpu) {
+        if (vcpu_threads && env != cpu_single_env &&
+            tlb_flush_remote(env))
+            continue;
         for(i = 0; i < CPU_TLB_SIZE; i++)
             tlb_reset_dirty_range(&env->tlb_table[0][i], start1, length);
         for(i = 0; i < CPU_TLB_SIZE; i++)
@@ -1485,6 +1875,10 @@ void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t end,
             tlb_reset_dirty_range(&env->tlb_table[3][i], start1, length);
 #endif
 #endif
+        for(j = 0; j < NB_MMU_MODES; j++)
+            for(i = 0; i < CPU_VTLB_SIZE; i++)
+                tlb_reset_dirty_range(&env->tlb_v_table[j][i],
+                                      start1, length);
     }
 
 #if !defined(CONFIG_SOFTMMU)
@@ -1532,7 +1926,7 @@ static inline void tlb_update_dirty(CPUTLBEntry *tlb_entry)
 /* update the TLB according to the current state of the dirty bits */
 void cpu_tlb_update_dirty(CPUState *env)
 {
-    int i;
+    int i, j;
     for(i = 0; i < CPU_TLB_SIZE; i++)
         tlb_update_dirty(&env->tlb_table[0][i]);
     for(i = 0; i < CPU_TLB_SIZE; i++)
@@ -1545,6 +1939,9 @@ void cpu_tlb_update_dirty(CPUState *env)
         tlb_update_dirty(&env->tlb_table[3][i]);
 #endif
 #endif
+    for(j = 0; j < NB_MMU_MODES; j++)
+        for(i = 0; i < CPU_VTLB_SIZE; i++)
+            tlb_update_dirty(&env->tlb_v_table[j][i]);
 }
 
 static inline void tlb_set_dirty1(CPUTLBEntry *tlb_entry, 
@@ -1564,7 +1961,7 @@ static inline void tlb_set_dirty1(CPUTLBEntry *tlb_entry,
 static inline void tlb_set_dirty(CPUState *env,
                                  unsigned long addr, target_ulong vaddr)
 {
-    int i;
+    int i, j;
 
     addr &= TARGET_PAGE_MASK;
     i = (vaddr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
@@ -1576,6 +1973,123 @@ static inline void tlb_set_dirty(CPUState *env,
     tlb_set_dirty1(&env->tlb_table[3][i], addr);
 #endif
 #endif
+    for(j = 0; j < NB_MMU_MODES; j++)
+        for(i = 0; i < CPU_VTLB_SIZE; i++)
+            tlb_set_dirty1(&env->tlb_v_table[j][i], addr);
+}
+
+/* move the entry which is about to be replaced by virtual page
+   'vaddr' to the victim TLB. At most one entry for a given virtual
+   address is kept in both TLBs. */
+static inline void tlb_add_victim(CPUState *env, int is_user,
+                                  CPUTLBEntry *te, target_ulong vaddr)
+{
+    int i;
+
+    tlb_flush_vtlb_page(env, is_user, vaddr);
+    tlb_flush_entry(te, vaddr);
+    if (te->gen != env->tlb_gen ||
+        (te->addr_read == -1 && te->addr_write == -1 &&
+         te->addr_code == -1))
+        return;
+    i = env->vtlb_index[is_user];
+    env->tlb_v_table[is_user][i] = *te;
+    env->vtlb_index[is_user] = (i + 1) & (CPU_VTLB_SIZE - 1);
+}
+
+/* if the page is in the victim TLB, swap it with the direct mapped
+   entry and return 1 */
+static inline int tlb_victim_lookup(CPUState *env, target_ulong addr,
+                                    int is_write, int is_user)
+{
+    CPUTLBEntry *te, *vte, tmp;
+    target_ulong tlb_addr, page;
+    int i, index;
+
+    page = addr & TARGET_PAGE_MASK;
+    for(i = 0; i < CPU_VTLB_SIZE; i++) {
+        vte = &env->tlb_v_table[is_user][i];
+        if (is_write == 0)
+            tlb_addr = vte->addr_read;
+        else if (is_write == 1)
+            tlb_addr = vte->addr_write;
+        else
+            tlb_addr = vte->addr_code;
+        if (page == (tlb_addr & (TARGET_PAGE_MASK | TLB_INVALID_MASK)) &&
+            vte->gen == env->tlb_gen) {
+            index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+            te = &env->tlb_table[is_user][index];
+            tmp = *te;
+            *te = *vte;
+            *vte = tmp;
+            tlb_victim_hit_count++;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* if the page is covered by the last large page mapping found for
+   this MMU mode, set its TLB entry and return 1 */
+static inline int tlb_large_page_fill(CPUState *env, target_ulong addr,
+                                      int is_write, int is_user)
+{
+    CPUTLBLargePage *lp;
+    static const int access_prot[3] = { PAGE_READ, PAGE_WRITE, PAGE_EXEC };
+
+    lp = &env->tlb_large_page[is_user];
+    if (lp->mask == 0 || ((addr ^ lp->vaddr) & ~lp->mask) != 0 ||
+        !(lp->prot & access_prot[is_write]))
+        return 0;
+    tlb_set_page_exec(env, addr & TARGET_PAGE_MASK,
+                      lp->paddr + (addr & lp->mask & TARGET_PAGE_MASK),
+                      lp->prot, is_user, 1);
+    tlb_large_page_fill_count++;
+    return 1;
+}
+
+/* called by the softmmu slow path when the direct mapped TLB
+   misses. Return 1 if the entry could be set without calling
+   tlb_fill(), i.e. without walking the guest page tables. */
+int tlb_fill_fast(CPUState *env, target_ulong addr, int is_write,
+                  int is_user)
+{
+    tlb_miss_count++;
+    if (tlb_victim_lookup(env, addr, is_write, is_user))
+        return 1;
+    return tlb_large_page_fill(env, addr, is_write, is_user);
+}
+
+/* Record a mapping of 'size' bytes (a power of two larger than
+   TARGET_PAGE_SIZE) found by the target MMU code. The TLB still
+   holds TARGET_PAGE_SIZE entries: the mapping is used to refill them
+   and tlb_flush_page() flushes the whole TLB if an address inside
+   one of the large pages is invalidated. */
+void tlb_set_large_page(CPUState *env, target_ulong vaddr,
+                        target_phys_addr_t paddr, target_ulong size,
+                        int prot, int is_user)
+{
+    CPUTLBLargePage *lp;
+    target_ulong mask;
+
+    mask = ~(size - 1);
+    lp = &env->tlb_large_page[is_user];
+    lp->vaddr = vaddr & mask;
+    lp->mask = size - 1;
+    lp->paddr = paddr & mask;
+    lp->prot = prot;
+
+    /* extend the flushed area so that it covers all the large pages */
+    if (env->tlb_flush_addr == (target_ulong)-1) {
+        env->tlb_flush_addr = vaddr & mask;
+        env->tlb_flush_mask = mask;
+        return;
+    }
+    mask &= env->tlb_flush_mask;
+    while (((env->tlb_flush_addr ^ vaddr) & mask) != 0)
+        mask <<= 1;
+    env->tlb_flush_addr &= mask;
+    env->tlb_flush_mask = mask;
 }
 
 /* add a new TLB entry. At most one entry for a given virtual address
@@ -1640,6 +2154,12 @@ int tlb_set_page_exec(CPUState *env, target_ulong vaddr,
         index = (vaddr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
         addend -= vaddr;
         te = &env->tlb_table[is_user][index];
+        tlb_add_victim(env, is_user, te, vaddr);
+        te->gen = env->tlb_gen;
+        /* the dirty flags must be read after the generation (see
+           tlb_flush_remote) */
+        if (vcpu_threads)
+            smp_mb();
         te->addend = addend;
         if (prot & PAGE_READ) {
             te->addr_read = address;
@@ -1905,6 +2425,248 @@ void page_unprotect_range(target_ulong data, target_ulong data_size)
     }
 }
 
+/* TB cache: the translated code and the TBs are saved to a file when
+   the program exits and reloaded at the same host addresses on the
+   next run of the same program. A reloaded TB is only linked when it
+   is looked up and the guest code it was generated from is
+   unchanged. */
+
+#define TB_CACHE_MAGIC   0x51544243 /* "QTBC" */
+#define TB_CACHE_VERSION 1
+
+typedef struct TBCacheHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t tb_size;           /* sizeof(TranslationBlock) */
+    uint32_t nb_tbs;
+    /* identity of the qemu executable which generated the code */
+    uint64_t exe_size;
+    uint64_t exe_mtime;
+    uint64_t exe_ino;
+    uint64_t code_gen_buffer;   /* host address of code_gen_buffer */
+    uint64_t tbs;               /* host address of tbs */
+    uint64_t code_size;
+} TBCacheHeader;
+
+typedef struct TBCacheEntry {
+    uint32_t valid;
+    uint32_t pad;
+    uint64_t code_hash;         /* hash of the guest code */
+    TranslationBlock tb;
+} TBCacheEntry;
+
+static char *tb_cache_filename;
+/* TBs loaded from the cache and not yet linked, chained with
+   phys_hash_next */
+static TranslationBlock **tb_cache_hash;
+static uint64_t *tb_cache_code_hash;
+
+static uint64_t tb_cache_hash_code(target_ulong pc, int size)
+{
+    const uint8_t *p;
+    uint64_t h;
+    int i;
+
+    /* FNV-1a */
+    p = g2h(pc);
+    h = 0xcbf29ce484222325ULL;
+    for(i = 0; i < size; i++) {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static int tb_cache_code_valid(target_ulong pc, int size)
+{
+    if (!(page_get_flags(pc) & PAGE_VALID) ||
+        !(page_get_flags(pc + size - 1) & PAGE_VALID))
+        return 0;
+    return 1;
+}
+
+static int tb_cache_exe_info(TBCacheHeader *h)
+{
+    struct stat st;
+
+    if (stat("/proc/self/exe", &st) < 0)
+        return -1;
+    h->exe_size = st.st_size;
+    h->exe_mtime = st.st_mtime;
+    h->exe_ino = st.st_ino;
+    return 0;
+}
+
+static void tb_cache_reset(void)
+{
+    if (tb_cache_hash)
+        memset(tb_cache_hash, 0, CODE_GEN_PHYS_HASH_SIZE * sizeof(void *));
+}
+
+/* Load the TB cache 'filename'. It is also the file where the cache
+   is saved at exit. Must be called before any code is translated. */
+void tb_cache_load(const char *filename)
+{
+    TBCacheHeader h, cur;
+    TBCacheEntry e;
+    TranslationBlock *tb;
+    unsigned int hidx;
+    int fd, i;
+
+    if (!code_gen_ptr)
+        cpu_exec_init_all(0, 1);
+    if (nb_tbs != 0 || code_gen_nb_regions != 1)
+        return;
+    tb_cache_filename = strdup(filename);
+    tb_cache_hash = qemu_mallocz(CODE_GEN_PHYS_HASH_SIZE * sizeof(void *));
+    tb_cache_code_hash = qemu_mallocz(code_gen_max_blocks * sizeof(uint64_t));
+    if (!tb_cache_filename || !tb_cache_hash || !tb_cache_code_hash) {
+        tb_cache_filename = NULL;
+        return;
+    }
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return;
+    memset(&cur, 0, sizeof(cur));
+    if (tb_cache_exe_info(&cur) < 0)
+        goto fail;
+    if (read(fd, &h, sizeof(h)) != sizeof(h) ||
+        h.magic != TB_CACHE_MAGIC ||
+        h.version != TB_CACHE_VERSION ||
+        h.tb_size != sizeof(TranslationBlock) ||
+        h.exe_size != cur.exe_size ||
+        h.exe_mtime != cur.exe_mtime ||
+        h.exe_ino != cur.exe_ino ||
+        h.code_gen_buffer != (unsigned long)code_gen_buffer ||
+        h.tbs != (unsigned long)tbs ||
+        h.nb_tbs > code_gen_max_blocks ||
+        h.code_size > code_gen_buffer_max_size)
+        goto fail;
+    if (read(fd, code_gen_buffer, h.code_size) != h.code_size)
+        goto fail;
+    for(i = 0; i < h.nb_tbs; i++) {
+        if (read(fd, &e, sizeof(e)) != sizeof(e))
+            goto fail;
+        tb = &tbs[i];
+        *tb = e.tb;
+        tb->exec_count = 0;
+        if (e.valid) {
+            tb->cflags |= CF_INVALIDATED | CF_CACHE_PENDING;
+            tb_cache_code_hash[i] = e.code_hash;
+            hidx = tb_phys_hash_func(tb->pc);
+            tb->phys_hash_next = tb_cache_hash[hidx];
+            tb_cache_hash[hidx] = tb;
+        } else {
+            tb->cflags |= CF_INVALIDATED;
+        }
+    }
+    close(fd);
+    nb_tbs = h.nb_tbs;
+    code_gen_regions[0].nb_tbs = nb_tbs;
+    code_gen_ptr = code_gen_buffer + h.code_size;
+    cpu_flush_icache_range((unsigned long)code_gen_buffer,
+                           (unsigned long)code_gen_ptr);
+    if (loglevel)
+        fprintf(logfile, "TB cache: loaded %d TBs from '%s'\n",
+                nb_tbs, filename);
+    return;
+ fail:
+    close(fd);
+    tb_cache_reset();
+}
+
+/* Return the TB loaded from the cache for 'pc' and link it if the
+   guest code is unchanged. Return NULL if none. */
+TranslationBlock *tb_cache_find(target_ulong pc, target_ulong cs_base,
+                                unsigned int flags)
+{
+    TranslationBlock *tb, **ptb;
+    target_ulong virt_page2;
+
+    if (!tb_cache_hash)
+        return NULL;
+    ptb = &tb_cache_hash[tb_phys_hash_func(pc)];
+    for(;;) {
+        tb = *ptb;
+        if (!tb)
+            return NULL;
+        if (tb->pc == pc && tb->cs_base == cs_base && tb->flags == flags)
+            break;
+        ptb = &tb->phys_hash_next;
+    }
+    *ptb = tb->phys_hash_next;
+    tb->cflags &= ~(CF_INVALIDATED | CF_CACHE_PENDING);
+    if (!tb_cache_code_valid(pc, tb->size) ||
+        tb_cache_hash_code(pc, tb->size) != tb_cache_code_hash[tb - tbs]) {
+        /* the guest code was modified: drop the translation */
+        tb->cflags |= CF_INVALIDATED;
+        return NULL;
+    }
+    virt_page2 = (pc + tb->size - 1) & TARGET_PAGE_MASK;
+    if ((pc & TARGET_PAGE_MASK) == virt_page2)
+        virt_page2 = -1;
+    tb_link_phys(tb, pc, virt_page2);
+    return tb;
+}
+
+/* Save the TBs to the cache file given to tb_cache_load(). */
+void tb_cache_save(void)
+{
+    TBCacheHeader h;
+    TBCacheEntry e;
+    TranslationBlock *tb;
+    char tmp_filename[1024];
+    int fd, i;
+
+    if (!tb_cache_filename || nb_tbs == 0)
+        return;
+    memset(&h, 0, sizeof(h));
+    if (tb_cache_exe_info(&h) < 0)
+        return;
+    h.magic = TB_CACHE_MAGIC;
+    h.version = TB_CACHE_VERSION;
+    h.tb_size = sizeof(TranslationBlock);
+    h.nb_tbs = nb_tbs;
+    h.code_gen_buffer = (unsigned long)code_gen_buffer;
+    h.tbs = (unsigned long)tbs;
+    h.code_size = code_gen_ptr - code_gen_buffer;
+
+    /* several instances of the program may save the cache at the same
+       time: write to a temporary file and rename it */
+    snprintf(tmp_filename, sizeof(tmp_filename), "%s.%d",
+             tb_cache_filename, (int)getpid());
+    fd = open(tmp_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return;
+    if (write(fd, &h, sizeof(h)) != sizeof(h) ||
+        write(fd, code_gen_buffer, h.code_size) != h.code_size)
+        goto fail;
+    for(i = 0; i < nb_tbs; i++) {
+        tb = &tbs[i];
+        memset(&e, 0, sizeof(e));
+        e.tb = *tb;
+        if (tb->cflags & CF_CACHE_PENDING) {
+            e.valid = 1;
+            e.code_hash = tb_cache_code_hash[i];
+        } else if (!(tb->cflags & CF_INVALIDATED) &&
+                   tb_cache_code_valid(tb->pc, tb->size)) {
+            e.valid = 1;
+            e.code_hash = tb_cache_hash_code(tb->pc, tb->size);
+        }
+        e.tb.cflags &= ~(CF_INVALIDATED | CF_CACHE_PENDING);
+        if (write(fd, &e, sizeof(e)) != sizeof(e))
+            goto fail;
+    }
+    close(fd);
+    if (rename(tmp_filename, tb_cache_filename) < 0)
+        unlink(tmp_filename);
+    return;
+ fail:
+    close(fd);
+    unlink(tmp_filename);
+}
+
 static inline void tlb_set_dirty(CPUState *env,
                                  unsigned long addr, target_ulong vaddr)
 {
@@ -2602,6 +3364,73 @@ void cpu_physical_memory_write_rom(target_phys_addr_t addr,
     }
 }
 
+/* Return a host pointer to the guest memory at 'addr' for a zero copy
+   DMA transfer. '*plen' is reduced to the length of the contiguous RAM
+   (or ROM if '!is_write') area. NULL is returned for I/O memory. */
+uint8_t *cpu_physical_memory_map(target_phys_addr_t addr,
+                                 target_phys_addr_t *plen, int is_write)
+{
+    target_phys_addr_t len, done, page;
+    unsigned long pd, addr1, start;
+    PhysPageDesc *p;
+    int l;
+
+    len = *plen;
+    done = 0;
+    start = 0;
+    while (done < len) {
+        page = addr & TARGET_PAGE_MASK;
+        l = (page + TARGET_PAGE_SIZE) - addr;
+        if (l > len - done)
+            l = len - done;
+        p = phys_page_find(page >> TARGET_PAGE_BITS);
+        if (!p) {
+            pd = IO_MEM_UNASSIGNED;
+        } else {
+            pd = p->phys_offset;
+        }
+        if ((pd & ~TARGET_PAGE_MASK) != IO_MEM_RAM &&
+            (is_write || (pd & ~TARGET_PAGE_MASK) != IO_MEM_ROM))
+            break;
+        addr1 = (pd & TARGET_PAGE_MASK) + (addr & ~TARGET_PAGE_MASK);
+        if (done == 0)
+            start = addr1;
+        else if (addr1 != start + done)
+            break;
+        done += l;
+        addr += l;
+    }
+    if (done == 0)
+        return NULL;
+    *plen = done;
+    return phys_ram_base + start;
+}
+
+/* end of a transfer in a buffer returned by cpu_physical_memory_map():
+   the modified pages are marked dirty and their code is invalidated */
+void cpu_physical_memory_unmap(uint8_t *buffer, target_phys_addr_t len,
+                               int is_write)
+{
+    unsigned long addr1, end;
+    int l;
+
+    if (!is_write)
+        return;
+    addr1 = buffer - phys_ram_base;
+    end = addr1 + len;
+    while (addr1 < end) {
+        l = TARGET_PAGE_SIZE - (addr1 & ~TARGET_PAGE_MASK);
+        if (l > end - addr1)
+            l = end - addr1;
+        if (!cpu_physical_memory_is_dirty(addr1)) {
+            tb_invalidate_phys_page_range(addr1, addr1 + l, 0);
+            phys_ram_dirty[addr1 >> TARGET_PAGE_BITS] |=
+                (0xff & ~CODE_DIRTY_FLAG);
+        }
+        addr1 += l;
+    }
+}
+
 
 /* warning: addr must be aligned */
 uint32_t ldl_phys(target_phys_addr_t addr)
@@ -2828,8 +3657,9 @@ int cpu_memory_rw_debug(CPUState *env, target_ulong addr,
 void dump_exec_info(FILE *f,
                     int (*cpu_fprintf)(FILE *f, const char *fmt, ...))
 {
-    int i, target_code_size, max_target_code_size;
+    int i, j, target_code_size, max_target_code_size;
     int direct_jmp_count, direct_jmp2_count, cross_page;
+    unsigned long code_size;
     TranslationBlock *tb;
     
     target_code_size = 0;
@@ -2837,28 +3667,36 @@ void dump_exec_info(FILE *f,
     cross_page = 0;
     direct_jmp_count = 0;
     direct_jmp2_count = 0;
-    for(i = 0; i < nb_tbs; i++) {
-        tb = &tbs[i];
-        target_code_size += tb->size;
-        if (tb->size > max_target_code_size)
-            max_target_code_size = tb->size;
-        if (tb->page_addr[1] != -1)
-            cross_page++;
-        if (tb->tb_next_offset[0] != 0xffff) {
-            direct_jmp_count++;
-            if (tb->tb_next_offset[1] != 0xffff) {
-                direct_jmp2_count++;
+    for(i = 0; i < code_gen_nb_regions; i++) {
+        for(j = 0; j < code_gen_regions[i].nb_tbs; j++) {
+            tb = &tbs[code_gen_regions[i].first_tb + j];
+            target_code_size += tb->size;
+            if (tb->size > max_target_code_size)
+                max_target_code_size = tb->size;
+            if (tb->page_addr[1] != -1)
+                cross_page++;
+            if (tb->tb_next_offset[0] != 0xffff) {
+                direct_jmp_count++;
+                if (tb->tb_next_offset[1] != 0xffff) {
+                    direct_jmp2_count++;
+                }
             }
         }
     }
+    code_size = code_gen_used_size();
     /* XXX: avoid using doubles ? */
-    cpu_fprintf(f, "TB count            %d\n", nb_tbs);
+    cpu_fprintf(f, "gen code size       %ld/%ld\n",
+                code_size, (long)code_gen_buffer_max_size);
+    cpu_fprintf(f, "code regions        %d (current=%d)\n",
+                code_gen_nb_regions, code_gen_cur_region);
+    cpu_fprintf(f, "TB count            %d/%d\n", 
+                nb_tbs, code_gen_max_blocks);
     cpu_fprintf(f, "TB avg target size  %d max=%d bytes\n", 
                 nb_tbs ? target_code_size / nb_tbs : 0,
                 max_target_code_size);
     cpu_fprintf(f, "TB avg host size    %d bytes (expansion ratio: %0.1f)\n", 
-                nb_tbs ? (code_gen_ptr - code_gen_buffer) / nb_tbs : 0,
-                target_code_size ? (double) (code_gen_ptr - code_gen_buffer) / target_code_size : 0);
+                nb_tbs ? (int)(code_size / nb_tbs) : 0,
+                target_code_size ? (double) code_size / target_code_size : 0);
     cpu_fprintf(f, "cross page TB count %d (%d%%)\n", 
             cross_page, 
             nb_tbs ? (cross_page * 100) / nb_tbs : 0);
@@ -2868,8 +3706,22 @@ void dump_exec_info(FILE *f,
                 direct_jmp2_count,
                 nb_tbs ? (direct_jmp2_count * 100) / nb_tbs : 0);
     cpu_fprintf(f, "TB flush count      %d\n", tb_flush_count);
+    cpu_fprintf(f, "TB region evictions %d\n", tb_evict_count);
+    cpu_fprintf(f, "superblock count    %d\n", tb_superblock_count);
     cpu_fprintf(f, "TB invalidate count %d\n", tb_phys_invalidate_count);
-    cpu_fprintf(f, "TLB flush count     %d\n", tlb_flush_count);
+    cpu_fprintf(f, "TLB flush count     %d (full clears=%d)\n",
+                tlb_flush_count, tlb_full_flush_count);
+    cpu_fprintf(f, "TLB size            %d entries + %d victim\n",
+                CPU_TLB_SIZE, CPU_VTLB_SIZE);
+    cpu_fprintf(f, "TLB miss count      %d\n", tlb_miss_count);
+    cpu_fprintf(f, "TLB victim hits     %d (%d%%)\n",
+                tlb_victim_hit_count,
+                tlb_miss_count ? 
+                (int)((int64_t)tlb_victim_hit_count * 100 / tlb_miss_count) : 0);
+    cpu_fprintf(f, "TLB large page hits %d\n", tlb_large_page_fill_count);
+    cpu_fprintf(f, "TLB fill count      %d\n",
+                tlb_miss_count - tlb_victim_hit_count -
+                tlb_large_page_fill_count);
 }
 
 #if !defined(CONFIG_USER_ONLY) 
@@ -430,6 +430,7 @@ void DMA_schedule(int nchan)
     CPUState *env = cpu_single_env;
     if (env)
         cpu_interrupt(env, CPU_INTERRUPT_EXIT);
+    main_loop_notify();
 }
 
 static void dma_reset(void *opaque)
@@ -401,6 +401,9 @@ typedef struct BMDMAState {
     IDEState *ide_if;
     BlockDriverCompletionFunc *dma_cb;
     BlockDriverAIOCB *aiocb;
+    /* guest memory mapped for the current transfer */
+    QEMUIOVector qiov;
+    int dma_to_ram;
 } BMDMAState;
 
 typedef struct PCIIDEState {
@@ -757,35 +760,45 @@ static void ide_sector_read(IDEState *s)
     }
 }
 
-/* return 0 if buffer completed */
-static int dma_buf_rw(BMDMAState *bm, int is_write)
+/* load the next PRD entry. Return 0 at the end of the table. */
+static int dma_prd_next(BMDMAState *bm)
 {
-    IDEState *s = bm->ide_if;
     struct {
         uint32_t addr;
         uint32_t size;
     } prd;
-    int l, len;
+    int len;
+
+    /* end of table (with a fail safe of one page) */
+    if (bm->cur_prd_last ||
+        (bm->cur_addr - bm->addr) >= 4096)
+        return 0;
+    cpu_physical_memory_read(bm->cur_addr, (uint8_t *)&prd, 8);
+    bm->cur_addr += 8;
+    prd.addr = le32_to_cpu(prd.addr);
+    prd.size = le32_to_cpu(prd.size);
+    len = prd.size & 0xfffe;
+    if (len == 0)
+        len = 0x10000;
+    bm->cur_prd_len = len;
+    bm->cur_prd_addr = prd.addr;
+    bm->cur_prd_last = (prd.size & 0x80000000);
+    return 1;
+}
+
+/* return 0 if buffer completed */
+static int dma_buf_rw(BMDMAState *bm, int is_write)
+{
+    IDEState *s = bm->ide_if;
+    int l;
 
     for(;;) {
         l = s->io_buffer_size - s->io_buffer_index;
         if (l <= 0) 
             break;
         if (bm->cur_prd_len == 0) {
-            /* end of table (with a fail safe of one page) */
-            if (bm->cur_prd_last ||
-                (bm->cur_addr - bm->addr) >= 4096)
+            if (!dma_prd_next(bm))
                 return 0;
-            cpu_physical_memory_read(bm->cur_addr, (uint8_t *)&prd, 8);
-            bm->cur_addr += 8;
-            prd.addr = le32_to_cpu(prd.addr);
-            prd.size = le32_to_cpu(prd.size);
-            len = prd.size & 0xfffe;
-            if (len == 0)
-                len = 0x10000;
-            bm->cur_prd_len = len;
-            bm->cur_prd_addr = prd.addr;
-            bm->cur_prd_last = (prd.size & 0x80000000);
         }
         if (l > bm->cur_prd_len)
             l = bm->cur_prd_len;
@@ -805,6 +818,96 @@ static int dma_buf_rw(BMDMAState *bm, int is_write)
     return 1;
 }
 
+static void dma_buf_skip(BMDMAState *bm, int len)
+{
+    int l;
+
+    while (len > 0) {
+        if (bm->cur_prd_len == 0 && !dma_prd_next(bm))
+            break;
+        l = bm->cur_prd_len;
+        if (l > len)
+            l = len;
+        bm->cur_prd_addr += l;
+        bm->cur_prd_len -= l;
+        len -= l;
+    }
+}
+
+/* Map up to 'max' bytes of the guest buffers of the PRD table in
+   bm->qiov so that the block layer transfers them without copy. Return
+   the number of bytes mapped, a multiple of the sector size: 0 means
+   that io_buffer must be used (I/O memory or end of table). */
+static int dma_buf_map(BMDMAState *bm, int max, int to_ram)
+{
+    uint32_t cur_addr, cur_prd_last, cur_prd_addr, cur_prd_len;
+    target_phys_addr_t l;
+    struct iovec *iov;
+    uint8_t *ptr;
+    int size, rest;
+
+    cur_addr = bm->cur_addr;
+    cur_prd_last = bm->cur_prd_last;
+    cur_prd_addr = bm->cur_prd_addr;
+    cur_prd_len = bm->cur_prd_len;
+
+    qemu_iovec_reset(&bm->qiov);
+    bm->dma_to_ram = to_ram;
+    size = 0;
+    while (size < max) {
+        if (bm->cur_prd_len == 0 && !dma_prd_next(bm))
+            break;
+        l = bm->cur_prd_len;
+        if (l > max - size)
+            l = max - size;
+        ptr = cpu_physical_memory_map(bm->cur_prd_addr, &l, to_ram);
+        if (!ptr)
+            break;
+        if (qemu_iovec_add(&bm->qiov, ptr, l) < 0) {
+            /* nothing was transferred in this buffer */
+            cpu_physical_memory_unmap(ptr, l, 0);
+            break;
+        }
+        bm->cur_prd_addr += l;
+        bm->cur_prd_len -= l;
+        size += l;
+    }
+
+    rest = size & 511;
+    if (rest) {
+        /* the last partial sector is left to the next transfer */
+        size -= rest;
+        while (rest > 0) {
+            iov = &bm->qiov.iov[bm->qiov.niov - 1];
+            if (iov->iov_len > rest) {
+                iov->iov_len -= rest;
+                bm->qiov.size -= rest;
+                rest = 0;
+            } else {
+                rest -= iov->iov_len;
+                bm->qiov.size -= iov->iov_len;
+                bm->qiov.niov--;
+            }
+        }
+        bm->cur_addr = cur_addr;
+        bm->cur_prd_last = cur_prd_last;
+        bm->cur_prd_addr = cur_prd_addr;
+        bm->cur_prd_len = cur_prd_len;
+        dma_buf_skip(bm, size);
+    }
+    return size;
+}
+
+static void dma_buf_unmap(BMDMAState *bm)
+{
+    int i;
+
+    for(i = 0; i < bm->qiov.niov; i++)
+        cpu_physical_memory_unmap(bm->qiov.iov[i].iov_base,
+                                  bm->qiov.iov[i].iov_len, bm->dma_to_ram);
+    qemu_iovec_reset(&bm->qiov);
+}
+
 /* XXX: handle errors */
 static void ide_read_dma_cb(void *opaque, int ret)
 {
@@ -819,7 +922,9 @@ static void ide_read_dma_cb(void *opaque, int ret)
         sector_num += n;
         ide_set_sector(s, sector_num);
         s->nsector -= n;
-        if (dma_buf_rw(bm, 1) == 0)
+        if (bm->qiov.niov > 0)
+            dma_buf_unmap(bm);
+        else if (dma_buf_rw(bm, 1) == 0)
             goto eot;
     }
 
@@ -836,17 +941,24 @@ static void ide_read_dma_cb(void *opaque, int ret)
         return;
     }
 
-    /* launch next transfer */
-    n = s->nsector;
-    if (n > MAX_MULT_SECTORS)
-        n = MAX_MULT_SECTORS;
+    /* launch next transfer, directly in the guest memory if possible */
+    n = dma_buf_map(bm, s->nsector * 512, 1) >> 9;
+    if (n == 0) {
+        n = s->nsector;
+        if (n > MAX_MULT_SECTORS)
+            n = MAX_MULT_SECTORS;
+    }
     s->io_buffer_index = 0;
     s->io_buffer_size = n * 512;
 #ifdef DEBUG_AIO
     printf("aio_read: sector_num=%lld n=%d\n", sector_num, n);
 #endif
-    bm->aiocb = bdrv_aio_read(s->bs, sector_num, s->io_buffer, n, 
-                              ide_read_dma_cb, bm);
+    if (bm->qiov.niov > 0)
+        bm->aiocb = bdrv_aio_readv(s->bs, sector_num, &bm->qiov, n,
+                                   ide_read_dma_cb, bm);
+    else
+        bm->aiocb = bdrv_aio_read(s->bs, sector_num, s->io_buffer, n, 
+                                  ide_read_dma_cb, bm);
 }
 
 static void ide_sector_read_dma(IDEState *s)
@@ -920,6 +1032,7 @@ static void ide_write_dma_cb(void *opaque, int ret)
         sector_num += n;
         ide_set_sector(s, sector_num);
         s->nsector -= n;
+        dma_buf_unmap(bm);
     }
 
     /* end of transfer ? */
@@ -935,7 +1048,18 @@ static void ide_write_dma_cb(void *opaque, int ret)
         return;
     }
 
-    /* launch next transfer */
+    /* launch next transfer, directly from the guest memory if possible */
+    n = dma_buf_map(bm, s->nsector * 512, 0) >> 9;
+    if (n > 0) {
+        s->io_buffer_index = 0;
+        s->io_buffer_size = n * 512;
+#ifdef DEBUG_AIO
+        printf("aio_writev: sector_num=%lld n=%d\n", sector_num, n);
+#endif
+        bm->aiocb = bdrv_aio_writev(s->bs, sector_num, &bm->qiov, n,
+                                    ide_write_dma_cb, bm);
+        return;
+    }
     n = s->nsector;
     if (n > MAX_MULT_SECTORS)
         n = MAX_MULT_SECTORS;
@@ -2553,6 +2677,7 @@ static void bmdma_cmd_writeb(void *opaque, uint32_t addr, uint32_t val)
                 bdrv_aio_cancel(bm->aiocb);
                 bm->aiocb = NULL;
             }
+            dma_buf_unmap(bm);
         }
         bm->cmd = val & 0x09;
     } else {
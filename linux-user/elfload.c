@@ -941,6 +941,51 @@ static void load_symbols(struct elfhdr *hdr, int fd)
     syminfos = s;
 }
 
+/* Look for the GNU build ID note in a PT_NOTE segment. */
+static void load_build_id(int fd, struct elf_phdr *phdr,
+                          struct image_info *info)
+{
+    struct elf_note *note;
+    uint8_t *buf, *p, *end;
+    uint32_t namesz, descsz, type;
+
+    if (info->build_id_len != 0 || phdr->p_filesz > 4096)
+        return;
+    buf = malloc(phdr->p_filesz);
+    if (!buf)
+        return;
+    if (lseek(fd, phdr->p_offset, SEEK_SET) < 0 ||
+        read(fd, buf, phdr->p_filesz) != phdr->p_filesz)
+        goto out;
+    p = buf;
+    end = buf + phdr->p_filesz;
+    while (p + sizeof(struct elf_note) <= end) {
+        note = (struct elf_note *)p;
+        namesz = note->n_namesz;
+        descsz = note->n_descsz;
+        type = note->n_type;
+#ifdef BSWAP_NEEDED
+        bswap32s(&namesz);
+        bswap32s(&descsz);
+        bswap32s(&type);
+#endif
+        p += sizeof(struct elf_note);
+        if (namesz > end - p ||
+            ((namesz + 3) & ~3) + descsz > end - p)
+            break;
+        if (type == NT_GNU_BUILD_ID && namesz == 4 &&
+            !memcmp(p, "GNU", 4) && descsz > 0 &&
+            descsz <= MAX_BUILD_ID_SIZE) {
+            memcpy(info->build_id, p + 4, descsz);
+            info->build_id_len = descsz;
+            break;
+        }
+        p += ((namesz + 3) & ~3) + ((descsz + 3) & ~3);
+    }
+ out:
+    free(buf);
+}
+
 int load_elf_binary(struct linux_binprm * bprm, struct target_pt_regs * regs,
                     struct image_info * info)
 {
@@ -1102,6 +1147,8 @@ int load_elf_binary(struct linux_binprm * bprm, struct target_pt_regs * regs,
 		return retval;
 	    }
 	}
+	if (elf_ppnt->p_type == PT_NOTE)
+	    load_build_id(bprm->fd, elf_ppnt, info);
 	elf_ppnt++;
     }
 
@@ -1672,6 +1672,10 @@ void usage(void)
            "-s size           set the stack size in bytes (default=%ld)\n"
            "-cpu model        select CPU (-cpu ? for list)\n"
            "-drop-ld-preload  drop LD_PRELOAD for target process\n"
+           "-tb-cache dir     save and reload the translated code in 'dir'\n"
+#ifdef TARGET_HAS_SUPERBLOCKS
+           "-tb-hot n         retranslate the blocks executed 'n' times as superblocks\n"
+#endif
            "\n"
            "debug options:\n"
 #ifdef USE_CODE_COPY
@@ -1705,6 +1709,7 @@ int main(int argc, char **argv)
     int gdbstub_port = 0;
     int drop_ld_preload = 0, environ_count = 0;
     char **target_environ, **wrk, **dst;
+    const char *tb_cache_dir = NULL;
 
     if (argc <= 1)
         usage();
@@ -1779,6 +1784,14 @@ int main(int argc, char **argv)
             }
         } else if (!strcmp(r, "drop-ld-preload")) {
             drop_ld_preload = 1;
+        } else if (!strcmp(r, "tb-cache")) {
+            tb_cache_dir = argv[optind++];
+#ifdef TARGET_HAS_SUPERBLOCKS
+        } else if (!strcmp(r, "tb-hot")) {
+            tb_hot_threshold = atoi(argv[optind++]);
+            if (tb_hot_threshold < 0)
+                tb_hot_threshold = 0;
+#endif
         } else 
 #ifdef USE_CODE_COPY
         if (!strcmp(r, "no-code-copy")) {
@@ -1832,6 +1845,22 @@ int main(int argc, char **argv)
     
     free(target_environ);
 
+    /* the translated code is cached per executable, identified by its
+       build ID */
+    if (tb_cache_dir && info->build_id_len > 0) {
+        char buf[1024];
+        int i, len;
+
+        len = snprintf(buf, sizeof(buf), "%s/", tb_cache_dir);
+        for(i = 0; i < info->build_id_len && len < sizeof(buf); i++)
+            len += snprintf(buf + len, sizeof(buf) - len, "%02x",
+                            info->build_id[i]);
+        if (len < sizeof(buf))
+            snprintf(buf + len, sizeof(buf) - len, "-%s.tbc",
+                     cpu_model ? cpu_model : "default");
+        tb_cache_load(buf);
+    }
+
     if (loglevel) {
         page_dump(logfile);
     
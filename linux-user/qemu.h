@@ -15,6 +15,8 @@
  * Basically, it replicates in user space what would be certain
  * task_struct fields in the kernel
  */
+#define MAX_BUILD_ID_SIZE 32
+
 struct image_info {
 	unsigned long	start_code;
 	unsigned long	end_code;
@@ -31,6 +33,9 @@ struct image_info {
         target_ulong    data_offset;
         char            **host_argv;
 	int		personality;
+        /* NT_GNU_BUILD_ID note of the executable (build_id_len = 0 if none) */
+        uint8_t         build_id[MAX_BUILD_ID_SIZE];
+        int             build_id_len;
 };
 
 #ifdef TARGET_I386
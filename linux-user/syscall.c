@@ -2458,6 +2458,7 @@ long do_syscall(void *cpu_env, int num, long arg1, long arg2, long arg3,
         _mcleanup();
 #endif
         gdb_exit(cpu_env, arg1);
+        tb_cache_save();
         /* XXX: should free thread stack and CPU env */
         _exit(arg1);
         ret = 0; /* avoid warning */
@@ -3657,6 +3658,7 @@ long do_syscall(void *cpu_env, int num, long arg1, long arg2, long arg3,
         /* new thread calls */
     case TARGET_NR_exit_group:
         gdb_exit(cpu_env, arg1);
+        tb_cache_save();
         ret = get_errno(exit_group(arg1));
         break;
 #endif
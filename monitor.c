@@ -249,6 +249,11 @@ static void do_info_block(void)
     bdrv_info();
 }
 
+static void do_info_stream(void)
+{
+    bdrv_stream_info();
+}
+
 /* get the current CPU defined by the user */
 int mon_set_cpu(int cpu_index)
 {
@@ -401,6 +406,63 @@ static void do_change(const char *device, const char *filename)
     qemu_key_check(bs, filename);
 }
 
+static void do_block_stream(const char *device, const char *base)
+{
+    BlockDriverState *bs;
+    int ret;
+
+    bs = bdrv_find(device);
+    if (!bs) {
+        term_printf("device not found\n");
+        return;
+    }
+    ret = bdrv_stream_start(bs, base);
+    switch(ret) {
+    case 0:
+        break;
+    case -EBUSY:
+        term_printf("device is already streaming\n");
+        break;
+    case -EINVAL:
+        term_printf("device has no backing file\n");
+        break;
+    case -ENOENT:
+        term_printf("base image not found in the backing chain\n");
+        break;
+    case -ENOTSUP:
+        term_printf("image format does not support streaming\n");
+        break;
+    default:
+        term_printf("could not start streaming: %s\n", strerror(-ret));
+        break;
+    }
+}
+
+static void do_block_stream_speed(const char *device, int speed)
+{
+    BlockDriverState *bs;
+
+    bs = bdrv_find(device);
+    if (!bs) {
+        term_printf("device not found\n");
+        return;
+    }
+    if (bdrv_stream_set_speed(bs, (int64_t)speed << 20) < 0)
+        term_printf("invalid speed or device not streaming\n");
+}
+
+static void do_block_stream_cancel(const char *device)
+{
+    BlockDriverState *bs;
+
+    bs = bdrv_find(device);
+    if (!bs) {
+        term_printf("device not found\n");
+        return;
+    }
+    bdrv_stream_cancel(bs);
+}
+
 static void do_screen_dump(const char *filename)
 {
     vga_hw_screen_dump(filename);
@@ -1211,6 +1273,12 @@ static term_cmd_t term_cmds[] = {
       "[-f] device", "eject a removable medium (use -f to force it)" },
     { "change", "BF", do_change,
       "device filename", "change a removable medium" },
+    { "block_stream", "Bs?", do_block_stream,
+      "device [base]", "copy the backing files (down to 'base') into the image while the VM runs" },
+    { "block_stream_speed", "Bi", do_block_stream_speed,
+      "device speed", "limit the streaming of the device to 'speed' MB/s (0 for no limit)" },
+    { "block_stream_cancel", "B", do_block_stream_cancel,
+      "device", "stop the streaming of the device" },
     { "screendump", "F", do_screen_dump, 
       "filename", "save screen into PPM image 'filename'" },
     { "log", "s", do_log,
@@ -1277,6 +1345,8 @@ static term_cmd_t info_cmds[] = {
       "", "show the network state" },
     { "block", "", do_info_block,
       "", "show the block devices" },
+    { "stream", "", do_info_stream,
+      "", "show the progress of the block streaming" },
     { "registers", "", do_info_registers,
       "", "show the cpu registers" },
     { "cpus", "", do_info_cpus,
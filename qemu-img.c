@@ -25,6 +25,11 @@
 
 #ifdef _WIN32
 #include <windows.h>
+#else
+#include <sys/time.h>
+#endif
+#ifdef CONFIG_AIO_THREADS
+#include <pthread.h>
 #endif
 
 void *get_mmap_addr(unsigned long size)
@@ -98,10 +103,13 @@ void help(void)
            "QEMU disk image utility\n"
            "\n"
            "Command syntax:\n"
-           "  create [-e] [-b base_image] [-f fmt] filename [size]\n"
+           "  create [-e] [-b base_image] [-f fmt] [-o options] filename [size]\n"
            "  commit [-f fmt] filename\n"
-           "  convert [-c] [-e] [-f fmt] filename [-O output_fmt] output_filename\n"
+           "  rebase [-u] [-f fmt] -b base_image filename\n"
+           "  convert [-c] [-e] [-m num] [-f fmt] filename [-O output_fmt] output_filename\n"
            "  info [-f fmt] filename\n"
+           "  map [-j] [-f fmt] filename\n"
+           "  bench [-c count] [-d depth] [-s size] [-r] [-w percent] [-a aio] [-f fmt] filename\n"
            "\n"
            "Command parameters:\n"
            "  'filename' is a disk image filename\n"
@@ -110,10 +118,23 @@ void help(void)
            "  'fmt' is the disk image format. It is guessed automatically in most cases\n"
            "  'size' is the disk image size in kilobytes. Optional suffixes 'M' (megabyte)\n"
            "    and 'G' (gigabyte) are supported\n"
+           "  '-u' makes 'rebase' only change the name of the base image, without\n"
+           "    copying the sectors which differ between the old and new base image\n"
            "  'output_filename' is the destination disk image filename\n"
            "  'output_fmt' is the destination format\n"
            "  '-c' indicates that target image must be compressed (qcow format only)\n"
            "  '-e' indicates that the target image must be encrypted (qcow format only)\n"
+           "  '-m' sets the number of parallel requests of the conversion (default 8)\n"
+           "  'options' is 'preallocation=metadata' to allocate all the image metadata\n"
+           "    at creation (qcow2 format only, without base image nor encryption)\n"
+           "  '-j' prints the extents of 'map' in JSON instead of a table\n"
+           "  'count' is the number of requests of the benchmark (default 10000)\n"
+           "  'depth' is the number of requests in flight (default 16)\n"
+           "  'size' is the size of the requests in bytes (default 4K)\n"
+           "  '-r' makes the requests random instead of sequential\n"
+           "  'percent' is the percentage of writes, which overwrite the image data\n"
+           "  'aio' is the AIO method of the image: posix, native, threads or\n"
+           "    threads,direct (see the -aio option of qemu)\n"
            );
     printf("\nSupported format:");
     bdrv_iterate_format(format_print, NULL);
@@ -210,7 +231,7 @@ int read_password(char *buf, int buf_size)
 #endif
 
 static BlockDriverState *bdrv_new_open(const char *filename,
-                                       const char *fmt)
+                                       const char *fmt, int flags)
 {
     BlockDriverState *bs;
     BlockDriver *drv;
@@ -226,7 +247,7 @@ static BlockDriverState *bdrv_new_open(const char *filename,
     } else {
         drv = NULL;
     }
-    if (bdrv_open2(bs, filename, 0, drv) < 0) {
+    if (bdrv_open2(bs, filename, flags, drv) < 0) {
         error("Could not open '%s'", filename);
     }
     if (bdrv_is_encrypted(bs)) {
@@ -241,7 +262,7 @@ static BlockDriverState *bdrv_new_open(const char *filename,
 
 static int img_create(int argc, char **argv)
 {
-    int c, ret, encrypted;
+    int c, ret, flags;
     const char *fmt = "raw";
     const char *filename;
     const char *base_filename = NULL;
@@ -249,9 +270,9 @@ static int img_create(int argc, char **argv)
     const char *p;
     BlockDriver *drv;
     
-    encrypted = 0;
+    flags = 0;
     for(;;) {
-        c = getopt(argc, argv, "b:f:he");
+        c = getopt(argc, argv, "b:f:heo:");
         if (c == -1)
             break;
         switch(c) {
@@ -265,7 +286,13 @@ static int img_create(int argc, char **argv)
             fmt = optarg;
             break;
         case 'e':
-            encrypted = 1;
+            flags |= BLOCK_FLAG_ENCRYPT;
+            break;
+        case 'o':
+            if (!strcmp(optarg, "preallocation=metadata"))
+                flags |= BLOCK_FLAG_PREALLOC_METADATA;
+            else if (strcmp(optarg, "preallocation=off"))
+                error("Unknown option '%s'", optarg);
             break;
         }
     }
@@ -275,7 +302,7 @@ static int img_create(int argc, char **argv)
     size = 0;
     if (base_filename) {
         BlockDriverState *bs;
-        bs = bdrv_new_open(base_filename, NULL);
+        bs = bdrv_new_open(base_filename, NULL, 0);
         bdrv_get_geometry(bs, &size);
         size *= 512;
         bdrv_delete(bs);
@@ -297,16 +324,20 @@ static int img_create(int argc, char **argv)
     drv = bdrv_find_format(fmt);
     if (!drv)
         error("Unknown file format '%s'", fmt);
+    if ((flags & BLOCK_FLAG_PREALLOC_METADATA) && drv != &bdrv_qcow2)
+        error("Preallocation not supported for this file format");
     printf("Formating '%s', fmt=%s",
            filename, fmt);
-    if (encrypted)
+    if (flags & BLOCK_FLAG_ENCRYPT)
         printf(", encrypted");
+    if (flags & BLOCK_FLAG_PREALLOC_METADATA)
+        printf(", preallocation=metadata");
     if (base_filename) {
         printf(", backing_file=%s",
                base_filename);
     }
     printf(", size=%" PRId64 " kB\n", (int64_t) (size / 1024));
-    ret = bdrv_create(drv, filename, size / 512, base_filename, encrypted);
+    ret = bdrv_create(drv, filename, size / 512, base_filename, flags);
     if (ret < 0) {
         if (ret == -ENOTSUP) {
             error("Formatting or formatting option not supported for file format '%s'", fmt);
@@ -378,6 +409,155 @@ static int img_commit(int argc, char **argv)
     return 0;
 }
 
+#define REBASE_BUF_SIZE (1024 * 1024)
+
+/* read from a base image, which may be smaller than the image or
+   absent: the missing sectors read as zero */
+static void rebase_read(BlockDriverState *bs, int64_t total_sectors,
+                        int64_t sector_num, uint8_t *buf, int nb_sectors)
+{
+    int n;
+
+    n = 0;
+    if (bs && sector_num < total_sectors) {
+        n = nb_sectors;
+        if (total_sectors - sector_num < n)
+            n = total_sectors - sector_num;
+        if (bdrv_read(bs, sector_num, buf, n) < 0)
+            error("error while reading the base image");
+    }
+    memset(buf + n * 512, 0, (nb_sectors - n) * 512);
+}
+
+/* copy to 'bs' the sectors which it does not contain and which differ
+   between its current base image and 'new_base' */
+static void rebase_copy(BlockDriverState *bs, BlockDriverState *new_base)
+{
+    BlockDriverState *old_base;
+    int64_t total_sectors, old_sectors, new_sectors, sector_num;
+    uint8_t *buf_old, *buf_new;
+    int i, n, n1, differ, ret;
+
+    old_base = bdrv_get_backing_hd(bs);
+    bdrv_get_geometry(bs, &total_sectors);
+    old_sectors = 0;
+    if (old_base)
+        bdrv_get_geometry(old_base, &old_sectors);
+    bdrv_get_geometry(new_base, &new_sectors);
+    buf_old = qemu_malloc(REBASE_BUF_SIZE);
+    buf_new = qemu_malloc(REBASE_BUF_SIZE);
+    if (!buf_old || !buf_new)
+        error("Not enough memory");
+
+    for(sector_num = 0; sector_num < total_sectors; sector_num += n) {
+        n = REBASE_BUF_SIZE / 512;
+        if (total_sectors - sector_num < n)
+            n = total_sectors - sector_num;
+        ret = bdrv_is_allocated(bs, sector_num, n, &n);
+        if (ret < 0)
+            error("error while reading the image");
+        if (ret)
+            continue;
+        rebase_read(old_base, old_sectors, sector_num, buf_old, n);
+        rebase_read(new_base, new_sectors, sector_num, buf_new, n);
+        for(i = 0; i < n; i += n1) {
+            differ = memcmp(buf_old + i * 512, buf_new + i * 512, 512) != 0;
+            for(n1 = 1; i + n1 < n; n1++) {
+                if ((memcmp(buf_old + (i + n1) * 512,
+                            buf_new + (i + n1) * 512, 512) != 0) != differ)
+                    break;
+            }
+            if (differ && bdrv_write(bs, sector_num + i,
+                                     buf_old + i * 512, n1) < 0)
+                error("error while writing");
+        }
+    }
+    qemu_free(buf_old);
+    qemu_free(buf_new);
+}
+
+static int img_rebase(int argc, char **argv)
+{
+    int c, ret, unsafe;
+    const char *filename, *fmt, *base_name;
+    BlockDriverState *bs, *new_base, *p;
+    char base_path[1024];
+
+    fmt = NULL;
+    base_name = NULL;
+    unsafe = 0;
+    for(;;) {
+        c = getopt(argc, argv, "b:f:hu");
+        if (c == -1)
+            break;
+        switch(c) {
+        case 'h':
+            help();
+            break;
+        case 'b':
+            base_name = optarg;
+            break;
+        case 'f':
+            fmt = optarg;
+            break;
+        case 'u':
+            unsafe = 1;
+            break;
+        }
+    }
+    if (optind >= argc || !base_name) 
+        help();
+    filename = argv[optind++];
+
+    bs = bdrv_new_open(filename, fmt, 0);
+    if (unsafe) {
+        ret = bdrv_change_backing_file(bs, base_name);
+    } else {
+        /* a base image of the chain is made the backing file by
+           streaming the data of the images above it: there is nothing
+           to compare */
+        p = NULL;
+        if (base_name[0] != '\0') {
+            path_combine(base_path, sizeof(base_path), filename, base_name);
+            for(p = bdrv_get_backing_hd(bs); p; p = bdrv_get_backing_hd(p)) {
+                if (!strcmp(bdrv_get_filename(p), base_path))
+                    break;
+            }
+        }
+        if (p || base_name[0] == '\0') {
+            ret = bdrv_stream(bs, p, base_name);
+        } else {
+            /* fail before the copy if the name cannot be written */
+            ret = bdrv_check_backing_file(bs, base_name);
+            if (ret == 0) {
+                new_base = bdrv_new_open(base_path, NULL, 0);
+                rebase_copy(bs, new_base);
+                ret = bdrv_change_backing_file(bs, base_name);
+                bdrv_delete(new_base);
+            }
+        }
+    }
+    switch(ret) {
+    case 0:
+        break;
+    case -ENOTSUP:
+        error("Changing the backing file not supported for this file format");
+        break;
+    case -ENOSPC:
+        error("Backing file name too long for this image");
+        break;
+    case -EACCES:
+        error("Image is read-only");
+        break;
+    default:
+        error("Error while rebasing image");
+        break;
+    }
+
+    bdrv_delete(bs);
+    return 0;
+}
+
 static int is_not_zero(const uint8_t *sector, int len)
 {
     int i;
@@ -409,23 +589,367 @@ static int is_allocated_sectors(const uint8_t *buf, int n, int *pnum)
 
 #define IO_BUF_SIZE 65536
 
+/* size of the buffer of each request of the conversion */
+#define CONVERT_BUF_SIZE (1024 * 1024)
+#define CONVERT_REQS 8
+#define CONVERT_MAX_REQS 64
+
+/* TRUE if the source image has no backing file */
+static int convert_skip_unallocated;
+
+/* Return the number of sectors from 'sector_num' which do not need to
+   be read: the sectors which are not allocated in an image without
+   backing file read as zero. */
+static int convert_skip(BlockDriverState *bs, int64_t sector_num,
+                        int64_t total_sectors)
+{
+    int64_t n;
+    int n1;
+
+    if (!convert_skip_unallocated)
+        return 0;
+    n = total_sectors - sector_num;
+    if (n > 65536)
+        n = 65536;
+    if (n <= 0 || bdrv_is_allocated(bs, sector_num, n, &n1) != 0)
+        return 0;
+    return n1;
+}
+
+enum {
+    CONV_FREE,
+    CONV_READ,
+    CONV_READ_DONE,
+    CONV_WRITE,
+};
+
+/* a chunk of the image being read then written */
+typedef struct ConvertReq {
+    int64_t sector_num;
+    int nb_sectors;
+    uint8_t *buf;
+    int state;
+    int nb_writes; /* pending writes */
+    int ret;
+} ConvertReq;
+
+static void convert_read_cb(void *opaque, int ret)
+{
+    ConvertReq *req = opaque;
+    req->ret = ret;
+    req->state = CONV_READ_DONE;
+}
+
+static void convert_write_cb(void *opaque, int ret)
+{
+    ConvertReq *req = opaque;
+    if (ret < 0)
+        req->ret = ret;
+    req->nb_writes--;
+}
+
+/* issue the writes of the non zero sectors of 'req' */
+static void convert_write(BlockDriverState *out_bs, ConvertReq *req)
+{
+    int64_t sector_num;
+    int n, n1, pending;
+    const uint8_t *buf1;
+
+    /* the request cannot complete before all its writes are issued */
+    req->state = CONV_WRITE;
+    req->nb_writes = 1;
+    sector_num = req->sector_num;
+    n = req->nb_sectors;
+    buf1 = req->buf;
+    /* NOTE: at the same time we convert, we do not write zero
+       sectors to have a chance to compress the image */
+    while (n > 0) {
+        if (is_allocated_sectors(buf1, n, &n1)) {
+            pending = ++req->nb_writes;
+            /* the emulated AIO of the tools completes at once and
+               returns NULL */
+            if (!bdrv_aio_write(out_bs, sector_num, buf1, n1,
+                                convert_write_cb, req) &&
+                req->nb_writes == pending) {
+                req->nb_writes--;
+                req->ret = -EIO;
+                break;
+            }
+        }
+        sector_num += n1;
+        n -= n1;
+        buf1 += n1 * 512;
+    }
+    req->nb_writes--;
+}
+
+/* copy the image with 'nb_reqs' chunks being read or written at the
+   same time */
+static void convert_copy(BlockDriverState *bs, BlockDriverState *out_bs,
+                         int64_t total_sectors, int nb_reqs)
+{
+    ConvertReq reqs[CONVERT_MAX_REQS], *req;
+    int64_t sector_num, nb_sectors;
+    int i, n, busy, progress;
+
+    for(i = 0; i < nb_reqs; i++) {
+        req = &reqs[i];
+        memset(req, 0, sizeof(*req));
+        req->buf = qemu_malloc(CONVERT_BUF_SIZE);
+        if (!req->buf)
+            error("not enough memory");
+        req->state = CONV_FREE;
+    }
+
+    sector_num = 0;
+    qemu_aio_wait_start();
+    for(;;) {
+        busy = 0;
+        progress = 0;
+        for(i = 0; i < nb_reqs; i++) {
+            req = &reqs[i];
+            if (req->state == CONV_READ_DONE) {
+                if (req->ret < 0)
+                    error("error while reading");
+                convert_write(out_bs, req);
+                progress = 1;
+            }
+            if (req->state == CONV_WRITE && req->nb_writes == 0) {
+                if (req->ret < 0)
+                    error("error while writing");
+                req->state = CONV_FREE;
+                progress = 1;
+            }
+            if (req->state == CONV_FREE) {
+                while ((n = convert_skip(bs, sector_num, total_sectors)) > 0)
+                    sector_num += n;
+                nb_sectors = total_sectors - sector_num;
+                if (nb_sectors > 0) {
+                    if (nb_sectors > (CONVERT_BUF_SIZE / 512))
+                        nb_sectors = (CONVERT_BUF_SIZE / 512);
+                    req->sector_num = sector_num;
+                    req->nb_sectors = nb_sectors;
+                    req->ret = 0;
+                    req->state = CONV_READ;
+                    if (!bdrv_aio_read(bs, sector_num, req->buf, nb_sectors,
+                                       convert_read_cb, req) &&
+                        req->state == CONV_READ)
+                        error("error while reading");
+                    sector_num += nb_sectors;
+                    progress = 1;
+                }
+            }
+            if (req->state != CONV_FREE)
+                busy = 1;
+        }
+        if (!busy)
+            break;
+        if (!progress)
+            qemu_aio_wait();
+    }
+    qemu_aio_wait_end();
+
+    for(i = 0; i < nb_reqs; i++)
+        qemu_free(reqs[i].buf);
+}
+
+enum {
+    CJ_ZERO,
+    CJ_PENDING,
+    CJ_DONE,
+};
+
+/* a cluster being compressed */
+typedef struct CompressJob {
+    int64_t sector_num;
+    uint8_t *buf;
+    uint8_t *out_buf;
+    int state;
+    int ret; /* compressed size, 0 if not compressible */
+    struct CompressJob *next;
+} CompressJob;
+
+static BlockDriverState *compress_bs;
+
+#ifdef CONFIG_AIO_THREADS
+/* the clusters are compressed by worker threads while the main thread
+   reads the next ones and writes the compressed data in order */
+static pthread_mutex_t compress_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t compress_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t compress_done_cond = PTHREAD_COND_INITIALIZER;
+static CompressJob *compress_first; /* jobs waiting for a thread */
+static CompressJob **compress_last = &compress_first;
+static int compress_nb_threads;
+
+static void *compress_worker(void *opaque)
+{
+    CompressJob *job;
+    int ret;
+
+    pthread_mutex_lock(&compress_lock);
+    for(;;) {
+        while (!compress_first)
+            pthread_cond_wait(&compress_cond, &compress_lock);
+        job = compress_first;
+        compress_first = job->next;
+        if (!compress_first)
+            compress_last = &compress_first;
+        pthread_mutex_unlock(&compress_lock);
+
+        ret = bdrv_compress_cluster(compress_bs, job->out_buf, job->buf);
+
+        pthread_mutex_lock(&compress_lock);
+        job->ret = ret;
+        job->state = CJ_DONE;
+        pthread_cond_broadcast(&compress_done_cond);
+    }
+    return NULL;
+}
+
+static void compress_start(int nb_threads)
+{
+    pthread_t thread;
+    sigset_t set, oldset;
+    int i;
+
+    /* the AIO signal is handled by the main thread */
+    sigfillset(&set);
+    pthread_sigmask(SIG_SETMASK, &set, &oldset);
+    for(i = 0; i < nb_threads; i++) {
+        if (pthread_create(&thread, NULL, compress_worker, NULL))
+            break;
+        pthread_detach(thread);
+    }
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+    compress_nb_threads = i;
+}
+#endif
+
+static void compress_submit(CompressJob *job)
+{
+#ifdef CONFIG_AIO_THREADS
+    if (compress_nb_threads > 0) {
+        pthread_mutex_lock(&compress_lock);
+        job->state = CJ_PENDING;
+        job->next = NULL;
+        *compress_last = job;
+        compress_last = &job->next;
+        pthread_cond_signal(&compress_cond);
+        pthread_mutex_unlock(&compress_lock);
+        return;
+    }
+#endif
+    job->ret = bdrv_compress_cluster(compress_bs, job->out_buf, job->buf);
+    job->state = CJ_DONE;
+}
+
+static void compress_wait(CompressJob *job)
+{
+#ifdef CONFIG_AIO_THREADS
+    pthread_mutex_lock(&compress_lock);
+    while (job->state == CJ_PENDING)
+        pthread_cond_wait(&compress_done_cond, &compress_lock);
+    pthread_mutex_unlock(&compress_lock);
+#endif
+}
+
+/* copy the image to the compressed image 'out_bs' with up to 'nb_jobs'
+   clusters being compressed at the same time */
+static void convert_compressed(BlockDriverState *bs, BlockDriverState *out_bs,
+                               int64_t total_sectors, int cluster_sectors,
+                               int nb_jobs)
+{
+    CompressJob jobs[CONVERT_MAX_REQS], *job;
+    int64_t sector_num;
+    int i, n, head, count, cluster_size, ret;
+
+    cluster_size = cluster_sectors * 512;
+    for(i = 0; i < nb_jobs; i++) {
+        jobs[i].buf = qemu_malloc(cluster_size);
+        jobs[i].out_buf = qemu_malloc(cluster_size);
+        if (!jobs[i].buf || !jobs[i].out_buf)
+            error("not enough memory");
+    }
+    compress_bs = out_bs;
+#ifdef CONFIG_AIO_THREADS
+    if (compress_nb_threads == 0) {
+        n = sysconf(_SC_NPROCESSORS_ONLN);
+        if (n > nb_jobs)
+            n = nb_jobs;
+        compress_start(n);
+    }
+#endif
+
+    sector_num = 0;
+    head = 0;
+    count = 0;
+    for(;;) {
+        /* read the next clusters while the previous ones are compressed */
+        while (count < nb_jobs && sector_num < total_sectors) {
+            job = &jobs[(head + count) % nb_jobs];
+            n = cluster_sectors;
+            if (total_sectors - sector_num < n)
+                n = total_sectors - sector_num;
+            job->sector_num = sector_num;
+            job->state = CJ_ZERO;
+            if (convert_skip(bs, sector_num, total_sectors) < n) {
+                if (bdrv_read(bs, sector_num, job->buf, n) < 0) 
+                    error("error while reading");
+                if (n < cluster_sectors)
+                    memset(job->buf + n * 512, 0, cluster_size - n * 512);
+                if (is_not_zero(job->buf, cluster_size))
+                    compress_submit(job);
+            }
+            sector_num += n;
+            count++;
+        }
+        if (count == 0)
+            break;
+        /* write the oldest cluster so that the image is written in order */
+        job = &jobs[head];
+        compress_wait(job);
+        if (job->state == CJ_DONE) {
+            ret = job->ret;
+            if (ret == 0) {
+                ret = bdrv_write(out_bs, job->sector_num, job->buf,
+                                 cluster_sectors);
+            } else if (ret > 0) {
+                ret = bdrv_write_compressed_data(out_bs, job->sector_num,
+                                                 job->out_buf, ret);
+            }
+            if (ret < 0)
+                error("error while compressing sector %" PRId64,
+                      job->sector_num);
+        }
+        head = (head + 1) % nb_jobs;
+        count--;
+    }
+    /* signal EOF to align */
+    bdrv_write_compressed(out_bs, 0, NULL, 0);
+
+    for(i = 0; i < nb_jobs; i++) {
+        qemu_free(jobs[i].buf);
+        qemu_free(jobs[i].out_buf);
+    }
+}
+
 static int img_convert(int argc, char **argv)
 {
-    int c, ret, n, n1, compress, cluster_size, cluster_sectors, encrypt;
+    int c, ret, compress, cluster_size, encrypt, nb_reqs;
     const char *filename, *fmt, *out_fmt, *out_filename;
     BlockDriver *drv;
     BlockDriverState *bs, *out_bs;
-    int64_t total_sectors, nb_sectors, sector_num;
-    uint8_t buf[IO_BUF_SIZE];
-    const uint8_t *buf1;
+    int64_t total_sectors;
     BlockDriverInfo bdi;
+    char backing_filename[1024];
 
     fmt = NULL;
     out_fmt = "raw";
     compress = 0;
     encrypt = 0;
+    nb_reqs = CONVERT_REQS;
     for(;;) {
-        c = getopt(argc, argv, "f:O:hce");
+        c = getopt(argc, argv, "f:O:m:hce");
         if (c == -1)
             break;
         switch(c) {
@@ -438,6 +962,11 @@ static int img_convert(int argc, char **argv)
         case 'O':
             out_fmt = optarg;
             break;
+        case 'm':
+            nb_reqs = atoi(optarg);
+            if (nb_reqs < 1 || nb_reqs > CONVERT_MAX_REQS)
+                error("Invalid number of parallel requests '%s'", optarg);
+            break;
         case 'c':
             compress = 1;
             break;
@@ -453,7 +982,9 @@ static int img_convert(int argc, char **argv)
         help();
     out_filename = argv[optind++];
     
-    bs = bdrv_new_open(filename, fmt);
+    bs = bdrv_new_open(filename, fmt, 0);
+    bdrv_get_backing_filename(bs, backing_filename, sizeof(backing_filename));
+    convert_skip_unallocated = (backing_filename[0] == '\0');
 
     drv = bdrv_find_format(out_fmt);
     if (!drv)
@@ -465,7 +996,8 @@ static int img_convert(int argc, char **argv)
     if (compress && encrypt)
         error("Compression and encryption not supported at the same time");
     bdrv_get_geometry(bs, &total_sectors);
-    ret = bdrv_create(drv, out_filename, total_sectors, NULL, encrypt);
+    ret = bdrv_create(drv, out_filename, total_sectors, NULL,
+                      encrypt ? BLOCK_FLAG_ENCRYPT : 0);
     if (ret < 0) {
         if (ret == -ENOTSUP) {
             error("Formatting not supported for file format '%s'", fmt);
@@ -474,7 +1006,7 @@ static int img_convert(int argc, char **argv)
         }
     }
     
-    out_bs = bdrv_new_open(out_filename, out_fmt);
+    out_bs = bdrv_new_open(out_filename, out_fmt, 0);
 
     if (compress) {
         if (bdrv_get_info(out_bs, &bdi) < 0)
@@ -482,56 +1014,10 @@ static int img_convert(int argc, char **argv)
         cluster_size = bdi.cluster_size;
         if (cluster_size <= 0 || cluster_size > IO_BUF_SIZE)
             error("invalid cluster size");
-        cluster_sectors = cluster_size >> 9;
-        sector_num = 0;
-        for(;;) {
-            nb_sectors = total_sectors - sector_num;
-            if (nb_sectors <= 0)
-                break;
-            if (nb_sectors >= cluster_sectors)
-                n = cluster_sectors;
-            else
-                n = nb_sectors;
-            if (bdrv_read(bs, sector_num, buf, n) < 0) 
-                error("error while reading");
-            if (n < cluster_sectors)
-                memset(buf + n * 512, 0, cluster_size - n * 512);
-            if (is_not_zero(buf, cluster_size)) {
-                if (bdrv_write_compressed(out_bs, sector_num, buf, 
-                                          cluster_sectors) != 0)
-                    error("error while compressing sector %" PRId64,
-                          sector_num);
-            }
-            sector_num += n;
-        }
-        /* signal EOF to align */
-        bdrv_write_compressed(out_bs, 0, NULL, 0);
+        convert_compressed(bs, out_bs, total_sectors, cluster_size >> 9,
+                           nb_reqs);
     } else {
-        sector_num = 0;
-        for(;;) {
-            nb_sectors = total_sectors - sector_num;
-            if (nb_sectors <= 0)
-                break;
-            if (nb_sectors >= (IO_BUF_SIZE / 512))
-                n = (IO_BUF_SIZE / 512);
-            else
-                n = nb_sectors;
-            if (bdrv_read(bs, sector_num, buf, n) < 0) 
-                error("error while reading");
-            /* NOTE: at the same time we convert, we do not write zero
-               sectors to have a chance to compress the image. Ideally, we
-               should add a specific call to have the info to go faster */
-            buf1 = buf;
-            while (n > 0) {
-                if (is_allocated_sectors(buf1, n, &n1)) {
-                    if (bdrv_write(out_bs, sector_num, buf1, n1) < 0) 
-                        error("error while writing");
-                }
-                sector_num += n1;
-                n -= n1;
-                buf1 += n1 * 512;
-            }
-        }
+        convert_copy(bs, out_bs, total_sectors, nb_reqs);
     }
     bdrv_delete(out_bs);
     bdrv_delete(bs);
@@ -664,6 +1150,422 @@ static int img_info(int argc, char **argv)
     return 0;
 }
 
+/* a range of the image with the same allocation */
+typedef struct MapExtent {
+    int64_t start;
+    int64_t length;
+    int64_t host_offset; /* -1 if not stored as is */
+    int depth; /* index of the image in the backing chain */
+    BlockDriverState *file; /* NULL if the range reads as zero */
+} MapExtent;
+
+/* print 's' as a JSON string */
+static void json_print_string(const char *s)
+{
+    int c;
+
+    putchar('"');
+    for(; *s != '\0'; s++) {
+        c = (unsigned char)*s;
+        switch(c) {
+        case '"':
+            printf("\\\"");
+            break;
+        case '\\':
+            printf("\\\\");
+            break;
+        case '\n':
+            printf("\\n");
+            break;
+        case '\r':
+            printf("\\r");
+            break;
+        case '\t':
+            printf("\\t");
+            break;
+        default:
+            if (c < 0x20 || c == 0x7f)
+                printf("\\u%04x", c);
+            else
+                putchar(c);
+            break;
+        }
+    }
+    putchar('"');
+}
+
+static void map_print(MapExtent *e, int json, int first)
+{
+    if (json) {
+        printf("%s{ \"start\": %" PRId64 ", \"length\": %" PRId64
+               ", \"depth\": %d, \"zero\": %s, \"data\": %s",
+               first ? "" : ",\n", e->start, e->length, e->depth,
+               e->file ? "false" : "true", e->file ? "true" : "false");
+        if (e->host_offset >= 0)
+            printf(", \"offset\": %" PRId64, e->host_offset);
+        if (e->file) {
+            printf(", \"file\": ");
+            json_print_string(bdrv_get_filename(e->file));
+        }
+        printf(" }");
+    } else {
+        if (first)
+            printf("%-18s %-18s %-18s %-5s %-4s %s\n", "Offset", "Length",
+                   "Mapped to", "Depth", "Type", "File");
+        printf("0x%-16" PRIx64 " 0x%-16" PRIx64, e->start, e->length);
+        if (e->host_offset >= 0)
+            printf(" 0x%-16" PRIx64, e->host_offset);
+        else
+            printf(" %-18s", "-");
+        printf(" %-5d %-4s %s\n", e->depth, e->file ? "data" : "zero",
+               e->file ? bdrv_get_filename(e->file) : "-");
+    }
+}
+
+static int img_map(int argc, char **argv)
+{
+    int c, json, first, ret, n, depth;
+    const char *filename, *fmt;
+    BlockDriverState *bs, *layer, *backing_hd;
+    int64_t total_sectors, sector_num, run_end, host_offset;
+    MapExtent e, cur;
+
+    fmt = NULL;
+    json = 0;
+    for(;;) {
+        c = getopt(argc, argv, "f:hj");
+        if (c == -1)
+            break;
+        switch(c) {
+        case 'h':
+            help();
+            break;
+        case 'f':
+            fmt = optarg;
+            break;
+        case 'j':
+            json = 1;
+            break;
+        }
+    }
+    if (optind >= argc) 
+        help();
+    filename = argv[optind++];
+
+    bs = bdrv_new_open(filename, fmt, 0);
+    bdrv_get_geometry(bs, &total_sectors);
+
+    if (json)
+        printf("[");
+    first = 1;
+    cur.length = 0;
+    sector_num = 0;
+    while (sector_num < total_sectors) {
+        /* find the image of the backing chain which provides the
+           sectors */
+        n = 1 << 20;
+        if (total_sectors - sector_num < n)
+            n = total_sectors - sector_num;
+        layer = bs;
+        depth = 0;
+        for(;;) {
+            ret = bdrv_is_allocated(layer, sector_num, n, &c);
+            if (ret < 0)
+                error("error while reading the allocation of '%s'",
+                      bdrv_get_filename(layer));
+            if (ret)
+                break;
+            backing_hd = bdrv_get_backing_hd(layer);
+            /* the sectors after the end of a backing file read as zero */
+            if (c == 0 || !backing_hd) {
+                layer = NULL;
+                break;
+            }
+            n = c;
+            layer = backing_hd;
+            depth++;
+        }
+        if (c > 0)
+            n = c;
+        run_end = sector_num + n;
+
+        /* split the run where its data is not contiguous in the file */
+        while (sector_num < run_end) {
+            n = run_end - sector_num;
+            host_offset = -1;
+            if (layer) {
+                host_offset = bdrv_get_host_offset(layer, sector_num, n, &c);
+                if (c > 0 && c < n)
+                    n = c;
+            }
+            e.start = sector_num * 512;
+            e.length = (int64_t)n * 512;
+            e.host_offset = host_offset;
+            e.depth = depth;
+            e.file = layer;
+            if (cur.length > 0 && cur.file == e.file &&
+                cur.depth == e.depth &&
+                cur.start + cur.length == e.start &&
+                ((cur.host_offset < 0 && e.host_offset < 0) ||
+                 (cur.host_offset >= 0 &&
+                  cur.host_offset + cur.length == e.host_offset))) {
+                cur.length += e.length;
+            } else {
+                if (cur.length > 0) {
+                    map_print(&cur, json, first);
+                    first = 0;
+                }
+                cur = e;
+            }
+            sector_num += n;
+        }
+    }
+    if (cur.length > 0)
+        map_print(&cur, json, first);
+    if (json)
+        printf("]\n");
+    bdrv_delete(bs);
+    return 0;
+}
+
+#define BENCH_MAX_DEPTH 256
+
+/* a request of the benchmark */
+typedef struct BenchReq {
+    int64_t start_time;
+    int64_t *latency; /* where to store the latency */
+    int is_write;
+    int ret;
+} BenchReq;
+
+static int bench_in_flight;
+
+/* in microseconds */
+static int64_t bench_clock(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER ti, freq;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&ti);
+    return (ti.QuadPart * 1000000) / freq.QuadPart;
+#else
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000000LL + tv.tv_usec;
+#endif
+}
+
+static void bench_cb(void *opaque, int ret)
+{
+    BenchReq *req = opaque;
+    *req->latency = bench_clock() - req->start_time;
+    req->ret = ret;
+    bench_in_flight--;
+}
+
+static int bench_cmp(const void *a, const void *b)
+{
+    int64_t d = *(const int64_t *)a - *(const int64_t *)b;
+    return d < 0 ? -1 : d > 0;
+}
+
+/* print the latency statistics of 'n' requests (in microseconds) */
+static void bench_print_latency(const char *name, int64_t *lat, int n)
+{
+    int64_t sum;
+    int i;
+
+    if (n == 0)
+        return;
+    qsort(lat, n, sizeof(int64_t), bench_cmp);
+    sum = 0;
+    for(i = 0; i < n; i++)
+        sum += lat[i];
+    printf("%s latency (us): min %" PRId64 " avg %" PRId64
+           " 50%% %" PRId64 " 90%% %" PRId64 " 99%% %" PRId64
+           " 99.9%% %" PRId64 " max %" PRId64 "\n",
+           name, lat[0], sum / n, lat[n / 2],
+           lat[((int64_t)n * 90) / 100], lat[((int64_t)n * 99) / 100],
+           lat[((int64_t)n * 999) / 1000], lat[n - 1]);
+}
+
+static int img_bench(int argc, char **argv)
+{
+    int c, i, flags, depth, count, size, nb_sectors, write_pct, random;
+    int submitted, nb_reads, nb_writes, slot;
+    const char *filename, *fmt, *p;
+    BlockDriverState *bs;
+    BenchReq reqs[BENCH_MAX_DEPTH], *req;
+    uint8_t *buf_base, *buf;
+    int64_t total_sectors, nb_slots, sector_num, start_time, t;
+    int64_t *read_lat, *write_lat;
+    double secs;
+
+    fmt = NULL;
+    flags = 0;
+    count = 10000;
+    depth = 16;
+    size = 4096;
+    write_pct = 0;
+    random = 0;
+    for(;;) {
+        c = getopt(argc, argv, "a:c:d:f:hrs:w:");
+        if (c == -1)
+            break;
+        switch(c) {
+        case 'h':
+            help();
+            break;
+        case 'a':
+            if (!strcmp(optarg, "posix")) {
+                flags = BDRV_O_DIRECT;
+            } else if (!strcmp(optarg, "native")) {
+                flags = BDRV_O_DIRECT | BDRV_O_NATIVE_AIO;
+            } else if (!strcmp(optarg, "threads")) {
+                flags = BDRV_O_AIO_THREADS;
+            } else if (!strcmp(optarg, "threads,direct")) {
+                flags = BDRV_O_AIO_THREADS | BDRV_O_DIRECT;
+            } else {
+                error("Unknown aio method '%s'", optarg);
+            }
+            break;
+        case 'c':
+            count = atoi(optarg);
+            if (count < 1)
+                error("Invalid request count '%s'", optarg);
+            break;
+        case 'd':
+            depth = atoi(optarg);
+            if (depth < 1 || depth > BENCH_MAX_DEPTH)
+                error("Invalid queue depth '%s'", optarg);
+            break;
+        case 'f':
+            fmt = optarg;
+            break;
+        case 'r':
+            random = 1;
+            break;
+        case 's':
+            p = optarg;
+            size = strtoul(p, (char **)&p, 0);
+            if (*p == 'M') {
+                size *= 1024 * 1024;
+            } else if (*p == 'k' || *p == 'K') {
+                size *= 1024;
+            } else if (*p != '\0') {
+                help();
+            }
+            if (size <= 0 || (size & 511) || size > 16 * 1024 * 1024)
+                error("Invalid request size '%s'", optarg);
+            break;
+        case 'w':
+            write_pct = atoi(optarg);
+            if (write_pct < 0 || write_pct > 100)
+                error("Invalid write percentage '%s'", optarg);
+            break;
+        }
+    }
+    if (optind >= argc) 
+        help();
+    filename = argv[optind++];
+
+    bs = bdrv_new_open(filename, fmt, flags);
+    bdrv_get_geometry(bs, &total_sectors);
+    nb_sectors = size >> 9;
+    nb_slots = total_sectors / nb_sectors;
+    if (nb_slots <= 0)
+        error("Image too small for requests of %d bytes", size);
+
+    /* aligned for O_DIRECT */
+    buf_base = qemu_malloc(depth * size + 511);
+    read_lat = qemu_malloc(count * sizeof(int64_t));
+    write_lat = qemu_malloc(count * sizeof(int64_t));
+    if (!buf_base || !read_lat || !write_lat)
+        error("Not enough memory");
+    buf = (uint8_t *)(((unsigned long)buf_base + 511) & ~511UL);
+    for(i = 0; i < depth * size; i++)
+        buf[i] = i;
+    for(i = 0; i < depth; i++)
+        reqs[i].latency = NULL;
+
+    printf("Sending %d %s requests, %d bytes each, %d in parallel, "
+           "%d%% writes\n", count, random ? "random" : "sequential",
+           size, depth, write_pct);
+    srand(1);
+    submitted = 0;
+    nb_reads = 0;
+    nb_writes = 0;
+    sector_num = 0;
+    slot = 0;
+    bench_in_flight = 0;
+    start_time = bench_clock();
+    qemu_aio_wait_start();
+    while (submitted < count || bench_in_flight > 0) {
+        if (submitted == count || bench_in_flight == depth) {
+            qemu_aio_wait();
+            continue;
+        }
+        /* the requests complete in any order: find a free buffer */
+        while (reqs[slot].latency && bench_in_flight > 0 &&
+               *reqs[slot].latency < 0)
+            slot = (slot + 1) % depth;
+        req = &reqs[slot];
+        if (req->latency && req->ret < 0)
+            error("I/O error");
+        if (random) {
+            sector_num = ((((int64_t)rand() << 31) | rand()) % nb_slots) *
+                nb_sectors;
+        } else if (sector_num + nb_sectors > total_sectors) {
+            sector_num = 0;
+        }
+        req->is_write = (rand() % 100) < write_pct;
+        if (req->is_write)
+            req->latency = &write_lat[nb_writes++];
+        else
+            req->latency = &read_lat[nb_reads++];
+        /* -1 until the request completes */
+        *req->latency = -1;
+        req->ret = 0;
+        bench_in_flight++;
+        req->start_time = bench_clock();
+        if (req->is_write) {
+            if (!bdrv_aio_write(bs, sector_num, buf + slot * size,
+                                nb_sectors, bench_cb, req) &&
+                *req->latency < 0)
+                error("I/O error");
+        } else {
+            if (!bdrv_aio_read(bs, sector_num, buf + slot * size,
+                               nb_sectors, bench_cb, req) &&
+                *req->latency < 0)
+                error("I/O error");
+        }
+        submitted++;
+        sector_num += nb_sectors;
+        slot = (slot + 1) % depth;
+    }
+    qemu_aio_wait_end();
+    t = bench_clock() - start_time;
+    for(i = 0; i < depth; i++) {
+        if (reqs[i].latency && reqs[i].ret < 0)
+            error("I/O error");
+    }
+
+    secs = t / 1000000.0;
+    if (secs <= 0)
+        secs = 0.000001;
+    printf("Run completed in %.3f seconds.\n", secs);
+    printf("%.0f IOPS, %.2f MB/s\n", count / secs,
+           (double)count * size / (1024 * 1024) / secs);
+    bench_print_latency("read", read_lat, nb_reads);
+    bench_print_latency("write", write_lat, nb_writes);
+
+    qemu_free(read_lat);
+    qemu_free(write_lat);
+    qemu_free(buf_base);
+    bdrv_delete(bs);
+    return 0;
+}
+
 int main(int argc, char **argv)
 {
     const char *cmd;
@@ -677,10 +1579,16 @@ int main(int argc, char **argv)
         img_create(argc, argv);
     } else if (!strcmp(cmd, "commit")) {
         img_commit(argc, argv);
+    } else if (!strcmp(cmd, "rebase")) {
+        img_rebase(argc, argv);
     } else if (!strcmp(cmd, "convert")) {
         img_convert(argc, argv);
     } else if (!strcmp(cmd, "info")) {
         img_info(argc, argv);
+    } else if (!strcmp(cmd, "bench")) {
+        img_bench(argc, argv);
+    } else if (!strcmp(cmd, "map")) {
+        img_map(argc, argv);
     } else {
         help();
     }
@@ -118,7 +118,7 @@ void REGPARM(2) glue(glue(__st, SUFFIX), MMUSUFFIX)(target_ulong addr, DATA_TYPE
 #if (DATA_SIZE <= 4) && (TARGET_LONG_BITS == 32) && defined(__i386__) && \
     (ACCESS_TYPE <= 1) && defined(ASM_SOFTMMU)
 
-#define CPU_TLB_ENTRY_BITS 4
+#define CPU_TLB_ENTRY_BITS 5
 
 static inline RES_TYPE glue(glue(ld, USUFFIX), MEMSUFFIX)(target_ulong ptr)
 {
@@ -132,14 +132,18 @@ static inline RES_TYPE glue(glue(ld, USUFFIX), MEMSUFFIX)(target_ulong ptr)
                   "leal %5(%%edx, %%ebp), %%edx\n"
                   "cmpl (%%edx), %%eax\n"
                   "movl %1, %%eax\n"
+                  "jne 3f\n"
+                  "movl %8(%%ebp), %%ecx\n"
+                  "cmpl 12(%%edx), %%ecx\n"
                   "je 1f\n"
+                  "3:\n"
                   "pushl %6\n"
                   "call %7\n"
                   "popl %%edx\n"
                   "movl %%eax, %0\n"
                   "jmp 2f\n"
                   "1:\n"
-                  "addl 12(%%edx), %%eax\n"
+                  "addl 16(%%edx), %%eax\n"
 #if DATA_SIZE == 1
                   "movzbl (%%eax), %0\n"
 #elif DATA_SIZE == 2
@@ -157,7 +161,8 @@ static inline RES_TYPE glue(glue(ld, USUFFIX), MEMSUFFIX)(target_ulong ptr)
                   "i" (TARGET_PAGE_MASK | (DATA_SIZE - 1)),
                   "m" (*(uint32_t *)offsetof(CPUState, tlb_table[CPU_MEM_INDEX][0].addr_read)),
                   "i" (CPU_MEM_INDEX),
-                  "m" (*(uint8_t *)&glue(glue(__ld, SUFFIX), MMUSUFFIX))
+                  "m" (*(uint8_t *)&glue(glue(__ld, SUFFIX), MMUSUFFIX)),
+                  "m" (*(uint32_t *)offsetof(CPUState, tlb_gen))
                   : "%eax", "%ecx", "%edx", "memory", "cc");
     return res;
 }
@@ -175,7 +180,11 @@ static inline int glue(glue(lds, SUFFIX), MEMSUFFIX)(target_ulong ptr)
                   "leal %5(%%edx, %%ebp), %%edx\n"
                   "cmpl (%%edx), %%eax\n"
                   "movl %1, %%eax\n"
+                  "jne 3f\n"
+                  "movl %8(%%ebp), %%ecx\n"
+                  "cmpl 12(%%edx), %%ecx\n"
                   "je 1f\n"
+                  "3:\n"
                   "pushl %6\n"
                   "call %7\n"
                   "popl %%edx\n"
@@ -188,7 +197,7 @@ static inline int glue(glue(lds, SUFFIX), MEMSUFFIX)(target_ulong ptr)
 #endif
                   "jmp 2f\n"
                   "1:\n"
-                  "addl 12(%%edx), %%eax\n"
+                  "addl 16(%%edx), %%eax\n"
 #if DATA_SIZE == 1
                   "movsbl (%%eax), %0\n"
 #elif DATA_SIZE == 2
@@ -204,7 +213,8 @@ static inline int glue(glue(lds, SUFFIX), MEMSUFFIX)(target_ulong ptr)
                   "i" (TARGET_PAGE_MASK | (DATA_SIZE - 1)),
                   "m" (*(uint32_t *)offsetof(CPUState, tlb_table[CPU_MEM_INDEX][0].addr_read)),
                   "i" (CPU_MEM_INDEX),
-                  "m" (*(uint8_t *)&glue(glue(__ld, SUFFIX), MMUSUFFIX))
+                  "m" (*(uint8_t *)&glue(glue(__ld, SUFFIX), MMUSUFFIX)),
+                  "m" (*(uint32_t *)offsetof(CPUState, tlb_gen))
                   : "%eax", "%ecx", "%edx", "memory", "cc");
     return res;
 }
@@ -220,7 +230,11 @@ static inline void glue(glue(st, SUFFIX), MEMSUFFIX)(target_ulong ptr, RES_TYPE
                   "leal %5(%%edx, %%ebp), %%edx\n"
                   "cmpl (%%edx), %%eax\n"
                   "movl %0, %%eax\n"
+                  "jne 3f\n"
+                  "movl %8(%%ebp), %%ecx\n"
+                  "cmpl 8(%%edx), %%ecx\n"
                   "je 1f\n"
+                  "3:\n"
 #if DATA_SIZE == 1
                   "movzbl %b1, %%edx\n"
 #elif DATA_SIZE == 2
@@ -235,7 +249,7 @@ static inline void glue(glue(st, SUFFIX), MEMSUFFIX)(target_ulong ptr, RES_TYPE
                   "popl %%eax\n"
                   "jmp 2f\n"
                   "1:\n"
-                  "addl 8(%%edx), %%eax\n"
+                  "addl 12(%%edx), %%eax\n"
 #if DATA_SIZE == 1
                   "movb %b1, (%%eax)\n"
 #elif DATA_SIZE == 2
@@ -256,7 +270,8 @@ static inline void glue(glue(st, SUFFIX), MEMSUFFIX)(target_ulong ptr, RES_TYPE
                   "i" (TARGET_PAGE_MASK | (DATA_SIZE - 1)),
                   "m" (*(uint32_t *)offsetof(CPUState, tlb_table[CPU_MEM_INDEX][0].addr_write)),
                   "i" (CPU_MEM_INDEX),
-                  "m" (*(uint8_t *)&glue(glue(__st, SUFFIX), MMUSUFFIX))
+                  "m" (*(uint8_t *)&glue(glue(__st, SUFFIX), MMUSUFFIX)),
+                  "m" (*(uint32_t *)offsetof(CPUState, tlb_gen))
                   : "%eax", "%ecx", "%edx", "memory", "cc");
 }
 
@@ -276,7 +291,9 @@ static inline RES_TYPE glue(glue(ld, USUFFIX), MEMSUFFIX)(target_ulong ptr)
     index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
     is_user = CPU_MEM_INDEX;
     if (__builtin_expect(env->tlb_table[is_user][index].ADDR_READ != 
-                         (addr & (TARGET_PAGE_MASK | (DATA_SIZE - 1))), 0)) {
+                         (addr & (TARGET_PAGE_MASK | (DATA_SIZE - 1))) ||
+                         env->tlb_table[is_user][index].gen != env->tlb_gen,
+                         0)) {
         res = glue(glue(__ld, SUFFIX), MMUSUFFIX)(addr, is_user);
     } else {
         physaddr = addr + env->tlb_table[is_user][index].addend;
@@ -297,7 +314,9 @@ static inline int glue(glue(lds, SUFFIX), MEMSUFFIX)(target_ulong ptr)
     index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
     is_user = CPU_MEM_INDEX;
     if (__builtin_expect(env->tlb_table[is_user][index].ADDR_READ != 
-                         (addr & (TARGET_PAGE_MASK | (DATA_SIZE - 1))), 0)) {
+                         (addr & (TARGET_PAGE_MASK | (DATA_SIZE - 1))) ||
+                         env->tlb_table[is_user][index].gen != env->tlb_gen,
+                         0)) {
         res = (DATA_STYPE)glue(glue(__ld, SUFFIX), MMUSUFFIX)(addr, is_user);
     } else {
         physaddr = addr + env->tlb_table[is_user][index].addend;
@@ -322,7 +341,9 @@ static inline void glue(glue(st, SUFFIX), MEMSUFFIX)(target_ulong ptr, RES_TYPE
     index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
     is_user = CPU_MEM_INDEX;
     if (__builtin_expect(env->tlb_table[is_user][index].addr_write != 
-                         (addr & (TARGET_PAGE_MASK | (DATA_SIZE - 1))), 0)) {
+                         (addr & (TARGET_PAGE_MASK | (DATA_SIZE - 1))) ||
+                         env->tlb_table[is_user][index].gen != env->tlb_gen,
+                         0)) {
         glue(glue(__st, SUFFIX), MMUSUFFIX)(addr, v, is_user);
     } else {
         physaddr = addr + env->tlb_table[is_user][index].addend;
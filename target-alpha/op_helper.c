@@ -1172,7 +1172,8 @@ void helper_ld_phys_to_virt (void)
  redo:
     tlb_addr = env->tlb_table[is_user][index].addr_read;
     if ((T0 & TARGET_PAGE_MASK) ==
-        (tlb_addr & (TARGET_PAGE_MASK | TLB_INVALID_MASK))) {
+        (tlb_addr & (TARGET_PAGE_MASK | TLB_INVALID_MASK)) &&
+        env->tlb_table[is_user][index].gen == env->tlb_gen) {
         physaddr = T0 + env->tlb_table[is_user][index].addend;
     } else {
         /* the page is not in the TLB : fill it */
@@ -1194,7 +1195,8 @@ void helper_st_phys_to_virt (void)
  redo:
     tlb_addr = env->tlb_table[is_user][index].addr_write;
     if ((T0 & TARGET_PAGE_MASK) ==
-        (tlb_addr & (TARGET_PAGE_MASK | TLB_INVALID_MASK))) {
+        (tlb_addr & (TARGET_PAGE_MASK | TLB_INVALID_MASK)) &&
+        env->tlb_table[is_user][index].gen == env->tlb_gen) {
         physaddr = T0 + env->tlb_table[is_user][index].addend;
     } else {
         /* the page is not in the TLB : fill it */
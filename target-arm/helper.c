@@ -397,7 +397,8 @@ static inline int check_ap(CPUState *env, int ap, int domain, int access_type,
 }
 
 static int get_phys_addr(CPUState *env, uint32_t address, int access_type,
-                         int is_user, uint32_t *phys_ptr, int *prot)
+                         int is_user, uint32_t *phys_ptr, int *prot,
+                         uint32_t *page_size)
 {
     int code;
     uint32_t table;
@@ -410,6 +411,7 @@ static int get_phys_addr(CPUState *env, uint32_t address, int access_type,
     /* Fast Context Switch Extension.  */
     if (address < 0x02000000)
         address += env->cp15.c13_fcse;
+    *page_size = TARGET_PAGE_SIZE;
 
     if ((env->cp15.c1_sys & 1) == 0) {
         /* MMU/MPU disabled.  */
@@ -493,6 +495,7 @@ static int get_phys_addr(CPUState *env, uint32_t address, int access_type,
             phys_addr = (desc & 0xfff00000) | (address & 0x000fffff);
             ap = (desc >> 10) & 3;
             code = 13;
+            *page_size = 0x100000;
         } else {
             /* Lookup l2 entry.  */
             if (type == 1) {
@@ -510,6 +513,7 @@ static int get_phys_addr(CPUState *env, uint32_t address, int access_type,
             case 1: /* 64k page.  */
                 phys_addr = (desc & 0xffff0000) | (address & 0xffff);
                 ap = (desc >> (4 + ((address >> 13) & 6))) & 3;
+                *page_size = 0x10000;
                 break;
             case 2: /* 4k page.  */
                 phys_addr = (desc & 0xfffff000) | (address & 0xfff);
@@ -555,12 +559,28 @@ do_fault:
 int cpu_arm_handle_mmu_fault (CPUState *env, target_ulong address,
                               int access_type, int is_user, int is_softmmu)
 {
-    uint32_t phys_addr;
-    int prot;
+    uint32_t phys_addr, page_size;
+    int prot, large_prot;
     int ret;
 
-    ret = get_phys_addr(env, address, access_type, is_user, &phys_addr, &prot);
+    ret = get_phys_addr(env, address, access_type, is_user, &phys_addr, &prot,
+                        &page_size);
     if (ret == 0) {
+        /* Sections and 64k pages are refilled without a page table
+           walk. The 64k pages have access permissions for each 16k
+           subpage, so only the subpage is recorded. get_phys_addr()
+           does not check the permissions of the first 16k of the
+           address space, so the mapping holding them is not recorded:
+           the rest of it may have other permissions.  */
+        if (page_size >= 0x10000) {
+            if (page_size == 0x10000)
+                page_size = 0x4000;
+            if ((address & ~(page_size - 1)) >= 0x4000) {
+                large_prot = (prot & PAGE_READ) ? prot | PAGE_EXEC : prot;
+                tlb_set_large_page(env, address, phys_addr, page_size,
+                                   large_prot, is_user);
+            }
+        }
         /* Map a single [sub]page.  */
         phys_addr &= ~(uint32_t)0x3ff;
         address &= ~(uint32_t)0x3ff;
@@ -582,11 +602,11 @@ int cpu_arm_handle_mmu_fault (CPUState *env, target_ulong address,
 
 target_phys_addr_t cpu_get_phys_page_debug(CPUState *env, target_ulong addr)
 {
-    uint32_t phys_addr;
+    uint32_t phys_addr, page_size;
     int prot;
     int ret;
 
-    ret = get_phys_addr(env, addr, 0, 0, &phys_addr, &prot);
+    ret = get_phys_addr(env, addr, 0, 0, &phys_addr, &prot, &page_size);
 
     if (ret != 0)
         return -1;
@@ -757,18 +777,14 @@ void helper_set_cp15(CPUState *env, uint32_t insn, uint32_t val)
             tlb_flush(env, 0);
             break;
         case 1: /* Invalidate single TLB entry.  */
-#if 0
-            /* ??? This is wrong for large pages and sections.  */
-            /* As an ugly hack to make linux work we always flush a 4K
-               pages.  */
+            /* tlb_flush_page() flushes everything for sections and
+               large pages. As an ugly hack to make linux work we
+               always flush a 4K page.  */
             val &= 0xfffff000;
             tlb_flush_page(env, val);
             tlb_flush_page(env, val + 0x400);
             tlb_flush_page(env, val + 0x800);
             tlb_flush_page(env, val + 0xc00);
-#else
-            tlb_flush(env, 1);
-#endif
             break;
         default:
             goto bad_reg;
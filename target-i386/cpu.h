@@ -34,6 +34,15 @@
    close to the modifying instruction */
 #define TARGET_HAS_PRECISE_SMC
 
+/* hot TBs can be retranslated as superblocks following direct jumps */
+#define TARGET_HAS_SUPERBLOCKS
+
+/* dead lazy flag updates are removed before code generation */
+#define TARGET_HAS_OP_LIVENESS
+
+/* the CPUs can run in their own host threads (-vcpu-threads) */
+#define TARGET_HAS_VCPU_THREADS
+
 #define TARGET_HAS_ICE 1
 
 #ifdef TARGET_X86_64
@@ -516,6 +525,7 @@ typedef struct CPUX86State {
     int interrupt_request; 
     int user_mode_only; /* user mode only simulation */
     int old_exception;  /* exception in flight */
+    int lock_held; /* inside a LOCK prefixed instruction */
 
     CPU_COMMON
 
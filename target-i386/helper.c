@@ -99,10 +99,12 @@ spinlock_t global_cpu_lock = SPIN_LOCK_UNLOCKED;
 void cpu_lock(void)
 {
     spin_lock(&global_cpu_lock);
+    env->lock_held = 1;
 }
 
 void cpu_unlock(void)
 {
+    env->lock_held = 0;
     spin_unlock(&global_cpu_lock);
 }
 
@@ -1293,7 +1295,9 @@ void do_smm_enter(void)
     }
 
     env->hflags |= HF_SMM_MASK;
+    qemu_global_lock();
     cpu_smm_update(env);
+    qemu_global_unlock();
 
     sm_state = env->smbase + 0x8000;
     
@@ -1533,7 +1537,9 @@ void helper_rsm(void)
 #endif
     CC_OP = CC_OP_EFLAGS;
     env->hflags &= ~HF_SMM_MASK;
+    qemu_global_lock();
     cpu_smm_update(env);
+    qemu_global_unlock();
 
     if (loglevel & CPU_LOG_INT) {
         fprintf(logfile, "SMM: after RSM\n");
@@ -2657,7 +2663,9 @@ void helper_movl_crN_T0(int reg)
         cpu_x86_update_cr4(env, T0);
         break;
     case 8:
+        qemu_global_lock();
         cpu_set_apic_tpr(env, T0);
+        qemu_global_unlock();
         break;
     default:
         env->cr[reg] = T0;
@@ -2715,7 +2723,9 @@ void helper_wrmsr(void)
         env->sysenter_eip = val;
         break;
     case MSR_IA32_APICBASE:
+        qemu_global_lock();
         cpu_set_apic_base(env, val);
+        qemu_global_unlock();
         break;
     case MSR_EFER:
         {
@@ -2779,7 +2789,9 @@ void helper_rdmsr(void)
         val = env->sysenter_eip;
         break;
     case MSR_IA32_APICBASE:
+        qemu_global_lock();
         val = cpu_get_apic_base(env);
+        qemu_global_unlock();
         break;
     case MSR_EFER:
         val = env->efer;
@@ -3012,7 +3024,9 @@ void fpu_raise_exception(void)
     } 
 #if !defined(CONFIG_USER_ONLY) 
     else {
+        qemu_global_lock();
         cpu_set_ferr(env);
+        qemu_global_unlock();
     }
 #endif
 }
@@ -853,7 +853,11 @@ int cpu_x86_handle_mmu_fault(CPUX86State *env, target_ulong addr,
     pte = pte & env->a20_mask;
 
     /* Even if 4MB pages, we map only one 4KB page in the cache to
-       avoid filling it too fast */
+       avoid filling it too fast. The other 4KB pages are refilled
+       from the recorded large page without walking the page tables. */
+    if (page_size > TARGET_PAGE_SIZE)
+        tlb_set_large_page(env, virt_addr, pte & TARGET_PAGE_MASK,
+                           page_size, prot, is_user);
     page_offset = (addr & TARGET_PAGE_MASK) & (page_size - 1);
     paddr = (pte & TARGET_PAGE_MASK) + page_offset;
     vaddr = virt_addr + page_offset;
@@ -0,0 +1,141 @@
+/*
+ *  i386 micro operation def/use table for the liveness pass
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+/* DEF_LIVE(op, def, use): 'def' is the lazy flag state written by
+   the op and 'use' the state it reads. Only ops listed here may be
+   moved across or removed: they must not fault, call helpers or
+   branch. Every other op is assumed to read all the state. */
+
+#define LIVE_CC_OP  0x01
+#define LIVE_CC_SRC 0x02
+#define LIVE_CC_DST 0x04
+#define LIVE_ALL    (LIVE_CC_OP | LIVE_CC_SRC | LIVE_CC_DST)
+
+#ifdef DEF_LIVE
+
+/* flag updates */
+DEF_LIVE(update2_cc, LIVE_CC_SRC | LIVE_CC_DST, 0)
+DEF_LIVE(update1_cc, LIVE_CC_DST, 0)
+DEF_LIVE(update_neg_cc, LIVE_CC_SRC | LIVE_CC_DST, 0)
+DEF_LIVE(cmpl_T0_T1_cc, LIVE_CC_SRC | LIVE_CC_DST, 0)
+DEF_LIVE(testl_T0_T1_cc, LIVE_CC_DST, 0)
+DEF_LIVE(set_cc_op, LIVE_CC_OP, 0)
+
+/* operations without flags */
+DEF_LIVE(addl_T0_T1, 0, 0)
+DEF_LIVE(orl_T0_T1, 0, 0)
+DEF_LIVE(andl_T0_T1, 0, 0)
+DEF_LIVE(subl_T0_T1, 0, 0)
+DEF_LIVE(xorl_T0_T1, 0, 0)
+DEF_LIVE(negl_T0, 0, 0)
+DEF_LIVE(incl_T0, 0, 0)
+DEF_LIVE(decl_T0, 0, 0)
+DEF_LIVE(notl_T0, 0, 0)
+
+DEF_LIVE(movl_T0_imu, 0, 0)
+DEF_LIVE(movl_T0_im, 0, 0)
+DEF_LIVE(addl_T0_im, 0, 0)
+DEF_LIVE(andl_T0_ffff, 0, 0)
+DEF_LIVE(andl_T0_im, 0, 0)
+DEF_LIVE(movl_T0_T1, 0, 0)
+DEF_LIVE(movl_T1_imu, 0, 0)
+DEF_LIVE(movl_T1_im, 0, 0)
+DEF_LIVE(addl_T1_im, 0, 0)
+DEF_LIVE(movl_T1_A0, 0, 0)
+DEF_LIVE(movl_A0_im, 0, 0)
+DEF_LIVE(addl_A0_im, 0, 0)
+DEF_LIVE(movl_A0_seg, 0, 0)
+DEF_LIVE(addl_A0_seg, 0, 0)
+DEF_LIVE(addl_A0_AL, 0, 0)
+DEF_LIVE(andl_A0_ffff, 0, 0)
+DEF_LIVE(movl_T0_0, 0, 0)
+DEF_LIVE(movsbl_T0_T0, 0, 0)
+DEF_LIVE(movzbl_T0_T0, 0, 0)
+DEF_LIVE(movswl_T0_T0, 0, 0)
+DEF_LIVE(movzwl_T0_T0, 0, 0)
+DEF_LIVE(movl_eip_im, 0, 0)
+#ifdef TARGET_X86_64
+DEF_LIVE(movq_T0_im64, 0, 0)
+DEF_LIVE(movq_T1_im64, 0, 0)
+DEF_LIVE(movq_A0_im, 0, 0)
+DEF_LIVE(movq_A0_im64, 0, 0)
+DEF_LIVE(addq_A0_im, 0, 0)
+DEF_LIVE(addq_A0_im64, 0, 0)
+DEF_LIVE(movq_A0_seg, 0, 0)
+DEF_LIVE(addq_A0_seg, 0, 0)
+DEF_LIVE(addq_A0_AL, 0, 0)
+DEF_LIVE(movslq_T0_T0, 0, 0)
+DEF_LIVE(movq_eip_im, 0, 0)
+DEF_LIVE(movq_eip_im64, 0, 0)
+#endif
+
+/* register moves (see opreg_template.h) */
+#define DEF_LIVE_REG(reg)                       \
+DEF_LIVE(movl_A0 ## reg, 0, 0)                  \
+DEF_LIVE(addl_A0 ## reg, 0, 0)                  \
+DEF_LIVE(addl_A0 ## reg ## _s1, 0, 0)           \
+DEF_LIVE(addl_A0 ## reg ## _s2, 0, 0)           \
+DEF_LIVE(addl_A0 ## reg ## _s3, 0, 0)           \
+DEF_LIVE(movl_T0 ## reg, 0, 0)                  \
+DEF_LIVE(movl_T1 ## reg, 0, 0)                  \
+DEF_LIVE(movl ## reg ## _T0, 0, 0)              \
+DEF_LIVE(movl ## reg ## _T1, 0, 0)              \
+DEF_LIVE(movl ## reg ## _A0, 0, 0)              \
+DEF_LIVE(movw ## reg ## _T0, 0, 0)              \
+DEF_LIVE(movw ## reg ## _T1, 0, 0)              \
+DEF_LIVE(movw ## reg ## _A0, 0, 0)              \
+DEF_LIVE(movb ## reg ## _T0, 0, 0)              \
+DEF_LIVE(movb ## reg ## _T1, 0, 0)
+
+#ifdef TARGET_X86_64
+#define DEF_LIVE_REG64(reg)                     \
+DEF_LIVE(movq_A0 ## reg, 0, 0)                  \
+DEF_LIVE(addq_A0 ## reg, 0, 0)                  \
+DEF_LIVE(movq ## reg ## _T0, 0, 0)              \
+DEF_LIVE(movq ## reg ## _T1, 0, 0)              \
+DEF_LIVE(movq ## reg ## _A0, 0, 0)
+#else
+#define DEF_LIVE_REG64(reg)
+#endif
+
+#define DEF_LIVE_REGS(reg) DEF_LIVE_REG(reg) DEF_LIVE_REG64(reg)
+
+DEF_LIVE_REGS(_EAX)
+DEF_LIVE_REGS(_ECX)
+DEF_LIVE_REGS(_EDX)
+DEF_LIVE_REGS(_EBX)
+DEF_LIVE_REGS(_ESP)
+DEF_LIVE_REGS(_EBP)
+DEF_LIVE_REGS(_ESI)
+DEF_LIVE_REGS(_EDI)
+#ifdef TARGET_X86_64
+DEF_LIVE_REGS(_R8)
+DEF_LIVE_REGS(_R9)
+DEF_LIVE_REGS(_R10)
+DEF_LIVE_REGS(_R11)
+DEF_LIVE_REGS(_R12)
+DEF_LIVE_REGS(_R13)
+DEF_LIVE_REGS(_R14)
+DEF_LIVE_REGS(_R15)
+#endif
+
+#undef DEF_LIVE_REGS
+#undef DEF_LIVE_REG64
+#undef DEF_LIVE_REG
+
+#endif /* DEF_LIVE */
@@ -101,6 +101,9 @@ typedef struct DisasContext {
     int rip_offset; /* only used in x86_64, but left for simplicity */
     int cpuid_features;
     int cpuid_ext_features;
+    int nb_followed_jmps; /* number of direct jumps followed (superblocks) */
+    int follow_jmp; /* if non zero, continue the translation at follow_pc */
+    target_ulong follow_pc;
 } DisasContext;
 
 static void gen_eob(DisasContext *s);
@@ -2285,11 +2288,44 @@ static void gen_eob(DisasContext *s)
     s->is_jmp = 3;
 }
 
+/* maximum number of direct jumps followed in a superblock */
+#define MAX_FOLLOWED_JMPS 8
+
+/* Return TRUE if the translation can continue at eip instead of
+   ending the TB with a jump. Only forward jumps inside the page of the
+   TB are followed so that the TB still covers a contiguous guest code
+   range of one page. */
+static inline int gen_follow_jmp(DisasContext *s, target_ulong eip)
+{
+    target_ulong pc;
+
+    pc = s->cs_base + eip;
+    if (pc < s->pc || (pc - s->tb->pc) >= (TARGET_PAGE_SIZE - 64) ||
+        (pc & TARGET_PAGE_MASK) != (s->tb->pc & TARGET_PAGE_MASK))
+        return 0;
+    if (!(s->tb->cflags & CF_SUPERBLOCK)) {
+        /* this TB is worth retranslating as a superblock if hot */
+        s->tb->cflags |= CF_SB_JUMP;
+        return 0;
+    }
+    if (s->nb_followed_jmps >= MAX_FOLLOWED_JMPS) {
+        s->tb->cflags |= CF_SB_JUMP;
+        return 0;
+    }
+    s->nb_followed_jmps++;
+    s->follow_jmp = 1;
+    s->follow_pc = pc;
+    return 1;
+}
+
 /* generate a jump to eip. No segment change must happen before as a
    direct call to the next block may occur */
 static void gen_jmp_tb(DisasContext *s, target_ulong eip, int tb_num)
 {
     if (s->jmp_opt) {
+        /* in a superblock, the cc_op stays static across the jump */
+        if (tb_num == 0 && gen_follow_jmp(s, eip))
+            return;
         if (s->cc_op != CC_OP_DYNAMIC) {
             gen_op_set_cc_op(s->cc_op);
             s->cc_op = CC_OP_DYNAMIC;
@@ -6492,6 +6528,8 @@ static inline int gen_intermediate_code_internal(CPUState *env,
     }
     dc->cpuid_features = env->cpuid_features;
     dc->cpuid_ext_features = env->cpuid_ext_features;
+    dc->nb_followed_jmps = 0;
+    dc->follow_jmp = 0;
 #ifdef TARGET_X86_64
     dc->lma = (flags >> HF_LMA_SHIFT) & 1;
     dc->code64 = (flags >> HF_CS64_SHIFT) & 1;
@@ -6542,6 +6580,11 @@ static inline int gen_intermediate_code_internal(CPUState *env,
         /* stop translation if indicated */
         if (dc->is_jmp)
             break;
+        /* superblock: continue at the target of a direct jump */
+        if (dc->follow_jmp) {
+            pc_ptr = dc->follow_pc;
+            dc->follow_jmp = 0;
+        }
         /* if single step mode, we generate only one instruction and
            generate an exception */
         /* if irq were inhibited with HF_INHIBIT_IRQ_MASK, we clear
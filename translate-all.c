@@ -59,15 +59,15 @@ uint32_t gen_opc_hflags[OPC_BUF_SIZE];
 
 int code_copy_enabled = 1;
 
-#ifdef DEBUG_DISAS
-static const char *op_str[] = {
-#define DEF(s, n, copy_size) #s,
+static uint8_t op_nb_args[] = {
+#define DEF(s, n, copy_size) n,
 #include "opc.h"
 #undef DEF
 };
 
-static uint8_t op_nb_args[] = {
-#define DEF(s, n, copy_size) n,
+#ifdef DEBUG_DISAS
+static const char *op_str[] = {
+#define DEF(s, n, copy_size) #s,
 #include "opc.h"
 #undef DEF
 };
@@ -103,6 +103,60 @@ void dump_ops(const uint16_t *opc_buf, const uint32_t *opparam_buf)
 
 #endif
 
+#ifdef TARGET_HAS_OP_LIVENESS
+#include "oplive.h"
+
+/* set in opc_live_use[] for the ops described by the target */
+#define LIVE_KNOWN 0x80
+
+static const uint8_t opc_live_def[NB_OPS] = {
+#define DEF_LIVE(op, def, use) [INDEX_op_ ## op] = (def),
+#include "oplive.h"
+#undef DEF_LIVE
+};
+
+static const uint8_t opc_live_use[NB_OPS] = {
+#define DEF_LIVE(op, def, use) [INDEX_op_ ## op] = (use) | LIVE_KNOWN,
+#include "oplive.h"
+#undef DEF_LIVE
+};
+
+static const uint16_t opc_nop[4] = {
+    INDEX_op_nop, INDEX_op_nop1, INDEX_op_nop2, INDEX_op_nop3,
+};
+
+/* Dead state elimination: we move backward thru the generated code
+   and replace by a nop every op whose only effect is to write state
+   which is overwritten before being read. Ops unknown to the target
+   table are considered to read all the state, so this is safe across
+   helpers, faults, branches and the end of the block. The op indexes
+   are unchanged, so cpu_restore_state() must run the same pass. */
+static void optimize_liveness(uint16_t *opc_buf)
+{
+    uint16_t *opc_ptr;
+    int live, def, use, op;
+
+    for(opc_ptr = opc_buf; *opc_ptr != INDEX_op_end; opc_ptr++);
+
+    live = LIVE_ALL;
+    while (opc_ptr > opc_buf) {
+        op = *--opc_ptr;
+        use = opc_live_use[op];
+        if (!(use & LIVE_KNOWN)) {
+            live = LIVE_ALL;
+            continue;
+        }
+        def = opc_live_def[op];
+        if (def != 0 && (live & def) == 0 && op_nb_args[op] <= 3) {
+            /* keep the parameters in place for dyngen_code() */
+            *opc_ptr = opc_nop[op_nb_args[op]];
+            continue;
+        }
+        live = (live & ~def) | (use & ~LIVE_KNOWN);
+    }
+}
+#endif
+
 /* compute label info */
 static void dyngen_labels(long *gen_labels, int nb_gen_labels,
                           uint8_t *gen_code_buf, const uint16_t *opc_buf)
@@ -153,6 +207,16 @@ int cpu_gen_code(CPUState *env, TranslationBlock *tb,
     {
         if (gen_intermediate_code(env, tb) < 0)
             return -1;
+#ifdef TARGET_HAS_OP_LIVENESS
+        optimize_liveness(gen_opc_buf);
+#ifdef DEBUG_DISAS
+        if (loglevel & CPU_LOG_TB_OP_OPT) {
+            fprintf(logfile, "AFTER LIVENESS OPT:\n");
+            dump_ops(gen_opc_buf, gen_opparam_buf);
+            fprintf(logfile, "\n");
+        }
+#endif
+#endif
 
         /* generate machine code */
         tb->tb_next_offset[0] = 0xffff;
@@ -185,11 +249,9 @@ int cpu_gen_code(CPUState *env, TranslationBlock *tb,
     return 0;
 }
 
-/* The cpu state corresponding to 'searched_pc' is restored. 
- */
-int cpu_restore_state(TranslationBlock *tb, 
-                      CPUState *env, unsigned long searched_pc,
-                      void *puc)
+static int cpu_restore_state1(TranslationBlock *tb, 
+                              CPUState *env, unsigned long searched_pc,
+                              void *puc)
 {
     int j, c;
     unsigned long tc_ptr;
@@ -202,6 +264,9 @@ int cpu_restore_state(TranslationBlock *tb,
 #endif
     if (gen_intermediate_code_pc(env, tb) < 0)
         return -1;
+#ifdef TARGET_HAS_OP_LIVENESS
+    optimize_liveness(gen_opc_buf);
+#endif
     
     /* find opc index corresponding to search_pc */
     tc_ptr = (unsigned long)tb->tc_ptr;
@@ -313,3 +378,22 @@ int cpu_restore_state(TranslationBlock *tb,
 #endif
     return 0;
 }
+
+/* The cpu state corresponding to 'searched_pc' is restored. 
+ */
+int cpu_restore_state(TranslationBlock *tb, 
+                      CPUState *env, unsigned long searched_pc,
+                      void *puc)
+{
+#if !defined(CONFIG_USER_ONLY)
+    int ret;
+
+    /* the translation buffers are shared by the CPU threads */
+    tb_lock_acquire();
+    ret = cpu_restore_state1(tb, env, searched_pc, puc);
+    tb_lock_release();
+    return ret;
+#else
+    return cpu_restore_state1(tb, env, searched_pc, puc);
+#endif
+}
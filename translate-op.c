@@ -35,3 +35,9 @@ enum {
 #include "dyngen.h"
 #include "op.h"
 
+/* make the code generated in [start, stop) visible to the host
+   instruction cache */
+void cpu_flush_icache_range(unsigned long start, unsigned long stop)
+{
+    flush_icache_range(start, stop);
+}
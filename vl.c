@@ -36,12 +36,18 @@
 #include <sys/wait.h>
 #include <termios.h>
 #include <sys/poll.h>
+#ifdef CONFIG_EPOLL
+#include <sys/epoll.h>
+#endif
 #include <sys/mman.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <dirent.h>
 #include <netdb.h>
+#ifdef CONFIG_VCPU_THREADS
+#include <pthread.h>
+#endif
 #ifdef _BSD
 #include <sys/stat.h>
 #ifndef __APPLE__
@@ -342,7 +348,9 @@ void cpu_outb(CPUState *env, int addr, int val)
     if (loglevel & CPU_LOG_IOPORT)
         fprintf(logfile, "outb: %04x %02x\n", addr, val);
 #endif    
+    qemu_global_lock();
     ioport_write_table[0][addr](ioport_opaque[addr], addr, val);
+    qemu_global_unlock();
 #ifdef USE_KQEMU
     if (env)
         env->last_io_time = cpu_get_time_fast();
@@ -355,7 +363,9 @@ void cpu_outw(CPUState *env, int addr, int val)
     if (loglevel & CPU_LOG_IOPORT)
         fprintf(logfile, "outw: %04x %04x\n", addr, val);
 #endif    
+    qemu_global_lock();
     ioport_write_table[1][addr](ioport_opaque[addr], addr, val);
+    qemu_global_unlock();
 #ifdef USE_KQEMU
     if (env)
         env->last_io_time = cpu_get_time_fast();
@@ -368,7 +378,9 @@ void cpu_outl(CPUState *env, int addr, int val)
     if (loglevel & CPU_LOG_IOPORT)
         fprintf(logfile, "outl: %04x %08x\n", addr, val);
 #endif
+    qemu_global_lock();
     ioport_write_table[2][addr](ioport_opaque[addr], addr, val);
+    qemu_global_unlock();
 #ifdef USE_KQEMU
     if (env)
         env->last_io_time = cpu_get_time_fast();
@@ -378,7 +390,9 @@ void cpu_outl(CPUState *env, int addr, int val)
 int cpu_inb(CPUState *env, int addr)
 {
     int val;
+    qemu_global_lock();
     val = ioport_read_table[0][addr](ioport_opaque[addr], addr);
+    qemu_global_unlock();
 #ifdef DEBUG_IOPORT
     if (loglevel & CPU_LOG_IOPORT)
         fprintf(logfile, "inb : %04x %02x\n", addr, val);
@@ -393,7 +407,9 @@ int cpu_inb(CPUState *env, int addr)
 int cpu_inw(CPUState *env, int addr)
 {
     int val;
+    qemu_global_lock();
     val = ioport_read_table[1][addr](ioport_opaque[addr], addr);
+    qemu_global_unlock();
 #ifdef DEBUG_IOPORT
     if (loglevel & CPU_LOG_IOPORT)
         fprintf(logfile, "inw : %04x %04x\n", addr, val);
@@ -408,7 +424,9 @@ int cpu_inw(CPUState *env, int addr)
 int cpu_inl(CPUState *env, int addr)
 {
     int val;
+    qemu_global_lock();
     val = ioport_read_table[2][addr](ioport_opaque[addr], addr);
+    qemu_global_unlock();
 #ifdef DEBUG_IOPORT
     if (loglevel & CPU_LOG_IOPORT)
         fprintf(logfile, "inl : %04x %08x\n", addr, val);
@@ -771,13 +789,26 @@ struct QEMUTimer {
     int64_t expire_time;
     QEMUTimerCB *cb;
     void *opaque;
-    struct QEMUTimer *next;
+    int heap_index; /* position in the timer heap, -1 if not active */
+    unsigned int seq; /* keeps the timers with the same deadline in order */
 };
 
+/* the active timers of a clock, as a binary heap ordered by deadline */
+typedef struct QEMUTimerHeap {
+    QEMUTimer **timers;
+    int count;
+    int size;
+} QEMUTimerHeap;
+
 QEMUClock *rt_clock;
 QEMUClock *vm_clock;
 
+static QEMUTimerHeap timer_heaps[2];
+/* first timer of each heap. It is the only part of the queues read by
+   the alarm signal handler and it is updated after the heap is
+   consistent. */
 static QEMUTimer *active_timers[2];
+static unsigned int timer_seq;
 #ifdef _WIN32
 static MMRESULT timerID;
 static HANDLE host_alarm = NULL;
@@ -786,6 +817,17 @@ static unsigned int period = 1;
 /* frequency of the times() clock tick */
 static int timer_freq;
 #endif
+/* host alarm selected with -clock (NULL for the best available) */
+static const char *clock_method;
+#ifdef CONFIG_POSIX_TIMERS
+/* the alarm is a one-shot timer armed for the next deadline */
+static int alarm_dynticks;
+/* the alarm fired and qemu_run_timers() will rearm it */
+static int alarm_expired;
+static timer_t host_timer;
+#endif
+
+static void qemu_rearm_alarm_timer(void);
 
 QEMUClock *qemu_new_clock(int type)
 {
@@ -805,67 +847,129 @@ QEMUTimer *qemu_new_timer(QEMUClock *clock, QEMUTimerCB *cb, void *opaque)
     ts->clock = clock;
     ts->cb = cb;
     ts->opaque = opaque;
+    ts->heap_index = -1;
     return ts;
 }
 
 void qemu_free_timer(QEMUTimer *ts)
 {
+    qemu_del_timer(ts);
     qemu_free(ts);
 }
 
-/* stop a timer, but do not dealloc it */
-void qemu_del_timer(QEMUTimer *ts)
+static inline int qemu_timer_before(QEMUTimer *a, QEMUTimer *b)
+{
+    if (a->expire_time != b->expire_time)
+        return a->expire_time < b->expire_time;
+    return (int)(a->seq - b->seq) < 0;
+}
+
+static inline void timer_heap_set(QEMUTimerHeap *h, int i, QEMUTimer *ts)
+{
+    h->timers[i] = ts;
+    ts->heap_index = i;
+}
+
+static void timer_heap_up(QEMUTimerHeap *h, int i)
 {
-    QEMUTimer **pt, *t;
+    QEMUTimer *ts;
+    int parent;
+
+    ts = h->timers[i];
+    while (i > 0) {
+        parent = (i - 1) / 2;
+        if (!qemu_timer_before(ts, h->timers[parent]))
+            break;
+        timer_heap_set(h, i, h->timers[parent]);
+        i = parent;
+    }
+    timer_heap_set(h, i, ts);
+}
 
-    /* NOTE: this code must be signal safe because
-       qemu_timer_expired() can be called from a signal. */
-    pt = &active_timers[ts->clock->type];
+static void timer_heap_down(QEMUTimerHeap *h, int i)
+{
+    QEMUTimer *ts;
+    int child;
+
+    ts = h->timers[i];
     for(;;) {
-        t = *pt;
-        if (!t)
+        child = 2 * i + 1;
+        if (child >= h->count)
             break;
-        if (t == ts) {
-            *pt = t->next;
+        if (child + 1 < h->count &&
+            qemu_timer_before(h->timers[child + 1], h->timers[child]))
+            child++;
+        if (!qemu_timer_before(h->timers[child], ts))
             break;
-        }
-        pt = &t->next;
+        timer_heap_set(h, i, h->timers[child]);
+        i = child;
     }
+    timer_heap_set(h, i, ts);
+}
+
+/* stop a timer, but do not dealloc it */
+void qemu_del_timer(QEMUTimer *ts)
+{
+    QEMUTimerHeap *h;
+    QEMUTimer *last;
+    int i, type;
+
+    i = ts->heap_index;
+    if (i < 0)
+        return;
+    type = ts->clock->type;
+    h = &timer_heaps[type];
+    ts->heap_index = -1;
+    last = h->timers[--h->count];
+    if (last != ts) {
+        timer_heap_set(h, i, last);
+        timer_heap_down(h, i);
+        timer_heap_up(h, last->heap_index);
+    }
+    /* NOTE: the head is updated last because qemu_timer_expired() can
+       be called from a signal. */
+    active_timers[type] = h->count ? h->timers[0] : NULL;
 }
 
 /* modify the current timer so that it will be fired when current_time
    >= expire_time. The corresponding callback will be called. */
 void qemu_mod_timer(QEMUTimer *ts, int64_t expire_time)
 {
-    QEMUTimer **pt, *t;
-
-    qemu_del_timer(ts);
+    QEMUTimerHeap *h;
+    int type;
 
-    /* add the timer in the sorted list */
-    /* NOTE: this code must be signal safe because
-       qemu_timer_expired() can be called from a signal. */
-    pt = &active_timers[ts->clock->type];
-    for(;;) {
-        t = *pt;
-        if (!t)
-            break;
-        if (t->expire_time > expire_time) 
-            break;
-        pt = &t->next;
+    type = ts->clock->type;
+    h = &timer_heaps[type];
+    if (ts->heap_index < 0) {
+        if (h->count == h->size) {
+            QEMUTimer **timers;
+            h->size = h->size ? h->size * 2 : 16;
+            timers = qemu_malloc(h->size * sizeof(QEMUTimer *));
+            if (!timers) {
+                fprintf(stderr, "qemu: could not allocate the timer queue\n");
+                exit(1);
+            }
+            if (h->count)
+                memcpy(timers, h->timers, h->count * sizeof(QEMUTimer *));
+            qemu_free(h->timers);
+            h->timers = timers;
+        }
+        timer_heap_set(h, h->count++, ts);
     }
     ts->expire_time = expire_time;
-    ts->next = *pt;
-    *pt = ts;
+    ts->seq = timer_seq++;
+    timer_heap_up(h, ts->heap_index);
+    timer_heap_down(h, ts->heap_index);
+    active_timers[type] = h->timers[0];
+
+    /* the next deadline only changes if the timer is the first one */
+    if (h->timers[0] == ts)
+        qemu_rearm_alarm_timer();
 }
 
 int qemu_timer_pending(QEMUTimer *ts)
 {
-    QEMUTimer *t;
-    for(t = active_timers[ts->clock->type]; t != NULL; t = t->next) {
-        if (t == ts)
-            return 1;
-    }
-    return 0;
+    return ts->heap_index >= 0;
 }
 
 static inline int qemu_timer_expired(QEMUTimer *timer_head, int64_t current_time)
@@ -875,19 +979,18 @@ static inline int qemu_timer_expired(QEMUTimer *timer_head, int64_t current_time
     return (timer_head->expire_time <= current_time);
 }
 
-static void qemu_run_timers(QEMUTimer **ptimer_head, int64_t current_time)
+static void qemu_run_timers(QEMUClock *clock, int64_t current_time)
 {
     QEMUTimer *ts;
     
     for(;;) {
-        ts = *ptimer_head;
+        ts = active_timers[clock->type];
         if (!ts || ts->expire_time > current_time)
             break;
-        /* remove timer from the list before calling the callback */
-        *ptimer_head = ts->next;
-        ts->next = NULL;
+        /* remove timer from the queue before calling the callback */
+        qemu_del_timer(ts);
         
-        /* run the callback (the timer list can be modified) */
+        /* run the callback (the timer queue can be modified) */
         ts->cb(ts->opaque);
     }
 }
@@ -903,6 +1006,40 @@ int64_t qemu_get_clock(QEMUClock *clock)
     }
 }
 
+/* Return the number of nanoseconds until the next timer deadline
+   (0 if a timer is expired) or -1 if no timer is active. The virtual
+   timers are ignored when the VM is stopped. */
+static int64_t qemu_next_deadline(void)
+{
+    int64_t delta, rtdelta;
+
+    delta = -1;
+    if (vm_running && active_timers[QEMU_TIMER_VIRTUAL]) {
+        delta = active_timers[QEMU_TIMER_VIRTUAL]->expire_time -
+            qemu_get_clock(vm_clock);
+    }
+    if (active_timers[QEMU_TIMER_REALTIME]) {
+        rtdelta = (active_timers[QEMU_TIMER_REALTIME]->expire_time -
+                   qemu_get_clock(rt_clock)) * 1000000;
+        if (delta < 0 || rtdelta < delta)
+            delta = rtdelta;
+    }
+    if (delta < -1)
+        delta = 0;
+    return delta;
+}
+
+/* timeout in ms of main_loop_wait() when the CPUs are idle */
+static int qemu_calculate_timeout(void)
+{
+    int64_t delta;
+
+    delta = qemu_next_deadline();
+    if (delta < 0 || delta > 5000 * (int64_t)1000000)
+        return 5000;
+    return (delta + 999999) / 1000000;
+}
+
 static void init_timers(void)
 {
     init_get_clock();
@@ -997,10 +1134,22 @@ static void host_alarm_handler(int host_signum)
         last_clock = ti;
     }
 #endif
+#ifdef CONFIG_POSIX_TIMERS
+    /* the one-shot alarm is only armed for a deadline: it may fire
+       slightly before the clocks reach it */
+    if (alarm_dynticks)
+        alarm_expired = 1;
+    if (alarm_dynticks ||
+        qemu_timer_expired(active_timers[QEMU_TIMER_VIRTUAL],
+                           qemu_get_clock(vm_clock)) ||
+        qemu_timer_expired(active_timers[QEMU_TIMER_REALTIME],
+                           qemu_get_clock(rt_clock))) {
+#else
     if (qemu_timer_expired(active_timers[QEMU_TIMER_VIRTUAL],
                            qemu_get_clock(vm_clock)) ||
         qemu_timer_expired(active_timers[QEMU_TIMER_REALTIME],
                            qemu_get_clock(rt_clock))) {
+#endif
 #ifdef _WIN32
         SetEvent(host_alarm);
 #endif
@@ -1054,8 +1203,52 @@ static int start_rtc_timer(void)
 
 #endif /* !defined(__linux__) */
 
+#ifdef CONFIG_POSIX_TIMERS
+
+/* do not rearm the alarm closer than this to avoid signal storms */
+#define MIN_TIMER_REARM_NS 250000
+
+static int start_dynticks_timer(void)
+{
+    struct sigevent ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.sigev_notify = SIGEV_SIGNAL;
+    ev.sigev_signo = SIGALRM;
+    if (timer_create(CLOCK_REALTIME, &ev, &host_timer) < 0)
+        return -1;
+    alarm_dynticks = 1;
+    pit_min_timer_count = ((uint64_t)MIN_TIMER_REARM_NS * PIT_FREQ) /
+        1000000000;
+    return 0;
+}
+
+#endif /* CONFIG_POSIX_TIMERS */
+
 #endif /* !defined(_WIN32) */
 
+/* arm the one-shot alarm for the next timer deadline */
+static void qemu_rearm_alarm_timer(void)
+{
+#ifdef CONFIG_POSIX_TIMERS
+    struct itimerspec its;
+    int64_t delta;
+
+    if (!alarm_dynticks || alarm_expired)
+        return;
+    delta = qemu_next_deadline();
+    if (delta < 0)
+        return;
+    if (delta < MIN_TIMER_REARM_NS)
+        delta = MIN_TIMER_REARM_NS;
+    its.it_interval.tv_sec = 0;
+    its.it_interval.tv_nsec = 0;
+    its.it_value.tv_sec = delta / 1000000000;
+    its.it_value.tv_nsec = delta % 1000000000;
+    timer_settime(host_timer, 0, &its, NULL);
+#endif
+}
+
 static void init_timer_alarm(void)
 {
 #ifdef _WIN32
@@ -1102,6 +1295,12 @@ static void init_timer_alarm(void)
         act.sa_handler = host_alarm_handler;
         sigaction(SIGALRM, &act, NULL);
 
+#ifdef CONFIG_POSIX_TIMERS
+        if (!clock_method || !strcmp(clock_method, "dynticks")) {
+            if (start_dynticks_timer() == 0)
+                return;
+        }
+#endif
         itv.it_interval.tv_sec = 0;
         itv.it_interval.tv_usec = 999; /* for i386 kernel 2.6 to get 1 ms */
         itv.it_value.tv_sec = 0;
@@ -1116,7 +1315,8 @@ static void init_timer_alarm(void)
            have timers with 1 ms resolution. The correct solution will
            be to use the POSIX real time timers available in recent
            2.6 kernels */
-        if (itv.it_interval.tv_usec > 1000 || 1) {
+        if ((itv.it_interval.tv_usec > 1000 || 1) &&
+            !(clock_method && !strcmp(clock_method, "unix"))) {
             /* try to use /dev/rtc to have a faster timer */
             if (start_rtc_timer() < 0)
                 goto use_itimer;
@@ -1144,6 +1344,10 @@ static void init_timer_alarm(void)
 
 void quit_timers(void)
 {
+#ifdef CONFIG_POSIX_TIMERS
+    if (alarm_dynticks)
+        timer_delete(host_timer);
+#endif
 #ifdef _WIN32
     timeKillEvent(timerID);
     timeEndPeriod(period);
@@ -4523,14 +4727,106 @@ typedef struct IOHandlerRecord {
     IOHandler *fd_read;
     IOHandler *fd_write;
     int deleted;
+    int read_disabled; /* see qemu_set_fd_read_enabled() */
+    int read_polled; /* last result of fd_read_poll */
     void *opaque;
+#ifdef CONFIG_EPOLL
+    int events; /* events registered in the epoll set */
+    int unpollable; /* the fd cannot be added to the epoll set */
+#endif
+    /* handlers which must be examined at each iteration */
+    int polled;
+    struct IOHandlerRecord *next_polled;
     /* temporary data */
     struct pollfd *ufd;
     struct IOHandlerRecord *next;
 } IOHandlerRecord;
 
 static IOHandlerRecord *first_io_handler;
+static IOHandlerRecord *first_polled_io_handler;
+static int io_handlers_deleted;
+
+#ifdef CONFIG_EPOLL
+static int io_epoll_fd = -1;
+
+static void io_handlers_init(void)
+{
+    /* the select() loop is used if epoll is not supported by the
+       kernel */
+    io_epoll_fd = epoll_create(MAX_IO_HANDLERS);
+    if (io_epoll_fd >= 0)
+        fcntl(io_epoll_fd, F_SETFD, FD_CLOEXEC);
+}
+
+/* update the events registered for 'ioh' in the epoll set */
+static void io_handler_update_events(IOHandlerRecord *ioh)
+{
+    struct epoll_event ev;
+    int events, op;
+
+    events = 0;
+    if (!ioh->deleted && !ioh->unpollable) {
+        if (ioh->fd_read && !ioh->read_disabled && ioh->read_polled)
+            events |= EPOLLIN;
+        if (ioh->fd_write)
+            events |= EPOLLOUT;
+    }
+    if (events == ioh->events)
+        return;
+    if (events == 0)
+        op = EPOLL_CTL_DEL;
+    else if (ioh->events == 0)
+        op = EPOLL_CTL_ADD;
+    else
+        op = EPOLL_CTL_MOD;
+    ev.events = events;
+    ev.data.ptr = ioh;
+    if (epoll_ctl(io_epoll_fd, op, ioh->fd, &ev) < 0 && op == EPOLL_CTL_ADD) {
+        /* regular files are always ready, as with select() */
+        ioh->unpollable = 1;
+        events = 0;
+    }
+    ioh->events = events;
+}
+#endif
+
+/* add or remove 'ioh' from the list of the handlers examined at each
+   iteration of the main loop */
+static void io_handler_update_polled(IOHandlerRecord *ioh)
+{
+    IOHandlerRecord **pioh;
+    int polled;
+
+    polled = !ioh->deleted && ioh->fd_read_poll != NULL;
+#ifdef CONFIG_EPOLL
+    polled |= !ioh->deleted && ioh->unpollable;
+#endif
+    if (polled == ioh->polled)
+        return;
+    if (polled) {
+        ioh->next_polled = first_polled_io_handler;
+        first_polled_io_handler = ioh;
+    } else {
+        for(pioh = &first_polled_io_handler; *pioh != ioh;
+            pioh = &(*pioh)->next_polled)
+            continue;
+        *pioh = ioh->next_polled;
+    }
+    ioh->polled = polled;
+}
 
+static void io_handler_update(IOHandlerRecord *ioh)
+{
+#ifdef CONFIG_EPOLL
+    if (io_epoll_fd >= 0)
+        io_handler_update_events(ioh);
+#endif
+    io_handler_update_polled(ioh);
+}
+
+/* Register the handlers of 'fd'. They stay registered in the epoll set
+   until they are changed, so the main loop only visits the handlers
+   whose fd is ready and the ones using fd_read_poll. */
 /* XXX: fd_read_poll should be suppressed, but an API change is
    necessary in the character devices to suppress fd_can_read(). */
 int qemu_set_fd_handler2(int fd, 
@@ -4549,6 +4845,8 @@ int qemu_set_fd_handler2(int fd,
                 break;
             if (ioh->fd == fd) {
                 ioh->deleted = 1;
+                io_handlers_deleted = 1;
+                io_handler_update(ioh);
                 break;
             }
             pioh = &ioh->next;
@@ -4570,6 +4868,10 @@ int qemu_set_fd_handler2(int fd,
         ioh->fd_write = fd_write;
         ioh->opaque = opaque;
         ioh->deleted = 0;
+        ioh->read_disabled = 0;
+        /* a polled handler is only enabled after its first poll */
+        ioh->read_polled = (fd_read_poll == NULL);
+        io_handler_update(ioh);
     }
     return 0;
 }
@@ -4582,6 +4884,40 @@ int qemu_set_fd_handler(int fd,
     return qemu_set_fd_handler2(fd, NULL, fd_read, fd_write, opaque);
 }
 
+/* Temporarily stop or restart watching 'fd' for reading. This is the
+   explicit replacement of the fd_read_poll callbacks. */
+void qemu_set_fd_read_enabled(int fd, int enabled)
+{
+    IOHandlerRecord *ioh;
+
+    for(ioh = first_io_handler; ioh != NULL; ioh = ioh->next) {
+        if (ioh->fd == fd && !ioh->deleted) {
+            ioh->read_disabled = !enabled;
+            io_handler_update(ioh);
+            break;
+        }
+    }
+}
+
+/* free the handlers deleted since the last iteration */
+static void io_handlers_free_deleted(void)
+{
+    IOHandlerRecord **pioh, *ioh;
+
+    if (!io_handlers_deleted)
+        return;
+    io_handlers_deleted = 0;
+    pioh = &first_io_handler;
+    while (*pioh) {
+        ioh = *pioh;
+        if (ioh->deleted) {
+            *pioh = ioh->next;
+            qemu_free(ioh);
+        } else 
+            pioh = &ioh->next;
+    }
+}
+
 /***********************************************************/
 /* Polling handling */
 
@@ -6149,7 +6485,9 @@ void qemu_bh_schedule(QEMUBH *bh)
     first_bh = bh;
 
     /* stop the currently executing CPU to execute the BH ASAP */
-    if (env) {
+    if (vcpu_threads) {
+        main_loop_notify();
+    } else if (env) {
         cpu_interrupt(env, CPU_INTERRUPT_EXIT);
     }
 }
@@ -6199,6 +6537,128 @@ QEMUMachine *find_machine(const char *name)
     return NULL;
 }
 
+/***********************************************************/
+/* CPU threads */
+
+#ifdef CONFIG_VCPU_THREADS
+
+/* With -vcpu-threads each CPU runs cpu_exec() in its own host
+   thread. The device models, timers and bottom halves are protected
+   by the global lock: the main thread only releases it while waiting
+   for events and the CPU threads take it around the I/O accesses. */
+static pthread_mutex_t qemu_global_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* signalled when a CPU thread may run again */
+static pthread_cond_t qemu_cpu_cond = PTHREAD_COND_INITIALIZER;
+/* signalled when a CPU thread leaves cpu_exec() */
+static pthread_cond_t qemu_cpu_stopped_cond = PTHREAD_COND_INITIALIZER;
+static int cpu_stop_requests;
+static VCPU_TLS int qemu_global_lock_depth;
+static int main_loop_notify_fds[2] = { -1, -1 };
+
+void qemu_global_lock(void)
+{
+    if (!vcpu_threads)
+        return;
+    if (qemu_global_lock_depth++ == 0)
+        pthread_mutex_lock(&qemu_global_mutex);
+}
+
+void qemu_global_unlock(void)
+{
+    if (!vcpu_threads)
+        return;
+    if (--qemu_global_lock_depth == 0)
+        pthread_mutex_unlock(&qemu_global_mutex);
+}
+
+/* wake up a CPU thread waiting for an interrupt */
+void qemu_cpu_kick(CPUState *env)
+{
+    env->thread_halted = 0;
+    pthread_cond_broadcast(&qemu_cpu_cond);
+}
+
+/* wake up the main thread from a CPU thread or a signal handler */
+void main_loop_notify(void)
+{
+    char byte = 0;
+
+    if (main_loop_notify_fds[1] >= 0)
+        write(main_loop_notify_fds[1], &byte, 1);
+}
+
+static void main_loop_notify_read(void *opaque)
+{
+    char buf[64];
+
+    while (read(main_loop_notify_fds[0], buf, sizeof(buf)) > 0)
+        continue;
+}
+
+/* Stop all the CPU threads but the current one. The global lock must
+   be held. */
+static void cpu_stop_all(void)
+{
+    CPUState *env;
+    struct timeval tv;
+    struct timespec ts;
+    int running;
+
+    cpu_stop_requests++;
+    for(;;) {
+        running = 0;
+        for(env = first_cpu; env != NULL; env = env->next_cpu) {
+            if (env->thread_running && env != cpu_single_env) {
+                cpu_interrupt(env, CPU_INTERRUPT_EXIT);
+                running = 1;
+            }
+        }
+        if (!running)
+            break;
+        /* the request can be lost while a TB is being linked, so it
+           is sent again after a short delay */
+        gettimeofday(&tv, NULL);
+        ts.tv_sec = tv.tv_sec;
+        ts.tv_nsec = tv.tv_usec * 1000 + 10000000;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&qemu_cpu_stopped_cond, &qemu_global_mutex,
+                               &ts);
+    }
+}
+
+static void cpu_resume_all(void)
+{
+    CPUState *env;
+
+    if (--cpu_stop_requests == 0) {
+        for(env = first_cpu; env != NULL; env = env->next_cpu)
+            qemu_cpu_kick(env);
+    }
+}
+
+#else
+
+void qemu_global_lock(void)
+{
+}
+
+void qemu_global_unlock(void)
+{
+}
+
+void qemu_cpu_kick(CPUState *env)
+{
+}
+
+void main_loop_notify(void)
+{
+}
+
+#endif /* CONFIG_VCPU_THREADS */
+
 /***********************************************************/
 /* main execution loop */
 
@@ -6268,6 +6728,12 @@ void vm_start(void)
     if (!vm_running) {
         cpu_enable_ticks();
         vm_running = 1;
+        /* the virtual timers are active again */
+        qemu_rearm_alarm_timer();
+#ifdef CONFIG_VCPU_THREADS
+        if (vcpu_threads)
+            pthread_cond_broadcast(&qemu_cpu_cond);
+#endif
         vm_state_notify(1);
     }
 }
@@ -6277,6 +6743,13 @@ void vm_stop(int reason)
     if (vm_running) {
         cpu_disable_ticks();
         vm_running = 0;
+#ifdef CONFIG_VCPU_THREADS
+        if (vcpu_threads) {
+            /* wait until the other CPU threads are stopped */
+            cpu_stop_all();
+            cpu_resume_all();
+        }
+#endif
         if (reason != 0) {
             if (vm_stop_cb) {
                 vm_stop_cb(vm_stop_opaque, reason);
@@ -6332,6 +6805,7 @@ void qemu_system_reset_request(void)
     }
     if (cpu_single_env)
         cpu_interrupt(cpu_single_env, CPU_INTERRUPT_EXIT);
+    main_loop_notify();
 }
 
 void qemu_system_shutdown_request(void)
@@ -6339,6 +6813,7 @@ void qemu_system_shutdown_request(void)
     shutdown_requested = 1;
     if (cpu_single_env)
         cpu_interrupt(cpu_single_env, CPU_INTERRUPT_EXIT);
+    main_loop_notify();
 }
 
 void qemu_system_powerdown_request(void)
@@ -6346,57 +6821,35 @@ void qemu_system_powerdown_request(void)
     powerdown_requested = 1;
     if (cpu_single_env)
         cpu_interrupt(cpu_single_env, CPU_INTERRUPT_EXIT);
+    main_loop_notify();
 }
 
-void main_loop_wait(int timeout)
+/* The CPU threads can access the devices while the main thread waits
+   for events. Returns true if the global lock was released. */
+static int io_wait_begin(void)
+{
+#ifdef CONFIG_VCPU_THREADS
+    if (vcpu_threads && qemu_global_lock_depth == 1) {
+        qemu_global_unlock();
+        return 1;
+    }
+#endif
+    return 0;
+}
+
+static void io_wait_end(int unlocked)
+{
+    if (unlocked)
+        qemu_global_lock();
+}
+
+static void io_handlers_select(int timeout)
 {
     IOHandlerRecord *ioh;
     fd_set rfds, wfds, xfds;
-    int ret, nfds;
-#ifdef _WIN32
-    int ret2, i;
-#endif
+    int ret, nfds, unlocked;
     struct timeval tv;
-    PollingEntry *pe;
-
 
-    /* XXX: need to suppress polling by better using win32 events */
-    ret = 0;
-    for(pe = first_polling_entry; pe != NULL; pe = pe->next) {
-        ret |= pe->func(pe->opaque);
-    }
-#ifdef _WIN32
-    if (ret == 0) {
-        int err;
-        WaitObjects *w = &wait_objects;
-        
-        ret = WaitForMultipleObjects(w->num, w->events, FALSE, timeout);
-        if (WAIT_OBJECT_0 + 0 <= ret && ret <= WAIT_OBJECT_0 + w->num - 1) {
-            if (w->func[ret - WAIT_OBJECT_0])
-                w->func[ret - WAIT_OBJECT_0](w->opaque[ret - WAIT_OBJECT_0]);
-                
-            /* Check for additional signaled events */ 
-            for(i = (ret - WAIT_OBJECT_0 + 1); i < w->num; i++) {
-                                
-                /* Check if event is signaled */
-                ret2 = WaitForSingleObject(w->events[i], 0);
-                if(ret2 == WAIT_OBJECT_0) {
-                    if (w->func[i])
-                        w->func[i](w->opaque[i]);
-                } else if (ret2 == WAIT_TIMEOUT) {
-                } else {
-                    err = GetLastError();
-                    fprintf(stderr, "WaitForSingleObject error %d %d\n", i, err);
-                }                
-            }                 
-        } else if (ret == WAIT_TIMEOUT) {
-        } else {
-            err = GetLastError();
-            fprintf(stderr, "WaitForMultipleObjects error %d %d\n", ret, err);
-        }
-    }
-#endif
-    /* poll any events */
     /* XXX: separate device handlers from system ones */
     nfds = -1;
     FD_ZERO(&rfds);
@@ -6405,7 +6858,7 @@ void main_loop_wait(int timeout)
     for(ioh = first_io_handler; ioh != NULL; ioh = ioh->next) {
         if (ioh->deleted)
             continue;
-        if (ioh->fd_read &&
+        if (ioh->fd_read && !ioh->read_disabled &&
             (!ioh->fd_read_poll ||
              ioh->fd_read_poll(ioh->opaque) != 0)) {
             FD_SET(ioh->fd, &rfds);
@@ -6419,21 +6872,22 @@ void main_loop_wait(int timeout)
         }
     }
     
-    tv.tv_sec = 0;
 #ifdef _WIN32
+    tv.tv_sec = 0;
     tv.tv_usec = 0;
 #else
-    tv.tv_usec = timeout * 1000;
+    tv.tv_sec = timeout / 1000;
+    tv.tv_usec = (timeout % 1000) * 1000;
 #endif
 #if defined(CONFIG_SLIRP)
     if (slirp_inited) {
         slirp_select_fill(&nfds, &rfds, &wfds, &xfds);
     }
 #endif
+    unlocked = io_wait_begin();
     ret = select(nfds + 1, &rfds, &wfds, &xfds, &tv);
+    io_wait_end(unlocked);
     if (ret > 0) {
-        IOHandlerRecord **pioh;
-
         for(ioh = first_io_handler; ioh != NULL; ioh = ioh->next) {
             if (ioh->deleted)
                 continue;
@@ -6444,40 +6898,181 @@ void main_loop_wait(int timeout)
                 ioh->fd_write(ioh->opaque);
             }
         }
+    }
+#if defined(CONFIG_SLIRP)
+    if (slirp_inited) {
+        if (ret < 0) {
+            FD_ZERO(&rfds);
+            FD_ZERO(&wfds);
+            FD_ZERO(&xfds);
+        }
+        slirp_select_poll(&rfds, &wfds, &xfds);
+    }
+#endif
+}
 
-	/* remove deleted IO handlers */
-	pioh = &first_io_handler;
-	while (*pioh) {
-            ioh = *pioh;
-            if (ioh->deleted) {
-                *pioh = ioh->next;
-                qemu_free(ioh);
-            } else 
-                pioh = &ioh->next;
+#ifdef CONFIG_EPOLL
+
+#define MAX_IO_EVENTS 32
+
+static void io_handlers_epoll(int timeout)
+{
+    IOHandlerRecord *ioh;
+    struct epoll_event events[MAX_IO_EVENTS];
+    int i, n, unlocked;
+#if defined(CONFIG_SLIRP)
+    fd_set rfds, wfds, xfds;
+    int ret, nfds;
+    struct timeval tv;
+#endif
+
+    /* only the handlers using fd_read_poll and the fds which cannot
+       be polled are visited */
+    for(ioh = first_polled_io_handler; ioh != NULL; ioh = ioh->next_polled) {
+        if (ioh->fd_read_poll) {
+            ioh->read_polled = ioh->fd_read_poll(ioh->opaque) != 0;
+            io_handler_update_events(ioh);
         }
+        if (ioh->unpollable)
+            timeout = 0;
     }
+
 #if defined(CONFIG_SLIRP)
     if (slirp_inited) {
+        /* slirp only supports select(), so the epoll fd is added to
+           its fd sets */
+        nfds = io_epoll_fd;
+        FD_ZERO(&rfds);
+        FD_ZERO(&wfds);
+        FD_ZERO(&xfds);
+        FD_SET(io_epoll_fd, &rfds);
+        slirp_select_fill(&nfds, &rfds, &wfds, &xfds);
+        tv.tv_sec = timeout / 1000;
+        tv.tv_usec = (timeout % 1000) * 1000;
+        unlocked = io_wait_begin();
+        ret = select(nfds + 1, &rfds, &wfds, &xfds, &tv);
+        io_wait_end(unlocked);
+        n = 0;
+        if (ret > 0 && FD_ISSET(io_epoll_fd, &rfds))
+            n = epoll_wait(io_epoll_fd, events, MAX_IO_EVENTS, 0);
         if (ret < 0) {
             FD_ZERO(&rfds);
             FD_ZERO(&wfds);
             FD_ZERO(&xfds);
         }
+    } else
+#endif
+    {
+        unlocked = io_wait_begin();
+        n = epoll_wait(io_epoll_fd, events, MAX_IO_EVENTS, timeout);
+        io_wait_end(unlocked);
+    }
+
+    for(i = 0; i < n; i++) {
+        ioh = events[i].data.ptr;
+        /* a previous handler may have changed this one */
+        if (ioh->deleted)
+            continue;
+        if ((events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) &&
+            (ioh->events & EPOLLIN))
+            ioh->fd_read(ioh->opaque);
+        if (ioh->deleted)
+            continue;
+        if ((events[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR)) &&
+            (ioh->events & EPOLLOUT))
+            ioh->fd_write(ioh->opaque);
+    }
+
+    /* select() reports the fds which cannot be polled as ready */
+    for(ioh = first_polled_io_handler; ioh != NULL; ioh = ioh->next_polled) {
+        if (!ioh->unpollable)
+            continue;
+        if (ioh->fd_read && !ioh->read_disabled && ioh->read_polled)
+            ioh->fd_read(ioh->opaque);
+        if (!ioh->deleted && ioh->fd_write)
+            ioh->fd_write(ioh->opaque);
+    }
+
+#if defined(CONFIG_SLIRP)
+    if (slirp_inited) {
         slirp_select_poll(&rfds, &wfds, &xfds);
     }
 #endif
+}
+
+#endif /* CONFIG_EPOLL */
+
+void main_loop_wait(int timeout)
+{
+    int ret;
+#ifdef _WIN32
+    int ret2, i;
+#endif
+    PollingEntry *pe;
+
+
+    /* XXX: need to suppress polling by better using win32 events */
+    ret = 0;
+    for(pe = first_polling_entry; pe != NULL; pe = pe->next) {
+        ret |= pe->func(pe->opaque);
+    }
+#ifdef _WIN32
+    if (ret == 0) {
+        int err;
+        WaitObjects *w = &wait_objects;
+        
+        ret = WaitForMultipleObjects(w->num, w->events, FALSE, timeout);
+        if (WAIT_OBJECT_0 + 0 <= ret && ret <= WAIT_OBJECT_0 + w->num - 1) {
+            if (w->func[ret - WAIT_OBJECT_0])
+                w->func[ret - WAIT_OBJECT_0](w->opaque[ret - WAIT_OBJECT_0]);
+                
+            /* Check for additional signaled events */ 
+            for(i = (ret - WAIT_OBJECT_0 + 1); i < w->num; i++) {
+                                
+                /* Check if event is signaled */
+                ret2 = WaitForSingleObject(w->events[i], 0);
+                if(ret2 == WAIT_OBJECT_0) {
+                    if (w->func[i])
+                        w->func[i](w->opaque[i]);
+                } else if (ret2 == WAIT_TIMEOUT) {
+                } else {
+                    err = GetLastError();
+                    fprintf(stderr, "WaitForSingleObject error %d %d\n", i, err);
+                }                
+            }                 
+        } else if (ret == WAIT_TIMEOUT) {
+        } else {
+            err = GetLastError();
+            fprintf(stderr, "WaitForMultipleObjects error %d %d\n", ret, err);
+        }
+    }
+#endif
+    /* poll any events */
+#ifdef CONFIG_EPOLL
+    if (io_epoll_fd >= 0)
+        io_handlers_epoll(timeout);
+    else
+#endif
+    io_handlers_select(timeout);
+    io_handlers_free_deleted();
+
     qemu_aio_poll();
 
     if (vm_running) {
-        qemu_run_timers(&active_timers[QEMU_TIMER_VIRTUAL], 
-                        qemu_get_clock(vm_clock));
+        qemu_run_timers(vm_clock, qemu_get_clock(vm_clock));
         /* run dma transfers, if any */
         DMA_run();
     }
 
     /* real time timers */
-    qemu_run_timers(&active_timers[QEMU_TIMER_REALTIME], 
-                    qemu_get_clock(rt_clock));
+    qemu_run_timers(rt_clock, qemu_get_clock(rt_clock));
+
+#ifdef CONFIG_POSIX_TIMERS
+    if (alarm_expired) {
+        alarm_expired = 0;
+        qemu_rearm_alarm_timer();
+    }
+#endif
 
     /* Check bottom-halves last in case any of the earlier events triggered
        them.  */
@@ -6487,6 +7082,95 @@ void main_loop_wait(int timeout)
 
 static CPUState *cur_cpu;
 
+#ifdef CONFIG_VCPU_THREADS
+
+static void *cpu_thread_fn(void *opaque)
+{
+    CPUState *env = opaque;
+    sigset_t set;
+    int ret;
+
+    /* the signals are handled by the main thread */
+    sigfillset(&set);
+    sigdelset(&set, SIGSEGV);
+    sigdelset(&set, SIGBUS);
+    sigdelset(&set, SIGFPE);
+    sigdelset(&set, SIGILL);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    qemu_global_lock();
+    for(;;) {
+        while (!vm_running || cpu_stop_requests || env->thread_halted)
+            pthread_cond_wait(&qemu_cpu_cond, &qemu_global_mutex);
+        env->thread_running = 1;
+        /* cleared by qemu_cpu_kick() if an interrupt comes while the
+           CPU is running */
+        env->thread_halted = 1;
+        qemu_global_unlock();
+        ret = cpu_exec(env);
+        qemu_global_lock();
+        env->thread_running = 0;
+        pthread_cond_broadcast(&qemu_cpu_stopped_cond);
+        if (ret != EXCP_HALTED)
+            env->thread_halted = 0;
+        if (ret == EXCP_DEBUG)
+            vm_stop(EXCP_DEBUG);
+        if (tb_recycle_requested) {
+            /* the translated code can only be recycled when no other
+               CPU executes it */
+            cpu_stop_all();
+            if (tb_alloc_full())
+                tb_alloc_recycle(env);
+            tb_recycle_requested = 0;
+            cpu_resume_all();
+        }
+    }
+    return NULL;
+}
+
+static int main_loop_threads(void)
+{
+    CPUState *env;
+    pthread_t thread;
+
+    if (pipe(main_loop_notify_fds) < 0) {
+        perror("pipe");
+        exit(1);
+    }
+    fcntl(main_loop_notify_fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(main_loop_notify_fds[1], F_SETFL, O_NONBLOCK);
+    qemu_set_fd_handler(main_loop_notify_fds[0], main_loop_notify_read,
+                        NULL, NULL);
+
+    qemu_global_lock();
+    for(env = first_cpu; env != NULL; env = env->next_cpu) {
+        if (pthread_create(&thread, NULL, cpu_thread_fn, env) != 0) {
+            fprintf(stderr, "qemu: could not create CPU thread\n");
+            exit(1);
+        }
+    }
+    for(;;) {
+        if (shutdown_requested)
+            break;
+        if (reset_requested) {
+            reset_requested = 0;
+            cpu_stop_all();
+            qemu_system_reset();
+            cpu_resume_all();
+        }
+        if (powerdown_requested) {
+            powerdown_requested = 0;
+            qemu_system_powerdown();
+        }
+        main_loop_wait(qemu_calculate_timeout());
+    }
+    cpu_stop_all();
+    cpu_disable_ticks();
+    return EXCP_INTERRUPT;
+}
+
+#endif
+
 int main_loop(void)
 {
     int ret, timeout;
@@ -6495,6 +7179,10 @@ int main_loop(void)
 #endif
     CPUState *env;
 
+#ifdef CONFIG_VCPU_THREADS
+    if (vcpu_threads)
+        return main_loop_threads();
+#endif
     cur_cpu = first_cpu;
     for(;;) {
         if (vm_running) {
@@ -6543,13 +7231,12 @@ int main_loop(void)
                 vm_stop(EXCP_DEBUG);
             }
             /* If all cpus are halted then wait until the next IRQ */
-            /* XXX: use timeout computed from timers */
             if (ret == EXCP_HALTED)
-                timeout = 10;
+                timeout = qemu_calculate_timeout();
             else
                 timeout = 0;
         } else {
-            timeout = 10;
+            timeout = qemu_calculate_timeout();
         }
 #ifdef CONFIG_PROFILER
         ti = profile_getclock();
@@ -6582,6 +7269,18 @@ void help(void)
            "-pflash file    use 'file' as a parallel flash image\n"
            "-boot [a|c|d|n] boot on floppy (a), hard disk (c), CD-ROM (d), or network (n)\n"
            "-snapshot       write to temporary files instead of disk image files\n"
+#ifndef _WIN32
+           "-aio posix|native\n"
+           "                access the hard disk images with O_DIRECT and the POSIX\n"
+           "                or the Linux native AIO [default=page cache]\n"
+           "-aio threads[,direct]\n"
+           "                access the hard disk images with a pool of worker threads\n"
+           "-aio-threads n  set the number of worker threads per image [default=4]\n"
+#endif
+           "-qcow2-cache mb cache the qcow2 L2 tables mapping 'mb' MB of each image\n"
+           "-qcow2-zlib-threads n\n"
+           "                inflate the compressed qcow2 clusters with 'n' threads\n"
+           "                [default=4]\n"
 #ifdef CONFIG_SDL
            "-no-frame       open SDL window without a frame and window decorations\n"
            "-alt-grab       use Ctrl-Alt-Shift to grab mouse (instead of Ctrl-Alt)\n"
@@ -6592,6 +7291,9 @@ void help(void)
 #endif
            "-m megs         set virtual RAM size to megs MB [default=%d]\n"
            "-smp n          set the number of CPUs to 'n' [default=1]\n"
+#if defined(CONFIG_VCPU_THREADS) && defined(TARGET_HAS_VCPU_THREADS)
+           "-vcpu-threads   run each emulated CPU in its own host thread\n"
+#endif
            "-nographic      disable graphical output and redirect serial I/Os to console\n"
            "-portrait       rotate graphical output 90 deg left (only PXA LCD)\n"
 #ifndef _WIN32
@@ -6689,6 +7391,16 @@ void help(void)
 	   "-option-rom rom load a file, rom, into the option ROM space\n"
 #ifdef TARGET_SPARC
            "-prom-env variable=value  set OpenBIOS nvram variables\n"
+#endif
+           "-tb-size n      set the translated code buffer size to 'n' MB\n"
+           "-tb-regions n   split the translated code buffer in 'n' regions which\n"
+           "                are evicted in FIFO order instead of flushing all the code\n"
+#ifdef TARGET_HAS_SUPERBLOCKS
+           "-tb-hot n       retranslate the blocks executed 'n' times as superblocks\n"
+#endif
+#ifndef _WIN32
+           "-clock method   select the host alarm: 'dynticks' (one-shot timer armed\n"
+           "                for the next deadline, default), 'rtc' or 'unix'\n"
 #endif
            "\n"
            "During emulation, the following keys are useful:\n"
@@ -6727,6 +7439,10 @@ enum {
     QEMU_OPTION_pflash,
     QEMU_OPTION_boot,
     QEMU_OPTION_snapshot,
+    QEMU_OPTION_aio,
+    QEMU_OPTION_aio_threads,
+    QEMU_OPTION_qcow2_cache,
+    QEMU_OPTION_qcow2_zlib_threads,
 #ifdef TARGET_I386
     QEMU_OPTION_no_fd_bootchk,
 #endif
@@ -6786,6 +7502,11 @@ enum {
     QEMU_OPTION_semihosting,
     QEMU_OPTION_name,
     QEMU_OPTION_prom_env,
+    QEMU_OPTION_tb_size,
+    QEMU_OPTION_vcpu_threads,
+    QEMU_OPTION_clock,
+    QEMU_OPTION_tb_regions,
+    QEMU_OPTION_tb_hot,
 };
 
 typedef struct QEMUOption {
@@ -6812,6 +7533,12 @@ const QEMUOption qemu_options[] = {
     { "pflash", HAS_ARG, QEMU_OPTION_pflash },
     { "boot", HAS_ARG, QEMU_OPTION_boot },
     { "snapshot", 0, QEMU_OPTION_snapshot },
+#ifndef _WIN32
+    { "aio", HAS_ARG, QEMU_OPTION_aio },
+    { "aio-threads", HAS_ARG, QEMU_OPTION_aio_threads },
+#endif
+    { "qcow2-cache", HAS_ARG, QEMU_OPTION_qcow2_cache },
+    { "qcow2-zlib-threads", HAS_ARG, QEMU_OPTION_qcow2_zlib_threads },
 #ifdef TARGET_I386
     { "no-fd-bootchk", 0, QEMU_OPTION_no_fd_bootchk },
 #endif
@@ -6887,6 +7614,15 @@ const QEMUOption qemu_options[] = {
 #if defined(TARGET_SPARC)
     { "prom-env", HAS_ARG, QEMU_OPTION_prom_env },
 #endif
+    { "tb-size", HAS_ARG, QEMU_OPTION_tb_size },
+    { "tb-regions", HAS_ARG, QEMU_OPTION_tb_regions },
+#ifdef TARGET_HAS_SUPERBLOCKS
+    { "tb-hot", HAS_ARG, QEMU_OPTION_tb_hot },
+#endif
+#if defined(CONFIG_VCPU_THREADS) && defined(TARGET_HAS_VCPU_THREADS)
+    { "vcpu-threads", 0, QEMU_OPTION_vcpu_threads },
+#endif
+    { "clock", HAS_ARG, QEMU_OPTION_clock },
     { NULL },
 };
 
@@ -7125,7 +7861,7 @@ int main(int argc, char **argv)
     const char *gdbstub_port;
 #endif
     int i, cdrom_index, pflash_index;
-    int snapshot, linux_boot;
+    int snapshot, linux_boot, disk_cache_flags;
     const char *initrd_filename;
     const char *hd_filename[MAX_DISKS], *fd_filename[MAX_FD];
     const char *pflash_filename[MAX_PFLASH];
@@ -7152,8 +7888,13 @@ int main(int argc, char **argv)
     int fds[2];
     const char *pid_file = NULL;
     VLANState *vlan;
+    unsigned long tb_size;
+    int tb_regions;
 
     LIST_INIT (&vm_change_state_head);
+#ifdef CONFIG_EPOLL
+    io_handlers_init();
+#endif
 #ifndef _WIN32
     {
         struct sigaction act;
@@ -7204,6 +7945,7 @@ int main(int argc, char **argv)
     gdbstub_port = DEFAULT_GDBSTUB_PORT;
 #endif
     snapshot = 0;
+    disk_cache_flags = 0;
     nographic = 0;
     kernel_filename = NULL;
     kernel_cmdline = "";
@@ -7229,6 +7971,8 @@ int main(int argc, char **argv)
     usb_devices_index = 0;
     
     nb_net_clients = 0;
+    tb_size = 0;
+    tb_regions = 1;
 
     nb_nics = 0;
     /* default mac address of the first network interface */
@@ -7331,6 +8075,43 @@ int main(int argc, char **argv)
             case QEMU_OPTION_snapshot:
                 snapshot = 1;
                 break;
+            case QEMU_OPTION_aio:
+                if (!strcmp(optarg, "posix")) {
+                    disk_cache_flags = BDRV_O_DIRECT;
+                } else if (!strcmp(optarg, "native")) {
+                    disk_cache_flags = BDRV_O_DIRECT | BDRV_O_NATIVE_AIO;
+                } else if (!strcmp(optarg, "threads")) {
+                    disk_cache_flags = BDRV_O_AIO_THREADS;
+                } else if (!strcmp(optarg, "threads,direct")) {
+                    disk_cache_flags = BDRV_O_AIO_THREADS | BDRV_O_DIRECT;
+                } else {
+                    fprintf(stderr, "qemu: unknown aio method '%s'\n", optarg);
+                    exit(1);
+                }
+                break;
+#ifndef _WIN32
+            case QEMU_OPTION_aio_threads:
+                aio_thread_workers = atoi(optarg);
+                if (aio_thread_workers < 1 || aio_thread_workers > 64) {
+                    fprintf(stderr, "qemu: invalid number of AIO threads\n");
+                    exit(1);
+                }
+                break;
+#endif
+            case QEMU_OPTION_qcow2_cache:
+                qcow2_l2_cache_mb = atoi(optarg);
+                if (qcow2_l2_cache_mb < 0) {
+                    fprintf(stderr, "qemu: invalid qcow2 cache size\n");
+                    exit(1);
+                }
+                break;
+            case QEMU_OPTION_qcow2_zlib_threads:
+                qcow2_zlib_threads = atoi(optarg);
+                if (qcow2_zlib_threads < 0 || qcow2_zlib_threads > 64) {
+                    fprintf(stderr, "qemu: invalid number of qcow2 zlib threads\n");
+                    exit(1);
+                }
+                break;
             case QEMU_OPTION_hdachs:
                 {
                     const char *p;
@@ -7665,6 +8446,48 @@ int main(int argc, char **argv)
                 nb_prom_envs++;
                 break;
 #endif
+            case QEMU_OPTION_tb_size:
+                {
+                    long n;
+
+                    n = strtol(optarg, NULL, 0);
+                    if (n < 0)
+                        n = 0;
+                    /* the size in bytes must fit in an unsigned long */
+                    if ((unsigned long)n > ((unsigned long)-1 >> 20)) {
+                        fprintf(stderr, "qemu: -tb-size %s is too large\n",
+                                optarg);
+                        exit(1);
+                    }
+                    tb_size = n;
+                }
+                break;
+            case QEMU_OPTION_tb_regions:
+                tb_regions = atoi(optarg);
+                if (tb_regions < 1)
+                    tb_regions = 1;
+                break;
+#ifdef TARGET_HAS_SUPERBLOCKS
+            case QEMU_OPTION_tb_hot:
+                tb_hot_threshold = atoi(optarg);
+                if (tb_hot_threshold < 0)
+                    tb_hot_threshold = 0;
+                break;
+#endif
+#if defined(CONFIG_VCPU_THREADS) && defined(TARGET_HAS_VCPU_THREADS)
+            case QEMU_OPTION_vcpu_threads:
+                vcpu_threads = 1;
+                break;
+#endif
+            case QEMU_OPTION_clock:
+                if (strcmp(optarg, "dynticks") && strcmp(optarg, "rtc") &&
+                    strcmp(optarg, "unix")) {
+                    fprintf(stderr, "qemu: unknown clock method '%s'\n",
+                            optarg);
+                    exit(1);
+                }
+                clock_method = optarg;
+                break;
             }
         }
     }
@@ -7730,7 +8553,7 @@ int main(int argc, char **argv)
     }
 
 #ifdef USE_KQEMU
-    if (smp_cpus > 1)
+    if (smp_cpus > 1 || vcpu_threads)
         kqemu_allowed = 0;
 #endif
     linux_boot = (kernel_filename != NULL);
@@ -7818,8 +8641,12 @@ int main(int argc, char **argv)
         exit(1);
     }
 
+    /* init the dynamic translator */
+    cpu_exec_init_all(tb_size * 1024 * 1024, tb_regions);
+
     /* we always create the cdrom drive, even if no disk is there */
     bdrv_init();
+    atexit(bdrv_flush_all);
     if (cdrom_index >= 0) {
         bs_table[cdrom_index] = bdrv_new("cdrom");
         bdrv_set_type_hint(bs_table[cdrom_index], BDRV_TYPE_CDROM);
@@ -7833,7 +8660,9 @@ int main(int argc, char **argv)
                 snprintf(buf, sizeof(buf), "hd%c", i + 'a');
                 bs_table[i] = bdrv_new(buf);
             }
-            if (bdrv_open(bs_table[i], hd_filename[i], snapshot ? BDRV_O_SNAPSHOT : 0) < 0) {
+            if (bdrv_open(bs_table[i], hd_filename[i],
+                          (snapshot ? BDRV_O_SNAPSHOT : 0) |
+                          disk_cache_flags) < 0) {
                 fprintf(stderr, "qemu: could not open hard disk image '%s'\n",
                         hd_filename[i]);
                 exit(1);
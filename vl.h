@@ -68,6 +68,13 @@ static inline char *realpath(const char *path, char *resolved_path)
 #define PRIx64 "I64x"
 #define PRIu64 "I64u"
 #define PRIo64 "I64o"
+
+struct iovec {
+    void *iov_base;
+    size_t iov_len;
+};
+#else
+#include <sys/uio.h>
 #endif
 
 #ifdef QEMU_TOOL
@@ -106,6 +113,43 @@ char *pstrcat(char *buf, int buf_size, const char *s);
 int strstart(const char *str, const char *val, const char **ptr);
 int stristart(const char *str, const char *val, const char **ptr);
 
+/* scatter-gather list */
+typedef struct QEMUIOVector {
+    struct iovec *iov;
+    int niov;
+    int nalloc;
+    size_t size;
+} QEMUIOVector;
+
+void qemu_iovec_init(QEMUIOVector *qiov, int alloc_hint);
+int qemu_iovec_add(QEMUIOVector *qiov, void *base, size_t len);
+void qemu_iovec_reset(QEMUIOVector *qiov);
+void qemu_iovec_destroy(QEMUIOVector *qiov);
+void qemu_iovec_to_buffer(QEMUIOVector *qiov, void *buf);
+void qemu_iovec_from_buffer(QEMUIOVector *qiov, const void *buf, size_t count);
+
+/* coroutine.c */
+typedef struct Coroutine Coroutine;
+typedef void CoroutineEntry(void *opaque);
+
+Coroutine *qemu_coroutine_create(CoroutineEntry *entry, void *opaque);
+void qemu_coroutine_enter(Coroutine *co);
+void qemu_coroutine_yield(void);
+Coroutine *qemu_coroutine_self(void);
+int qemu_in_coroutine(void);
+
+/* mutex whose waiters are coroutines. Its owner may take it again. */
+typedef struct CoMutex {
+    int locked; /* lock depth */
+    Coroutine *owner; /* NULL if taken outside of a coroutine */
+    Coroutine *waiters;
+    Coroutine **waiters_tail;
+} CoMutex;
+
+void qemu_co_mutex_init(CoMutex *mutex);
+void qemu_co_mutex_lock(CoMutex *mutex);
+void qemu_co_mutex_unlock(CoMutex *mutex);
+
 /* vl.c */
 uint64_t muldiv64(uint64_t a, uint32_t b, uint32_t c);
 
@@ -144,6 +188,7 @@ void qemu_system_powerdown(void);
 #endif
 
 void main_loop_wait(int timeout);
+void main_loop_notify(void);
 
 extern int ram_size;
 extern int bios_size;
@@ -256,6 +301,7 @@ int qemu_set_fd_handler(int fd,
                         IOHandler *fd_read, 
                         IOHandler *fd_write,
                         void *opaque);
+void qemu_set_fd_read_enabled(int fd, int enabled);
 
 /* Polling handling */
 
@@ -575,6 +621,10 @@ typedef struct BlockDriverInfo {
     int cluster_size; 
     /* offset at which the VM state can be saved (0 if not possible) */
     int64_t vm_state_offset; 
+    /* number of cached metadata tables, 0 if irrelevant */
+    int l2_cache_size;
+    int64_t l2_cache_hits;
+    int64_t l2_cache_misses;
 } BlockDriverInfo;
 
 typedef struct QEMUSnapshotInfo {
@@ -597,6 +647,20 @@ typedef struct QEMUSnapshotInfo {
                                      use a disk image format on top of
                                      it (default for
                                      bdrv_file_open()) */
+#define BDRV_O_DIRECT      0x0020 /* bypass the host page cache (O_DIRECT) */
+#define BDRV_O_NATIVE_AIO  0x0040 /* use the Linux native AIO (with
+                                     BDRV_O_DIRECT only) */
+#define BDRV_O_AIO_THREADS 0x0080 /* use a pool of worker threads */
+#define BDRV_O_AIO_MASK    (BDRV_O_DIRECT | BDRV_O_NATIVE_AIO | \
+                            BDRV_O_AIO_THREADS)
+
+/* bdrv_create() flags */
+#define BLOCK_FLAG_ENCRYPT           0x0001
+#define BLOCK_FLAG_PREALLOC_METADATA 0x0002 /* allocate all the metadata */
+
+extern int aio_thread_workers;
+extern int qcow2_l2_cache_mb;
+extern int qcow2_zlib_threads;
 
 void bdrv_init(void);
 BlockDriver *bdrv_find_format(const char *format_name);
@@ -621,6 +685,20 @@ int bdrv_pwrite(BlockDriverState *bs, int64_t offset,
 int bdrv_truncate(BlockDriverState *bs, int64_t offset);
 int64_t bdrv_getlength(BlockDriverState *bs);
 void bdrv_get_geometry(BlockDriverState *bs, int64_t *nb_sectors_ptr);
+int bdrv_is_allocated(BlockDriverState *bs, int64_t sector_num,
+                      int nb_sectors, int *pnum);
+int64_t bdrv_get_host_offset(BlockDriverState *bs, int64_t sector_num,
+                             int nb_sectors, int *pnum);
+int bdrv_is_allocated_above(BlockDriverState *top, BlockDriverState *base,
+                            int64_t sector_num, int nb_sectors, int *pnum);
+int bdrv_change_backing_file(BlockDriverState *bs, const char *backing_file);
+int bdrv_check_backing_file(BlockDriverState *bs, const char *backing_file);
+int bdrv_stream(BlockDriverState *bs, BlockDriverState *base,
+                const char *base_name);
+int bdrv_stream_start(BlockDriverState *bs, const char *base_name);
+int bdrv_stream_set_speed(BlockDriverState *bs, int64_t speed);
+void bdrv_stream_cancel(BlockDriverState *bs);
+void bdrv_stream_info(void);
 int bdrv_commit(BlockDriverState *bs);
 void bdrv_set_boot_sector(BlockDriverState *bs, const uint8_t *data, int size);
 /* async block I/O */
@@ -633,6 +711,12 @@ BlockDriverAIOCB *bdrv_aio_read(BlockDriverState *bs, int64_t sector_num,
 BlockDriverAIOCB *bdrv_aio_write(BlockDriverState *bs, int64_t sector_num,
                                  const uint8_t *buf, int nb_sectors,
                                  BlockDriverCompletionFunc *cb, void *opaque);
+BlockDriverAIOCB *bdrv_aio_readv(BlockDriverState *bs, int64_t sector_num,
+                                 QEMUIOVector *qiov, int nb_sectors,
+                                 BlockDriverCompletionFunc *cb, void *opaque);
+BlockDriverAIOCB *bdrv_aio_writev(BlockDriverState *bs, int64_t sector_num,
+                                  QEMUIOVector *qiov, int nb_sectors,
+                                  BlockDriverCompletionFunc *cb, void *opaque);
 void bdrv_aio_cancel(BlockDriverAIOCB *acb);
 
 void qemu_aio_init(void);
@@ -646,6 +730,7 @@ int qemu_key_check(BlockDriverState *bs, const char *name);
 
 /* Ensure contents are flushed to disk.  */
 void bdrv_flush(BlockDriverState *bs);
+void bdrv_flush_all(void);
 
 #define BDRV_TYPE_HD     0
 #define BDRV_TYPE_CDROM  1
@@ -682,8 +767,14 @@ int bdrv_set_key(BlockDriverState *bs, const char *key);
 void bdrv_iterate_format(void (*it)(void *opaque, const char *name), 
                          void *opaque);
 const char *bdrv_get_device_name(BlockDriverState *bs);
+const char *bdrv_get_filename(BlockDriverState *bs);
+BlockDriverState *bdrv_get_backing_hd(BlockDriverState *bs);
 int bdrv_write_compressed(BlockDriverState *bs, int64_t sector_num, 
                           const uint8_t *buf, int nb_sectors);
+int bdrv_compress_cluster(BlockDriverState *bs, uint8_t *out_buf,
+                          const uint8_t *buf);
+int bdrv_write_compressed_data(BlockDriverState *bs, int64_t sector_num,
+                               const uint8_t *out_buf, int out_len);
 int bdrv_get_info(BlockDriverState *bs, BlockDriverInfo *bdi);
 
 void bdrv_get_backing_filename(BlockDriverState *bs, 
@@ -503,14 +503,6 @@ static void vnc_dpy_refresh(DisplayState *ds)
     vga_hw_update();
 }
 
-static int vnc_listen_poll(void *opaque)
-{
-    VncState *vs = opaque;
-    if (vs->csock == -1)
-	return 1;
-    return 0;
-}
-
 static void buffer_reserve(Buffer *buffer, size_t len)
 {
     if ((buffer->capacity - buffer->offset) < len) {
@@ -553,6 +545,8 @@ static int vnc_client_io_error(VncState *vs, int ret, int last_errno)
 	qemu_set_fd_handler2(vs->csock, NULL, NULL, NULL, NULL);
 	closesocket(vs->csock);
 	vs->csock = -1;
+	/* accept a new client */
+	qemu_set_fd_read_enabled(vs->lsock, 1);
 	buffer_reset(&vs->input);
 	buffer_reset(&vs->output);
 	vs->need_update = 0;
@@ -1154,6 +1148,8 @@ static void vnc_listen_read(void *opaque)
 
     vs->csock = accept(vs->lsock, (struct sockaddr *)&addr, &addrlen);
     if (vs->csock != -1) {
+        /* only one client is supported */
+        qemu_set_fd_read_enabled(vs->lsock, 0);
         socket_set_nonblock(vs->csock);
 	qemu_set_fd_handler2(vs->csock, NULL, vnc_client_read, NULL, opaque);
 	vnc_write(vs, "RFB 003.003\n", 12);
@@ -1267,7 +1263,7 @@ void vnc_display_init(DisplayState *ds, const char *arg)
 	exit(1);
     }
 
-    ret = qemu_set_fd_handler2(vs->lsock, vnc_listen_poll, vnc_listen_read, NULL, vs);
+    ret = qemu_set_fd_handler2(vs->lsock, NULL, vnc_listen_read, NULL, vs);
     if (ret == -1) {
 	exit(1);
     }